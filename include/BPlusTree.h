@@ -9,41 +9,125 @@
 #ifndef __BPLUSTREE_H__
 #define __BPLUSTREE_H__
 #include <list>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
-
-// #define BPTREE_DEGREE 3
-#define key_t long
-#define data_t long
+#include "BufferPool.h"
+#include "FreeSpace.h"
+#include "LeafCodec.h"
+#include "NodeSearch.h"
+#include "Wal.h"
 
 #define S_OK 0
 #define S_FALSE -1
+#define S_ERROR -2 // 读取节点失败(校验和不一致或读到的长度不足)
+
+// 打开索引的模式,可按位组合
+enum
+{
+    BPLUS_TREE_WAL = 1 << 0,  // 写前日志+组提交,崩溃后打开时恢复
+    BPLUS_TREE_MMAP = 1 << 1, // 映射索引文件,节点直接指向映射(不能与WAL同时使用)
+    BPLUS_TREE_DIRECT = 1 << 2, // O_DIRECT读写,只经过缓冲池(不能与MMAP同时使用)
+    BPLUS_TREE_URING = 1 << 3,  // 预读和批量写回通过io_uring一次提交
+    BPLUS_TREE_CONCURRENT = 1 << 4, // 多线程并发访问(不能与WAL/MMAP同时使用)
+    BPLUS_TREE_EYTZINGER = 1 << 5,  // 非叶子节点的key按Eytzinger顺序写回
+    BPLUS_TREE_COMPRESS = 1 << 6, // 叶子压缩存放(整数key/value,块为512~4096字节)
+};
+
+// 块号(文件偏移/BlockSize),节点之间的引用都使用块号
+typedef uint32_t PageId;
 
-#pragma pack(push)
-#pragma pack(2)
+/**
+ * 页头(v2格式),字段按自然边界对齐
+ * 叶子的页头为prev/next,非叶子节点的页头在prev的位置保存lastOffset,
+ * 不使用next; 两种页头大小相同,key的位置与DEGREE不区分节点类型
+ * 块的最后4字节为CRC32C校验和(v5格式),由缓冲池在写入时计算、读入时校验
+ */
 struct Node
 {
-    off_t self; // 当前block在文件中的偏移
-    // off_t parent;   // 可以不用
-    off_t prev; // 叶子节点的前一个
-    off_t next; // 叶子节点的后一个
-    off_t lastOffset; // 当此节点为非叶子节点时,lastOffset指向最右的子节点
-
-    short type; // 叶子节点/非叶子节点
-    int count;  // 节点中key的个数
+    PageId self; // 当前block的块号
+    short type;  // 叶子节点/非叶子节点
+    short unused;
+    int count; // 节点中key的个数
+    union
+    {
+        PageId prev;       // 叶子节点的前一个
+        PageId lastOffset; // 非叶子节点最右的子节点
+    };
+    PageId next; // 叶子节点的后一个
 };
-#pragma pack(pop)
 
+/**
+ * Key和Value为定长类型,BlockSize为块大小
+ * 树的度以及key/data/subNode的偏移均在编译期确定
+ * 已实例化的类型见BPlusTree.cc末尾
+ */
+template <typename Key, typename Value, int BlockSize>
 class BPlusTree
 {
     // 一些常量
   private:
-    static const int ADDR_OFFSET_LENTH = 16; // 每次读取文件的长度
-    static const off_t INVALID_OFFSET = 0xDEADBEEF; // 错误的文件偏移量
-    static const int MAX_CACHE_NUM = 5;             // 最大缓存块数量
+    static const int ADDR_OFFSET_LENTH = 16; // 旧格式.boot文件中每项的长度
+    static const off_t INVALID_OFFSET = 0xDEADBEEF; // 错误的块号
+    static const int FORMAT_VERSION = 5; // 索引文件的格式版本
+    static const char MAGIC[8];          // 超级块的标识
+    static const size_t DEFAULT_CACHE_SIZE = 4 << 20; // 默认缓冲池大小
+    static const size_t BULK_WRITE_SIZE = 1 << 20; // 批量建树时每次写入的大小
+    static const off_t WAL_CHECKPOINT_SIZE = 64 << 20; // 日志超过该值时做检查点
+    static const int OPTIMISTIC_RETRY = 4; // 乐观查找失败后重试的次数
+    // 叶子在相邻叶子前后多少块以内分配,也是一段预留的块数
+    static const int LEAF_RUN = 32;
+    static const int COMPACT_STEPS = 64; // 命令行整理时每次调用的步数
+    // 叶子节点的data与非叶子节点的subNode共用同一段空间
+    static const int SLOT_SIZE =
+        sizeof(Value) > sizeof(PageId) ? sizeof(Value) : sizeof(PageId);
+    // key在块中的起始位置(按Key的边界对齐)
+    static const int KEY_OFFSET = ((int) sizeof(Node) + alignof(Key) - 1)
+                                  / alignof(Key) * alignof(Key);
+    // 一个block中的最大节点数(不含块末尾的校验和) NOTE: DEGREE >= 3
+    static const int DEGREE =
+        (BlockSize - KEY_OFFSET - BufferPool::CHECKSUM_SIZE)
+        / ((int) sizeof(Key) + SLOT_SIZE);
+
+    static_assert(DEGREE > 2, "BlockSize is too small");
+    // 向量比较越过keys末尾读取的部分落在data/subNode中
+    static_assert(
+        DEGREE < NodeSearch::MIN_KEYS
+            || DEGREE * SLOT_SIZE >= NodeSearch::PAD_BYTES,
+        "key padding is too small");
+    static_assert(BULK_WRITE_SIZE >= 2 * BlockSize, "BlockSize is too large");
+
+    typedef LeafCodec<Key, Value> Codec;
+    // 叶子能否压缩: 块太小时平分后不一定放得下;
+    // 分裂/合并时解码到栈上的数组按PACKED_DEGREE分配,块过大时栈帧过大
+    static const bool COMPRESSIBLE =
+        Codec::SUPPORTED && BlockSize >= 512 && BlockSize <= 4096;
+    // 叶子中key开始之后的空间,压缩叶子编码可用的空间
+    // 校验和落在编码之后的SLACK中,解码时只可能越界读取,不影响结果
+    static const int LEAF_AREA = BlockSize - KEY_OFFSET;
+    static const int PACKED_CAPACITY = LEAF_AREA - Codec::SLACK;
+    static_assert(
+        Codec::SLACK >= BufferPool::CHECKSUM_SIZE,
+        "checksum overlaps packed entries");
+    // 压缩叶子中最多的key数(每个entry至少占用约4字节)
+    static const int PACKED_DEGREE =
+        COMPRESSIBLE ? LEAF_AREA / 4 : DEGREE;
     enum
     {
         BPLUS_TREE_LEAF = 0,
-        BPLUS_TREE_NON_LEAF = 1
+        BPLUS_TREE_NON_LEAF = 1,
+        BPLUS_TREE_NON_LEAF_EYTZINGER = 2, // key为Eytzinger布局的非叶子节点
+        BPLUS_TREE_LEAF_PACKED = 3, // key/value压缩存放的叶子节点
+        BPLUS_TREE_FREE = 4 // v3格式空闲链表中的块,next为下一个
+    };
+    // 在线整理的阶段
+    enum
+    {
+        COMPACT_IDLE = 0, // 未开始,下一次调用开始新的一轮
+        COMPACT_LEAVES,   // 叶子按key的顺序移到文件开头
+        COMPACT_TAIL,     // 文件末尾的节点移入最低的空闲块
+        COMPACT_DONE      // 本轮已完成
     };
     enum
     {
@@ -51,67 +135,468 @@ class BPlusTree
         RIGHT_NODE = 1
     };
 
+    /**
+     * 超级块,保存在索引文件的第一个块中,打开时一次读取
+     * 块的使用情况保存在连续的几个块中(位图),打开时一次读取;
+     * 检查点时位图写到新的位置,超级块指向新位置之后旧位置才被重用
+     */
+    struct Superblock
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t blockSize;
+        int64_t fileSize;
+        PageId root;
+        PageId freeMap;        // 位图的第一个块(v3格式为空闲链表的第一个块)
+        uint32_t freeMapPages; // 位图的块数
+        uint32_t checksum;     // 除本字段外超级块的校验和
+    };
+
   private:
-    off_t root_;                  // 记录root的偏移量
-    off_t blockSize_;             // 块大小
+    off_t root_;                  // 记录root的块号
     off_t fileSize_;              // 指向文件末尾,便于创建新的block
-    std::list<off_t> freeBlocks_; // 记录空闲块
+    FreeSpace space_;             // 块的使用情况,块数与fileSize_一致
+    off_t mapPage_;               // 位图在文件中的第一个块
+    int mapPages_;                // 位图的块数
     std::list<off_t> traceNode_; // 记录经过的父节点(Node结构可省去父指针)
     const char *fileName_; // 索引文件
     int fd_;               // 索引文件的描述符
-    int DEGREE;            // 一个block中的最大节点数 NOTE: DEGREE >= 3
     char cmdBuf_[64];      // 保存命令字符串
-    Node *rootCache_;      // root节点缓存
-    Node *caches_[MAX_CACHE_NUM]; // 块缓存
-    bool used_[MAX_CACHE_NUM];    // 标记使用的缓存
+    BufferPool *pool_;     // 块缓存
+    Wal *wal_;             // 写前日志,未启用时为NULL
+    int snapFd_;           // 快照文件的描述符,未使用快照时为-1
+    int opDepth_;          // 正在进行的修改操作的嵌套层数
+    int recovered_;        // 打开时从日志重放的操作数
+
+    /**
+     * 在线整理: 每一步移动一个节点(复制到新的块,修改父节点的引用和
+     * 叶子的prev/next,回收原来的块),各步之间可以进行其他操作
+     * 第一阶段沿key的顺序把叶子依次放到文件开头,目标块被占用时先把占用的
+     * 节点移走; 第二阶段把最后的节点移入最低的空闲块,直到没有空洞;
+     * 一轮结束时做检查点,文件末尾的空闲块被截掉
+     */
+    /**
+     * 删除时的下溢阈值: 非root节点少于该值时向相邻节点借数据或合并,
+     * 默认为半满(标准B+树); 调低后删除很少引起借数据与合并,
+     * 删除后留下的过小叶子由compact()合并
+     */
+    int leafMin_;    // 叶子删除前的key数不大于该值时借数据或合并
+    int nonLeafMin_; // 非叶子节点删除前的key数小于该值时借数据或合并
+    int packedMin_;  // 压缩叶子删除后编码不大于该字节数时合并
+
+    int compactPhase_;   // 整理所处的阶段
+    Key compactKey_;     // 下一个要整理的叶子中的key
+    bool compactFirst_;  // 下一个叶子为最左的叶子
+    off_t compactPage_;  // 下一个叶子的目标块
+
+    /**
+     * Eytzinger布局: 非叶子节点写回时key转换为层序(subNode仍然有序),
+     * 节点类型标明布局,两种布局的节点可以共存;
+     * 修改前通过fetchBlock取得节点时恢复为有序,所有修改都在有序布局上进行
+     */
+    bool eytzinger_; // 写回的非叶子节点是否转换为Eytzinger布局
+
+    /**
+     * 压缩叶子: key/value按LeafCodec编码,一个块中可以存放更多的entry;
+     * 修改时解码到数组,修改后重新编码,放不下时按编码大小分裂;
+     * 压缩叶子没有最少key数,删除后过小时与相邻叶子合并(合并后放得下时)
+     * 未启用时不再产生压缩叶子,已有的压缩叶子仍按同样的方式修改
+     */
+    bool compress_; // 修改的叶子是否压缩存放
+
+    /**
+     * 并发模式: 查找和不改变结构的插入/删除共享树锁,沿路径加锁耦合
+     * (持有父节点的块锁时再锁子节点,之后释放父节点),叶子上加写锁修改;
+     * 叶子需要分裂或合并时释放所有锁,独占树锁后按单线程方式重做
+     * 查找先乐观地进行: 不加锁不占用,读完每个节点后校验缓存块与树的版本,
+     * 冲突时重试,多次失败或节点不在缓存中时再按上述方式加锁
+     */
+    bool concurrent_;            // 是否允许多线程并发访问
+    pthread_rwlock_t treeLatch_; // 树锁,独占时可以修改结构
+    // 树的结构版本,独占树锁期间为奇数,游标据此判断叶子是否失效
+    unsigned long smoVersion_;
+    // 乐观查找失败后加锁查找的次数(只在退回时修改,乐观读者不写共享数据)
+    long lockedSearches_;
+
+    // 批量建树时顺序写入的缓冲
+    struct BulkBuffer
+    {
+        char *blocks; // 缓冲空间
+        int used;     // 已使用的块数
+        off_t start;  // 第一个块在文件中的偏移
+    };
+    // 批量建树时每个节点的最小key和偏移
+    struct BulkEntry
+    {
+        Key key;
+        off_t offset;
+    };
+    // 批量查找时一层中待访问的节点,以及落在其中的key(排序后的下标区间)
+    struct ProbeRange
+    {
+        off_t offset;
+        size_t begin;
+        size_t end;
+    };
+    // 批量建树的数组数据源
+    struct BulkArray
+    {
+        const Key *keys;
+        const Value *values;
+        size_t n;
+    };
 
   public:
-    BPlusTree(const char *fileName, int blockSize);
+    // 批量建树的数据源,依次返回有序的key/value,返回false表示结束
+    typedef bool (*BulkReader)(Key *key, Value *value, void *arg);
+
+    /**
+     * 批量写入: 先缓存put/remove,提交时按key排序,
+     * 落在同一个叶子中的修改一次合并,叶子只写回一次
+     */
+    class WriteBatch
+    {
+      private:
+        friend class BPlusTree;
+        struct Op
+        {
+            Key key;
+            Value value;
+            bool remove; // true为删除,false为写入(存在则覆盖)
+        };
+        std::vector<Op> ops_;
+
+      public:
+        // 写入,key已存在时覆盖value
+        void put(Key k, Value value) { ops_.push_back(Op{k, value, false}); }
+        // 删除
+        void remove(Key k) { ops_.push_back(Op{k, Value(), true}); }
+        void clear() { ops_.clear(); }
+        size_t size() const { return ops_.size(); }
+    };
+
+    /**
+     * 快照: 创建时树的一致视图,之后的修改不影响在快照中的查找和遍历
+     * 快照直接读取写回的镜像(不经过缓存),创建之后改变过的块读取
+     * 保存在<索引文件>.snap中的旧镜像,释放快照后旧镜像的位置被重用
+     * NOTE:同一个快照(及其游标)不能在多个线程中同时使用,树析构前需释放
+     */
+    class Snapshot
+    {
+      private:
+        friend class BPlusTree;
+        BPlusTree *tree_; // 所属的树
+        int id_;          // 缓冲池中的快照编号
+        off_t root_;      // 创建时的root
+        char *page_;      // 查找时读取节点的缓冲
+
+      public:
+        Snapshot(BPlusTree *tree);
+        ~Snapshot();
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        // 创建失败(推迟写回的修改写入失败)时为false,查找和遍历返回S_ERROR
+        bool valid() const { return id_ >= 0; }
+        // 在快照中查找,找到则通过value返回
+        int search(Key k, Value *value);
+
+      private:
+        // 把快照中offset处的节点读到page,读取失败时返回NULL
+        Node *readNode(off_t offset, char *page);
+    };
+
+    /**
+     * 沿叶子节点的prev/next双向遍历的游标
+     * 游标占用当前所在的叶子,每个叶子只读取一次
+     * NOTE:修改树之后需要重新seek
+     * 并发模式下每次移动时加锁,以当前key为基准重新定位,不需要重新seek
+     * 在快照上创建的游标读取叶子的副本,不占用缓存,也不受修改影响
+     * 读取节点失败时移动返回S_ERROR,游标变为无效
+     */
+    class Cursor
+    {
+      private:
+        BPlusTree *tree_; // 所属的树
+        Snapshot *snap_;  // 遍历的快照,为NULL时遍历当前的树
+        Node *leaf_;      // 当前叶子(已占用),NULL表示无效
+        int pos_;         // 在叶子中的位置
+        char *page_;      // 快照中最近读取的节点
+        off_t pageOffset_; // page_中节点的偏移
+        Key key_;         // 当前key的副本(并发模式)
+        Value value_;     // 当前value的副本(并发模式)
+        const Key *keys_; // 当前叶子的key(压缩叶子为解码后的副本)
+        const Value *values_; // 当前叶子的value
+        std::vector<Key> keyBuf_; // 压缩叶子解码后的key
+        std::vector<Value> valueBuf_; // 压缩叶子解码后的value
+        unsigned long version_; // 定位时树的结构版本(并发模式)
+
+        // 并发模式下的移动方式
+        enum
+        {
+            MOVE_SEEK, // 第一个不小于key的位置
+            MOVE_FIRST,
+            MOVE_LAST,
+            MOVE_NEXT, // 第一个大于key_的位置
+            MOVE_PREV  // 最后一个小于key_的位置
+        };
+
+      public:
+        Cursor(BPlusTree *tree);
+        Cursor(Snapshot *snapshot);
+        ~Cursor();
+        Cursor(const Cursor &) = delete;
+        Cursor &operator=(const Cursor &) = delete;
+
+        // 定位到第一个不小于k的key
+        int seek(Key k);
+        // 定位到最小的key
+        int seekFirst();
+        // 定位到最大的key
+        int seekLast();
+        // 移动到下一个key
+        int next();
+        // 移动到上一个key
+        int prev();
+
+        // 是否指向有效的key
+        bool valid() const { return leaf_ != NULL; }
+        Key key() const { return latched() ? key_ : keys_[pos_]; }
+        Value value() const { return latched() ? value_ : values_[pos_]; }
+
+      private:
+        // 是否每次移动时加锁(并发模式下遍历当前的树)
+        bool latched() const { return tree_->concurrent_ && snap_ == NULL; }
+        // 读取offset处的节点(不占用),读取失败时返回NULL
+        Node *readNode(off_t offset);
+        // 从root向下查找k所在的叶子,k为NULL时查找最左/最右的叶子
+        // 叶子的偏移通过leaf返回,树为空时返回S_FALSE
+        int descend(const Key *k, bool rightmost, off_t *leaf);
+        // 移动到offset处叶子的第pos个key(负数表示倒数),越界则沿链表移动
+        int moveTo(off_t offset, int pos);
+        // 释放当前叶子
+        void release();
+        // 并发模式下加锁移动,k为MOVE_SEEK的目标
+        int latchedMove(int how, Key k);
+    };
+
+    // cacheSize为缓冲池大小(字节), flags为BPLUS_TREE_WAL等模式的组合
+    // 并发模式下除commandHander外的公有方法都可以在多个线程中同时调用
+    BPlusTree(
+        const char *fileName,
+        size_t cacheSize = DEFAULT_CACHE_SIZE,
+        int flags = 0);
     ~BPlusTree();
 
     // 执行命令
     void commandHander();
 
-  private:
-    // 显示帮助信息
-    void help();
-    // 增加数据
-    int insert(key_t key, data_t value);
-    // 查找
-    long search(key_t k);
+    // 以下操作路径上的节点读取失败时不做修改,返回S_ERROR
+
+    // 增加数据,key已存在时返回S_FALSE(不修改)
+    int insert(Key key, Value value);
+    // 查找,找到则通过value返回
+    int search(Key k, Value *value);
+    /**
+     * 批量查找: key排序后逐层向下,落在同一子树的key共享一次遍历,
+     * 每个节点在一批中只读取一次,同一层不在缓存中的节点一次预读
+     * rets[i]为keys[i]的查找结果(S_OK/S_FALSE/S_ERROR),返回找到的个数
+     */
+    size_t multiGet(const Key *keys, Value *values, int *rets, size_t n);
     // 删除
-    int remove(key_t);
+    int remove(Key);
     // 显示树中所有节点
     void dump();
 
+    // 从有序数据自底向上批量建树(只能用于空树)
+    // fillFactor为节点的填充率(0, 1]; 树不为空、key不严格递增或
+    // fillFactor不合法时返回S_FALSE,树不变
+    int bulkLoad(BulkReader reader, void *arg, double fillFactor = 1.0);
+    int bulkLoad(
+        const Key *keys,
+        const Value *values,
+        size_t n,
+        double fillFactor = 1.0);
+
+    // 提交批量写入,同一个key以最后一次修改为准,提交后batch被清空
+    // 有节点读取失败时跳过相应的修改,完成其余的修改后返回S_ERROR
+    int commit(WriteBatch *batch);
+
+    /**
+     * 启用写前日志时,每次修改操作只追加日志,凑满一组操作才fdatasync一次,
+     * sync之后已完成的操作一定持久化; 修改过的块在检查点时才写回原位置
+     */
+    // 使已完成的操作持久化
+    int sync();
+    // 将所有修改写回索引文件并清空日志
+    int checkpoint();
+    // 设置每次fdatasync提交的操作数
+    void setGroupCommit(int ops);
+    // 打开时从日志重放的操作数(上次未正常关闭)
+    int recovered() const { return recovered_; }
+    /**
+     * 未启用写前日志时,修改的块在缓存中标记为脏,置换时、脏块超过pages个时
+     * (按偏移顺序)或sync/checkpoint时才写回; pages为0时每个操作结束时写回
+     * 默认为缓存块数的一半
+     */
+    void setDirtyLimit(int pages);
+
+    /**
+     * 设置删除时节点的最少填充率fill(0, 0.5],默认0.5
+     * 例如0.25时节点少于1/4满才借数据或合并,0时只在叶子删空时合并
+     */
+    void setMergeFill(double fill);
+
+    // 并发模式下乐观查找失败,退回加锁查找的次数
+    long lockedSearches() const
+    {
+        return __atomic_load_n(&lockedSearches_, __ATOMIC_RELAXED);
+    }
+    // 修改的叶子是否压缩存放(BPLUS_TREE_COMPRESS且块大小支持)
+    bool compressEnabled() const { return compress_; }
+    // 预读和批量写回是否通过io_uring提交(BPLUS_TREE_URING且内核支持)
+    bool uringEnabled() const { return pool_->ringEnabled(); }
+    // 从磁盘读入时校验和不一致的块数
+    long checksumErrors() const { return pool_->checksumErrors(); }
+    // 写回磁盘的块数
+    long blockWrites() const { return pool_->writes(); }
+
+    /**
+     * 在线整理,最多进行steps步(访问或移动一个节点为一步),
+     * 返回本次进行的步数; 一轮已完成时返回0,之后的调用开始新的一轮
+     * e.g. while (tree.compact(64) > 0) { 处理其他请求 }
+     */
+    int compact(int steps);
+
+    /**
+     * 把使用.boot文件的索引文件from转换为当前格式写入to: v1格式为pack(2)
+     * 的页头,节点之间用8字节的文件偏移引用; v2格式的页头与当前相同
+     * 块的顺序不变,整体后移一块留给超级块; from需已正常关闭(日志为空)
+     */
+    static int convert(const char *from, const char *to);
+
+  private:
+    // 显示帮助信息
+    void help();
+
   private:
     // NOTE:指针运算必须转换为char *
     // 获取node中key的位置
-    inline key_t *key(const Node *node)
+    static inline Key *key(const Node *node)
     {
-        return (key_t *) ((char *) node + sizeof(Node));
+        return (Key *) ((char *) node + KEY_OFFSET);
     }
     // 获取node中data的位置
-    inline data_t *data(const Node *node)
+    static inline Value *data(const Node *node)
     {
-        return (data_t *) ((char *) key(node) + DEGREE * sizeof(key_t));
+        return (Value *) ((char *) key(node) + DEGREE * sizeof(Key));
     }
     // 获取node中子节点的位置
-    inline off_t *subNode(Node *node, const int pos)
+    static inline PageId *subNode(Node *node, const int pos)
     {
-        // 最后一个位置的子节点偏移保存在lastOffset中
+        // 最后一个位置的子节点保存在lastOffset中
         if (pos == DEGREE) return &node->lastOffset;
-        return &((off_t *) ((char *) key(node) + DEGREE * sizeof(key_t)))[pos];
+        return &((PageId *) ((char *) key(node) + DEGREE * sizeof(Key)))[pos];
+    }
+    // 块号对应的文件偏移
+    static off_t fileOffset(off_t page) { return page * BlockSize; }
+
+    // 获取node中第pos个key(不要求有序布局)
+    inline Key nodeKey(const Node *node, int pos)
+    {
+        if (node->type == BPLUS_TREE_LEAF_PACKED) {
+            Key keys[Codec::GROUP];
+            int g = pos / Codec::GROUP;
+            Codec::decodeGroup(
+                (char *) key(node), LEAF_AREA, node->count, g, keys, NULL);
+            return keys[pos % Codec::GROUP];
+        }
+        if (node->type != BPLUS_TREE_NON_LEAF_EYTZINGER) return key(node)[pos];
+        return key(node)[Eytzinger<Key, DEGREE>::index(pos, node->count) - 1];
     }
 
     // 判断是否为叶子节点
-    inline bool isLeaf(Node *node) { return node->type == BPLUS_TREE_LEAF; }
+    inline bool isLeaf(const Node *node)
+    {
+        return node->type == BPLUS_TREE_LEAF
+               || node->type == BPLUS_TREE_LEAF_PACKED;
+    }
 
   private:
-    // 读取一个偏移量
-    off_t offsetLoad(int fd);
-    // 存一个偏移量
-    int offsetStore(int fd, off_t offset);
+    // 从.boot文件读取一个偏移量(转换旧格式时使用)
+    static off_t offsetLoad(int fd);
+    // 读取超级块和位图,新文件则写入空树的超级块
+    void superLoad();
+    // v3格式的空闲链表转换为位图
+    void upgradeFreeList(off_t freeHead);
+    // v3/v4格式从root遍历所有节点,写入校验和
+    void upgradeChecksums();
+    // 位图写到新的位置,然后写入超级块
+    int metaStore();
+    // 写入超级块并同步
+    static int superStore(
+        int fd,
+        off_t root,
+        off_t fileSize,
+        off_t mapPage,
+        int mapPages);
+    // 超级块的校验和(v5为CRC32C,之前的版本为FNV-1a)
+    static uint32_t superChecksum(const Superblock *super);
+    // 位图写入从page开始的pages个块
+    static int mapStore(int fd, const FreeSpace &space, off_t page, int pages);
+    // 保存pages个块的位图需要的块数
+    static int mapBlocks(off_t pages)
+    {
+        off_t bytes = (pages + 63) / 64 * 8;
+        return (int) ((bytes + BlockSize - 1) / BlockSize);
+    }
+    // 文件的块数变为pages(不改变实际的文件长度)
+    void resizeFile(off_t pages);
+
+    /*** Write-ahead log ***/
+    // 开始一个修改操作(可嵌套)
+    void beginOperation();
+    // 结束修改操作,最外层结束时写入元数据和COMMIT
+    void endOperation();
+    // 重放日志中的一条记录
+    static void walReplay(
+        const Wal::Record *record,
+        const char *payload,
+        void *arg);
+
+    /*** Concurrency ***/
+    // 加树锁,exclusive为true时独占(非并发模式下不做任何事)
+    void lockTree(bool exclusive);
+    // 释放树锁
+    void unlockTree();
+    // 占用offset处的块并加锁
+    Node *latchNode(off_t offset, bool exclusive);
+    // 释放块锁和占用
+    void unlatchNode(const Node *node);
+    // 从root开始加锁耦合向下,返回已占用并加锁的叶子(空树返回NULL)
+    // k为NULL时返回最左/最右的叶子
+    Node *latchLeaf(const Key *k, bool rightmost, bool exclusive);
+    /**
+     * 不加锁不占用地从root查找k所在的叶子,每一步校验节点与树的版本
+     * (树的版本需为读取root之前的treeVersion),返回叶子的偏移,
+     * 并通过leaf/version返回叶子的缓存及其版本; 失败返回INVALID_OFFSET
+     */
+    off_t optimisticLeaf(
+        Key k,
+        unsigned long treeVersion,
+        Node **leaf,
+        unsigned long *version);
+    // 乐观查找,成功时通过ret返回查找结果,重试多次仍冲突时返回false
+    bool optimisticSearch(Key k, Value *value, int *ret);
+    // 只锁住叶子完成插入,需要分裂时返回false
+    bool latchedInsert(Key k, Value value, int *ret);
+    // 只锁住叶子完成删除,需要合并或借数据时返回false
+    bool latchedRemove(Key k, int *ret);
+    // 持有独占树锁(或非并发模式)时插入,可能分裂节点
+    // key已存在时overwrite为true则覆盖value(批量写入),否则返回S_FALSE
+    int insertLocked(Key k, Value value, bool overwrite = false);
+    // 持有独占树锁(或非并发模式)时删除,可能合并节点
+    int removeLocked(Key k);
 
     // 数据插入之前的预处理
     int insertHandler();
@@ -119,104 +604,218 @@ class BPlusTree
     int searchHandler();
     // 删除之前的数据预处理
     int removeHandler();
+    // 批量建树的预处理
+    int bulkLoadHandler();
+    // 整理索引文件
+    int compactHandler();
 
-    // 占用一个缓存
-    Node *cacheRefer();
     // 对node使用缓存占用
     void cacheOccupy(Node *node);
     // 释放一个缓存
     void cacheDefer(const Node *node);
 
     /***在内存中命名为node***/
-    // 在rootCache中创建新的root
-    // 使用思路:在locateNode和blockFlush中判断,but,traceNode_?
-    Node *newRoot();
-    // 创建叶子节点root
-    Node *newLeafRoot();
-    // 创建非叶子节点root
-    Node *newNonLeafRoot();
-    // 在cache中创建新的节点
-    Node *newNode();
+    // 分配磁盘空间并在cache中创建新的节点,sibling见appendBlock
+    Node *newNode(off_t sibling, bool right);
     // 在cache中创建新的非叶子节点
     Node *newNonLeaf();
-    // 在cache中创建新的叶子节点
-    Node *newLeaf();
+    // 在cache中创建新的叶子节点,尽量放在相邻叶子sibling的左边/右边
+    Node *newLeaf(off_t sibling, bool right);
     // 在节点内部查找
-    int searchInNode(Node *node, key_t target);
+    int searchInNode(Node *node, Key target);
+    // 非叶子节点的key转换为Eytzinger布局
+    void packNode(Node *node);
+    // Eytzinger布局恢复为有序
+    void unpackNode(Node *node);
+
+    /*** Compressed leaf ***/
+    // 叶子中第pos个value(乐观读取时不会越界)
+    Value leafValue(const Node *leaf, int pos);
+    // 解码叶子中所有的key/value,返回个数
+    int decodeLeaf(const Node *leaf, Key *keys, Value *values);
+    // n个有序的key/value写入叶子(优先压缩),放不下时不做修改并返回S_FALSE
+    int storeLeaf(Node *leaf, const Key *keys, const Value *values, int n);
+    // 写入叶子并写回,放不下时按编码大小分裂,分裂时节点读取失败返回S_ERROR
+    int storeOrSplitLeaf(
+        Node *leaf,
+        const Key *keys,
+        const Value *values,
+        int n);
+    // 在压缩叶子(或压缩模式下的叶子)中插入,不允许分裂时放不下则返回S_FALSE
+    // key已存在且不覆盖时返回S_FALSE
+    int insertPackedLeaf(
+        Node *leaf,
+        Key k,
+        Value value,
+        bool split,
+        bool overwrite);
+    // 在压缩叶子中删除,不允许合并时需要合并则返回S_FALSE
+    int removePackedLeaf(Node *leaf, int pos, Key k, bool merge);
+    // 删除后过小的叶子与同一父节点下的相邻叶子合并
+    void mergePackedLeaf(
+        Node *node,
+        const Key *keys,
+        const Value *values,
+        int n,
+        Node *parent,
+        Node *left,
+        Node *right,
+        int ppos);
+    // 叶子的修改是否解码后进行
+    bool packedPath(const Node *leaf)
+    {
+        return compress_ || leaf->type == BPLUS_TREE_LEAF_PACKED;
+    }
 
     /***在磁盘中命名为block***/
-    // 为node节点分配磁盘空间
-    off_t appendBlock(Node *node);
-    // 回收磁盘空间
+    /**
+     * 分配一个block的磁盘空间并取得其缓存(已占用)
+     * 叶子(sibling有效)优先分配在sibling附近,附近没有空闲块时
+     * 选择一段连续的空闲块的开头,后续分裂出的叶子落在同一段中;
+     * 其他节点分配最低的空闲块; 都没有时在文件末尾增加
+     */
+    Node *appendBlock(off_t sibling, bool right);
+    // 分配page处的块并取得其缓存(已占用)
+    Node *allocBlock(off_t page);
+    // 回收磁盘空间,回收最后一个块时文件末尾的空闲块都不再属于文件
     void unappendBlock(Node *node);
     // block写回磁盘
     int blockFlush(Node *node);
-    // 把root读取到rootCache_中
+    // 把root预读到缓存中
     void fetchRootBlock();
-    // 把block取到cache中(不可覆盖)
+    // 把block取到cache中(不可覆盖),读取失败时返回NULL
     Node *fetchBlock(off_t offset);
-    // 把block读到cache中(可覆盖)
+    // 结构修改中取得预先确认过可以读取的block
+    Node *refetchBlock(off_t offset);
+    // 把block读到cache中(可覆盖),读取失败时返回NULL
     Node *locateNode(off_t offset);
 
+    /**
+     * 分裂与合并开始后无法回退,预先确认会修改的节点都能读取:
+     * 叶子的前后节点,以及沿traceNode_向上会被修改的节点(及其相邻节点)
+     */
+    // offset为INVALID_OFFSET或可以读取
+    bool readable(off_t offset);
+    // 叶子(已占用)分裂时会修改的节点都能读取
+    bool splitReadable(const Node *leaf);
+    // 前后节点为prev/next的叶子借数据或合并时会修改的节点都能读取
+    bool mergeReadable(off_t prev, off_t next);
+
     /*** Insert ***/
-    // 插入叶子节点
-    int insertLeaf(Node *node, key_t key, data_t value);
+    // 插入叶子节点,key已存在时见insertLocked
+    int insertLeaf(Node *node, Key key, Value value, bool overwrite = false);
     // 简单方式插入叶子节点(不分裂)
-    void simpleInsertLeaf(Node *leaf, int pos, key_t k, data_t value);
+    void simpleInsertLeaf(Node *leaf, int pos, Key k, Value value);
     // 叶子节点左分裂
-    key_t splitLeftLeaf(Node *leaf, Node *left, key_t k, data_t value, int pos);
+    Key splitLeftLeaf(Node *leaf, Node *left, Key k, Value value, int pos);
     // 叶子节点右分裂
-    key_t
-    splitRightLeaf(Node *leaf, Node *right, key_t k, data_t value, int pos);
+    Key splitRightLeaf(Node *leaf, Node *right, Key k, Value value, int pos);
     // 增加左叶子节点
     void addLeftNode(Node *node, Node *left);
     // 增加右叶子节点
     void addRightNode(Node *node, Node *right);
 
     // 更新父节点
-    int updateParentNode(Node *leftChild, Node *rightChild, key_t k);
+    int updateParentNode(Node *leftChild, Node *rightChild, Key k);
 
-    // 为非叶子节点分配磁盘空间
-    void addNonLeafNode(Node *anotherNode);
     // 在非叶子节点中插入
-    int insertNonLeaf(Node *node, Node *leftChild, Node *rightChild, key_t k);
+    int insertNonLeaf(Node *node, Node *leftChild, Node *rightChild, Key k);
     // 简单方式插入非叶子节点
     void simpleInsertNonLeaf(
         Node *node,
         int pos,
-        key_t k,
+        Key k,
         Node *leftChild,
         Node *rightChild);
     // 非叶子节点左分裂(关注lastOffset)
-    key_t splitLeftNonLeaf(
+    Key splitLeftNonLeaf(
         Node *node,
         Node *leftNode,
         int pos,
-        key_t k,
+        Key k,
         Node *leftChild,
         Node *rightChild);
     // 非叶子节点右分裂1(pos == split)
-    key_t splitRightNonLeaf1(
+    Key splitRightNonLeaf1(
         Node *node,
         Node *rightNode,
         int pos,
-        key_t k,
+        Key k,
         Node *leftChild,
         Node *rightChild);
     // 非叶子节点右分裂(pos > split)
-    key_t splitRightNonLeaf2(
+    Key splitRightNonLeaf2(
         Node *node,
         Node *rightNode,
         int pos,
-        key_t k,
+        Key k,
         Node *leftChild,
         Node *rightChild);
 
+    /*** Write batch ***/
+    typedef typename WriteBatch::Op BatchOp;
+    // 比较两个修改的key
+    static bool batchOpLess(const BatchOp &a, const BatchOp &b);
+    // 查找k所在的叶子并记录父节点,upper返回叶子中key的上界
+    Node *locateLeaf(Key k, Key *upper, bool *bounded);
+    // 把n个有序的修改一次合并到leaf中,叶子会上溢或下溢时返回S_FALSE
+    int mergeBatchIntoLeaf(Node *leaf, const BatchOp *ops, int n);
+    // 单独执行一个修改(可能分裂或合并节点),返回insert/remove的结果
+    int applyBatchOp(const BatchOp &op);
+
+    /*** Bulk load ***/
+    // 数组数据源
+    static bool arrayReader(Key *key, Value *value, void *arg);
+    // 区间数据源(命令行使用)
+    static bool rangeReader(Key *key, Value *value, void *arg);
+    // 在写缓冲中顺序分配一个新节点
+    Node *bulkNewNode(BulkBuffer *buf, short type);
+    // 把写缓冲中的前n个块写入磁盘
+    void bulkFlush(BulkBuffer *buf, int n);
+    // 建立叶子层,返回每个叶子节点的最小key和偏移
+    int bulkLoadLeaves(
+        BulkBuffer *buf,
+        BulkReader reader,
+        void *arg,
+        int fill,
+        std::vector<BulkEntry> &entries);
+    // 建立压缩的叶子层,fillFactor为编码后的填充率
+    int bulkLoadPackedLeaves(
+        BulkBuffer *buf,
+        BulkReader reader,
+        void *arg,
+        double fillFactor,
+        std::vector<BulkEntry> &entries);
+    // 由下一层的节点建立一层非叶子节点
+    void bulkLoadNonLeaves(
+        BulkBuffer *buf,
+        int fill,
+        std::vector<BulkEntry> &entries);
+
+    /*** Compact ***/
+    /**
+     * 从root向下查找page处的节点并记录经过的父节点,k为该节点中的一个key
+     * (为NULL时沿最左的子节点); page为INVALID_OFFSET时返回到达的叶子,
+     * upper返回叶子中key的上界; 路径上没有page时返回NULL
+     */
+    Node *tracePage(const Key *k, off_t page, Key *upper, bool *bounded);
+    // 按page处节点中的key查找并记录它的父节点,找不到时返回false
+    bool tracePage(off_t page);
+    // page处的节点移到to(to空闲),父节点为traceNode_的最后一个
+    // 会修改的节点读取失败时不移动,返回false
+    bool moveNode(off_t page, off_t to);
+    // 整理一个叶子,返回进行的步数
+    int compactLeaf();
+    // page处的叶子与同一父节点下的右边叶子合并后不超过3/4满时合并
+    bool compactMerge(off_t page);
+    // 把最后的节点移入空洞,返回进行的步数
+    int compactTail();
+
     /*** Remove ***/
     // 删除节点,回收block
     void removeNode(Node *node, Node *left, Node *right);
     // 删除叶子节点(与其他叶子节点合并)
-    int removeLeaf(Node *node, key_t k);
+    int removeLeaf(Node *node, Key k);
     // 简单删除叶子节点
     void simpleRemoveInLeaf(Node *node, int pos);
     // 选择使用左节点还是右节点来借数据
@@ -270,9 +869,7 @@ class BPlusTree
 
   private:
     // 字符串转换为off_t
-    off_t pchar_2_off_t(const char *str, size_t size);
-    // off_t转换为字符串
-    void off_t_2_pchar(off_t offset, char *buf, int len);
+    static off_t pchar_2_off_t(const char *str, size_t size);
 
     // 输出当前节点
     void draw(Node *node, int level);
@@ -0,0 +1,284 @@
+/*
+ * @file BufferPool.h
+ * @brief
+ * 缓冲池: 以块偏移为键的页表 + 占用计数 + CLOCK置换
+ * 启用写前日志后,写回的块只追加到日志,检查点时才写回原位置
+ * 映射模式下不使用缓存块,直接返回指向文件映射的指针
+ * 预读与批量写回的多个块一次提交(io_uring或逐个pread/pwrite)
+ * 并发模式下页表等状态由一把互斥锁保护,每个缓存块另有一把读写锁(块锁),
+ * 读入块时先占用frame并持有块的写锁,释放互斥锁后再读取
+ * 每个缓存块还有一个版本号,内容或对应的块改变期间为奇数,
+ * 乐观读者通过peek无锁取得缓存块,读完后用validate校验版本未变
+ * 存在快照时,块的写回镜像第一次改变(写回或回收)之前,旧镜像被复制到快照文件
+ * 未启用写前日志时,写回的块只标记为脏,置换时、脏块超过上限时(按偏移顺序)
+ * 或检查点时才写入文件,反复修改的热点块只写一次
+ * 启用校验和后,每个块的最后4字节为其余部分的CRC32C,写入文件或日志前计算,
+ * 从文件或日志读入时校验(映射模式下只计算,读取由内核完成,不校验);
+ * 校验和不一致或读到的长度不足的块不进入缓存,读取返回失败
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+#include <pthread.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "IoRing.h"
+
+class Wal;
+
+class BufferPool
+{
+  private:
+    static const int MAX_USAGE_COUNT = 5; // 使用计数上限(防止扫描冲掉热点)
+    static const off_t FREE_FRAME = -1;   // 空闲frame的偏移
+
+    struct Frame
+    {
+        off_t offset; // 缓存的块在文件中的偏移
+        int pinCount; // 占用计数,大于0时不可被置换
+        int usage;    // CLOCK使用计数
+        bool queued;  // 已加入批量写回(占用到写回完成)
+        bool dirty;   // 修改过但尚未写入文件
+        bool loading; // 并发模式下正在读入(读入失败时frame被释放)
+        pthread_rwlock_t latch; // 块锁,只能在占用期间持有
+        unsigned long version;  // 版本号,修改期间为奇数
+    };
+
+    static const size_t MMAP_RESERVE = 1ull << 40; // 映射模式预留的地址空间
+    static const off_t MMAP_MIN_GROW = 1 << 20;     // 映射每次至少增长的大小
+    static const off_t MMAP_MAX_GROW = 64 << 20;    // 映射每次最多增长的大小
+    static const unsigned RING_DEPTH = 64;          // io_uring队列深度
+    static const off_t LOST_IMAGE = -1; // 旧镜像未能保存,快照中读取该块失败
+
+    // 一个快照保存的旧镜像
+    struct SnapshotPages
+    {
+        off_t fileSize; // 创建时的文件大小,之后追加的块不属于该快照
+        std::unordered_map<off_t, off_t> pages; // 块偏移 -> 快照文件中的位置
+    };
+
+  public:
+    static const int MIN_FRAME_NUM = 8; // 一次操作最多同时占用的块数
+    static const size_t IO_ALIGN = 4096; // 读写缓冲的对齐(满足O_DIRECT)
+    static const int CHECKSUM_SIZE = 4;  // 块末尾校验和的字节数
+
+  private:
+    int fd_;                                  // 索引文件的描述符
+    int blockSize_;                           // 块大小
+    int frameNum_;                            // 缓存块数量
+    char *pages_;                             // 所有缓存块的连续空间
+    Frame *frames_;                           // 缓存块的描述信息
+    std::unordered_map<off_t, int> pageTable_; // 块偏移 -> frame下标
+    int hand_;                                // CLOCK指针
+    // 块偏移 -> frame下标的直接映射,供peek无锁读取(可能过时,需核对偏移)
+    int *hints_;
+    size_t hintMask_;
+
+    long hits_;   // 命中次数
+    long misses_; // 未命中次数(即pread次数)
+    long writes_; // 写入索引文件的块数
+
+    int dirtyLimit_; // 脏块数的上限,为0时不推迟写回
+    int dirtyNum_;   // 当前的脏块数
+
+    bool checksum_;       // 是否计算和校验块末尾的校验和
+    long checksumErrors_; // 读入时校验和不一致的块数
+
+    Wal *wal_; // 写前日志,为NULL时直接写回
+    // 已写入日志但未写回原位置的块: 块偏移 -> 最新镜像在日志中的位置
+    std::unordered_map<off_t, off_t> logged_;
+
+    char *map_;     // 映射模式下预留的地址空间,否则为NULL
+    off_t mapped_;  // 已映射的文件长度
+
+    IoRing *ring_;             // 批量读写使用的io_uring,为NULL时逐个读写
+    std::mutex ringMutex_;     // 并发的预读同时提交时保护ring_
+    bool batch_;               // 是否处于批量写回中
+    std::vector<int> pending_; // 等待写回的frame下标
+
+    bool concurrent_;  // 是否允许多线程同时访问
+    std::mutex mutex_; // 并发模式下保护页表/占用计数/CLOCK
+    std::condition_variable unpinned_; // 有缓存块的占用计数减为0
+
+    int snapFd_;                             // 快照文件,未启用时为-1
+    std::map<int, SnapshotPages> snapshots_; // 活动的快照
+    int snapshotNum_;                        // 活动的快照数(无锁读取)
+    int nextSnapshot_;                       // 下一个快照编号
+    std::vector<int> slotRefs_;  // 快照文件中每个位置被多少快照引用
+    std::vector<off_t> freeSlots_; // 快照文件中可重用的位置
+    char *snapBuf_;                // 复制旧镜像的缓冲
+    std::mutex snapMutex_;         // 保护快照的状态及与写回的先后
+
+  public:
+    // cacheSize为缓冲池大小(字节), mapped为true时使用映射模式
+    BufferPool(int fd, int blockSize, size_t cacheSize, bool mapped = false);
+    ~BufferPool();
+
+    // 取得offset处的块并占用,不在缓存中则从磁盘读取,读取失败时返回NULL
+    void *fetch(off_t offset);
+    // 为新分配的块取得一个缓存并占用(不读取磁盘)
+    void *create(off_t offset);
+    // 取得offset处的块但不占用,下一次换入时可能被覆盖,读取失败时返回NULL
+    void *lookup(off_t offset);
+    // 增加占用计数
+    void pin(const void *page);
+    // 减少占用计数
+    void unpin(const void *page);
+    // 将缓存块写回磁盘
+    int flush(const void *page);
+    // 丢弃offset处的块(块已被回收)
+    void discard(off_t offset);
+
+    // 此后写回的块只追加到日志中(不能用于映射模式)
+    void attachWal(Wal *wal) { wal_ = wal; }
+    // 将脏块与日志中的块按偏移顺序写回原位置并同步
+    int checkpoint();
+    // size之后的块已不再使用: 截掉文件(映射模式下打洞)
+    int truncate(off_t size);
+
+    /**
+     * 允许多线程同时访问(不能用于映射模式与写前日志)
+     * fetch未命中时,读入期间持有块的写锁,因此其他线程必须先加块锁再读取
+     * 所有缓存都被占用时等待其他线程释放,缓存块数应不少于同时占用的块数
+     */
+    void setConcurrent();
+    // 对已占用的块加锁,exclusive为true时加写锁
+    void latch(const void *page, bool exclusive);
+    // 释放块锁
+    void unlatch(const void *page);
+
+    /**
+     * 乐观读取: 不占用不加锁地取得offset处的缓存块及其当前版本
+     * 不在缓存中或正在被修改时返回NULL; 读取的内容在validate成功前不可信
+     */
+    void *peek(off_t offset, unsigned long *version);
+    // peek之后的读取期间缓存块未被修改或置换
+    bool validate(const void *page, unsigned long version) const;
+
+    /**
+     * 快照: 读取创建时的写回镜像(此时所有修改都已写回)
+     * 块的写回镜像在创建之后第一次改变前,旧镜像被复制到快照文件中,
+     * 同时存在的多个快照共享同一份复制,没有快照引用的位置被重用
+     */
+    // 指定保存旧镜像的文件
+    void attachSnapshotFile(int fd) { snapFd_ = fd; }
+    /**
+     * 创建快照,不小于fileSize的块不属于快照,返回快照编号
+     * 推迟写回的脏块先写入文件,写入失败时返回-1
+     */
+    int openSnapshot(off_t fileSize);
+    // 释放快照
+    void closeSnapshot(int id);
+    // 读取快照中offset处的块,page按IO_ALIGN对齐,读取失败时返回-1
+    int readSnapshot(int id, off_t offset, void *page);
+
+    // 使用io_uring提交批量读写,内核不支持时返回false
+    bool enableRing();
+    bool ringEnabled() const { return ring_ != NULL; }
+    // 把不在缓存中的块一次读入(不占用),读取失败的块不留在缓存中
+    void prefetch(const off_t *offsets, int n);
+    // 开始批量写回: 此后写回的块暂不写入,仍然占用
+    void beginBatch();
+    // 结束批量写回: 按偏移顺序一次提交所有写回
+    void endBatch();
+
+    /**
+     * 设置脏块数的上限(未启用写前日志时),超过时按偏移顺序写回未占用的脏块;
+     * 为0时每个操作结束时写回修改的块
+     */
+    void setDirtyLimit(int frames);
+
+    // 此后写入的块计算校验和,读入的块校验(块的最后CHECKSUM_SIZE字节)
+    void enableChecksum() { checksum_ = true; }
+    // 计算page的校验和,保存在块末尾
+    static void seal(void *page, int blockSize);
+    // page末尾的校验和是否与内容一致
+    static bool verify(const void *page, int blockSize);
+
+    long hits() const { return hits_; }
+    long misses() const { return misses_; }
+    long writes() const { return writes_; }
+    int dirtyNum() const { return dirtyNum_; }
+    long checksumErrors() const
+    {
+        return __atomic_load_n(&checksumErrors_, __ATOMIC_RELAXED);
+    }
+    int frameNum() const { return frameNum_; }
+    // 预读或批量写回一次最多占用的块数
+    int batchLimit() const { return frameNum_ / 4 > 1 ? frameNum_ / 4 : 1; }
+    bool mapped() const { return map_ != NULL; }
+    // 当前被占用的缓存块数量
+    int pinnedNum() const;
+
+    // 分配按IO_ALIGN对齐的缓冲,用free释放
+    static void *allocAligned(size_t size);
+
+  private:
+    // 获取page所在的frame下标
+    int frameOf(const void *page) const;
+    // 获取frame对应的缓存空间
+    inline char *pageOf(int i) const { return pages_ + (size_t) i * blockSize_; }
+    // 在页表中查找offset
+    int find(off_t offset);
+    // offset在hints_中的位置
+    inline size_t hintOf(off_t offset) const
+    {
+        return (size_t) (offset / blockSize_) & hintMask_;
+    }
+    // 修改frame之前使版本变为奇数
+    inline void beginChange(Frame &frame)
+    {
+        __atomic_store_n(&frame.version, frame.version + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    // 修改完成,版本变为偶数
+    inline void endChange(Frame &frame)
+    {
+        __atomic_store_n(&frame.version, frame.version + 1, __ATOMIC_RELEASE);
+    }
+    // 查找或分配offset的frame并计数,miss返回是否需要读入
+    int frameFor(off_t offset, bool *miss);
+    // 并发模式下返回需要持有的互斥锁,否则为NULL
+    std::mutex *lock() { return concurrent_ ? &mutex_ : NULL; }
+    // 为offset分配一个frame(可能置换出其他块),没有可用的frame时返回-1
+    // 返回的frame版本为奇数,内容就绪后由调用者endChange
+    int allocFrame(off_t offset);
+    // 读取offset处的块,已写入日志的块从日志中读取,失败时返回false
+    bool readPage(off_t offset, char *page);
+    // 写入文件或日志之前计算校验和
+    inline void seal(char *page)
+    {
+        if (checksum_) seal(page, blockSize_);
+    }
+    // 校验读入的块,不一致时计数并返回false
+    bool check(const char *page);
+    // 读入失败: 从页表中移除frame并释放读入者的占用
+    void dropFrame(int i);
+    // 标记为脏块(写入失败的块之后再写)
+    void markDirty(int i);
+    // 读取offset处的写回镜像,返回读到的长度(不存在时小于块大小)
+    int readImage(off_t offset, char *page);
+    // CLOCK算法选出一个可置换的frame,全部被占用时返回-1(并发模式)
+    int evict();
+    // 等待任一缓存块的占用被释放(持有mutex_时调用)
+    void waitUnpin();
+    // 映射模式下保证[0, end)已被映射,必要时扩展文件
+    void mapTo(off_t end);
+    // 提交n个读写请求并等待完成,返回失败的请求数
+    int submit(IoRing::Request *reqs, int n);
+    // 写回批量写回中积累的块
+    void flushPending();
+    // 按偏移顺序写回脏块,all为false时只写回未占用的块(持有mutex_时调用)
+    int writeBack(bool all);
+    // offset处的写回镜像即将改变,为尚未保存它的快照复制旧镜像
+    void preserve(off_t offset);
+};
+
+#endif // __BUFFERPOOL_H__
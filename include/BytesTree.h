@@ -0,0 +1,237 @@
+/*
+ * @file BytesTree.h
+ * @brief
+ * key为变长字节串的B+树,key按memcmp的顺序比较,支持范围遍历
+ * 节点使用SlottedPage格式: 页内的key共享公共前缀(前缀压缩),
+ * 叶子分裂时只把区分两个叶子所需的最短前缀提升到父节点(后缀截断)
+ * value为任意长度的字节串: 放得下时与key一起存放在叶子中,查找时一次读取;
+ * 否则存放在链接起来的溢出页中,叶子中只保存长度和第一个溢出页
+ * 索引文件的第一个块保存元数据,回收的块通过页头的next串成空闲链表
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __BYTESTREE_H__
+#define __BYTESTREE_H__
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "BufferPool.h"
+#include "SlottedPage.h"
+
+#ifndef S_OK
+#define S_OK 0
+#define S_FALSE -1
+#endif
+
+class BytesTree
+{
+  private:
+    static const off_t INVALID_OFFSET = 0xDEADBEEF; // 错误的文件偏移量
+    static const size_t DEFAULT_CACHE_SIZE = 4 << 20; // 默认缓冲池大小
+    static const char MAGIC[8];                       // 元数据块的标识
+
+    enum
+    {
+        BYTES_TREE_LEAF = 0,
+        BYTES_TREE_NON_LEAF = 1,
+        BYTES_TREE_FREE = 2,    // 空闲块
+        BYTES_TREE_OVERFLOW = 3 // 溢出页: 页头的next为下一个, count为数据长度
+    };
+
+    // 叶子中溢出value的引用
+    struct OverflowRef
+    {
+        uint64_t size; // value的长度
+        off_t first;   // 第一个溢出页
+    };
+
+    // 元数据,保存在文件的第一个块中
+    struct Meta
+    {
+        char magic[8];
+        int32_t blockSize;
+        int32_t unused;
+        off_t root;
+        off_t fileSize;
+        off_t freeHead; // 空闲链表的第一个块
+    };
+
+    int blockSize_;   // 块大小
+    int maxCell_;     // 一个entry最多占用的空间,保证节点至少能放下4个
+    off_t root_;      // 记录root的偏移量
+    off_t fileSize_;  // 指向文件末尾,便于创建新的block
+    off_t freeHead_;  // 空闲链表
+    int fd_;          // 索引文件的描述符
+    BufferPool *pool_; // 块缓存
+    std::vector<off_t> traceNode_; // 记录经过的父节点
+
+  public:
+    /**
+     * 沿叶子节点的prev/next双向遍历的游标
+     * 游标占用当前所在的叶子
+     * NOTE:修改树之后需要重新seek
+     */
+    class Cursor
+    {
+      private:
+        BytesTree *tree_; // 所属的树
+        char *leaf_;      // 当前叶子(已占用),NULL表示无效
+        int pos_;         // 在叶子中的位置
+
+      public:
+        Cursor(BytesTree *tree);
+        ~Cursor();
+        Cursor(const Cursor &) = delete;
+        Cursor &operator=(const Cursor &) = delete;
+
+        // 定位到第一个不小于k的key
+        int seek(const char *k, int len);
+        // 定位到最小的key
+        int seekFirst();
+        // 定位到最大的key
+        int seekLast();
+        // 移动到下一个key
+        int next();
+        // 移动到上一个key
+        int prev();
+
+        // 是否指向有效的key
+        bool valid() const { return leaf_ != NULL; }
+        std::string key() const;
+        // 当前value的副本(溢出的value从溢出页中读取)
+        std::string value() const;
+
+      private:
+        SlottedPage page() const;
+        // 移动到offset处叶子的第pos个key(负数表示倒数),越界则沿链表移动
+        int moveTo(off_t offset, int pos);
+        // 释放当前叶子
+        void release();
+    };
+
+    /**
+     * 流式读取value: 每次返回一段连续的数据,直接指向缓存(不复制)
+     * 叶子中的value只有一段,溢出的value每个溢出页一段
+     * 返回的数据在下一次调用next或析构之前有效
+     * NOTE:读取期间不能修改树
+     */
+    class ValueReader
+    {
+      private:
+        BytesTree *tree_;  // 所属的树
+        char *page_;       // 当前段所在的块(已占用)
+        const char *data_; // 叶子中尚未返回的value,NULL表示没有
+        int len_;          // data_的长度
+        off_t next_;       // 下一个溢出页
+        size_t size_;      // value的长度
+
+      public:
+        ValueReader(BytesTree *tree);
+        ~ValueReader();
+        ValueReader(const ValueReader &) = delete;
+        ValueReader &operator=(const ValueReader &) = delete;
+
+        // 打开k的value,不存在时返回S_FALSE
+        int open(const char *k, int klen);
+        // value的长度
+        size_t size() const { return size_; }
+        // 取得下一段数据,没有更多数据时返回S_FALSE
+        int next(const char **data, int *len);
+
+      private:
+        // 释放当前块
+        void release();
+    };
+
+    // blockSize不超过SlottedPage::MAX_BLOCK_SIZE, cacheSize为缓冲池大小
+    BytesTree(
+        const char *fileName,
+        int blockSize = 4096,
+        size_t cacheSize = DEFAULT_CACHE_SIZE);
+    ~BytesTree();
+
+    // 增加数据,key已存在或key太长时返回S_FALSE
+    int insert(const char *k, int klen, const char *value, int vlen);
+    // 查找,找到则通过value返回
+    int search(const char *k, int klen, std::string *value);
+    // 删除
+    int remove(const char *k, int klen);
+    // 写回推迟的脏块与元数据并同步索引文件
+    int sync();
+
+    // 叶子中key与value的总长度上限,超过时value放入溢出页
+    int maxEntrySize() const
+    {
+        return maxCell_ - SlottedPage::cellSize(0, 0);
+    }
+    // key的长度上限
+    int maxKeySize() const
+    {
+        return maxEntrySize() - (int) sizeof(OverflowRef);
+    }
+
+  private:
+    SlottedPage page(void *node) const
+    {
+        return SlottedPage(node, blockSize_);
+    }
+    bool isLeaf(void *node) const
+    {
+        return ((PageHeader *) node)->type == BYTES_TREE_LEAF;
+    }
+
+    // 读取/写回元数据块
+    void metaLoad();
+    int metaStore();
+
+    // 分配一个block(优先使用空闲链表),返回已占用的缓存
+    char *newNode(int type);
+    // 回收block,加入空闲链表
+    void freeNode(char *node);
+    // 写回并释放占用
+    void blockFlush(char *node);
+    // 把block取到cache中(占用)
+    char *fetchBlock(off_t offset);
+    // 把block读到cache中(不占用)
+    char *locateNode(off_t offset);
+
+    // 从root查找k所在的叶子并记录父节点,k为NULL时查找最左/最右的叶子
+    off_t descend(const char *k, int klen, bool rightmost);
+
+    /*** Overflow ***/
+    // 每个溢出页中的数据长度
+    int overflowCapacity() const
+    {
+        return blockSize_ - (int) sizeof(PageHeader);
+    }
+    // value写入新分配的溢出页,返回第一个溢出页
+    off_t writeOverflow(const char *value, int vlen);
+    // 回收从first开始的溢出页
+    void freeOverflow(off_t first);
+    // 读取叶子中第pos个value(包括溢出的value)
+    void readValue(const SlottedPage &leaf, int pos, std::string *value);
+
+    // 叶子放不下时按占用的空间平分,返回右侧的第一个位置
+    static int splitPoint(const std::vector<SlottedPage::Entry> &all);
+    // 区分left与right的最短分隔key: left < key <= right
+    static std::string
+    separator(const std::string &left, const std::string &right);
+
+    // 在叶子中插入(external表示v为溢出页的引用),放不下时分裂
+    int insertLeaf(
+        char *leaf,
+        int pos,
+        const char *k,
+        int klen,
+        const char *v,
+        int vlen,
+        bool external);
+    // 子节点分裂后在父节点插入分隔key
+    void updateParentNode(off_t left, off_t right, const std::string &k);
+
+    // 删除后过小的节点与同一父节点下的相邻节点合并
+    void mergeNode(char *node);
+};
+
+#endif // __BYTESTREE_H__
@@ -0,0 +1,43 @@
+/*
+ * @file Crc32c.h
+ * @brief
+ * CRC32C(Castagnoli)校验和: 支持SSE4.2时使用crc32指令,
+ * 三路交错计算后合并以隐藏指令延迟; 否则按8字节查表(slicing-by-8)
+ * 指令集在运行时通过cpuid选择
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+#include <stddef.h>
+#include <stdint.h>
+
+class Crc32c
+{
+  public:
+    // data的CRC32C
+    static uint32_t compute(const void *data, size_t len)
+    {
+        return extend(0, data, len);
+    }
+    // crc为之前数据的CRC32C,返回接上data之后的CRC32C
+    static uint32_t extend(uint32_t crc, const void *data, size_t len)
+    {
+        return ~extend_(~crc, (const char *) data, len);
+    }
+
+    // 当前使用的指令集(NodeSearch::ISA_*)
+    static int isa() { return isa_; }
+    // 指定使用的指令集(测试用),CPU不支持时返回false
+    static bool select(int isa);
+
+  private:
+    // 在未取反的寄存器值上继续计算
+    typedef uint32_t (*Extend)(uint32_t, const char *, size_t);
+
+    static int isa_;
+    static Extend extend_;
+};
+
+#endif // __CRC32C_H__
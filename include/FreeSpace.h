@@ -0,0 +1,61 @@
+/*
+ * @file FreeSpace.h
+ * @brief
+ * 空闲空间管理: 每个块在位图中占一位(1为已使用)
+ * 分配时优先选择指定块附近的空闲块,使相邻的叶子在文件中也相邻;
+ * 否则选择最低的空闲块,让文件末尾的块尽量空闲,便于缩小文件
+ * 位图按64位字存放,整字已满或全空时一次跳过
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __FREESPACE_H__
+#define __FREESPACE_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+
+class FreeSpace
+{
+  public:
+    static const off_t NONE = -1; // 没有可用的块
+
+  private:
+    std::vector<uint64_t> words_; // 位图
+    off_t pages_;                 // 块数
+    size_t lowest_; // 最低的可能有空闲块的字(之前的字都已满)
+
+  public:
+    FreeSpace();
+
+    // 块数变为pages: 新增的块空闲,超出的块被丢弃
+    void resize(off_t pages);
+    off_t pages() const { return pages_; }
+    // page是否已使用
+    bool used(off_t page) const
+    {
+        return (words_[page / 64] >> (page % 64)) & 1;
+    }
+    // 标记page已使用/空闲
+    void mark(off_t page);
+    void release(off_t page);
+
+    // hint前后range个块以内最近的空闲块(after为true时先向后找),没有返回NONE
+    off_t near(off_t hint, int range, bool after) const;
+    // 最低的空闲块,没有返回NONE
+    off_t lowest() const;
+    // 最低的连续n个空闲块的第一个,没有返回NONE
+    off_t lowestRun(int n) const;
+    // 最后一个已使用的块之后的块数
+    off_t usedEnd() const;
+
+    // 位图序列化后的字节数
+    size_t bytes() const { return words_.size() * sizeof(uint64_t); }
+    // 序列化到buf(至少bytes()字节)
+    void store(char *buf) const;
+    // 从store的结果中恢复pages个块的位图
+    void load(const char *buf, off_t pages);
+};
+
+#endif // __FREESPACE_H__
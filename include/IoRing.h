@@ -0,0 +1,68 @@
+/*
+ * @file IoRing.h
+ * @brief
+ * 基于io_uring系统调用的批量读写,一次io_uring_enter提交多个请求
+ * 内核不支持时valid()为false,由调用者退回pread/pwrite
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __IORING_H__
+#define __IORING_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class IoRing
+{
+  public:
+    // 一个读写请求
+    struct Request
+    {
+        char *buf;    // 缓冲区
+        off_t offset; // 文件偏移
+        int len;      // 长度
+        bool write;   // true为写,false为读
+        int result;   // 完成后的返回值(同pread/pwrite,失败为-errno)
+    };
+
+  private:
+    int ringFd_;       // io_uring的描述符,失败时为-1
+    unsigned entries_; // 提交队列长度(同时在途的最大请求数)
+
+    // 提交队列
+    void *sqRing_;
+    size_t sqRingSize_;
+    unsigned *sqTail_;
+    unsigned *sqMask_;
+    unsigned *sqArray_;
+    io_uring_sqe *sqes_;
+    size_t sqesSize_;
+
+    // 完成队列
+    void *cqRing_;
+    size_t cqRingSize_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned *cqMask_;
+    io_uring_cqe *cqes_;
+
+  public:
+    // entries为队列深度
+    IoRing(unsigned entries);
+    ~IoRing();
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    bool valid() const { return ringFd_ >= 0; }
+    // 对fd提交n个请求并等待全部完成,返回未完整读写的请求数
+    int submit(int fd, Request *reqs, int n);
+
+  private:
+    void release();
+};
+
+#endif // __IORING_H__
@@ -0,0 +1,312 @@
+/*
+ * @file LeafCodec.h
+ * @brief
+ * 叶子节点的压缩格式: 整数key/value按差值存放,每个差值占1/2/4/8字节
+ * key存放与前一个key的差, value存放与前一个value之差的zigzag编码,
+ * 每个entry的两个长度码各2位; 每GROUP个entry一个目录项,记录组内第一个
+ * entry的完整key/value以及差值的位置,查找时二分目录项后只解码一组
+ * 差值的解码使用pshufb一次解出两个(运行时选择指令集)
+ *
+ * 布局: [目录项 * 组数][key长度码][value长度码][key差值][value差值]
+ * 每个entry的大小只与相邻entry有关: 插入/删除后编码大小的变化有上界,
+ * 放不下时按编码大小平分成两半,每一半都能放下
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __LEAFCODEC_H__
+#define __LEAFCODEC_H__
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// 差值的解码
+class DeltaCodec
+{
+  public:
+    /**
+     * 按ctrl中的长度码(每个2位,从最低位开始)解码n个差值到out
+     * 不读取end之后的数据(越界的差值为0),返回之后的数据位置
+     */
+    static const char *decode(
+        const uint8_t *ctrl,
+        const char *data,
+        const char *end,
+        int n,
+        uint64_t *out)
+    {
+        return decode_(ctrl, data, end, n, out);
+    }
+
+    // 当前使用的指令集(NodeSearch::ISA_*)
+    static int isa() { return isa_; }
+    // 指定使用的指令集(测试用),CPU不支持时返回false
+    static bool select(int isa);
+
+  private:
+    typedef const char *(*Decode)(
+        const uint8_t *,
+        const char *,
+        const char *,
+        int,
+        uint64_t *);
+
+    static int isa_;
+    static Decode decode_;
+};
+
+/**
+ * Key/Value为不超过64位的整数时可以压缩
+ * 所有函数的area为节点中key开始的位置, limit为area中可读的字节数
+ */
+template <typename Key, typename Value>
+struct LeafCodec
+{
+    static const int GROUP = 16; // 每个目录项的entry数
+    // 目录项: key(8) + value(8) + key差值的位置(2) + value差值的位置(2)
+    static const int DIR_BYTES = 20;
+    // 数据之后保留的字节,向量解码时每次读取16字节
+    static const int SLACK = 16;
+    static const bool SUPPORTED =
+        std::is_integral<Key>::value && std::is_integral<Value>::value
+        && sizeof(Key) <= 8 && sizeof(Value) <= 8;
+
+    static int groups(int n) { return (n + GROUP - 1) / GROUP; }
+    static int ctrlBytes(int n) { return (n + 3) / 4; }
+
+    // 差值的长度码,占用(1 << code)字节
+    static int code(uint64_t d)
+    {
+        if (d < (1ull << 8)) return 0;
+        if (d < (1ull << 16)) return 1;
+        if (d < (1ull << 32)) return 2;
+        return 3;
+    }
+
+    // 整数扩展到64位(有符号数按符号扩展,差值按模2^64计算)
+    static uint64_t keyBits(Key k) { return toBits(k, Tag()); }
+    static uint64_t valueBits(Value v) { return toBits(v, Tag()); }
+
+    static uint64_t zigzag(uint64_t d)
+    {
+        return (d << 1) ^ (uint64_t) ((int64_t) d >> 63);
+    }
+    static uint64_t unzigzag(uint64_t z) { return (z >> 1) ^ (0 - (z & 1)); }
+
+    // 一个entry的差值占用的字节数,第一个entry的prevKey/prevValue为0
+    static int
+    entryBytes(uint64_t prevKey, uint64_t k, uint64_t prevValue, uint64_t v)
+    {
+        return (1 << code(k - prevKey)) + (1 << code(zigzag(v - prevValue)));
+    }
+
+    // n个entry,差值共dataBytes字节时编码后的大小
+    static int size(int n, int dataBytes)
+    {
+        return groups(n) * DIR_BYTES + 2 * ctrlBytes(n) + dataBytes;
+    }
+
+    static int size(const Key *keys, const Value *values, int n)
+    {
+        int dataBytes = 0;
+        uint64_t k = 0, v = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t nk = keyBits(keys[i]), nv = valueBits(values[i]);
+            dataBytes += entryBytes(k, nk, v, nv);
+            k = nk;
+            v = nv;
+        }
+        return size(n, dataBytes);
+    }
+
+    // 按编码大小平分n(> 1)个entry,返回右半部分的第一个位置
+    static int split(const Key *keys, const Value *values, int n)
+    {
+        int total = size(keys, values, n);
+        int left = 0;
+        int m = 0;
+        uint64_t k = 0, v = 0;
+        while (m < n - 1 && (m == 0 || left * 2 < total)) {
+            uint64_t nk = keyBits(keys[m]), nv = valueBits(values[m]);
+            left += entryBytes(k, nk, v, nv);
+            k = nk;
+            v = nv;
+            m++;
+        }
+        return m;
+    }
+
+    // 编码n个有序的entry,调用者保证area中有size() + SLACK字节
+    static void encode(const Key *keys, const Value *values, int n, char *area)
+    {
+        uint8_t *keyCtrl = (uint8_t *) area + groups(n) * DIR_BYTES;
+        uint8_t *valueCtrl = keyCtrl + ctrlBytes(n);
+        memset(keyCtrl, 0, 2 * ctrlBytes(n));
+
+        // key差值之后是value差值
+        int keyBytes = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t prev = i > 0 ? keyBits(keys[i - 1]) : 0;
+            keyBytes += 1 << code(keyBits(keys[i]) - prev);
+        }
+        char *kp = (char *) valueCtrl + ctrlBytes(n);
+        char *vp = kp + keyBytes;
+
+        uint64_t k = 0, v = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t nk = keyBits(keys[i]), nv = valueBits(values[i]);
+            if (i % GROUP == 0) {
+                char *dir = area + i / GROUP * DIR_BYTES;
+                uint16_t keyOff = kp - area, valueOff = vp - area;
+                memcpy(dir, &nk, 8);
+                memcpy(dir + 8, &nv, 8);
+                memcpy(dir + 16, &keyOff, 2);
+                memcpy(dir + 18, &valueOff, 2);
+            }
+
+            int kc = code(nk - k), vc = code(zigzag(nv - v));
+            keyCtrl[i / 4] |= kc << (i % 4 * 2);
+            valueCtrl[i / 4] |= vc << (i % 4 * 2);
+            kp = store(kp, nk - k, 1 << kc);
+            vp = store(vp, zigzag(nv - v), 1 << vc);
+            k = nk;
+            v = nv;
+        }
+        // 保留的字节清零,之后的内容与编码无关
+        memset(vp, 0, SLACK);
+    }
+
+    // 第g组第一个key
+    static Key groupKey(const char *area, int g)
+    {
+        uint64_t k;
+        memcpy(&k, area + g * DIR_BYTES, 8);
+        return fromBits<Key>(k, Tag());
+    }
+
+    /**
+     * 解码第g组的key/value(可为NULL),返回组内的entry数
+     * 内容不完整(乐观读取)时结果无意义,但不会越过limit读取
+     */
+    static int decodeGroup(
+        const char *area,
+        int limit,
+        int n,
+        int g,
+        Key *keys,
+        Value *values)
+    {
+        int first = g * GROUP;
+        int m = n - first < GROUP ? n - first : GROUP;
+        const uint8_t *keyCtrl =
+            (const uint8_t *) area + groups(n) * DIR_BYTES + first / 4;
+        const uint8_t *valueCtrl = keyCtrl + ctrlBytes(n);
+        const char *dir = area + g * DIR_BYTES;
+
+        uint64_t d[GROUP];
+        uint64_t x;
+        uint16_t off;
+        if (keys != NULL) {
+            memcpy(&x, dir, 8);
+            memcpy(&off, dir + 16, 2);
+            if (off > limit) off = limit;
+            DeltaCodec::decode(keyCtrl, area + off, area + limit, m, d);
+            keys[0] = fromBits<Key>(x, Tag());
+            for (int i = 1; i < m; i++)
+                keys[i] = fromBits<Key>(x += d[i], Tag());
+        }
+        if (values != NULL) {
+            memcpy(&x, dir + 8, 8);
+            memcpy(&off, dir + 18, 2);
+            if (off > limit) off = limit;
+            DeltaCodec::decode(valueCtrl, area + off, area + limit, m, d);
+            values[0] = fromBits<Value>(x, Tag());
+            for (int i = 1; i < m; i++)
+                values[i] = fromBits<Value>(x += unzigzag(d[i]), Tag());
+        }
+        return m;
+    }
+
+    // 解码全部n个entry
+    static void
+    decode(const char *area, int limit, int n, Key *keys, Value *values)
+    {
+        for (int g = 0; g < groups(n); g++)
+            decodeGroup(
+                area,
+                limit,
+                n,
+                g,
+                keys + g * GROUP,
+                values != NULL ? values + g * GROUP : NULL);
+    }
+
+    // 返回值与BPlusTree::searchInNode相同: 非负数->存在 负数->可插入坐标-1
+    static int search(const char *area, int limit, int n, Key target)
+    {
+        if (n <= 0 || target < groupKey(area, 0)) return -1;
+
+        // 最后一个第一个key不大于target的组
+        int low = 0, high = groups(n) - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (target < groupKey(area, mid))
+                high = mid - 1;
+            else
+                low = mid;
+        }
+
+        Key keys[GROUP];
+        int m = decodeGroup(area, limit, n, low, keys, NULL);
+        int i = 0;
+        while (i < m && keys[i] < target)
+            i++;
+
+        int pos = low * GROUP + i;
+        if (i < m && keys[i] == target) return pos;
+        return -pos - 1;
+    }
+
+    // 第pos个value
+    static Value value(const char *area, int limit, int n, int pos)
+    {
+        Value values[GROUP];
+        decodeGroup(area, limit, n, pos / GROUP, NULL, values);
+        return values[pos % GROUP];
+    }
+
+  private:
+    typedef std::integral_constant<bool, SUPPORTED> Tag;
+
+    template <typename T>
+    static uint64_t toBits(T x, std::true_type)
+    {
+        return (uint64_t) (int64_t) x;
+    }
+    template <typename T>
+    static T fromBits(uint64_t x, std::true_type)
+    {
+        return (T) x;
+    }
+    // 不能压缩的类型不会调用
+    template <typename T>
+    static uint64_t toBits(T, std::false_type)
+    {
+        return 0;
+    }
+    template <typename T>
+    static T fromBits(uint64_t, std::false_type)
+    {
+        return T();
+    }
+
+    // 按小端序写入d的低len字节
+    static char *store(char *p, uint64_t d, int len)
+    {
+        for (int i = 0; i < len; i++, d >>= 8)
+            p[i] = (char) (d & 0xff);
+        return p + len;
+    }
+};
+
+#endif // __LEAFCODEC_H__
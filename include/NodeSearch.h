@@ -0,0 +1,177 @@
+/*
+ * @file NodeSearch.h
+ * @brief
+ * 节点内查找: 在有序的key数组中查找第一个不小于target的位置
+ * 32/64位整数key先二分缩小到64字节的窗口,再用打包比较+movemask计数
+ * 比较窗口使用的指令集(AVX-512/AVX2/SSE)在运行时通过cpuid选择
+ * 另有Eytzinger布局的转换与查找,供只读居多的非叶子节点使用
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __NODESEARCH_H__
+#define __NODESEARCH_H__
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// 不大于n的最大的2的幂
+inline constexpr int floorPow2(int n, int p = 1)
+{
+    return p * 2 > n ? p : floorPow2(n, p * 2);
+}
+
+class NodeSearch
+{
+  public:
+    enum
+    {
+        ISA_SCALAR = 0,
+        ISA_SSE,    // SSE2(32位) / SSE4.2(64位)
+        ISA_AVX2,
+        ISA_AVX512, // AVX-512F
+    };
+
+    // 向量比较的窗口大小
+    static const int WINDOW_BYTES = 64;
+    // 窗口可能越过keys[count],之后的PAD_BYTES字节必须可读(内容无关)
+    static const int PAD_BYTES = WINDOW_BYTES;
+    // key数不少于该值时使用向量比较,更小的节点二分查找更快
+    static const int MIN_KEYS = 32;
+
+    // keys的前min(n, 窗口key数)个中小于target的个数
+    static int countLess(const int32_t *keys, int n, int32_t target)
+    {
+        return window32_(keys, n, target);
+    }
+    static int countLess(const int64_t *keys, int n, int64_t target)
+    {
+        return window64_(keys, n, target);
+    }
+
+    // 当前使用的指令集
+    static int isa() { return isa_; }
+    static const char *isaName(int isa);
+    // 指定使用的指令集(测试用),CPU不支持时返回false
+    static bool select(int isa);
+    // CPU支持的最好的指令集
+    static int detect();
+
+  private:
+    typedef int (*Window32)(const int32_t *, int, int32_t);
+    typedef int (*Window64)(const int64_t *, int, int64_t);
+
+    static int isa_;
+    static Window32 window32_;
+    static Window64 window64_;
+};
+
+/**
+ * 按Key类型选择节点内查找的方式, N为节点中最多的key数
+ * 默认: 二分查找,循环次数在编译期确定,可被完全展开
+ */
+template <
+    typename Key,
+    int N,
+    bool Simd = (std::is_same<Key, int32_t>::value
+                 || std::is_same<Key, int64_t>::value)
+                && N >= NodeSearch::MIN_KEYS>
+struct KeySearch
+{
+    static int lowerBound(const Key *keys, int count, Key target)
+    {
+        int low = 0;
+        for (int step = floorPow2(N); step > 0; step >>= 1) {
+            if (low + step <= count && keys[low + step - 1] < target)
+                low += step;
+        }
+        return low;
+    }
+};
+
+// 32/64位整数: 二分查找到窗口大小后使用NodeSearch的向量比较
+template <typename Key, int N>
+struct KeySearch<Key, N, true>
+{
+    static const int WINDOW = NodeSearch::WINDOW_BYTES / sizeof(Key);
+
+    static int lowerBound(const Key *keys, int count, Key target)
+    {
+        // 乐观读取时count可能不完整,限制在N以内保证不越界
+        if ((unsigned) count > (unsigned) N) count = count < 0 ? 0 : N;
+
+        int low = 0;
+        for (int step = floorPow2(N); step >= WINDOW; step >>= 1) {
+            if (low + step <= count && keys[low + step - 1] < target)
+                low += step;
+        }
+        // 结果位于[low, low + WINDOW)中
+        return low + NodeSearch::countLess(keys + low, count - low, target);
+    }
+};
+
+/**
+ * Eytzinger布局: 有序的key按完全二叉树的层序存放,
+ * 层序下标k(从1开始)的左右孩子为2k和2k+1,存放在keys[k - 1]
+ * 查找时访问的位置集中在数组前部,孩子所在的缓存行可以提前几层预取
+ * N为最多的key数
+ */
+template <typename Key, int N>
+struct Eytzinger
+{
+    // 一个缓存行中的key数,预取之后log2(LINE)层
+    static const int LINE = sizeof(Key) >= (size_t) NodeSearch::WINDOW_BYTES
+                                ? 1
+                                : NodeSearch::WINDOW_BYTES / sizeof(Key);
+
+    // 层序下标k在有序数组中的位置, n为key数
+    static int rank(int k, int n)
+    {
+        int h = 31 - __builtin_clz(n); // 最后一层的深度
+        int d = 31 - __builtin_clz(k);
+        int m = n - (1 << h) + 1; // 最后一层的节点数
+        // 在满二叉树中的位置,减去其前面缺少的最后一层节点
+        int r = ((2 * (k - (1 << d)) + 1) << (h - d)) - 1;
+        return r < 2 * m ? r : r - ((r + 1) / 2 - m);
+    }
+
+    // 有序数组中的位置r对应的层序下标
+    static int index(int r, int n)
+    {
+        int h = 31 - __builtin_clz(n);
+        int m = n - (1 << h) + 1;
+        int p = r < 2 * m ? r : 2 * r - 2 * m + 1;
+        int z = __builtin_ctz(p + 1);
+        return (1 << (h - z)) + ((p + 1) >> (z + 1));
+    }
+
+    // 有序数组转换为层序
+    static void pack(Key *keys, int n)
+    {
+        Key sorted[N];
+        memcpy(sorted, keys, n * sizeof(Key));
+        for (int k = 1; k <= n; k++) keys[k - 1] = sorted[rank(k, n)];
+    }
+
+    // 层序恢复为有序数组
+    static void unpack(Key *keys, int n)
+    {
+        Key packed[N];
+        memcpy(packed, keys, n * sizeof(Key));
+        for (int k = 1; k <= n; k++) keys[rank(k, n)] = packed[k - 1];
+    }
+
+    // 第一个不小于target的key的层序下标,不存在时为0
+    static int lowerBound(const Key *keys, int n, Key target)
+    {
+        int k = 1;
+        while (k <= n) {
+            __builtin_prefetch(keys + k * LINE - 1);
+            k = 2 * k + (keys[k - 1] < target);
+        }
+        // 去掉最后一段向右的路径,回到最后一次向左的节点
+        return k >> __builtin_ffs(~k);
+    }
+};
+
+#endif // __NODESEARCH_H__
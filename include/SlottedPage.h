@@ -0,0 +1,139 @@
+/*
+ * @file SlottedPage.h
+ * @brief
+ * 变长key的页面格式(slotted page): 页头之后是按key有序的slot数组,
+ * 每个slot为2字节,记录cell在块中的位置; cell从块末尾向前分配
+ * cell: [key后缀长度(2)][payload长度(2)][key后缀][payload]
+ * 叶子的payload为value(或溢出页的引用),非叶子的payload为key左侧子节点的偏移
+ * 页内所有key的公共前缀只在块末尾保存一次(前缀压缩),cell中只有后缀
+ *
+ * 布局: [PageHeader][slot * count] ... [cell区][公共前缀]
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __SLOTTEDPAGE_H__
+#define __SLOTTEDPAGE_H__
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// 页头,字段按自然边界对齐
+struct PageHeader
+{
+    off_t self;       // 当前block在文件中的偏移
+    off_t prev;       // 叶子节点的前一个
+    off_t next;       // 叶子节点的后一个,空闲块为下一个空闲块
+    off_t lastOffset; // 非叶子节点最右的子节点
+    uint16_t type;    // 叶子节点/非叶子节点/空闲块
+    uint16_t count;   // slot的个数
+    uint16_t heap;    // cell区的起始位置
+    uint16_t frag;    // 删除cell后留下的空洞字节数
+    uint16_t prefix;  // 公共前缀的长度
+    uint16_t unused[3];
+};
+
+class SlottedPage
+{
+  public:
+    static const int SLOT_SIZE = 2;   // 一个slot的大小
+    static const int CELL_HEADER = 4; // cell中两个长度的大小
+    static const int MAX_BLOCK_SIZE = 32768; // 块内位置为16位
+    // payload长度的最高位: payload是块外数据(溢出页)的引用
+    static const int EXTERNAL = 0x8000;
+
+    // 一个完整的entry,重建页面时使用
+    struct Entry
+    {
+        std::string key;
+        std::string payload;
+        bool external = false;
+    };
+
+  private:
+    char *page_;     // 块的缓存
+    int blockSize_;  // 块大小
+
+  public:
+    SlottedPage(void *page, int blockSize)
+        : page_((char *) page), blockSize_(blockSize)
+    {
+    }
+
+    PageHeader *header() const { return (PageHeader *) page_; }
+    int count() const { return header()->count; }
+    // 初始化为空页面
+    void init(off_t self, int type);
+
+    // 公共前缀
+    const char *prefix() const
+    {
+        return page_ + blockSize_ - header()->prefix;
+    }
+    int prefixLen() const { return header()->prefix; }
+    // 第i个key去掉公共前缀后的部分
+    const char *suffix(int i, int *len) const;
+    // 第i个cell的payload
+    const char *payload(int i, int *len) const;
+    // 第i个cell的payload是否为块外数据的引用
+    bool external(int i) const;
+    // 第i个完整的key
+    std::string key(int i) const;
+    // 非叶子节点第i个子节点(i == count时为最右的子节点)
+    off_t child(int i) const;
+    void setChild(int i, off_t offset);
+
+    // 返回值: 非负数->存在  负数->可插入坐标的相反数减1
+    int search(const char *k, int len) const;
+
+    // 页面中可以使用的空间
+    int capacity() const { return blockSize_ - (int) sizeof(PageHeader); }
+    // slot/cell/公共前缀占用的空间(不含空洞)
+    int used() const;
+
+    // 在pos处插入一个entry,放不下时返回false(页面不变)
+    bool insert(
+        int pos,
+        const char *k,
+        int klen,
+        const char *p,
+        int plen,
+        bool external = false);
+    // 删除pos处的entry
+    void remove(int pos);
+    // 把所有entry追加到out
+    void entries(std::vector<Entry> *out) const;
+    // 用n个有序的entry重建页面(页头的偏移与类型不变),放不下时返回false
+    bool build(const Entry *e, int n);
+
+    // n个entry重建后占用的空间
+    static int size(const Entry *e, int n);
+    // 一个entry占用的空间
+    static int cellSize(int keyLen, int payloadLen)
+    {
+        return SLOT_SIZE + CELL_HEADER + keyLen + payloadLen;
+    }
+    // 按memcmp比较,较短的key是较长的key的前缀时较小
+    static int compare(const char *a, int alen, const char *b, int blen);
+    // 两个key的公共前缀长度
+    static int commonPrefix(const char *a, int alen, const char *b, int blen);
+
+  private:
+    uint16_t *slots() const
+    {
+        return (uint16_t *) (page_ + sizeof(PageHeader));
+    }
+    // 第i个cell
+    const char *cell(int i) const { return page_ + slots()[i]; }
+    // slot数组之后到cell区之间的空间
+    int gap() const
+    {
+        return header()->heap - (int) sizeof(PageHeader)
+               - SLOT_SIZE * header()->count;
+    }
+    // 整理cell区,去掉空洞
+    void compact();
+};
+
+#endif // __SLOTTEDPAGE_H__
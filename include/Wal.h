@@ -0,0 +1,101 @@
+/*
+ * @file Wal.h
+ * @brief
+ * 写前日志: 块镜像与元数据记录顺序追加,以COMMIT记录划分操作,
+ * 多个操作共享一次fdatasync(组提交)
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __WAL_H__
+#define __WAL_H__
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+
+class Wal
+{
+  public:
+    enum {
+        WAL_PAGE = 1, // 块镜像, offset为块偏移, 负载为整个块
+        WAL_META,     // 元数据, offset为root, 负载为文件大小
+        WAL_ALLOC,    // offset处的块被分配
+        WAL_FREE,     // offset处的块被回收
+        WAL_COMMIT,   // 一个操作结束
+    };
+
+    // 记录的格式
+    enum {
+        FORMAT_FNV = 0,    // v4: FNV-1a校验和,块镜像末尾没有校验和
+        FORMAT_CRC32C = 1, // CRC32C校验和,块镜像末尾已有校验和
+    };
+
+    struct Record
+    {
+        uint32_t checksum; // 除本字段外整条记录(含负载)的校验和
+        uint32_t type;     // 记录类型
+        uint32_t length;   // 负载长度
+        uint32_t format;   // 记录的格式(FORMAT_*)
+        int64_t offset; // 块偏移或root
+    };
+
+    // 恢复时, 对每个完整操作中的记录依次调用
+    typedef void (*Replayer)(
+        const Record *record,
+        const char *payload,
+        void *arg);
+
+    static const int DEFAULT_GROUP_SIZE = 64; // 默认每组提交的操作数
+
+  private:
+    static const size_t BUFFER_SIZE = 1 << 20; // 日志缓冲超过该值则写入文件
+
+    int fd_;                // 日志文件的描述符
+    int blockSize_;         // 块大小
+    std::vector<char> buf_; // 尚未写入文件的记录
+    off_t written_;         // 已写入文件的长度
+    int groupSize_;         // 每组提交的操作数
+    int groupOps_;          // 当前组中尚未同步的操作数
+    int uncommitted_;       // 最后一个COMMIT之后的记录数
+    long syncs_;            // fdatasync次数
+
+  public:
+    Wal(const char *fileName, int blockSize);
+    ~Wal();
+
+    // 追加一个块镜像,返回镜像在日志中的位置
+    off_t appendPage(off_t offset, const void *page);
+    void appendMeta(off_t root, off_t fileSize);
+    void appendAlloc(off_t offset);
+    void appendFree(off_t offset);
+    // 结束一个操作,凑满一组后同步
+    int commit();
+    // 将已提交的操作写入文件并同步
+    int sync();
+    // 读取appendPage返回位置处的块镜像,读到的长度不足时返回-1
+    int readPage(off_t pos, void *page);
+
+    // 重放日志中完整的操作,丢弃不完整的尾部,返回重放的操作数
+    int recover(Replayer replayer, void *arg);
+    // 检查点完成后清空日志
+    int reset();
+
+    off_t size() const { return written_ + buf_.size(); }
+    int uncommitted() const { return uncommitted_; }
+    long syncs() const { return syncs_; }
+    void setGroupSize(int n) { groupSize_ = n > 0 ? n : 1; }
+
+  private:
+    void append(
+        uint32_t type,
+        off_t offset,
+        const void *payload,
+        uint32_t length);
+    // 将缓冲中的记录写入文件(不同步)
+    int writeOut();
+    // 按记录的格式计算校验和
+    static uint32_t checksum(const Record *record, const void *payload);
+    static uint32_t fnvChecksum(const Record *record, const void *payload);
+};
+
+#endif // __WAL_H__
@@ -12,40 +12,69 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include "BPlusTree.h"
+#include "Crc32c.h"
 
-BPlusTree::BPlusTree(const char *fileName, int blockSize)
-    : fileName_(fileName)
+// O_DIRECT要求的偏移与内存对齐,无法获取时按512字节的扇区计算
+static int directAlignment(int fd)
 {
-    char bootFile[32];
-    off_t freeBlock;
-    sprintf(bootFile, "%s.boot", fileName);
-    int fd = open(bootFile, O_RDONLY, 0644);
-
-    // 读取配置
-    if (fd > 0) {
-        printf("load boot file...\n");
-        root_ = offsetLoad(fd);
-        blockSize_ = offsetLoad(fd);
-        fileSize_ = offsetLoad(fd);
-
-        // 加载空闲块
-        while ((freeBlock = offsetLoad(fd)) != INVALID_OFFSET) {
-            freeBlocks_.push_back(freeBlock);
-        }
-        close(fd);
-    } else {
-        root_ = INVALID_OFFSET;
-        blockSize_ = blockSize;
-        fileSize_ = 0;
+#ifdef STATX_DIOALIGN
+    struct statx st;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &st) == 0
+        && (st.stx_mask & STATX_DIOALIGN) && st.stx_dio_offset_align > 0) {
+        return std::max(st.stx_dio_offset_align, st.stx_dio_mem_align);
     }
+#endif
+    return 512;
+}
 
-    // 计算树的度
-    DEGREE = (blockSize_ - sizeof(Node)) / (sizeof(key_t) + sizeof(off_t));
-    assert(DEGREE > 2);
-
+// v1格式的页头
+#pragma pack(push)
+#pragma pack(2)
+struct NodeV1
+{
+    off_t self;
+    off_t prev;
+    off_t next;
+    off_t lastOffset;
+    short type;
+    int count;
+};
+#pragma pack(pop)
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::BPlusTree(
+    const char *fileName,
+    size_t cacheSize,
+    int flags)
+    : root_(INVALID_OFFSET)
+    , fileSize_(BlockSize)
+    , mapPage_(INVALID_OFFSET)
+    , mapPages_(0)
+    , fileName_(fileName)
+    , wal_(NULL)
+    , snapFd_(-1)
+    , opDepth_(0)
+    , recovered_(0)
+    , leafMin_((DEGREE + 1) / 2)
+    , nonLeafMin_((DEGREE + 1) / 2)
+    , packedMin_(PACKED_CAPACITY / 4)
+    , compactPhase_(COMPACT_IDLE)
+    , compactKey_()
+    , compactFirst_(true)
+    , compactPage_(1)
+    , eytzinger_((flags & BPLUS_TREE_EYTZINGER) != 0)
+    , compress_(COMPRESSIBLE && (flags & BPLUS_TREE_COMPRESS) != 0)
+    , concurrent_((flags & BPLUS_TREE_CONCURRENT) != 0)
+    , smoVersion_(0)
+    , lockedSearches_(0)
+{
     printf("Degree = %d\n", DEGREE);
-    printf("Block size = %ld\n", blockSize_);
+    printf("Block size = %d\n", BlockSize);
     printf("Node = %ld\n", sizeof(Node));
 
     /**
@@ -54,46 +83,116 @@ BPlusTree::BPlusTree(const char *fileName, int blockSize)
      * 数据传输的开始点，即文件和设备的偏移量，必须是块大小的整数倍
      * 待传递数据的长度必须是块大小的整数倍。
      * 不遵守上述任一限制均将导致EINVAL错误。
+     * 所有读写缓冲都按BufferPool::IO_ALIGN对齐,偏移和长度都是BlockSize的
+     * 整数倍,因此只要求BlockSize是对齐大小的整数倍,否则退回到普通读写
      */
-    // 打开索引文件 FIXME:暂未打开O_DIRECT
-    fd_ = open(fileName, O_CREAT | O_RDWR, 0644);
+    // 映射模式下修改直接进入映射,无法保证先写日志,也无法绕过页缓存
+    if ((flags & BPLUS_TREE_MMAP)
+        && (flags & (BPLUS_TREE_WAL | BPLUS_TREE_DIRECT))) {
+        printf("WAL and O_DIRECT are not supported in mmap mode.\n");
+        assert(0);
+    }
+    // 日志的操作边界与映射的增长都按单线程设计
+    if ((flags & BPLUS_TREE_CONCURRENT)
+        && (flags & (BPLUS_TREE_WAL | BPLUS_TREE_MMAP))) {
+        printf("WAL and mmap are not supported in concurrent mode.\n");
+        assert(0);
+    }
+
+    // 等待独占的线程优先,避免结构修改被持续的查找饿死
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(
+        &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&treeLatch_, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    // 打开索引文件
+    int openFlags = O_CREAT | O_RDWR;
+    if (flags & BPLUS_TREE_DIRECT) openFlags |= O_DIRECT;
+    fd_ = open(fileName, openFlags, 0644);
+    if (fd_ < 0 && errno == EINVAL) {
+        // 文件系统不支持O_DIRECT(如tmpfs)
+        fd_ = open(fileName, O_CREAT | O_RDWR, 0644);
+    }
     assert(fd_ >= 0);
 
+    if (fcntl(fd_, F_GETFL) & O_DIRECT) {
+        int align = directAlignment(fd_);
+        if (BlockSize % align != 0 || align > (int) BufferPool::IO_ALIGN) {
+            // 块大小不满足对齐要求,同样退回到普通读写
+            close(fd_);
+            fd_ = open(fileName, O_CREAT | O_RDWR, 0644);
+            assert(fd_ >= 0);
+        }
+    }
+
+    // 读取配置
+    superLoad();
+
     // cache分配空间
-    rootCache_ = (Node *) malloc(blockSize_);
-    for (int i = 0; i < MAX_CACHE_NUM; i++) {
-        caches_[i] = (Node *) malloc(blockSize_);
+    pool_ = new BufferPool(
+        fd_, BlockSize, cacheSize, (flags & BPLUS_TREE_MMAP) != 0);
+    pool_->enableChecksum();
+
+    // 内核不支持时退回pread/pwrite,由uringEnabled()查看
+    if (flags & BPLUS_TREE_URING) pool_->enableRing();
+    // 块大小不支持压缩叶子时忽略BPLUS_TREE_COMPRESS,由compressEnabled()查看
+    if (concurrent_) pool_->setConcurrent();
+
+    if (flags & BPLUS_TREE_WAL) {
+        char walFile[PATH_MAX];
+        snprintf(walFile, sizeof walFile, "%s.wal", fileName);
+        wal_ = new Wal(walFile, BlockSize);
+
+        // 重放上次关闭前未写回的操作,然后做检查点
+        recovered_ = wal_->recover(walReplay, this);
+        if (recovered_ > 0) {
+            // 上次检查点写入超级块之后、清空日志之前崩溃时,
+            // 重放的记录早于位图的新位置,位图所在的块需重新标记
+            if (mapPages_ > 0) {
+                off_t mapEnd = mapPage_ + mapPages_;
+                if (space_.pages() < mapEnd) resizeFile(mapEnd);
+                for (off_t page = mapPage_; page < mapEnd; page++)
+                    space_.mark(page);
+            }
+
+            int ret = metaStore();
+            assert(ret == S_OK);
+        }
+        wal_->reset();
+
+        pool_->attachWal(wal_);
     }
 
     // 若存在root,则读到缓存
     fetchRootBlock();
 }
 
-BPlusTree::~BPlusTree()
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::~BPlusTree()
 {
-    char bootFile[32];
-    sprintf(bootFile, "%s.boot", fileName_);
-    int fd = open(bootFile, O_CREAT | O_WRONLY, 0644);
-    assert(fd >= 0);
-    // 保存配置
-    assert(offsetStore(fd, root_) == S_OK);
-    assert(offsetStore(fd, blockSize_) == S_OK);
-    assert(offsetStore(fd, fileSize_) == S_OK);
-
-    // 保存空闲块
-    for (auto it = freeBlocks_.begin(); it != freeBlocks_.end(); ++it) {
-        assert(offsetStore(fd, (*it)) == S_OK);
+    // 保存配置,写回日志中的块
+    checkpoint();
+
+    delete wal_;
+    delete pool_;
+    pthread_rwlock_destroy(&treeLatch_);
+
+    // 快照不会在关闭后保留
+    if (snapFd_ >= 0) {
+        char snapFile[PATH_MAX];
+        snprintf(snapFile, sizeof snapFile, "%s.snap", fileName_);
+        close(snapFd_);
+        unlink(snapFile);
     }
 
-    for (int i = 0; i < MAX_CACHE_NUM; ++i)
-        free(caches_[i]);
-
     // 关闭文件
-    close(fd);
     close(fd_);
 }
 
-void BPlusTree::commandHander()
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::commandHander()
 {
     while (true) {
         printf("Please input your command.(Type 'h' for help):");
@@ -119,6 +218,12 @@ void BPlusTree::commandHander()
         case 't':
             showLeaves();
             break;
+        case 'l':
+            bulkLoadHandler();
+            break;
+        case 'c':
+            compactHandler();
+            break;
 
         default:
             break;
@@ -126,25 +231,50 @@ void BPlusTree::commandHander()
     }
 }
 
-void BPlusTree::help()
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::help()
 {
     printf("i: Insert key. e.g. i 1 4-7 9\n");
     printf("r: Remove key. e.g. r 1 4-7 9\n");
     printf("s: Search by key. e.g. s 41-50\n");
+    printf("l: Bulk load keys into an empty tree. e.g. l 1-1000000\n");
+    printf("c: Compact the index file.\n");
     printf("d: Dump the tree structure.\n");
     printf("q: Quit.\n");
 }
 
-int BPlusTree::insert(key_t k, data_t value)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insert(Key k, Value value)
 {
+    int ret;
+    // 叶子不需要分裂时只锁住叶子
+    if (concurrent_ && latchedInsert(k, value, &ret)) return ret;
+
+    lockTree(true);
+    ret = insertLocked(k, value);
+    unlockTree();
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insertLocked(
+    Key k,
+    Value value,
+    bool overwrite)
+{
+    int ret = S_OK;
     Node *node = locateNode(root_);
+    bool failed = node == NULL && root_ != INVALID_OFFSET;
+
+    beginOperation();
 
     // 清空traceNode_
     traceNode_.clear();
 
     while (node != NULL) {
         if (isLeaf(node)) {
-            return insertLeaf(node, k, value);
+            ret = insertLeaf(node, k, value, overwrite);
+            break;
 
         } else {
             // 记录父节点偏移
@@ -155,52 +285,202 @@ int BPlusTree::insert(key_t k, data_t value)
                 node = locateNode(*subNode(node, pos + 1));
             else // 没有找到,则读取在此范围的block
                 node = locateNode(*subNode(node, -pos - 1));
+            // 子节点读取失败
+            failed = node == NULL;
         }
     }
 
-    // 新的root节点
-    Node *root = newLeafRoot();
-    key(root)[0] = k;
-    data(root)[0] = value;
-    root->count = 1;
-    root_ = appendBlock(root);
-
-    blockFlush(root);
+    if (failed) {
+        ret = S_ERROR;
+    } else if (node == NULL) {
+        // 新的root节点
+        Node *root = newLeaf(INVALID_OFFSET, true);
+        key(root)[0] = k;
+        data(root)[0] = value;
+        root->count = 1;
+        root_ = root->self;
+
+        blockFlush(root);
+    }
 
-    return S_OK;
+    endOperation();
+    return ret;
 }
 
-// data_t == long
-long BPlusTree::search(key_t k)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::search(Key k, Value *value)
 {
-    long ret = -1;
+    int ret = S_FALSE;
+
+    if (concurrent_) {
+        // 大多数查找不写入任何共享数据
+        if (optimisticSearch(k, value, &ret)) return ret;
+        __atomic_fetch_add(&lockedSearches_, 1, __ATOMIC_RELAXED);
+
+        lockTree(false);
+        Node *leaf = latchLeaf(&k, false, false);
+        if (leaf != NULL) {
+            int pos = searchInNode(leaf, k);
+            if (pos >= 0) {
+                *value = leafValue(leaf, pos);
+                ret = S_OK;
+            }
+            unlatchNode(leaf);
+        } else if (root_ != INVALID_OFFSET) {
+            ret = S_ERROR;
+        }
+        unlockTree();
+        return ret;
+    }
+
     Node *node = locateNode(root_);
+    if (node == NULL && root_ != INVALID_OFFSET) return S_ERROR;
 
     while (NULL != node) {
         int pos = searchInNode(node, k);
         if (isLeaf(node)) {
-            ret = pos >= 0 ? data(node)[pos] : -1;
+            if (pos >= 0) {
+                *value = leafValue(node, pos);
+                ret = S_OK;
+            }
             break;
         } else {
             if (pos >= 0)
                 node = locateNode(*subNode(node, pos + 1));
             else
                 node = locateNode(*subNode(node, -pos - 1));
+            if (node == NULL) ret = S_ERROR;
         }
     }
     return ret;
 }
 
-int BPlusTree::remove(key_t k)
+template <typename Key, typename Value, int BlockSize>
+size_t BPlusTree<Key, Value, BlockSize>::multiGet(
+    const Key *keys,
+    Value *values,
+    int *rets,
+    size_t n)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++)
+        rets[i] = S_FALSE;
+    if (n == 0) return 0;
+
+    // 持有树锁时结构不变,只需逐个锁住正在读取的节点
+    lockTree(false);
+    if (root_ == INVALID_OFFSET) {
+        unlockTree();
+        return 0;
+    }
+
+    // 按key排序的下标,相同子树中的key相邻
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [keys](size_t a, size_t b) {
+        return keys[a] < keys[b];
+    });
+
+    std::vector<ProbeRange> level(1, ProbeRange{root_, 0, n});
+    std::vector<ProbeRange> next;
+    std::vector<off_t> offsets;
+    int chunk = pool_->batchLimit();
+
+    while (!level.empty()) {
+        next.clear();
+
+        // 分段预读,避免预读的块在访问之前被置换
+        for (size_t c = 0; c < level.size(); c += chunk) {
+            size_t last = std::min(level.size(), c + chunk);
+            if (last - c > 1) {
+                offsets.clear();
+                for (size_t r = c; r < last; r++)
+                    offsets.push_back(fileOffset(level[r].offset));
+                pool_->prefetch(&offsets[0], offsets.size());
+            }
+
+            for (size_t r = c; r < last; r++) {
+                off_t offset = level[r].offset;
+                Node *node = concurrent_ ? latchNode(offset, false)
+                                         : locateNode(offset);
+                size_t i = level[r].begin;
+                size_t end = level[r].end;
+
+                // 读取失败,落在其中的key都不能确定
+                if (node == NULL) {
+                    for (; i < end; i++)
+                        rets[order[i]] = S_ERROR;
+                    continue;
+                }
+
+                if (isLeaf(node)) {
+                    for (; i < end; i++) {
+                        int pos = searchInNode(node, keys[order[i]]);
+                        if (pos < 0) continue;
+
+                        values[order[i]] = leafValue(node, pos);
+                        rets[order[i]] = S_OK;
+                        found++;
+                    }
+                } else {
+                    // 落在同一个子节点中的key为一组
+                    while (i < end) {
+                        int pos = searchInNode(node, keys[order[i]]);
+                        pos = pos >= 0 ? pos + 1 : -pos - 1;
+
+                        size_t j = i + 1;
+                        if (pos == node->count) {
+                            j = end;
+                        } else {
+                            Key upper = nodeKey(node, pos);
+                            while (j < end && keys[order[j]] < upper) j++;
+                        }
+                        next.push_back(ProbeRange{*subNode(node, pos), i, j});
+                        i = j;
+                    }
+                }
+
+                if (concurrent_) unlatchNode(node);
+            }
+        }
+        level.swap(next);
+    }
+
+    unlockTree();
+    return found;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::remove(Key k)
+{
+    int ret;
+    // 叶子不需要合并或借数据时只锁住叶子
+    if (concurrent_ && latchedRemove(k, &ret)) return ret;
+
+    lockTree(true);
+    ret = removeLocked(k);
+    unlockTree();
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::removeLocked(Key k)
 {
+    // 没找到,则返回-1
+    int ret = S_FALSE;
     Node *node = locateNode(root_);
+    if (node == NULL && root_ != INVALID_OFFSET) ret = S_ERROR;
+
+    beginOperation();
 
     // 清空traceNode_
     traceNode_.clear();
 
     while (node != NULL) {
         if (isLeaf(node)) {
-            return removeLeaf(node, k);
+            ret = removeLeaf(node, k);
+            break;
         } else {
             // 记录经过的节点
             traceNode_.push_back(node->self);
@@ -210,14 +490,335 @@ int BPlusTree::remove(key_t k)
                 node = locateNode(*subNode(node, pos + 1));
             else
                 node = locateNode(*subNode(node, -pos - 1));
+            // 子节点读取失败
+            if (node == NULL) ret = S_ERROR;
         }
     }
 
-    // 没找到,则返回-1
-    return S_FALSE;
+    endOperation();
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::commit(WriteBatch *batch)
+{
+    std::vector<BatchOp> &ops = batch->ops_;
+
+    // 整个batch独占树锁,作为一个操作写入日志
+    lockTree(true);
+    beginOperation();
+
+    // 按key排序,相同的key只保留最后一次修改
+    std::stable_sort(ops.begin(), ops.end(), batchOpLess);
+    size_t n = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (n > 0 && !(ops[n - 1].key < ops[i].key))
+            ops[n - 1] = ops[i];
+        else
+            ops[n++] = ops[i];
+    }
+    ops.resize(n);
+
+    int ret = S_OK;
+    size_t i = 0;
+    while (i < n) {
+        Key upper;
+        bool bounded;
+        Node *leaf = locateLeaf(ops[i].key, &upper, &bounded);
+
+        // 落在同一个叶子中的修改为一组
+        size_t j = i + 1;
+        if (leaf != NULL) {
+            while (j < n && (!bounded || ops[j].key < upper))
+                j++;
+        } else if (root_ != INVALID_OFFSET) {
+            // 路径上的节点读取失败,跳过该修改
+            ret = S_ERROR;
+            i = j;
+            continue;
+        }
+
+        // 整组无法一次合并(叶子需要分裂或合并),则逐个修改
+        if (leaf == NULL || mergeBatchIntoLeaf(leaf, &ops[i], j - i) != S_OK) {
+            for (size_t k = i; k < j; k++) {
+                if (applyBatchOp(ops[k]) == S_ERROR) ret = S_ERROR;
+            }
+        }
+        i = j;
+    }
+
+    endOperation();
+    unlockTree();
+
+    batch->clear();
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::sync()
+{
+    if (wal_ == NULL) return checkpoint();
+
+    return wal_->sync() == 0 ? S_OK : S_FALSE;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::checkpoint()
+{
+    // 先同步日志,再写回原位置
+    if (wal_ != NULL && wal_->sync() != 0) return S_FALSE;
+
+    // 并发模式下没有日志,不会在操作内部做检查点;
+    // 其他线程的修改操作结束并释放树锁之后才能检查
+    lockTree(true);
+    assert(opDepth_ == 0);
+    int ret = S_OK;
+    if (pool_->checkpoint() != 0 || metaStore() != S_OK) ret = S_FALSE;
+    // 超级块已不再引用文件末尾的空闲块
+    if (ret == S_OK && pool_->truncate(fileSize_) != 0) ret = S_FALSE;
+    unlockTree();
+    if (ret != S_OK) return S_FALSE;
+
+    // 索引文件与超级块已包含日志中的全部修改
+    if (wal_ != NULL && wal_->reset() != 0) return S_FALSE;
+
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::setGroupCommit(int ops)
+{
+    if (wal_ != NULL) wal_->setGroupSize(ops);
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::setDirtyLimit(int pages)
+{
+    // 没有进行中的修改时才能写回所有脏块
+    lockTree(true);
+    pool_->setDirtyLimit(pages);
+    unlockTree();
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::setMergeFill(double fill)
+{
+    if (fill < 0) fill = 0;
+    if (fill > 0.5) fill = 0.5;
+
+    // 借数据与合并的正确性要求阈值不超过半满; 叶子至少有1个key,
+    // 非叶子节点至少有2个子节点(借数据与合并只在同一父节点下进行)
+    int half = (DEGREE + 1) / 2;
+    int min = (int) (DEGREE * fill + 0.5);
+    leafMin_ = std::max(1, std::min(min, half));
+    nonLeafMin_ = std::max(2, std::min(min, half));
+    packedMin_ = (int) (PACKED_CAPACITY * fill / 2);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::compact(int steps)
+{
+    // 整理的进度在树锁内读写,多个线程可以同时调用
+    lockTree(true);
+
+    // 上一轮已完成
+    if (compactPhase_ == COMPACT_DONE) {
+        compactPhase_ = COMPACT_IDLE;
+        unlockTree();
+        return 0;
+    }
+    if (compactPhase_ == COMPACT_IDLE) {
+        compactPhase_ = COMPACT_LEAVES;
+        compactFirst_ = true;
+        compactPage_ = 1; // 第一个块为超级块
+    }
+
+    int done = 0;
+    while (done < steps && compactPhase_ != COMPACT_DONE) {
+        beginOperation();
+        if (compactPhase_ == COMPACT_LEAVES)
+            done += compactLeaf();
+        else
+            done += compactTail();
+        endOperation();
+
+        // 每一步为一个独立的操作,其他线程可以在两步之间修改
+        unlockTree();
+        lockTree(true);
+    }
+
+    bool finished = compactPhase_ == COMPACT_DONE;
+    if (finished && done == 0) compactPhase_ = COMPACT_IDLE;
+    unlockTree();
+    if (!finished) return done;
+
+    // 截掉文件末尾的空闲块
+    checkpoint();
+    return done;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::convert(const char *from, const char *to)
+{
+    // v1格式的节点布局
+    const int SLOT_SIZE_V1 =
+        sizeof(Value) > sizeof(off_t) ? sizeof(Value) : sizeof(off_t);
+    const int DEGREE_V1 = (BlockSize - (int) sizeof(NodeV1))
+                          / ((int) sizeof(Key) + SLOT_SIZE_V1);
+    static_assert(DEGREE_V1 <= DEGREE, "v1 node does not fit");
+
+    // 日志中还有未写回的修改时,索引文件与.boot文件不一致
+    char file[PATH_MAX];
+    struct stat st;
+    snprintf(file, sizeof file, "%s.wal", from);
+    if (stat(file, &st) == 0 && st.st_size > 0) {
+        printf("%s is not empty, open and close the index first.\n", file);
+        return S_FALSE;
+    }
+
+    snprintf(file, sizeof file, "%s.boot", from);
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return S_FALSE;
+    off_t root = offsetLoad(fd);
+    off_t blockSize = offsetLoad(fd);
+    off_t fileSize = offsetLoad(fd);
+    std::vector<off_t> freeBlocks;
+    off_t freeBlock;
+    while ((freeBlock = offsetLoad(fd)) != INVALID_OFFSET)
+        freeBlocks.push_back(freeBlock);
+    close(fd);
+
+    // v1的块大小没有版本号,v2的高32位为版本号; v1中的偏移都换算为块号
+    int version = (int) (blockSize >> 32);
+    if (version == 0) version = 1;
+    if ((blockSize & 0xFFFFFFFF) != BlockSize || version > 2) {
+        printf("%s is not a v1/v2 index with block size %d.\n",
+               from, BlockSize);
+        return S_FALSE;
+    }
+    if (version == 1) {
+        if (root != INVALID_OFFSET) root /= BlockSize;
+        for (size_t i = 0; i < freeBlocks.size(); i++)
+            freeBlocks[i] /= BlockSize;
+    }
+
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (in < 0 || out < 0) {
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+        return S_FALSE;
+    }
+
+    // 从root遍历所有节点,逐个转换后写到后一个块(块号加1)
+    char *oldPage = (char *) BufferPool::allocAligned(BlockSize);
+    char *newPage = (char *) BufferPool::allocAligned(BlockSize);
+    const NodeV1 *old = (const NodeV1 *) oldPage;
+    const char *oldKey = oldPage + sizeof(NodeV1);
+    const char *oldSlot = oldKey + DEGREE_V1 * sizeof(Key);
+    Node *node = (Node *) newPage;
+    std::vector<off_t> stack;
+    if (root != INVALID_OFFSET) stack.push_back(root);
+
+    int ret = S_OK;
+    while (!stack.empty() && ret == S_OK) {
+        off_t page = stack.back();
+        stack.pop_back();
+        if (pread(in, oldPage, BlockSize, fileOffset(page)) != BlockSize) {
+            ret = S_FALSE;
+            break;
+        }
+
+        if (version == 1) {
+            memset(node, 0, BlockSize);
+            node->self = page;
+            node->type = old->type;
+            node->count = old->count;
+        } else {
+            memcpy(node, oldPage, BlockSize);
+        }
+
+        bool leaf = node->type == BPLUS_TREE_LEAF;
+        bool packed = node->type == BPLUS_TREE_LEAF_PACKED;
+        int maxCount = packed ? (BlockSize - KEY_OFFSET) / 4 : DEGREE;
+        if (version == 1 && !packed) maxCount = DEGREE_V1;
+        if (node->count < 0 || node->count > maxCount
+            || node->type > BPLUS_TREE_LEAF_PACKED) {
+            printf("Bad node at block %ld.\n", (long) page);
+            ret = S_FALSE;
+            break;
+        }
+
+        if (version == 1) {
+            node->next = INVALID_OFFSET;
+            if (leaf || packed) {
+                off_t prev = old->prev, next = old->next;
+                node->prev = prev == INVALID_OFFSET ? prev : prev / BlockSize;
+                node->next = next == INVALID_OFFSET ? next : next / BlockSize;
+            }
+
+            if (packed) {
+                // 编码与所在位置无关,整体复制
+                memcpy(key(node), oldKey, BlockSize - sizeof(NodeV1));
+            } else if (leaf) {
+                memcpy(key(node), oldKey, old->count * sizeof(Key));
+                memcpy(data(node), oldSlot, old->count * sizeof(Value));
+            } else {
+                // Eytzinger布局只与key数有关,key直接复制
+                memcpy(key(node), oldKey, old->count * sizeof(Key));
+                for (int i = 0; i <= old->count; i++) {
+                    off_t child = old->lastOffset;
+                    if (i < DEGREE_V1)
+                        memcpy(&child, oldSlot + i * sizeof child, sizeof child);
+                    *subNode(node, i) = child / BlockSize;
+                }
+            }
+        }
+
+        // 第一个块留给超级块,所有块号加1
+        node->self++;
+        if (leaf || packed) {
+            if (node->prev != INVALID_OFFSET) node->prev++;
+            if (node->next != INVALID_OFFSET) node->next++;
+        } else {
+            for (int i = 0; i <= node->count; i++) {
+                PageId *child = subNode(node, i);
+                stack.push_back(*child);
+                (*child)++;
+            }
+        }
+
+        BufferPool::seal(node, BlockSize);
+        if (pwrite(out, node, BlockSize, fileOffset(page + 1)) != BlockSize)
+            ret = S_FALSE;
+    }
+
+    close(in);
+    free(oldPage);
+    free(newPage);
+
+    // 加上超级块,位图写在文件末尾,其中记录原来的空闲块
+    off_t pages = fileSize / BlockSize + 1;
+    int mapPages = mapBlocks(pages);
+    while (mapBlocks(pages + mapPages) > mapPages) mapPages++;
+    FreeSpace space;
+    space.resize(pages + mapPages);
+    for (off_t page = 0; page < space.pages(); page++) space.mark(page);
+    for (size_t i = 0; i < freeBlocks.size(); i++)
+        space.release(freeBlocks[i] + 1);
+
+    if (root != INVALID_OFFSET) root++;
+    if (ret == S_OK && mapStore(out, space, pages, mapPages) != S_OK)
+        ret = S_FALSE;
+    fileSize = fileOffset(space.pages());
+    if (ret == S_OK && superStore(out, root, fileSize, pages, mapPages) != S_OK)
+        ret = S_FALSE;
+    close(out);
+    return ret;
 }
 
-void BPlusTree::draw(Node *node, int level)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::draw(Node *node, int level)
 {
     if (level != 0) {
         for (int i = 0; i < level - 1; i++)
@@ -232,12 +833,13 @@ void BPlusTree::draw(Node *node, int level)
         printf("node:");
 
     for (int i = 0; i < node->count; i++)
-        printf(" %ld", key(node)[i]);
+        printf(" %ld", (long) nodeKey(node, i));
     printf("\n");
 }
 
 // 显示树中所有节点 前序遍历
-void BPlusTree::dump()
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::dump()
 {
     struct NodeInfo
     {
@@ -245,7 +847,11 @@ void BPlusTree::dump()
         int level;
     };
 
-    if (root_ == INVALID_OFFSET) return;
+    lockTree(true);
+    if (root_ == INVALID_OFFSET) {
+        unlockTree();
+        return;
+    }
     // stack
     std::list<NodeInfo> preOrderStack;
 
@@ -256,6 +862,10 @@ void BPlusTree::dump()
         preOrderStack.pop_back();
 
         Node *node = locateNode(nodeinfo.offset);
+        if (node == NULL) {
+            printf("Block %ld is unreadable.\n", (long) nodeinfo.offset);
+            continue;
+        }
 
         draw(node, nodeinfo.level);
 
@@ -267,24 +877,876 @@ void BPlusTree::dump()
             }
         }
     }
+    unlockTree();
 }
 
-off_t BPlusTree::offsetLoad(int fd)
+template <typename Key, typename Value, int BlockSize>
+off_t BPlusTree<Key, Value, BlockSize>::offsetLoad(int fd)
 {
     char buf[ADDR_OFFSET_LENTH];
     int len = read(fd, buf, ADDR_OFFSET_LENTH);
     return len > 0 ? pchar_2_off_t(buf, sizeof buf) : INVALID_OFFSET;
 }
 
-int BPlusTree::offsetStore(int fd, off_t offset)
+template <typename Key, typename Value, int BlockSize>
+const char BPlusTree<Key, Value, BlockSize>::MAGIC[8] =
+    {'B', 'P', 'L', 'U', 'S', 'T', 'R', 'E'};
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::superLoad()
 {
-    char buf[ADDR_OFFSET_LENTH];
-    off_t_2_pchar(offset, buf, sizeof buf);
-    return write(fd, buf, sizeof buf) == ADDR_OFFSET_LENTH ? S_OK : S_FALSE;
+    struct stat st;
+    int ret = fstat(fd_, &st);
+    assert(ret == 0);
+
+    // 新文件,第一个块为超级块,写入空树的超级块和位图
+    if (st.st_size == 0) {
+        resizeFile(1);
+        space_.mark(0);
+        ret = metaStore();
+        assert(ret == S_OK);
+        return;
+    }
+
+    char *buf = (char *) BufferPool::allocAligned(BlockSize);
+    ret = pread(fd_, buf, BlockSize, 0);
+
+    Superblock *super = (Superblock *) buf;
+    if (ret != BlockSize || memcmp(super->magic, MAGIC, sizeof MAGIC) != 0) {
+        printf("Not a BPlusTree index file, ");
+        printf("convert older formats with BPlusTree::convert().\n");
+        assert(0);
+    }
+    if (super->checksum != superChecksum(super)) {
+        printf("Superblock checksum mismatch.\n");
+        assert(0);
+    }
+    if (super->version > FORMAT_VERSION || super->version < 3) {
+        printf("Index file is in format v%u.\n", super->version);
+        assert(0);
+    }
+    // 索引文件的块大小必须与模板参数一致
+    if (super->blockSize != BlockSize) {
+        printf("Block size mismatch: %u in superblock.\n", super->blockSize);
+        assert(0);
+    }
+    root_ = super->root;
+    fileSize_ = super->fileSize;
+    int version = super->version;
+    off_t freeMap = super->freeMap;
+    int freeMapPages = super->freeMapPages;
+    free(buf);
+
+    // 先写入校验和,中途崩溃时超级块仍为旧版本,重新打开时再写一遍
+    if (version < FORMAT_VERSION) upgradeChecksums();
+    if (version == 3) {
+        upgradeFreeList(freeMap);
+        return;
+    }
+
+    // 位图一次读入
+    off_t pages = fileSize_ / BlockSize;
+    size_t len = (size_t) freeMapPages * BlockSize;
+    assert(len >= (size_t) mapBlocks(pages) * BlockSize);
+    buf = (char *) BufferPool::allocAligned(len);
+    ret = pread(fd_, buf, len, fileOffset(freeMap));
+    assert(ret == (int) len);
+    space_.load(buf, pages);
+    free(buf);
+    mapPage_ = freeMap;
+    mapPages_ = freeMapPages;
+
+    // 位图留在原位置: 日志中的记录可能分配了其他空闲块
+    if (version < FORMAT_VERSION) {
+        ret = superStore(fd_, root_, fileSize_, mapPage_, mapPages_);
+        assert(ret == S_OK);
+    }
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::upgradeChecksums()
+{
+    // 节点的内容不超过DEGREE个key或压缩编码,块末尾的4字节未使用
+    Node *node = (Node *) BufferPool::allocAligned(BlockSize);
+    std::vector<off_t> stack;
+    if (root_ != INVALID_OFFSET) stack.push_back(root_);
+    while (!stack.empty()) {
+        off_t page = stack.back();
+        stack.pop_back();
+        int ret = pread(fd_, node, BlockSize, fileOffset(page));
+        assert(ret == BlockSize);
+
+        bool packed = node->type == BPLUS_TREE_LEAF_PACKED;
+        if (node->count < 0 || (!packed && node->count > DEGREE)
+            || node->type > BPLUS_TREE_LEAF_PACKED) {
+            printf("Bad node at block %ld.\n", (long) page);
+            assert(0);
+        }
+        if (!isLeaf(node)) {
+            for (int i = 0; i <= node->count; i++)
+                stack.push_back(*subNode(node, i));
+        }
+
+        BufferPool::seal(node, BlockSize);
+        ret = pwrite(fd_, node, BlockSize, fileOffset(page));
+        assert(ret == BlockSize);
+    }
+    free(node);
+
+    int ret = fdatasync(fd_);
+    assert(ret == 0);
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::upgradeFreeList(off_t freeHead)
+{
+    // 日志中的记录按空闲链表记录分配和回收,无法在位图上重放
+    char walFile[PATH_MAX];
+    struct stat st;
+    snprintf(walFile, sizeof walFile, "%s.wal", fileName_);
+    if (stat(walFile, &st) == 0 && st.st_size > 0) {
+        printf("%s is not empty, open the index with v3 first.\n", walFile);
+        assert(0);
+    }
+
+    resizeFile(fileSize_ / BlockSize);
+    for (off_t page = 0; page < space_.pages(); page++) space_.mark(page);
+
+    // 沿空闲链表逐个回收
+    Node *node = (Node *) BufferPool::allocAligned(BlockSize);
+    while (freeHead != INVALID_OFFSET) {
+        int ret = pread(fd_, node, BlockSize, fileOffset(freeHead));
+        assert(ret == BlockSize && node->type == BPLUS_TREE_FREE);
+        space_.release(freeHead);
+        freeHead = node->next;
+    }
+    free(node);
+
+    int ret = metaStore();
+    assert(ret == S_OK);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::metaStore()
+{
+    // 位图写到一段不与旧位置重叠的空闲块中,位图变长时重新选择
+    off_t page;
+    int n;
+    while (true) {
+        n = mapBlocks(space_.pages());
+        page = space_.lowestRun(n);
+        if (page == FreeSpace::NONE) {
+            page = space_.pages();
+            resizeFile(page + n);
+        }
+        if (mapBlocks(space_.pages()) <= n) break;
+    }
+    for (int i = 0; i < n; i++) space_.mark(page + i);
+
+    // 写入的位图中旧位置已空闲,超级块指向新位置之后才会被重用
+    for (int i = 0; i < mapPages_; i++) space_.release(mapPage_ + i);
+    mapPage_ = page;
+    mapPages_ = n;
+    resizeFile(space_.usedEnd());
+
+    if (mapStore(fd_, space_, mapPage_, mapPages_) != S_OK) return S_FALSE;
+    return superStore(fd_, root_, fileSize_, mapPage_, mapPages_);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::superStore(
+    int fd,
+    off_t root,
+    off_t fileSize,
+    off_t mapPage,
+    int mapPages)
+{
+    char *buf = (char *) BufferPool::allocAligned(BlockSize);
+    memset(buf, 0, BlockSize);
+
+    Superblock *super = (Superblock *) buf;
+    memcpy(super->magic, MAGIC, sizeof MAGIC);
+    super->version = FORMAT_VERSION;
+    super->blockSize = BlockSize;
+    super->fileSize = fileSize;
+    super->root = root;
+    super->freeMap = mapPage;
+    super->freeMapPages = mapPages;
+    super->checksum = superChecksum(super);
+
+    // 超级块落在第一个扇区中,写入是原子的; 校验和用于发现损坏
+    int ret = pwrite(fd, buf, BlockSize, 0) == BlockSize ? S_OK : S_FALSE;
+    if (ret == S_OK && fdatasync(fd) != 0) ret = S_FALSE;
+    free(buf);
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+uint32_t BPlusTree<Key, Value, BlockSize>::superChecksum(
+    const Superblock *super)
+{
+    if (super->version >= FORMAT_VERSION)
+        return Crc32c::compute(super, offsetof(Superblock, checksum));
+
+    // v3/v4格式为FNV-1a,升级时校验旧的超级块
+    const unsigned char *p = (const unsigned char *) super;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(Superblock, checksum); i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::mapStore(
+    int fd,
+    const FreeSpace &space,
+    off_t page,
+    int pages)
+{
+    size_t len = (size_t) pages * BlockSize;
+    char *buf = (char *) BufferPool::allocAligned(len);
+    memset(buf, 0, len);
+    space.store(buf);
+
+    // 超级块写入前同步,不会指向不完整的位图
+    int ret = pwrite(fd, buf, len, fileOffset(page)) == (ssize_t) len
+                  ? S_OK
+                  : S_FALSE;
+    if (ret == S_OK && fdatasync(fd) != 0) ret = S_FALSE;
+    free(buf);
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::resizeFile(off_t pages)
+{
+    fileSize_ = pages * BlockSize;
+    space_.resize(pages);
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::beginOperation()
+{
+    // 一次操作中写回的块在结束时一起提交
+    if (opDepth_++ == 0) pool_->beginBatch();
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::endOperation()
+{
+    assert(opDepth_ > 0);
+    if (--opDepth_ > 0) return;
+
+    pool_->endBatch();
+    if (wal_ == NULL) return;
+
+    // 元数据与COMMIT记录标志操作完整
+    wal_->appendMeta(root_, fileSize_);
+    wal_->commit();
+
+    if (wal_->size() > WAL_CHECKPOINT_SIZE) checkpoint();
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::walReplay(
+    const Wal::Record *record,
+    const char *payload,
+    void *arg)
+{
+    BPlusTree *tree = (BPlusTree *) arg;
+    int64_t fileSize;
+
+    // 每条记录都可重复重放
+    switch (record->type) {
+    case Wal::WAL_PAGE: {
+        assert(record->length == BlockSize);
+
+        // 日志中的镜像未必满足O_DIRECT的对齐要求
+        char *page = (char *) BufferPool::allocAligned(BlockSize);
+        memcpy(page, payload, BlockSize);
+
+        // v4格式的日志中的镜像没有校验和,重放时补上; 之后的镜像在记录时
+        // 已写入校验和,不符时原样写入,读取该块时返回S_ERROR
+        if (record->format == Wal::FORMAT_FNV) {
+            BufferPool::seal(page, BlockSize);
+        } else if (!BufferPool::verify(page, BlockSize)) {
+            printf("Bad image of block %ld in the log.\n",
+                   (long) (record->offset / BlockSize));
+        }
+        int len = pwrite(tree->fd_, page, BlockSize, record->offset);
+        assert(len == BlockSize);
+        free(page);
+        break;
+    }
+    case Wal::WAL_META:
+        memcpy(&fileSize, payload, sizeof fileSize);
+        tree->root_ = record->offset;
+        tree->resizeFile(fileSize / BlockSize);
+        break;
+    case Wal::WAL_ALLOC:
+        // 文件大小在操作结束时才记录,分配的块可能在末尾之后
+        if (record->offset >= tree->space_.pages())
+            tree->resizeFile(record->offset + 1);
+        tree->space_.mark(record->offset);
+        break;
+    case Wal::WAL_FREE:
+        if (record->offset < tree->space_.pages())
+            tree->space_.release(record->offset);
+        break;
+    default:
+        break;
+    }
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::lockTree(bool exclusive)
+{
+    if (!concurrent_) return;
+
+    if (exclusive) {
+        pthread_rwlock_wrlock(&treeLatch_);
+        // 乐观读者看到奇数或版本变化时重试
+        __atomic_store_n(&smoVersion_, smoVersion_ + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    } else {
+        pthread_rwlock_rdlock(&treeLatch_);
+    }
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::unlockTree()
+{
+    if (!concurrent_) return;
+
+    // 共享树锁时版本不会是奇数
+    if (smoVersion_ & 1)
+        __atomic_store_n(&smoVersion_, smoVersion_ + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&treeLatch_);
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::latchNode(off_t offset, bool exclusive)
+{
+    if (offset == INVALID_OFFSET) return NULL;
+
+    // 不经过fetchBlock,持有读锁时不能改变布局
+    Node *node = (Node *) pool_->fetch(fileOffset(offset));
+    if (node != NULL) pool_->latch(node, exclusive);
+    return node;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::unlatchNode(const Node *node)
+{
+    pool_->unlatch(node);
+    cacheDefer(node);
+}
+
+// 调用者持有树锁
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::latchLeaf(
+    const Key *k,
+    bool rightmost,
+    bool exclusive)
+{
+    // 持有树锁时结构不变,乐观找到的叶子偏移一定正确,只锁住叶子
+    if (k != NULL) {
+        Node *leaf;
+        unsigned long version;
+        off_t offset = optimisticLeaf(*k, smoVersion_, &leaf, &version);
+        if (offset != INVALID_OFFSET) return latchNode(offset, exclusive);
+    }
+
+    Node *node = latchNode(root_, false);
+
+    // 非叶子节点只在独占树锁时修改,沿途只加读锁
+    while (node != NULL && !isLeaf(node)) {
+        int pos;
+        if (k != NULL) {
+            pos = searchInNode(node, *k);
+            pos = pos >= 0 ? pos + 1 : -pos - 1;
+        } else {
+            pos = rightmost ? node->count : 0;
+        }
+
+        // 先锁住子节点,再释放父节点
+        Node *child = latchNode(*subNode(node, pos), false);
+        unlatchNode(node);
+        node = child;
+    }
+
+    // 持有树锁时节点类型不变,可以放开读锁后重新加写锁
+    if (node != NULL && exclusive) {
+        pool_->unlatch(node);
+        pool_->latch(node, true);
+    }
+    return node;
 }
 
-// key_t == long
-int BPlusTree::insertHandler()
+template <typename Key, typename Value, int BlockSize>
+off_t BPlusTree<Key, Value, BlockSize>::optimisticLeaf(
+    Key k,
+    unsigned long treeVersion,
+    Node **leaf,
+    unsigned long *version)
+{
+    off_t offset = __atomic_load_n(&root_, __ATOMIC_RELAXED);
+    if (offset == INVALID_OFFSET) return INVALID_OFFSET;
+
+    unsigned long v;
+    Node *node = (Node *) pool_->peek(fileOffset(offset), &v);
+    while (node != NULL) {
+        // 读取的内容可能不完整,只做不会越界的访问,校验通过后才使用
+        short type = node->type;
+        bool leafType =
+            type == BPLUS_TREE_LEAF || type == BPLUS_TREE_LEAF_PACKED;
+        off_t child = INVALID_OFFSET;
+        if (!leafType) {
+            int pos = searchInNode(node, k);
+            pos = pos >= 0 ? pos + 1 : -pos - 1;
+            if (pos <= DEGREE) child = *subNode(node, pos);
+        }
+
+        // validate之后读取的树版本也在节点内容之后
+        if (!pool_->validate(node, v)) return INVALID_OFFSET;
+        if (__atomic_load_n(&smoVersion_, __ATOMIC_RELAXED) != treeVersion)
+            return INVALID_OFFSET;
+
+        if (leafType) {
+            *leaf = node;
+            *version = v;
+            return offset;
+        }
+        if (child == INVALID_OFFSET) return INVALID_OFFSET;
+
+        offset = child;
+        node = (Node *) pool_->peek(fileOffset(offset), &v);
+    }
+    return INVALID_OFFSET;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::optimisticSearch(
+    Key k,
+    Value *value,
+    int *ret)
+{
+    for (int retry = 0; retry < OPTIMISTIC_RETRY; retry++) {
+        // 正在修改结构时等待树锁
+        unsigned long treeVersion =
+            __atomic_load_n(&smoVersion_, __ATOMIC_ACQUIRE);
+        if (treeVersion & 1) return false;
+
+        Node *leaf;
+        unsigned long version;
+        if (optimisticLeaf(k, treeVersion, &leaf, &version) == INVALID_OFFSET)
+            continue;
+
+        int pos = searchInNode(leaf, k);
+        Value v = Value();
+        if (pos >= 0) v = leafValue(leaf, pos);
+
+        if (!pool_->validate(leaf, version)) continue;
+        if (__atomic_load_n(&smoVersion_, __ATOMIC_RELAXED) != treeVersion)
+            continue;
+
+        *ret = pos >= 0 ? S_OK : S_FALSE;
+        if (pos >= 0) *value = v;
+        return true;
+    }
+    return false;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::latchedInsert(
+    Key k,
+    Value value,
+    int *ret)
+{
+    lockTree(false);
+
+    Node *leaf = latchLeaf(&k, false, true);
+    bool done = false;
+    if (leaf != NULL && packedPath(leaf)) {
+        // 重新编码后放得下时不需要分裂
+        // key已存在时同样返回S_FALSE,由insertLocked再确认
+        *ret = insertPackedLeaf(leaf, k, value, false, false);
+        done = *ret == S_OK;
+    } else if (leaf != NULL && leaf->count < DEGREE) {
+        *ret = insertLeaf(leaf, k, value);
+        done = true;
+    }
+    if (leaf != NULL) unlatchNode(leaf);
+
+    unlockTree();
+    return done;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::latchedRemove(Key k, int *ret)
+{
+    lockTree(false);
+
+    bool done = true;
+    *ret = S_FALSE;
+
+    Node *leaf = latchLeaf(&k, false, true);
+    if (leaf != NULL) {
+        int pos = searchInNode(leaf, k);
+        // 与removeLeaf相同: root只剩一个key时清空树,其他叶子过少时合并
+        int minCount = leaf->self == root_ ? 1 : leafMin_;
+
+        if (pos >= 0 && packedPath(leaf)) {
+            done = removePackedLeaf(leaf, pos, k, false) == S_OK;
+            if (done) *ret = S_OK;
+        } else if (pos >= 0 && leaf->count > minCount) {
+            simpleRemoveInLeaf(leaf, pos);
+            pool_->flush(leaf);
+            *ret = S_OK;
+        } else if (pos >= 0) {
+            done = false;
+        }
+        unlatchNode(leaf);
+    } else if (root_ != INVALID_OFFSET) {
+        // 读取失败,独占树锁后重做并返回错误
+        done = false;
+    }
+
+    unlockTree();
+    return done;
+}
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::Snapshot::Snapshot(BPlusTree *tree)
+    : tree_(tree)
+    , id_(-1)
+    , root_(INVALID_OFFSET)
+    , page_(NULL)
+{
+    // 映射模式下修改直接进入文件,无法保留旧镜像
+    if (tree->pool_->mapped()) {
+        printf("Snapshots are not supported in mmap mode.\n");
+        assert(0);
+        return;
+    }
+    page_ = (char *) BufferPool::allocAligned(BlockSize);
+
+    // 独占树锁时没有进行中的操作,所有修改都已写回
+    tree->lockTree(true);
+    if (tree->snapFd_ < 0) {
+        char snapFile[PATH_MAX];
+        snprintf(snapFile, sizeof snapFile, "%s.snap", tree->fileName_);
+        tree->snapFd_ = open(snapFile, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        assert(tree->snapFd_ >= 0);
+        tree->pool_->attachSnapshotFile(tree->snapFd_);
+    }
+    root_ = tree->root_;
+    id_ = tree->pool_->openSnapshot(tree->fileSize_);
+    tree->unlockTree();
+}
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::Snapshot::~Snapshot()
+{
+    if (id_ >= 0) tree_->pool_->closeSnapshot(id_);
+    free(page_);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Snapshot::search(Key k, Value *value)
+{
+    if (id_ < 0) return S_ERROR;
+
+    off_t offset = root_;
+    while (offset != INVALID_OFFSET) {
+        Node *node = readNode(offset, page_);
+        if (node == NULL) return S_ERROR;
+        int pos = tree_->searchInNode(node, k);
+        if (tree_->isLeaf(node)) {
+            if (pos < 0) return S_FALSE;
+            *value = tree_->leafValue(node, pos);
+            return S_OK;
+        }
+        offset = *tree_->subNode(node, pos >= 0 ? pos + 1 : -pos - 1);
+    }
+    return S_FALSE;
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::Snapshot::readNode(
+    off_t offset,
+    char *page)
+{
+    if (id_ < 0) return NULL;
+    if (tree_->pool_->readSnapshot(id_, fileOffset(offset), page) != 0)
+        return NULL;
+    return (Node *) page;
+}
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::Cursor::Cursor(BPlusTree *tree)
+    : tree_(tree)
+    , snap_(NULL)
+    , leaf_(NULL)
+    , pos_(0)
+    , page_(NULL)
+    , pageOffset_(INVALID_OFFSET)
+    , key_()
+    , value_()
+    , keys_(NULL)
+    , values_(NULL)
+    , version_(0)
+{
+}
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::Cursor::Cursor(Snapshot *snapshot)
+    : tree_(snapshot->tree_)
+    , snap_(snapshot)
+    , leaf_(NULL)
+    , pos_(0)
+    , page_((char *) BufferPool::allocAligned(BlockSize))
+    , pageOffset_(INVALID_OFFSET)
+    , key_()
+    , value_()
+    , keys_(NULL)
+    , values_(NULL)
+    , version_(0)
+{
+}
+
+template <typename Key, typename Value, int BlockSize>
+BPlusTree<Key, Value, BlockSize>::Cursor::~Cursor()
+{
+    release();
+    free(page_);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::seek(Key k)
+{
+    if (latched()) return latchedMove(MOVE_SEEK, k);
+
+    off_t offset;
+    int ret = descend(&k, false, &offset);
+    if (ret != S_OK) {
+        release();
+        return ret;
+    }
+
+    // 叶子刚被读入缓存,这里不会再读磁盘
+    int pos = tree_->searchInNode(readNode(offset), k);
+    return moveTo(offset, pos >= 0 ? pos : -pos - 1);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::seekFirst()
+{
+    if (latched()) return latchedMove(MOVE_FIRST, Key());
+
+    off_t offset;
+    int ret = descend(NULL, false, &offset);
+    if (ret != S_OK) {
+        release();
+        return ret;
+    }
+    return moveTo(offset, 0);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::seekLast()
+{
+    if (latched()) return latchedMove(MOVE_LAST, Key());
+
+    off_t offset;
+    int ret = descend(NULL, true, &offset);
+    if (ret != S_OK) {
+        release();
+        return ret;
+    }
+    return moveTo(offset, -1);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::next()
+{
+    if (leaf_ == NULL) return S_FALSE;
+    if (latched()) return latchedMove(MOVE_NEXT, key_);
+
+    if (pos_ + 1 < leaf_->count) {
+        pos_++;
+        return S_OK;
+    }
+    return moveTo(leaf_->next, 0);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::prev()
+{
+    if (leaf_ == NULL) return S_FALSE;
+    if (latched()) return latchedMove(MOVE_PREV, key_);
+
+    if (pos_ > 0) {
+        pos_--;
+        return S_OK;
+    }
+    return moveTo(leaf_->prev, -1);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::descend(
+    const Key *k,
+    bool rightmost,
+    off_t *leaf)
+{
+    off_t offset = snap_ != NULL ? snap_->root_ : tree_->root_;
+    if (offset == INVALID_OFFSET) return S_FALSE;
+    Node *node = readNode(offset);
+
+    while (node != NULL && !tree_->isLeaf(node)) {
+        int pos;
+        if (k != NULL) {
+            pos = tree_->searchInNode(node, *k);
+            pos = pos >= 0 ? pos + 1 : -pos - 1;
+        } else {
+            pos = rightmost ? node->count : 0;
+        }
+
+        offset = *tree_->subNode(node, pos);
+        node = readNode(offset);
+    }
+    if (node == NULL) return S_ERROR;
+
+    *leaf = offset;
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::Cursor::readNode(off_t offset)
+{
+    if (snap_ == NULL) return tree_->locateNode(offset);
+    if (offset == INVALID_OFFSET) return NULL;
+
+    // 同一个节点只读取一次
+    if (offset != pageOffset_) {
+        if (snap_->readNode(offset, page_) == NULL) {
+            pageOffset_ = INVALID_OFFSET;
+            return NULL;
+        }
+        pageOffset_ = offset;
+    }
+    return (Node *) page_;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::moveTo(off_t offset, int pos)
+{
+    release();
+
+    while (offset != INVALID_OFFSET) {
+        // 快照中的叶子是私有的副本,不需要占用
+        Node *leaf =
+            snap_ != NULL ? readNode(offset) : tree_->fetchBlock(offset);
+        if (leaf == NULL) return S_ERROR;
+        if (pos < 0) pos += leaf->count;
+
+        if (pos >= 0 && pos < leaf->count) {
+            leaf_ = leaf;
+            pos_ = pos;
+            keys_ = tree_->key(leaf);
+            values_ = tree_->data(leaf);
+            if (leaf->type == BPLUS_TREE_LEAF_PACKED) {
+                // 压缩叶子整体解码一次,之后的移动直接读取副本
+                keyBuf_.resize(leaf->count);
+                valueBuf_.resize(leaf->count);
+                tree_->decodeLeaf(leaf, &keyBuf_[0], &valueBuf_[0]);
+                keys_ = &keyBuf_[0];
+                values_ = &valueBuf_[0];
+            }
+            return S_OK;
+        }
+
+        // 越界则移动到相邻的叶子
+        offset = pos < 0 ? leaf->prev : leaf->next;
+        pos = pos < 0 ? -1 : 0;
+        if (snap_ == NULL) tree_->cacheDefer(leaf);
+    }
+    return S_FALSE;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::Cursor::release()
+{
+    if (leaf_ == NULL) return;
+
+    if (snap_ == NULL) tree_->cacheDefer(leaf_);
+    leaf_ = NULL;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::Cursor::latchedMove(int how, Key k)
+{
+    BPlusTree *tree = tree_;
+    tree->lockTree(false);
+
+    // 结构未改变时当前叶子仍在树中(一直被占用),否则从root重新查找
+    Node *leaf;
+    int ret = S_FALSE;
+    bool relative = how == MOVE_NEXT || how == MOVE_PREV;
+    if (relative && version_ == tree->smoVersion_) {
+        leaf = leaf_;
+        leaf_ = NULL;
+        tree->pool_->latch(leaf, false);
+    } else {
+        release();
+        bool byKey = how != MOVE_FIRST && how != MOVE_LAST;
+        leaf = tree->latchLeaf(byKey ? &k : NULL, how == MOVE_LAST, false);
+        if (leaf == NULL && tree->root_ != INVALID_OFFSET) ret = S_ERROR;
+    }
+
+    // 叶子中的key可能已被其他线程修改,按k重新计算位置
+    bool forward = how != MOVE_PREV && how != MOVE_LAST;
+    while (leaf != NULL) {
+        int pos;
+        if (how == MOVE_FIRST) {
+            pos = 0;
+        } else if (how == MOVE_LAST) {
+            pos = leaf->count - 1;
+        } else {
+            pos = tree->searchInNode(leaf, k);
+            if (how == MOVE_NEXT && pos >= 0) pos++;
+            if (pos < 0) pos = -pos - 1;
+            if (how == MOVE_PREV) pos--;
+        }
+
+        if (pos >= 0 && pos < leaf->count) {
+            key_ = tree->nodeKey(leaf, pos);
+            value_ = tree->leafValue(leaf, pos);
+            pos_ = pos;
+            // 释放块锁,保留占用
+            tree->pool_->unlatch(leaf);
+            leaf_ = leaf;
+            ret = S_OK;
+            break;
+        }
+
+        // 先锁住相邻的叶子,再释放当前叶子
+        off_t offset = forward ? leaf->next : leaf->prev;
+        Node *sibling = tree->latchNode(offset, false);
+        tree->unlatchNode(leaf);
+        if (sibling == NULL && offset != INVALID_OFFSET) ret = S_ERROR;
+        leaf = sibling;
+        how = forward ? MOVE_FIRST : MOVE_LAST;
+    }
+
+    version_ = tree->smoVersion_;
+    tree->unlockTree();
+    return ret;
+}
+
+// 命令中的key为long,转换为Key
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insertHandler()
 {
     char *s = strstr(cmdBuf_, " ");
     if (s == NULL) goto faild;
@@ -294,14 +1756,14 @@ int BPlusTree::insertHandler()
         char *s2 = strstr(s, "-");
         // 插入区间
         if (s2 != NULL) {
-            key_t n1, n2;
+            long n1, n2;
             sscanf(s, "%ld-%ld", &n1, &n2);
             for (; n1 <= n2; n1++)
-                insert(n1, n1);
+                insert((Key) n1, (Value) n1);
             return S_OK;
         } else { // 插入一个数
-            key_t n = atoi(s);
-            return insert(n, n);
+            long n = atol(s);
+            return insert((Key) n, (Value) n);
         }
     }
 
@@ -310,9 +1772,11 @@ faild:
     return S_FALSE;
 }
 
-// key_t == long && data_t == long
-int BPlusTree::searchHandler()
+// 命令中的key为long,Value以long输出
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::searchHandler()
 {
+    Value value;
     char *s = strstr(cmdBuf_, " ");
     if (NULL == s) goto faild;
 
@@ -322,14 +1786,24 @@ int BPlusTree::searchHandler()
         char *s2 = strstr(s, "-");
         // 查找区间
         if (s2 != NULL) {
-            key_t n1, n2;
+            long n1, n2;
             sscanf(s, "%ld-%ld", &n1, &n2);
-            for (; n1 <= n2; n1++)
-                printf("key: %ld, index: %ld\n", n1, search(n1));
+
+            // 沿叶子链表输出区间内存在的key
+            Cursor cursor(this);
+            for (cursor.seek((Key) n1); cursor.valid(); cursor.next()) {
+                if ((long) cursor.key() > n2) break;
+                printf(
+                    "key: %ld, index: %ld\n",
+                    (long) cursor.key(),
+                    (long) cursor.value());
+            }
             return S_OK;
         } else { // 查找一个数
-            key_t n = atoi(s);
-            printf("key: %ld, index: %ld\n", n, search(n));
+            long n = atol(s);
+            int ret = search((Key) n, &value);
+            printf(
+                "key: %ld, index: %ld\n", n, ret == S_OK ? (long) value : -1L);
             return S_OK;
         }
 
@@ -341,7 +1815,8 @@ faild:
     return S_FALSE;
 }
 
-int BPlusTree::removeHandler()
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::removeHandler()
 {
     char *s = strstr(cmdBuf_, " ");
     if (s == NULL) goto faild;
@@ -351,10 +1826,10 @@ int BPlusTree::removeHandler()
         char *s2 = strstr(s, "-");
         // 删除区间
         if (s2 != NULL) {
-            key_t n1, n2;
+            long n1, n2;
             sscanf(s, "%ld-%ld", &n1, &n2);
             for (; n1 <= n2; n1++) {
-                int ret = remove(n1);
+                int ret = remove((Key) n1);
                 if (ret == S_OK)
                     printf("%ld removed.\n", n1);
                 else
@@ -362,8 +1837,8 @@ int BPlusTree::removeHandler()
             }
             return S_OK;
         } else { // 删除一个数
-            key_t n = atoi(s);
-            int ret = remove(n);
+            long n = atol(s);
+            int ret = remove((Key) n);
             if (ret == S_OK) {
                 printf("%ld removed.\n", n);
                 return S_OK;
@@ -379,210 +1854,550 @@ faild:
     return S_FALSE;
 }
 
-Node *BPlusTree::cacheRefer()
+// 命令中的key为long,转换为Key
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::bulkLoadHandler()
 {
-    // 找到一块空闲的缓存使用
-    for (int i = 0; i < MAX_CACHE_NUM; ++i) {
-        if (!used_[i]) {
-            used_[i] = true;
-            return caches_[i];
-        }
+    long range[2];
+    char *s = strstr(cmdBuf_, " ");
+    if (s == NULL) goto faild;
+
+    s++;
+    if (sscanf(s, "%ld-%ld", &range[0], &range[1]) == 2) {
+        long first = range[0];
+        int ret = bulkLoad(rangeReader, range);
+        if (ret == S_OK)
+            printf("%ld-%ld loaded.\n", first, range[1]);
+        else
+            printf("Bulk load requires an empty tree.\n");
+        return ret;
     }
-    assert(0);
+
+faild:
+    printf("Invalid argument.\n");
+    return S_FALSE;
 }
 
-// 对一个已经在使用的缓存进行占用
-void BPlusTree::cacheOccupy(Node *node)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::compactHandler()
 {
-    // 若node为rootCache,则不需要标记
-    if (node == rootCache_) return;
-
-    int i = 0;
-    while (node != caches_[i] && i < MAX_CACHE_NUM)
-        i++;
+    off_t before = fileSize_;
+    while (compact(COMPACT_STEPS) > 0)
+        ;
+    printf("%ld -> %ld bytes.\n", (long) before, (long) fileSize_);
+    return S_OK;
+}
 
-    if (i < MAX_CACHE_NUM) used_[i] = true;
+// 对一个通过locateNode取得的缓存进行占用
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::cacheOccupy(Node *node)
+{
+    pool_->pin(node);
 }
 
-void BPlusTree::cacheDefer(const Node *node)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::cacheDefer(const Node *node)
 {
-    // 找到对应的缓存并释放
-    for (int i = 0; i < MAX_CACHE_NUM; ++i) {
-        if (node == caches_[i]) {
-            used_[i] = false;
-            return;
-        }
-    }
-    assert(0);
+    pool_->unpin(node);
 }
 
-Node *BPlusTree::newRoot()
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::newNode(off_t sibling, bool right)
 {
-    rootCache_->self = INVALID_OFFSET;
-    rootCache_->prev = INVALID_OFFSET;
-    rootCache_->next = INVALID_OFFSET;
-    rootCache_->lastOffset = INVALID_OFFSET;
+    Node *node = appendBlock(sibling, right);
+    // node->parent = INVALID_OFFSET;
+    node->prev = INVALID_OFFSET;
+    node->next = INVALID_OFFSET;
+    node->lastOffset = INVALID_OFFSET;
 
-    rootCache_->count = 0;
+    node->count = 0;
+    return node;
+}
 
-    return rootCache_;
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::newNonLeaf()
+{
+    Node *node = newNode(INVALID_OFFSET, true);
+    node->type = BPLUS_TREE_NON_LEAF;
+    return node;
 }
 
-Node *BPlusTree::newLeafRoot()
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::newLeaf(off_t sibling, bool right)
 {
-    Node *node = newRoot();
+    Node *node = newNode(sibling, right);
     node->type = BPLUS_TREE_LEAF;
-
     return node;
 }
 
-Node *BPlusTree::newNonLeafRoot()
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::appendBlock(off_t sibling, bool right)
 {
-    Node *node = newRoot();
-    node->type = BPLUS_TREE_NON_LEAF;
+    off_t page = FreeSpace::NONE;
+    if (sibling != INVALID_OFFSET) {
+        page = space_.near(sibling, LEAF_RUN, right);
+        if (page == FreeSpace::NONE) page = space_.lowestRun(LEAF_RUN);
+    }
+    // 没有合适的位置时先填补空洞,不为叶子扩大文件
+    if (page == FreeSpace::NONE) page = space_.lowest();
 
-    return node;
+    if (page == FreeSpace::NONE) {
+        // 在文件末尾增加块,叶子一次预留一段
+        page = space_.pages();
+        resizeFile(page + (sibling != INVALID_OFFSET ? LEAF_RUN : 1));
+    }
+    return allocBlock(page);
 }
 
-Node *BPlusTree::newNode()
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::allocBlock(off_t page)
 {
-    Node *node = cacheRefer();
-    node->self = INVALID_OFFSET;
-    // node->parent = INVALID_OFFSET;
-    node->prev = INVALID_OFFSET;
-    node->next = INVALID_OFFSET;
-    node->lastOffset = INVALID_OFFSET;
+    if (page >= space_.pages()) resizeFile(page + 1);
+    space_.mark(page);
+    if (wal_ != NULL) wal_->appendAlloc(page);
 
-    node->count = 0;
+    Node *node = (Node *) pool_->create(fileOffset(page));
+    node->self = page;
     return node;
 }
 
-Node *BPlusTree::newNonLeaf()
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::unappendBlock(Node *node)
 {
-    Node *node = newNode();
-    node->type = BPLUS_TREE_NON_LEAF;
+    // 缓存中的内容已作废
+    pool_->discard(fileOffset(node->self));
+    space_.release(node->self);
+    if (wal_ != NULL) wal_->appendFree(node->self);
+
+    // 若回收最后一个block,则文件末尾连续的空闲块都不再属于文件
+    if (node->self == space_.pages() - 1) resizeFile(space_.usedEnd());
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::blockFlush(Node *node)
+{
+    if (node == NULL) return S_FALSE;
+
+    packNode(node);
+    pool_->flush(node);
+    cacheDefer(node);
+
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::fetchRootBlock()
+{
+    if (root_ == INVALID_OFFSET) return;
+
+    pool_->lookup(fileOffset(root_));
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::fetchBlock(off_t offset)
+{
+    if (offset == INVALID_OFFSET) return NULL;
+
+    // 取得的节点可能被修改,先恢复为有序布局
+    Node *node = (Node *) pool_->fetch(fileOffset(offset));
+    if (node != NULL) unpackNode(node);
     return node;
 }
 
-Node *BPlusTree::newLeaf()
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::refetchBlock(off_t offset)
 {
-    Node *node = newNode();
-    node->type = BPLUS_TREE_LEAF;
+    // 修改已经开始,无法回退; 只有文件在此期间被改坏时才会失败
+    Node *node = fetchBlock(offset);
+    assert(node != NULL || offset == INVALID_OFFSET);
     return node;
 }
 
-off_t BPlusTree::appendBlock(Node *node)
+// 把block读到cache中(不占用)
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::locateNode(off_t offset)
 {
-    if (!freeBlocks_.empty()) {
-        // 取出空闲块
-        node->self = freeBlocks_.front();
-        freeBlocks_.pop_front();
-    } else {
-        // 在文件末尾增加块
-        node->self = fileSize_;
-        fileSize_ += blockSize_;
+    if (offset == INVALID_OFFSET) return NULL;
+
+    return (Node *) pool_->lookup(fileOffset(offset));
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::readable(off_t offset)
+{
+    return offset == INVALID_OFFSET || locateNode(offset) != NULL;
+}
+
+// 调用者已占用leaf
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::splitReadable(const Node *leaf)
+{
+    if (!readable(leaf->prev) || !readable(leaf->next)) return false;
+
+    // 父节点已满时继续向上分裂
+    std::list<off_t>::reverse_iterator it;
+    for (it = traceNode_.rbegin(); it != traceNode_.rend(); ++it) {
+        Node *node = locateNode(*it);
+        if (node == NULL) return false;
+        if (node->count < DEGREE) break;
     }
-    return node->self;
+    return true;
 }
 
-void BPlusTree::unappendBlock(Node *node)
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::mergeReadable(off_t prev, off_t next)
 {
-    // 若回收最后一个block,则直接减少fileSize_
-    if (fileSize_ - blockSize_ == node->self)
-        fileSize_ -= blockSize_;
-    else // 否则使用链表回收
-        freeBlocks_.push_back(node->self);
+    // 与右边的叶子合并时还要修改它之后的叶子
+    if (!readable(prev)) return false;
+    if (next != INVALID_OFFSET) {
+        Node *right = locateNode(next);
+        if (right == NULL || !readable(right->next)) return false;
+    }
+
+    std::list<off_t>::reverse_iterator it;
+    for (it = traceNode_.rbegin(); it != traceNode_.rend(); ++it) {
+        Node *node = locateNode(*it);
+        if (node == NULL) return false;
+        // 删除一个key后不会借数据或合并(与removeInNonLeaf相同),不再向上
+        std::list<off_t>::reverse_iterator up = it;
+        if (++up == traceNode_.rend() || node->count >= nonLeafMin_) break;
+
+        // 非叶子节点与同一父节点下的左右节点借数据或合并
+        off_t self = node->self;
+        Node *parent = locateNode(*up);
+        if (parent == NULL) return false;
+        int pos = 0;
+        while (pos < parent->count && *subNode(parent, pos) != self)
+            pos++;
+        off_t left = pos > 0 ? *subNode(parent, pos - 1) : INVALID_OFFSET;
+        off_t right =
+            pos < parent->count ? *subNode(parent, pos + 1) : INVALID_OFFSET;
+        if (!readable(left) || !readable(right)) return false;
+    }
+    return true;
 }
 
-int BPlusTree::blockFlush(Node *node)
+// 返回值: 非负数->存在  负数->可插入坐标的相反数减1
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::searchInNode(Node *node, Key target)
 {
-    if (node == NULL) return S_FALSE;
+    const Key *keys = key(node);
+    int count = node->count;
+    int low;
+
+    if (node->type == BPLUS_TREE_LEAF_PACKED) {
+        if ((unsigned) count > (unsigned) PACKED_DEGREE)
+            count = count < 0 ? 0 : PACKED_DEGREE;
+        return Codec::search((const char *) keys, LEAF_AREA, count, target);
+    }
+
+    if (node->type == BPLUS_TREE_NON_LEAF_EYTZINGER) {
+        typedef Eytzinger<Key, DEGREE> Layout;
+
+        // 乐观读取时count可能不完整,限制在DEGREE以内保证不越界
+        if ((unsigned) count > (unsigned) DEGREE)
+            count = count < 0 ? 0 : DEGREE;
+        int k = Layout::lowerBound(keys, count, target);
+        if (k == 0) return -count - 1;
+
+        low = Layout::rank(k, count);
+        if (keys[k - 1] == target) return low;
+        return -low - 1;
+    }
+
+    // low为第一个不小于target的坐标(整数key且节点较大时使用向量比较)
+    low = KeySearch<Key, DEGREE>::lowerBound(keys, count, target);
+    if (low < count && keys[low] == target) return low;
+
+    // 返回可插入坐标的相反数减1(避免0的双意性)
+    return -low - 1;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::packNode(Node *node)
+{
+    if (!eytzinger_ || node->type != BPLUS_TREE_NON_LEAF) return;
+
+    Eytzinger<Key, DEGREE>::pack(key(node), node->count);
+    node->type = BPLUS_TREE_NON_LEAF_EYTZINGER;
+}
 
-    int ret = pwrite(fd_, node, blockSize_, node->self);
-    assert(ret == blockSize_);
-    // 若是root,则不用cacheDefer
-    if (node->self != root_) cacheDefer(node);
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::unpackNode(Node *node)
+{
+    if (node == NULL || node->type != BPLUS_TREE_NON_LEAF_EYTZINGER) return;
+
+    Eytzinger<Key, DEGREE>::unpack(key(node), node->count);
+    node->type = BPLUS_TREE_NON_LEAF;
+}
 
+template <typename Key, typename Value, int BlockSize>
+Value BPlusTree<Key, Value, BlockSize>::leafValue(const Node *leaf, int pos)
+{
+    // 乐观读取时类型与count都可能不完整,位置越界时返回任意值
+    if (leaf->type != BPLUS_TREE_LEAF_PACKED)
+        return pos < DEGREE ? data(leaf)[pos] : Value();
+
+    int count = leaf->count;
+    if ((unsigned) count > (unsigned) PACKED_DEGREE) count = PACKED_DEGREE;
+    if (pos >= count) return Value();
+    return Codec::value((const char *) key(leaf), LEAF_AREA, count, pos);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::decodeLeaf(
+    const Node *leaf,
+    Key *keys,
+    Value *values)
+{
+    int n = leaf->count;
+    if (leaf->type == BPLUS_TREE_LEAF_PACKED) {
+        Codec::decode((const char *) key(leaf), LEAF_AREA, n, keys, values);
+    } else {
+        memcpy(keys, key(leaf), n * sizeof(Key));
+        memcpy(values, data(leaf), n * sizeof(Value));
+    }
+    return n;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::storeLeaf(
+    Node *leaf,
+    const Key *keys,
+    const Value *values,
+    int n)
+{
+    // 压缩模式下优先压缩,未启用时只有普通格式放不下才压缩
+    if (COMPRESSIBLE && (compress_ || n > DEGREE) && n <= PACKED_DEGREE
+        && Codec::size(keys, values, n) <= PACKED_CAPACITY) {
+        Codec::encode(keys, values, n, (char *) key(leaf));
+        leaf->type = BPLUS_TREE_LEAF_PACKED;
+    } else if (n <= DEGREE) {
+        // keys/values可能就是叶子中的数组
+        memmove(key(leaf), keys, n * sizeof(Key));
+        memmove(data(leaf), values, n * sizeof(Value));
+        leaf->type = BPLUS_TREE_LEAF;
+    } else {
+        return S_FALSE;
+    }
+
+    leaf->count = n;
     return S_OK;
 }
 
-void BPlusTree::fetchRootBlock()
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::storeOrSplitLeaf(
+    Node *leaf,
+    const Key *keys,
+    const Value *values,
+    int n)
 {
-    if (root_ == INVALID_OFFSET) return;
+    if (storeLeaf(leaf, keys, values, n) == S_OK) {
+        blockFlush(leaf);
+        return S_OK;
+    }
+
+    // 分裂会修改的节点读取失败时不做修改
+    if (!splitReadable(leaf)) {
+        cacheDefer(leaf);
+        return S_ERROR;
+    }
 
-    int len = pread(fd_, rootCache_, blockSize_, root_);
-    assert(len == blockSize_);
+    // 按编码大小平分,两边的key数也不能超过PACKED_DEGREE
+    int split = Codec::split(keys, values, n);
+    if (split < n - PACKED_DEGREE) split = n - PACKED_DEGREE;
+    if (split > PACKED_DEGREE) split = PACKED_DEGREE;
+
+    Node *right = newLeaf(leaf->self, true);
+    addRightNode(leaf, right);
+
+    // 修改一个entry后编码大小的变化有上界,每一半都能放下
+    int ret = storeLeaf(leaf, keys, values, split);
+    assert(ret == S_OK);
+    ret = storeLeaf(right, keys + split, values + split, n - split);
+    assert(ret == S_OK);
+
+    // 递归维护上层节点
+    updateParentNode(leaf, right, keys[split]);
+    return S_OK;
 }
 
-Node *BPlusTree::fetchBlock(off_t offset)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insertPackedLeaf(
+    Node *leaf,
+    Key k,
+    Value value,
+    bool split,
+    bool overwrite)
 {
-    if (offset == INVALID_OFFSET) return NULL;
+    int pos = searchInNode(leaf, k);
+    if (pos >= 0 && !overwrite) return S_FALSE;
 
-    if (offset == root_) return rootCache_;
+    Key keys[PACKED_DEGREE + 1];
+    Value values[PACKED_DEGREE + 1];
+    int n = decodeLeaf(leaf, keys, values);
 
-    Node *node = cacheRefer();
-    int len = pread(fd_, node, blockSize_, offset);
-    assert(len == blockSize_);
+    if (pos >= 0) {
+        // 批量修改已存在的key: 新value的编码更长时可能放不下,需要分裂
+        values[pos] = value;
+    } else {
+        pos = -pos - 1;
+        memmove(&keys[pos + 1], &keys[pos], (n - pos) * sizeof(Key));
+        memmove(&values[pos + 1], &values[pos], (n - pos) * sizeof(Value));
+        keys[pos] = k;
+        values[pos] = value;
+        n++;
+    }
 
-    return node;
+    if (!split) {
+        if (storeLeaf(leaf, keys, values, n) != S_OK) return S_FALSE;
+        pool_->flush(leaf);
+        return S_OK;
+    }
+
+    cacheOccupy(leaf);
+    return storeOrSplitLeaf(leaf, keys, values, n);
 }
 
-// 把block读到cache中
-Node *BPlusTree::locateNode(off_t offset)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::removePackedLeaf(
+    Node *node,
+    int pos,
+    Key k,
+    bool merge)
 {
-    if (offset == INVALID_OFFSET) return NULL;
+    Key keys[PACKED_DEGREE];
+    Value values[PACKED_DEGREE];
+    int n = decodeLeaf(node, keys, values);
+
+    n--;
+    memmove(&keys[pos], &keys[pos + 1], (n - pos) * sizeof(Key));
+    memmove(&values[pos], &values[pos + 1], (n - pos) * sizeof(Value));
+
+    // 不是root的叶子编码后不大于packedMin_(默认为容量的1/4)时
+    // 尝试与相邻叶子合并
+    bool root = node->self == root_;
+    bool small = !root
+                 && (n == 0 || Codec::size(keys, values, n) <= packedMin_);
+
+    if (!merge) {
+        if ((root && n == 0) || small) return S_FALSE;
+        if (storeLeaf(node, keys, values, n) != S_OK) return S_FALSE;
+        pool_->flush(node);
+        return S_OK;
+    }
 
-    // 若是root,则直接返回rootcache
-    if (offset == root_) return rootCache_;
+    cacheOccupy(node);
 
-    for (int i = 0; i < MAX_CACHE_NUM; i++) {
-        if (!used_[i]) {
-            int len = pread(fd_, caches_[i], blockSize_, offset);
-            assert(len == blockSize_);
-            return caches_[i];
+    if (root && n == 0) {
+        // 清空树
+        removeNode(node, NULL, NULL);
+        root_ = INVALID_OFFSET;
+    } else if (small) {
+        // 左右节点一次预读
+        off_t siblings[2];
+        int count = 0;
+        if (node->prev != INVALID_OFFSET)
+            siblings[count++] = fileOffset(node->prev);
+        if (node->next != INVALID_OFFSET)
+            siblings[count++] = fileOffset(node->next);
+        pool_->prefetch(siblings, count);
+
+        // 合并会修改的节点读取失败时不做修改
+        if (!mergeReadable(node->prev, node->next)) {
+            cacheDefer(node);
+            return S_ERROR;
         }
-    }
-    assert(0);
-}
 
-// 返回值: 非负数->存在  负数->可插入坐标的相反数减1
-int BPlusTree::searchInNode(Node *node, key_t target)
-{
-    key_t *keys = key(node);
-    int low = 0;
-    int high = node->count - 1;
-    int mid;
+        Node *parent = refetchBlock(traceNode_.back());
+        Node *left = refetchBlock(node->prev);
+        Node *right = refetchBlock(node->next);
+        traceNode_.pop_back();
 
-    // 二分查找
-    while (low < high) {
-        mid = (low + high) / 2;
-        // 找到则直接返回对应坐标
-        if (keys[mid] == target) return mid;
+        // ppos为node在parent的位置
+        int ppos = searchInNode(parent, k);
+        if (ppos < 0) ppos = -ppos - 2;
 
-        if (keys[mid] < target)
-            low = mid + 1;
-        else
-            high = mid - 1;
+        mergePackedLeaf(node, keys, values, n, parent, left, right, ppos);
+    } else {
+        // 删除后编码可能变大,放不下时分裂
+        return storeOrSplitLeaf(node, keys, values, n);
     }
+    return S_OK;
+}
 
-    // high == -1
-    if (high < 0) return high;
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::mergePackedLeaf(
+    Node *node,
+    const Key *keys,
+    const Value *values,
+    int n,
+    Node *parent,
+    Node *left,
+    Node *right,
+    int ppos)
+{
+    // 与selectNode相同只选择同一父节点下的叶子,中间的叶子选择较小的一个
+    bool useLeft = ppos == parent->count - 1
+                   || (ppos >= 0 && left->count <= right->count);
+    Node *sibling = useLeft ? left : right;
+
+    int total = n + sibling->count;
+    if (total <= PACKED_DEGREE || n == 0) {
+        Key all[2 * PACKED_DEGREE];
+        Value allValues[2 * PACKED_DEGREE];
+        int m = useLeft ? 0 : n;
+        decodeLeaf(sibling, all + m, allValues + m);
+        m = useLeft ? sibling->count : 0;
+        memcpy(all + m, keys, n * sizeof(Key));
+        memcpy(allValues + m, values, n * sizeof(Value));
+
+        if (useLeft && storeLeaf(left, all, allValues, total) == S_OK) {
+            // node合并到left
+            removeNode(node, left, right);
+            removeInNonLeaf(parent, ppos);
+            return;
+        }
+        if (!useLeft && storeLeaf(node, all, allValues, total) == S_OK) {
+            // right合并到node
+            removeNode(right, node, refetchBlock(right->next));
+            // left没有修改,只释放占用
+            if (left != NULL) cacheDefer(left);
+            removeInNonLeaf(parent, ppos + 1);
+            return;
+        }
+        // 空叶子合并后的内容与sibling相同,一定放得下
+        assert(n > 0);
+    }
 
-    // 返回第一个大于target的坐标的相反数减1(避免0的双意性)
-    if (keys[high] > target)
-        return -high - 1;
-    else if (keys[high] == target) // 找到则返回
-        return high;
-    else
-        return -high - 2;
+    // 合并后放不下,node单独写回
+    int ret = storeLeaf(node, keys, values, n);
+    assert(ret == S_OK);
+    blockFlush(node);
+    cacheDefer(parent);
+    if (left != NULL) cacheDefer(left);
+    if (right != NULL) cacheDefer(right);
 }
 
-int BPlusTree::insertLeaf(Node *leaf, key_t k, data_t value)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insertLeaf(
+    Node *leaf,
+    Key k,
+    Value value,
+    bool overwrite)
 {
+    if (packedPath(leaf))
+        return insertPackedLeaf(leaf, k, value, true, overwrite);
+
     int pos = searchInNode(leaf, k);
     if (pos >= 0) {
-        // TODO:插入已存在的点
-        assert(0);
+        if (!overwrite) return S_FALSE;
+
+        // 批量写入覆盖已存在的key
+        data(leaf)[pos] = value;
+        cacheOccupy(leaf);
+        blockFlush(leaf);
+        return S_OK;
     }
 
     /*新节点*/
@@ -594,10 +2409,16 @@ int BPlusTree::insertLeaf(Node *leaf, key_t k, data_t value)
 
     // block已满->分裂
     if (leaf->count == DEGREE) {
+        // 分裂会修改的节点读取失败时不做修改
+        if (!splitReadable(leaf)) {
+            cacheDefer(leaf);
+            return S_ERROR;
+        }
+
         int split = (DEGREE + 1) / 2;
         // NOTE:another何时写回
-        Node *anotherNode = newLeaf();
-        key_t splitkey;
+        Node *anotherNode = newLeaf(leaf->self, pos >= split);
+        Key splitkey;
 
         if (pos < split) { // 分裂出左叶子
             splitkey = splitLeftLeaf(leaf, anotherNode, k, value, pos);
@@ -619,19 +2440,24 @@ int BPlusTree::insertLeaf(Node *leaf, key_t k, data_t value)
     return S_OK;
 }
 
-void BPlusTree::simpleInsertLeaf(Node *leaf, int pos, key_t k, data_t value)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::simpleInsertLeaf(
+    Node *leaf,
+    int pos,
+    Key k,
+    Value value)
 {
     // 若插入不是在末尾,则需要移动数据
     if (pos < leaf->count) {
         memmove(
             &key(leaf)[pos + 1],
             &key(leaf)[pos],
-            (leaf->count - pos) * sizeof(key_t));
+            (leaf->count - pos) * sizeof(Key));
 
         memmove(
             &data(leaf)[pos + 1],
             &data(leaf)[pos],
-            (leaf->count - pos) * sizeof(data_t));
+            (leaf->count - pos) * sizeof(Value));
     }
 
     key(leaf)[pos] = k;
@@ -639,11 +2465,12 @@ void BPlusTree::simpleInsertLeaf(Node *leaf, int pos, key_t k, data_t value)
     leaf->count++;
 }
 
-key_t BPlusTree::splitLeftLeaf(
+template <typename Key, typename Value, int BlockSize>
+Key BPlusTree<Key, Value, BlockSize>::splitLeftLeaf(
     Node *leaf,
     Node *left,
-    key_t k,
-    data_t value,
+    Key k,
+    Value value,
     int pos)
 {
     // 从中间位置开始分裂
@@ -657,8 +2484,8 @@ key_t BPlusTree::splitLeftLeaf(
 
     // 移动数据到left. pos + 1 + (split - pos - 1) == split == left->count
     if (pos != 0) {
-        memmove(&key(left)[0], &key(leaf)[0], pos * sizeof(key_t));
-        memmove(&data(left)[0], &data(leaf)[0], pos * sizeof(data_t));
+        memmove(&key(left)[0], &key(leaf)[0], pos * sizeof(Key));
+        memmove(&data(left)[0], &data(leaf)[0], pos * sizeof(Value));
     }
 
     key(left)[pos] = k;
@@ -668,27 +2495,28 @@ key_t BPlusTree::splitLeftLeaf(
     memmove(
         &key(left)[pos + 1],
         &key(leaf)[pos],
-        (split - pos - 1) * sizeof(key_t));
+        (split - pos - 1) * sizeof(Key));
     memmove(
         &data(left)[pos + 1],
         &data(leaf)[pos],
-        (split - pos - 1) * sizeof(data_t));
+        (split - pos - 1) * sizeof(Value));
 
     // 移动leaf数据
-    memmove(&key(leaf)[0], &key(leaf)[split - 1], leaf->count * sizeof(key_t));
+    memmove(&key(leaf)[0], &key(leaf)[split - 1], leaf->count * sizeof(Key));
     memmove(
-        &data(leaf)[0], &data(leaf)[split - 1], leaf->count * sizeof(data_t));
+        &data(leaf)[0], &data(leaf)[split - 1], leaf->count * sizeof(Value));
 
     // NOTE:叶子节点无需考虑lastOffset
     // 分裂完成后,返回右节点的第一个key
     return key(leaf)[0];
 }
 
-key_t BPlusTree::splitRightLeaf(
+template <typename Key, typename Value, int BlockSize>
+Key BPlusTree<Key, Value, BlockSize>::splitRightLeaf(
     Node *leaf,
     Node *right,
-    key_t k,
-    data_t value,
+    Key k,
+    Value value,
     int pos)
 {
     int split = (DEGREE + 1) / 2;
@@ -701,11 +2529,11 @@ key_t BPlusTree::splitRightLeaf(
     // (pos - split) + 1 + (DEGREE - pos) == right->count
     if (pos > split) {
         memmove(
-            &key(right)[0], &key(leaf)[split], (pos - split) * sizeof(key_t));
+            &key(right)[0], &key(leaf)[split], (pos - split) * sizeof(Key));
         memmove(
             &data(right)[0],
             &data(leaf)[split],
-            (pos - split) * sizeof(data_t));
+            (pos - split) * sizeof(Value));
     }
 
     key(right)[pos - split] = k;
@@ -715,22 +2543,20 @@ key_t BPlusTree::splitRightLeaf(
         memmove(
             &key(right)[pos - split + 1],
             &key(leaf)[pos],
-            (DEGREE - pos) * sizeof(key_t));
+            (DEGREE - pos) * sizeof(Key));
         memmove(
             &data(right)[pos - split + 1],
             &data(leaf)[pos],
-            (DEGREE - pos) * sizeof(data_t));
+            (DEGREE - pos) * sizeof(Value));
     }
 
     return key(right)[0];
 }
 
-void BPlusTree::addLeftNode(Node *node, Node *left)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::addLeftNode(Node *node, Node *left)
 {
-    // 为left分配物理空间
-    appendBlock(left);
-
-    Node *prev = fetchBlock(node->prev);
+    Node *prev = refetchBlock(node->prev);
     if (prev != NULL) {
         prev->next = left->self;
         left->prev = prev->self;
@@ -742,11 +2568,10 @@ void BPlusTree::addLeftNode(Node *node, Node *left)
     node->prev = left->self;
 }
 
-void BPlusTree::addRightNode(Node *node, Node *right)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::addRightNode(Node *node, Node *right)
 {
-    appendBlock(right);
-
-    Node *next = fetchBlock(node->next);
+    Node *next = refetchBlock(node->next);
     if (next != NULL) {
         next->prev = right->self;
         right->next = next->self;
@@ -759,26 +2584,27 @@ void BPlusTree::addRightNode(Node *node, Node *right)
 }
 
 // 更新父节点
-int BPlusTree::updateParentNode(Node *leftChild, Node *rightChild, key_t k)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::updateParentNode(
+    Node *leftChild,
+    Node *rightChild,
+    Key k)
 {
     // 没有父节点
     if (traceNode_.empty()) {
-        off_t leftChildOffset = leftChild->self;
-        off_t rightChildOffset = rightChild->self;
-
-        // 先将左右子节点刷入内存(避免rootCache重复使用)
-        blockFlush(leftChild);
-        blockFlush(rightChild);
-
         // 创建父节点
-        Node *parent = newNonLeafRoot();
+        Node *parent = newNonLeaf();
         key(parent)[0] = k;
         parent->count = 1;
-        *subNode(parent, 0) = leftChildOffset;
-        *subNode(parent, 1) = rightChildOffset;
+        *subNode(parent, 0) = leftChild->self;
+        *subNode(parent, 1) = rightChild->self;
+
+        // 将左右子节点刷回磁盘
+        blockFlush(leftChild);
+        blockFlush(rightChild);
 
         // 设置root
-        root_ = appendBlock(parent);
+        root_ = parent->self;
         // 新的root节点刷进磁盘
         blockFlush(parent);
     } else {
@@ -787,19 +2613,18 @@ int BPlusTree::updateParentNode(Node *leftChild, Node *rightChild, key_t k)
         traceNode_.pop_back();
 
         // 在非叶子节点中插入key
-        return insertNonLeaf(fetchBlock(p), leftChild, rightChild, k);
+        return insertNonLeaf(refetchBlock(p), leftChild, rightChild, k);
     }
 
     return S_OK;
 }
 
-void BPlusTree::addNonLeafNode(Node *anotherNode) { appendBlock(anotherNode); }
-
-int BPlusTree::insertNonLeaf(
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::insertNonLeaf(
     Node *node,
     Node *leftChild,
     Node *rightChild,
-    key_t k)
+    Key k)
 {
     int pos = searchInNode(node, k);
     // TODO:暂不支持相同key
@@ -810,7 +2635,7 @@ int BPlusTree::insertNonLeaf(
     // 该节点已满,需关注lastOffset
     if (node->count == DEGREE) {
         int split = DEGREE / 2;
-        key_t splitkey;
+        Key splitkey;
         Node *anotherNode = newNonLeaf();
 
         // 分情况插入
@@ -840,10 +2665,11 @@ int BPlusTree::insertNonLeaf(
     return S_OK;
 }
 
-void BPlusTree::simpleInsertNonLeaf(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::simpleInsertNonLeaf(
     Node *node,
     int pos,
-    key_t k,
+    Key k,
     Node *leftChild,
     Node *rightChild)
 {
@@ -854,11 +2680,11 @@ void BPlusTree::simpleInsertNonLeaf(
             memmove(
                 &key(node)[pos + 1],
                 &key(node)[pos],
-                (node->count - pos) * sizeof(key_t));
+                (node->count - pos) * sizeof(Key));
             memmove(
                 subNode(node, pos + 2),
                 subNode(node, pos + 1),
-                (node->count - pos) * sizeof(off_t));
+                (node->count - pos) * sizeof(PageId));
         }
 
     } else { // 插入后节点被填满,需要维护lastOffset
@@ -869,13 +2695,13 @@ void BPlusTree::simpleInsertNonLeaf(
             memmove(
                 &key(node)[pos + 1],
                 &key(node)[pos],
-                (node->count - pos) * sizeof(key_t));
+                (node->count - pos) * sizeof(Key));
 
             // 拷贝数-1,因为最后已放在lastOffset
             memmove(
                 subNode(node, pos + 2),
                 subNode(node, pos + 1),
-                (node->count - pos - 1) * sizeof(off_t));
+                (node->count - pos - 1) * sizeof(PageId));
         }
 
         // 若插入点在最后一个位置,不需要移动数据,lastOffset由插入点确定
@@ -895,50 +2721,45 @@ void BPlusTree::simpleInsertNonLeaf(
 }
 
 // 非叶子节点左分裂(pos < split)(关注lastOffset)
-key_t BPlusTree::splitLeftNonLeaf(
+template <typename Key, typename Value, int BlockSize>
+Key BPlusTree<Key, Value, BlockSize>::splitLeftNonLeaf(
     Node *node,
     Node *leftNode,
     int pos,
-    key_t k,
+    Key k,
     Node *leftChild,
     Node *rightChild)
 {
-    key_t splitkey;         // 向上层节点增加的key
+    Key splitkey;         // 向上层节点增加的key
     int split = DEGREE / 2; // 左边节点个数
 
     // 非叶子节点无需维护prev/next指针
-    addNonLeafNode(leftNode);
 
     leftNode->count = split;
     node->count = DEGREE - split;
 
     // leftNode总共有 pos + (split - pos - 1) + 1 == split
     if (pos != 0) {
-        memmove(&key(leftNode)[0], &key(node)[0], pos * sizeof(key_t));
-        memmove(subNode(leftNode, 0), subNode(node, 0), pos * sizeof(off_t));
+        memmove(&key(leftNode)[0], &key(node)[0], pos * sizeof(Key));
+        memmove(subNode(leftNode, 0), subNode(node, 0), pos * sizeof(PageId));
     }
 
     // subNode多拷贝一个
     memmove(
         &key(leftNode)[pos + 1],
         &key(node)[pos],
-        (split - pos - 1) * sizeof(key_t));
+        (split - pos - 1) * sizeof(Key));
     memmove(
         subNode(leftNode, pos + 1),
         subNode(node, pos),
-        (split - pos) * sizeof(off_t));
+        (split - pos) * sizeof(PageId));
 
     key(leftNode)[pos] = k;
 
-    if (pos == split - 1) {
-        *subNode(leftNode, pos) = leftChild->self;
-        *subNode(node, 0) = rightChild->self;
-    } else {
-        *subNode(leftNode, pos) = leftChild->self;
-        *subNode(leftNode, pos + 1) = rightChild->self;
+    *subNode(leftNode, pos) = leftChild->self;
+    *subNode(leftNode, pos + 1) = rightChild->self;
 
-        *subNode(node, 0) = *subNode(node, split);
-    }
+    *subNode(node, 0) = *subNode(node, split);
 
     // 返回split-1位置的key
     splitkey = key(node)[split - 1];
@@ -948,11 +2769,11 @@ key_t BPlusTree::splitLeftNonLeaf(
     blockFlush(rightChild);
 
     // DEGREE - split == node->count
-    memmove(&key(node)[0], &key(node)[split], (DEGREE - split) * sizeof(key_t));
+    memmove(&key(node)[0], &key(node)[split], (DEGREE - split) * sizeof(Key));
     memmove(
         subNode(node, 1),
         subNode(node, split + 1),
-        (DEGREE - split - 1) * sizeof(off_t));
+        (DEGREE - split - 1) * sizeof(PageId));
 
     // node节点个数没有满,则不适用lastOffset
     *subNode(node, DEGREE - split) = node->lastOffset;
@@ -962,30 +2783,27 @@ key_t BPlusTree::splitLeftNonLeaf(
 }
 
 // 非叶子节点右分裂1(pos == split)(将k添加到父节点)
-key_t BPlusTree::splitRightNonLeaf1(
+template <typename Key, typename Value, int BlockSize>
+Key BPlusTree<Key, Value, BlockSize>::splitRightNonLeaf1(
     Node *node,
     Node *rightNode,
     int pos,
-    key_t k,
+    Key k,
     Node *leftChild,
     Node *rightChild)
 {
-    addNonLeafNode(rightNode);
-
     node->count = pos;
     rightNode->count = DEGREE - pos;
 
     // 将DEGREE - pos个key移动到右节点上
     memmove(
-        &key(rightNode)[0], &key(node)[pos], rightNode->count * sizeof(key_t));
-
-    // 右节点个数必大于2
-    assert(rightNode->count > 2);
+        &key(rightNode)[0], &key(node)[pos], rightNode->count * sizeof(Key));
 
+    // 除第一个和最后一个(lastOffset)外,中间的子节点右移
     memmove(
         subNode(rightNode, 1),
         subNode(node, pos + 1),
-        (rightNode->count - 2) * sizeof(off_t));
+        (rightNode->count - 1) * sizeof(PageId));
 
     // 左右子节点
     *subNode(node, pos) = leftChild->self;
@@ -1003,20 +2821,18 @@ key_t BPlusTree::splitRightNonLeaf1(
 }
 
 // 非叶子节点右分裂(pos > split)
-key_t BPlusTree::splitRightNonLeaf2(
+template <typename Key, typename Value, int BlockSize>
+Key BPlusTree<Key, Value, BlockSize>::splitRightNonLeaf2(
     Node *node,
     Node *rightNode,
     int pos,
-    key_t k,
+    Key k,
     Node *leftChild,
     Node *rightChild)
 {
     int split = DEGREE / 2;         // 分裂节点在左节点的位置
     int rightPos = pos - split - 1; // 插入节点在右节点的位置
 
-    // 为新节点分配磁盘空间
-    appendBlock(rightNode);
-
     node->count = split;
     rightNode->count = DEGREE - split;
 
@@ -1025,22 +2841,22 @@ key_t BPlusTree::splitRightNonLeaf2(
         memmove(
             &key(rightNode)[0],
             &key(node)[split + 1],
-            (rightPos) * sizeof(key_t));
+            (rightPos) * sizeof(Key));
         memmove(
             subNode(rightNode, 0),
             subNode(node, split + 1),
-            (rightPos) * sizeof(off_t));
+            (rightPos) * sizeof(PageId));
     }
 
     memmove(
         &key(rightNode)[rightPos + 1],
         &key(node)[pos],
-        (DEGREE - pos) * sizeof(key_t));
+        (DEGREE - pos) * sizeof(Key));
     if (pos < DEGREE - 1)
         memmove(
             subNode(rightNode, rightPos + 2),
             subNode(node, pos + 1),
-            (DEGREE - pos - 1) * sizeof(off_t));
+            (DEGREE - pos - 1) * sizeof(PageId));
     *subNode(rightNode, rightNode->count) = node->lastOffset;
 
     // 处理新插入节点的key和subNode
@@ -1055,7 +2871,685 @@ key_t BPlusTree::splitRightNonLeaf2(
     return key(node)[split];
 }
 
-void BPlusTree::removeNode(Node *node, Node *left, Node *right)
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::batchOpLess(
+    const BatchOp &a,
+    const BatchOp &b)
+{
+    return a.key < b.key;
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::locateLeaf(
+    Key k,
+    Key *upper,
+    bool *bounded)
+{
+    Node *node = locateNode(root_);
+
+    // 清空traceNode_
+    traceNode_.clear();
+    *bounded = false;
+
+    while (node != NULL && !isLeaf(node)) {
+        // 记录父节点偏移
+        traceNode_.push_back(node->self);
+
+        int pos = searchInNode(node, k);
+        pos = pos >= 0 ? pos + 1 : -pos - 1;
+
+        // 越往下层,上界越紧
+        if (pos < node->count) {
+            *upper = nodeKey(node, pos);
+            *bounded = true;
+        }
+        node = locateNode(*subNode(node, pos));
+    }
+    return node;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::mergeBatchIntoLeaf(
+    Node *leaf,
+    const BatchOp *ops,
+    int n)
+{
+    int count = leaf->count;
+    int changed = 0;
+    int p = 0;
+
+    // 压缩叶子先解码
+    bool packed = packedPath(leaf);
+    const Key *oldKeys = key(leaf);
+    const Value *oldValues = data(leaf);
+    Key decodedKeys[PACKED_DEGREE];
+    Value decodedValues[PACKED_DEGREE];
+    if (leaf->type == BPLUS_TREE_LEAF_PACKED) {
+        decodeLeaf(leaf, decodedKeys, decodedValues);
+        oldKeys = decodedKeys;
+        oldValues = decodedValues;
+    }
+
+    // 先计算合并后的个数
+    for (int i = 0; i < n; i++) {
+        while (p < leaf->count && oldKeys[p] < ops[i].key)
+            p++;
+        bool found = p < leaf->count && oldKeys[p] == ops[i].key;
+
+        if (ops[i].remove) {
+            if (found) count--, changed++;
+        } else {
+            if (!found) count++;
+            changed++;
+        }
+    }
+    if (changed == 0) return S_OK;
+
+    // 与removeLeaf相同,非root叶子删除后不能少于leafMin_
+    // 压缩叶子没有最少key数,但不能为空
+    int minCount = 1;
+    if (!traceNode_.empty() && !packed)
+        minCount = std::min(leaf->count, leafMin_);
+    if (count > (packed ? PACKED_DEGREE : DEGREE) || count < minCount)
+        return S_FALSE;
+
+    // 有序合并
+    Key keys[PACKED_DEGREE];
+    Value values[PACKED_DEGREE];
+    int m = 0;
+    p = 0;
+    for (int i = 0; i < n; i++) {
+        while (p < leaf->count && oldKeys[p] < ops[i].key) {
+            keys[m] = oldKeys[p];
+            values[m++] = oldValues[p++];
+        }
+        if (p < leaf->count && oldKeys[p] == ops[i].key) p++;
+
+        if (!ops[i].remove) {
+            keys[m] = ops[i].key;
+            values[m++] = ops[i].value;
+        }
+    }
+    while (p < leaf->count) {
+        keys[m] = oldKeys[p];
+        values[m++] = oldValues[p++];
+    }
+    assert(m == count);
+
+    // 重新编码后放不下时逐个修改(分裂)
+    if (storeLeaf(leaf, keys, values, count) != S_OK) return S_FALSE;
+
+    // 叶子只写回一次
+    cacheOccupy(leaf);
+    blockFlush(leaf);
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::applyBatchOp(const BatchOp &op)
+{
+    Key upper;
+    bool bounded;
+    Node *leaf = locateLeaf(op.key, &upper, &bounded);
+
+    // 不引起分裂与合并的修改直接在叶子中完成
+    if (leaf != NULL && mergeBatchIntoLeaf(leaf, &op, 1) == S_OK) return S_OK;
+
+    if (op.remove) return removeLocked(op.key);
+    return insertLocked(op.key, op.value, true);
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::bulkLoad(
+    BulkReader reader,
+    void *arg,
+    double fillFactor)
+{
+    if (fillFactor <= 0 || fillFactor > 1) return S_FALSE;
+
+    // 只能对空树批量建树
+    lockTree(true);
+    if (root_ != INVALID_OFFSET) {
+        unlockTree();
+        return S_FALSE;
+    }
+
+    // 批量建树直接写入索引文件,不经过日志: 之前的修改先写回,
+    // 建树完成后同步,中途崩溃则仍是空树
+    if (wal_ != NULL && checkpoint() != S_OK) {
+        unlockTree();
+        return S_FALSE;
+    }
+
+    // 叶子节点至少1个key,非叶子节点至少2个子节点
+    int leafFill = (int) (DEGREE * fillFactor);
+    int nonLeafFill = (int) ((DEGREE + 1) * fillFactor);
+    if (leafFill < 1) leafFill = 1;
+    if (nonLeafFill < 2) nonLeafFill = 2;
+
+    // 空树中超级块和位图之外的block均为空闲,从位图之后开始顺序分配,
+    // 之前的空闲块留给之后的修改
+    off_t start = mapPage_ + mapPages_;
+    resizeFile(0);
+    resizeFile(start);
+    space_.mark(0);
+    for (off_t page = mapPage_; page < start; page++) space_.mark(page);
+
+    BulkBuffer buf;
+    buf.blocks = (char *) BufferPool::allocAligned(BULK_WRITE_SIZE);
+    buf.used = 0;
+    buf.start = fileOffset(start);
+
+    std::vector<BulkEntry> entries;
+    int ret = compress_
+                  ? bulkLoadPackedLeaves(&buf, reader, arg, fillFactor, entries)
+                  : bulkLoadLeaves(&buf, reader, arg, leafFill, entries);
+    if (ret == S_OK) {
+        // 自底向上逐层建立非叶子节点,直到只剩root
+        while (entries.size() > 1)
+            bulkLoadNonLeaves(&buf, nonLeafFill, entries);
+
+        bulkFlush(&buf, buf.used);
+        if (!entries.empty()) root_ = entries[0].offset;
+        fetchRootBlock();
+    } else {
+        // 已写入的block作废
+        resizeFile(start);
+    }
+
+    free(buf.blocks);
+
+    if (wal_ != NULL && checkpoint() != S_OK) ret = S_FALSE;
+    unlockTree();
+    return ret;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::bulkLoad(
+    const Key *keys,
+    const Value *values,
+    size_t n,
+    double fillFactor)
+{
+    BulkArray array = {keys, values, n};
+
+    return bulkLoad(arrayReader, &array, fillFactor);
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::arrayReader(
+    Key *key,
+    Value *value,
+    void *arg)
+{
+    BulkArray *array = (BulkArray *) arg;
+
+    if (array->n == 0) return false;
+
+    *key = *array->keys++;
+    *value = *array->values++;
+    array->n--;
+    return true;
+}
+
+// arg为long[2]表示的闭区间, value与key相同
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::rangeReader(
+    Key *key,
+    Value *value,
+    void *arg)
+{
+    long *range = (long *) arg;
+    if (range[0] > range[1]) return false;
+
+    *key = (Key) range[0];
+    *value = (Value) range[0];
+    range[0]++;
+    return true;
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::bulkNewNode(BulkBuffer *buf, short type)
+{
+    // 缓冲已满,保留最后一个块(叶子层收尾时可能还要修改)
+    if ((buf->used + 1) * (size_t) BlockSize > BULK_WRITE_SIZE)
+        bulkFlush(buf, buf->used - 1);
+
+    Node *node = (Node *) (buf->blocks + buf->used * BlockSize);
+    memset(node, 0, BlockSize);
+    node->self = buf->start / BlockSize + buf->used;
+    node->prev = INVALID_OFFSET;
+    node->next = INVALID_OFFSET;
+    node->lastOffset = INVALID_OFFSET;
+    node->type = type;
+    node->count = 0;
+    buf->used++;
+
+    // 顺序分配block
+    assert(fileOffset(node->self) == fileSize_);
+    resizeFile(node->self + 1);
+    space_.mark(node->self);
+
+    return node;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::bulkFlush(BulkBuffer *buf, int n)
+{
+    if (n <= 0) return;
+
+    // 一次写入连续的n个块
+    size_t len = (size_t) n * BlockSize;
+    for (int i = 0; i < n; i++)
+        BufferPool::seal(buf->blocks + (size_t) i * BlockSize, BlockSize);
+    int ret = pwrite(fd_, buf->blocks, len, buf->start);
+    assert(ret == (int) len);
+
+    memmove(buf->blocks, buf->blocks + len, (buf->used - n) * BlockSize);
+    buf->used -= n;
+    buf->start += len;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::bulkLoadLeaves(
+    BulkBuffer *buf,
+    BulkReader reader,
+    void *arg,
+    int fill,
+    std::vector<BulkEntry> &entries)
+{
+    Key k;
+    Value value;
+    Node *leaf = NULL;
+
+    while (reader(&k, &value, arg)) {
+        // key必须严格递增
+        if (leaf != NULL && !(key(leaf)[leaf->count - 1] < k)) return S_FALSE;
+
+        // 当前叶子已满,顺序分配下一个叶子
+        if (leaf == NULL || leaf->count == fill) {
+            leaf = bulkNewNode(buf, BPLUS_TREE_LEAF);
+            if (!entries.empty()) {
+                // 前一个叶子仍在缓冲中
+                Node *prev = (Node *) ((char *) leaf - BlockSize);
+                prev->next = leaf->self;
+                leaf->prev = prev->self;
+            }
+            entries.push_back(BulkEntry{k, leaf->self});
+        }
+
+        key(leaf)[leaf->count] = k;
+        data(leaf)[leaf->count] = value;
+        leaf->count++;
+    }
+
+    // 最后一个叶子未满,则与前一个叶子平分
+    if (entries.size() > 1 && leaf->count < fill) {
+        Node *prev = (Node *) ((char *) leaf - BlockSize);
+        int move = (prev->count - leaf->count) / 2;
+
+        memmove(&key(leaf)[move], &key(leaf)[0], leaf->count * sizeof(Key));
+        memmove(
+            &data(leaf)[move], &data(leaf)[0], leaf->count * sizeof(Value));
+        memcpy(
+            &key(leaf)[0], &key(prev)[prev->count - move], move * sizeof(Key));
+        memcpy(
+            &data(leaf)[0],
+            &data(prev)[prev->count - move],
+            move * sizeof(Value));
+
+        prev->count -= move;
+        leaf->count += move;
+        entries.back().key = key(leaf)[0];
+    }
+
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::bulkLoadPackedLeaves(
+    BulkBuffer *buf,
+    BulkReader reader,
+    void *arg,
+    double fillFactor,
+    std::vector<BulkEntry> &entries)
+{
+    // 编码后的大小与key数都不超过填充率,每个叶子至少1个key
+    int fillBytes = std::max((int) (PACKED_CAPACITY * fillFactor), 1);
+    int fill = std::max((int) (PACKED_DEGREE * fillFactor), 1);
+
+    Key keys[PACKED_DEGREE];
+    Value values[PACKED_DEGREE];
+    int n = 0;
+    int dataBytes = 0; // 当前叶子中差值的字节数
+    Key k;
+    Value value;
+    Node *leaf = NULL;
+
+    while (reader(&k, &value, arg)) {
+        // key必须严格递增
+        if (leaf != NULL && !(keys[n - 1] < k)) return S_FALSE;
+
+        uint64_t prevKey = n > 0 ? Codec::keyBits(keys[n - 1]) : 0;
+        uint64_t prevValue = n > 0 ? Codec::valueBits(values[n - 1]) : 0;
+        int bytes = Codec::entryBytes(
+            prevKey, Codec::keyBits(k), prevValue, Codec::valueBits(value));
+
+        // 当前叶子已满,编码后顺序分配下一个叶子
+        bool full = n == fill
+                    || Codec::size(n + 1, dataBytes + bytes) > fillBytes;
+        if (leaf != NULL && full) {
+            int ret = storeLeaf(leaf, keys, values, n);
+            assert(ret == S_OK);
+            leaf = NULL;
+        }
+
+        if (leaf == NULL) {
+            leaf = bulkNewNode(buf, BPLUS_TREE_LEAF);
+            if (!entries.empty()) {
+                // 前一个叶子仍在缓冲中
+                Node *prev = (Node *) ((char *) leaf - BlockSize);
+                prev->next = leaf->self;
+                leaf->prev = prev->self;
+            }
+            entries.push_back(BulkEntry{k, leaf->self});
+
+            n = 0;
+            dataBytes = 0;
+            bytes = Codec::entryBytes(
+                0, Codec::keyBits(k), 0, Codec::valueBits(value));
+        }
+
+        keys[n] = k;
+        values[n++] = value;
+        dataBytes += bytes;
+    }
+
+    // 压缩叶子没有最少key数,最后一个叶子不需要平分
+    if (leaf != NULL) {
+        int ret = storeLeaf(leaf, keys, values, n);
+        assert(ret == S_OK);
+    }
+    return S_OK;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::bulkLoadNonLeaves(
+    BulkBuffer *buf,
+    int fill,
+    std::vector<BulkEntry> &entries)
+{
+    // 子节点数为n,平均分到m个节点中,每个节点至少2个子节点
+    size_t n = entries.size();
+    size_t m = (n + fill - 1) / fill;
+    if (n / m < 2) m = n / 2;
+
+    std::vector<BulkEntry> parents;
+    parents.reserve(m);
+
+    size_t child = 0;
+    for (size_t i = 0; i < m; i++) {
+        int children = n / m + (i < n % m ? 1 : 0);
+        Node *node = bulkNewNode(buf, BPLUS_TREE_NON_LEAF);
+
+        // 第一个子节点没有对应的key
+        *subNode(node, 0) = entries[child].offset;
+        for (int j = 1; j < children; j++) {
+            key(node)[j - 1] = entries[child + j].key;
+            *subNode(node, j) = entries[child + j].offset;
+        }
+        node->count = children - 1;
+        packNode(node);
+
+        parents.push_back(BulkEntry{entries[child].key, node->self});
+        child += children;
+    }
+
+    entries.swap(parents);
+}
+
+template <typename Key, typename Value, int BlockSize>
+Node *BPlusTree<Key, Value, BlockSize>::tracePage(
+    const Key *k,
+    off_t page,
+    Key *upper,
+    bool *bounded)
+{
+    Node *node = locateNode(root_);
+
+    traceNode_.clear();
+    *bounded = false;
+
+    while (node != NULL && node->self != page) {
+        if (isLeaf(node)) return page == INVALID_OFFSET ? node : NULL;
+
+        // 记录父节点偏移
+        traceNode_.push_back(node->self);
+
+        int pos = 0;
+        if (k != NULL) {
+            pos = searchInNode(node, *k);
+            pos = pos >= 0 ? pos + 1 : -pos - 1;
+        }
+        if (pos < node->count) {
+            *upper = nodeKey(node, pos);
+            *bounded = true;
+        }
+        node = locateNode(*subNode(node, pos));
+    }
+    return node;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::tracePage(off_t page)
+{
+    // 节点中的key一定落在它的范围内,空节点只能沿最左的路径查找
+    Node *node = locateNode(page);
+    if (node == NULL) return false;
+    Key k;
+    bool empty = node->count == 0;
+    if (!empty) k = nodeKey(node, 0);
+
+    Key upper;
+    bool bounded;
+    return tracePage(empty ? NULL : &k, page, &upper, &bounded) != NULL;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::moveNode(off_t page, off_t to)
+{
+    // 会修改的节点读取失败时不移动
+    Node *node = locateNode(page);
+    if (node == NULL) return false;
+    bool leaf = isLeaf(node);
+    off_t prev = node->prev;
+    off_t next = node->next;
+    if (!traceNode_.empty() && !readable(traceNode_.back())) return false;
+    if (leaf && (!readable(prev) || !readable(next))) return false;
+
+    node = refetchBlock(page);
+    Node *copy = allocBlock(to);
+    memcpy(copy, node, BlockSize);
+    copy->self = to;
+
+    // 父节点指向新的块
+    if (traceNode_.empty()) {
+        root_ = to;
+    } else {
+        Node *parent = refetchBlock(traceNode_.back());
+        for (int i = 0; i <= parent->count; i++) {
+            if (*subNode(parent, i) == page) {
+                *subNode(parent, i) = to;
+                break;
+            }
+        }
+        blockFlush(parent);
+    }
+
+    // 相邻的叶子指向新的块
+    if (isLeaf(copy)) {
+        if (copy->prev != INVALID_OFFSET) {
+            Node *prev = refetchBlock(copy->prev);
+            prev->next = to;
+            blockFlush(prev);
+        }
+        if (copy->next != INVALID_OFFSET) {
+            Node *next = refetchBlock(copy->next);
+            next->prev = to;
+            blockFlush(next);
+        }
+    }
+    blockFlush(copy);
+
+    // 回收原来的块
+    unappendBlock(node);
+    cacheDefer(node);
+    return true;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::compactLeaf()
+{
+    Key upper;
+    bool bounded;
+    const Key *k = compactFirst_ ? NULL : &compactKey_;
+    Node *leaf = tracePage(k, INVALID_OFFSET, &upper, &bounded);
+    if (leaf == NULL) {
+        compactPhase_ = COMPACT_TAIL;
+        return 0;
+    }
+    int steps = 1;
+
+    // 删除时留下的过小叶子先合并,合并后的叶子在下一步继续整理
+    if (compactMerge(leaf->self)) return steps;
+
+    // 跳过位图所在的块
+    off_t target = compactPage_;
+    if (target >= mapPage_ && target < mapPage_ + mapPages_)
+        target = mapPage_ + mapPages_;
+
+    off_t page = leaf->self;
+    if (page != target && target < space_.pages()) {
+        if (space_.used(target)) {
+            // 无法定位占用目标块的节点时跳过该块
+            if (!tracePage(target)) {
+                compactPage_ = target + 1;
+                return steps;
+            }
+            off_t to = space_.lowest();
+            if (to == FreeSpace::NONE) to = space_.pages();
+            if (!moveNode(target, to)) {
+                compactPage_ = target + 1;
+                return steps;
+            }
+            steps++;
+
+            // 叶子的父节点可能刚被移走
+            if (tracePage(k, INVALID_OFFSET, &upper, &bounded) == NULL)
+                return steps;
+        }
+        // 无法移动时叶子留在原处
+        if (moveNode(page, target)) {
+            steps++;
+            page = target;
+        }
+    }
+    // 叶子不在目标块时(目标块超出文件),下一个叶子仍以它为目标
+    compactPage_ = page == target ? target + 1 : target;
+
+    if (bounded) {
+        compactKey_ = upper;
+        compactFirst_ = false;
+    } else {
+        compactPhase_ = COMPACT_TAIL;
+    }
+    return steps;
+}
+
+template <typename Key, typename Value, int BlockSize>
+bool BPlusTree<Key, Value, BlockSize>::compactMerge(off_t page)
+{
+    if (traceNode_.empty()) return false;
+
+    // 读取失败的节点不合并
+    Node *node = locateNode(page);
+    if (node == NULL || node->count == 0 || node->next == INVALID_OFFSET)
+        return false;
+    Key k = nodeKey(node, 0);
+    off_t next = node->next;
+    bool packed = packedPath(node);
+    int count = node->count;
+
+    // 右边的叶子需在同一父节点下
+    Node *parent = locateNode(traceNode_.back());
+    if (parent == NULL) return false;
+    int ppos = searchInNode(parent, k);
+    if (ppos < 0) ppos = -ppos - 2;
+    if (ppos + 1 >= parent->count) return false;
+
+    // 合并后至多3/4满,之后的插入不会马上分裂
+    Node *right = locateNode(next);
+    if (right == NULL) return false;
+    packed = packed || packedPath(right);
+    count += right->count;
+    if (count > (packed ? PACKED_DEGREE : DEGREE * 3 / 4)) return false;
+    if (!mergeReadable(INVALID_OFFSET, next)) return false;
+
+    parent = refetchBlock(traceNode_.back());
+    node = refetchBlock(page);
+    right = refetchBlock(next);
+
+    if (packed) {
+        Key keys[2 * PACKED_DEGREE];
+        Value values[2 * PACKED_DEGREE];
+        int n = decodeLeaf(node, keys, values);
+        n += decodeLeaf(right, keys + n, values + n);
+        if (Codec::size(keys, values, n) > PACKED_CAPACITY * 3 / 4
+            || storeLeaf(node, keys, values, n) != S_OK) {
+            cacheDefer(parent);
+            cacheDefer(node);
+            cacheDefer(right);
+            return false;
+        }
+    } else {
+        mergeLeafWithRight(node, right);
+    }
+
+    // 与removeLeaf中right合并到node相同
+    traceNode_.pop_back();
+    removeNode(right, node, refetchBlock(right->next));
+    removeInNonLeaf(parent, ppos + 1);
+    return true;
+}
+
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::compactTail()
+{
+    // 最后一个节点(不计位图)
+    off_t last = space_.usedEnd() - 1;
+    while (last > 0
+           && (!space_.used(last)
+               || (last >= mapPage_ && last < mapPage_ + mapPages_)))
+        last--;
+
+    off_t hole = space_.lowest();
+    if (last <= 0 || hole == FreeSpace::NONE || hole > last
+        || !tracePage(last)) {
+        compactPhase_ = COMPACT_DONE;
+        return 0;
+    }
+    if (!moveNode(last, hole)) {
+        compactPhase_ = COMPACT_DONE;
+        return 0;
+    }
+    return 1;
+}
+
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::removeNode(
+    Node *node,
+    Node *left,
+    Node *right)
 {
     // 处理叶子节点的前后关系
     if (isLeaf(node)) {
@@ -1080,19 +3574,22 @@ void BPlusTree::removeNode(Node *node, Node *left, Node *right)
 
     // 回收block
     unappendBlock(node);
-    if (node->self != root_) cacheDefer(node);
+    cacheDefer(node);
 }
 
-int BPlusTree::removeLeaf(Node *node, key_t k)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::removeLeaf(Node *node, Key k)
 {
     int pos = searchInNode(node, k);
 
     // 不存在
     if (pos < 0) return S_FALSE;
 
+    if (packedPath(node)) return removePackedLeaf(node, pos, k, true);
+
     cacheOccupy(node);
 
-    // 没有父节点,即当前节点为root NOTE:node == rootCache_
+    // 没有父节点,即当前节点为root
     if (traceNode_.empty()) {
         // 只有一个成员,清空树
         if (node->count == 1) {
@@ -1106,13 +3603,28 @@ int BPlusTree::removeLeaf(Node *node, key_t k)
             blockFlush(node);
         }
     } // node会与其他节点合并或借数据
-    else if (node->count <= (DEGREE + 1) / 2) {
+    else if (node->count <= leafMin_) {
         // 分情况讨论删除
 
+        // 左右节点一次预读
+        off_t siblings[2];
+        int n = 0;
+        if (node->prev != INVALID_OFFSET)
+            siblings[n++] = fileOffset(node->prev);
+        if (node->next != INVALID_OFFSET)
+            siblings[n++] = fileOffset(node->next);
+        pool_->prefetch(siblings, n);
+
+        // 借数据或合并会修改的节点读取失败时不做修改
+        if (!mergeReadable(node->prev, node->next)) {
+            cacheDefer(node);
+            return S_ERROR;
+        }
+
         // 取出该节点的左右节点和父节点
-        Node *parent = fetchBlock(traceNode_.back());
-        Node *left = fetchBlock(node->prev);
-        Node *right = fetchBlock(node->next);
+        Node *parent = refetchBlock(traceNode_.back());
+        Node *left = refetchBlock(node->prev);
+        Node *right = refetchBlock(node->next);
 
         //  父节点出栈
         traceNode_.pop_back();
@@ -1121,10 +3633,26 @@ int BPlusTree::removeLeaf(Node *node, key_t k)
         int ppos = searchInNode(parent, k);
         if (ppos < 0) ppos = -ppos - 2;
 
+        // 相邻的压缩叶子不能按普通格式转移或合并
+        if ((left != NULL && left->type == BPLUS_TREE_LEAF_PACKED)
+            || (right != NULL && right->type == BPLUS_TREE_LEAF_PACKED)) {
+            simpleRemoveInLeaf(node, pos);
+            mergePackedLeaf(
+                node,
+                key(node),
+                data(node),
+                node->count,
+                parent,
+                left,
+                right,
+                ppos);
+            return S_OK;
+        }
+
         // 根据左右节点情况来选择
         if (selectNode(parent, left, right, ppos) == LEFT_NODE) {
             // 若left右足够多的数据,则分一个给node
-            if (left->count > (DEGREE + 1) / 2) {
+            if (left->count > leafMin_) {
                 // 从left转移一位数据到node
                 shiftLeafFromLeft(node, left, parent, ppos, pos);
 
@@ -1147,7 +3675,7 @@ int BPlusTree::removeLeaf(Node *node, key_t k)
             simpleRemoveInLeaf(node, pos);
 
             // 若right节点有足够多的数据,分一个给node
-            if (right->count > (DEGREE + 1) / 2) {
+            if (right->count > leafMin_) {
                 shiftLeafFromRight(node, right, parent, ppos + 1, pos);
 
                 // 把更改刷回磁盘
@@ -1158,7 +3686,7 @@ int BPlusTree::removeLeaf(Node *node, key_t k)
             } else { // right合并到node
                 mergeLeafWithRight(node, right);
                 // 删除right节点
-                removeNode(right, node, fetchBlock(right->next));
+                removeNode(right, node, refetchBlock(right->next));
                 blockFlush(left);
                 // 删除parent的key,并向上更新
                 removeInNonLeaf(parent, ppos + 1);
@@ -1173,7 +3701,8 @@ int BPlusTree::removeLeaf(Node *node, key_t k)
     return S_OK;
 }
 
-void BPlusTree::simpleRemoveInLeaf(Node *node, int pos)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::simpleRemoveInLeaf(Node *node, int pos)
 {
     // 节点数减1
     node->count--;
@@ -1182,15 +3711,20 @@ void BPlusTree::simpleRemoveInLeaf(Node *node, int pos)
         memmove(
             &key(node)[pos],
             &key(node)[pos + 1],
-            (node->count - pos) * sizeof(key_t));
+            (node->count - pos) * sizeof(Key));
         memmove(
             &data(node)[pos],
             &data(node)[pos + 1],
-            (node->count - pos) * sizeof(data_t));
+            (node->count - pos) * sizeof(Value));
     }
 }
 
-int BPlusTree::selectNode(Node *node, Node *left, Node *right, int pos)
+template <typename Key, typename Value, int BlockSize>
+int BPlusTree<Key, Value, BlockSize>::selectNode(
+    Node *node,
+    Node *left,
+    Node *right,
+    int pos)
 {
     // 若该节点是第一个子节点,则返回右节点
     if (pos == -1)
@@ -1204,7 +3738,8 @@ int BPlusTree::selectNode(Node *node, Node *left, Node *right, int pos)
 }
 
 // 从left移动最后一位到node
-void BPlusTree::shiftLeafFromLeft(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::shiftLeafFromLeft(
     Node *node,
     Node *left,
     Node *parent,
@@ -1212,8 +3747,8 @@ void BPlusTree::shiftLeafFromLeft(
     int pos)
 {
     if (pos != 0) {
-        memmove(&key(node)[1], &key(node)[0], pos * sizeof(key_t));
-        memmove(&data(node)[1], &data(node)[0], pos * sizeof(data_t));
+        memmove(&key(node)[1], &key(node)[0], pos * sizeof(Key));
+        memmove(&data(node)[1], &data(node)[0], pos * sizeof(Value));
     }
 
     key(node)[0] = key(left)[left->count - 1];
@@ -1225,24 +3760,29 @@ void BPlusTree::shiftLeafFromLeft(
 }
 
 // node合并到left
-void BPlusTree::mergeLeafIntoLeft(Node *node, Node *left, int pos)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::mergeLeafIntoLeft(
+    Node *node,
+    Node *left,
+    int pos)
 {
-    memmove(&key(left)[left->count], &key(node)[0], pos * sizeof(key_t));
-    memmove(&data(left)[left->count], &data(node)[0], pos * sizeof(data_t));
+    memmove(&key(left)[left->count], &key(node)[0], pos * sizeof(Key));
+    memmove(&data(left)[left->count], &data(node)[0], pos * sizeof(Value));
 
     left->count += pos;
     // 剩余从node到left的个数
     int rest = node->count - pos - 1;
 
-    memmove(&key(left)[left->count], &key(node)[pos + 1], rest * sizeof(key_t));
+    memmove(&key(left)[left->count], &key(node)[pos + 1], rest * sizeof(Key));
     memmove(
-        &data(left)[left->count], &data(node)[pos + 1], rest * sizeof(data_t));
+        &data(left)[left->count], &data(node)[pos + 1], rest * sizeof(Value));
 
     left->count += rest;
 }
 
 // 从right转移一位到node
-void BPlusTree::shiftLeafFromRight(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::shiftLeafFromRight(
     Node *node,
     Node *right,
     Node *parent,
@@ -1254,8 +3794,8 @@ void BPlusTree::shiftLeafFromRight(
     node->count++;
 
     right->count--;
-    memmove(&key(right)[0], &key(right)[1], right->count * sizeof(key_t));
-    memmove(&data(right)[0], &data(right)[1], right->count * sizeof(data_t));
+    memmove(&key(right)[0], &key(right)[1], right->count * sizeof(Key));
+    memmove(&data(right)[0], &data(right)[1], right->count * sizeof(Value));
 
     // 更新parent
     key(parent)[ppos] = key(right)[0];
@@ -1266,20 +3806,24 @@ void BPlusTree::shiftLeafFromRight(
 }
 
 // right合并到node
-void BPlusTree::mergeLeafWithRight(Node *node, Node *right)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::mergeLeafWithRight(
+    Node *node,
+    Node *right)
 {
     memmove(
-        &key(node)[node->count], &key(right)[0], right->count * sizeof(key_t));
+        &key(node)[node->count], &key(right)[0], right->count * sizeof(Key));
     memmove(
         &data(node)[node->count],
         &data(right)[0],
-        right->count * sizeof(data_t));
+        right->count * sizeof(Value));
 
     node->count += right->count;
 }
 
 // 删除非叶子节点
-void BPlusTree::removeInNonLeaf(Node *node, int pos)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::removeInNonLeaf(Node *node, int pos)
 {
     // node为root节点
     if (traceNode_.empty()) {
@@ -1288,38 +3832,37 @@ void BPlusTree::removeInNonLeaf(Node *node, int pos)
             assert(pos == 0);
             off_t nRoot = *subNode(node, 0);
             removeNode(node, NULL, NULL);
-            // 先删除node,后更新root_和rootCache_
+            // 先删除node,后更新root_
             root_ = nRoot;
-            fetchRootBlock();
         } else { // 删除一个key
             simpleRemoveInNonLeaf(node, pos);
             blockFlush(node);
         } // NOTE:这里是<,不是<=;
         // 非叶子节点中的key可以比叶子节点中的key还少一个,以下同理
-    } else if (node->count < (DEGREE + 1) / 2) {
+    } else if (node->count < nonLeafMin_) {
         // 记录node的父节点和左右节点
-        Node *parent = fetchBlock(traceNode_.back());
+        Node *parent = refetchBlock(traceNode_.back());
         Node *left, *right;
         traceNode_.pop_back();
 
         // NOTE:ppos可能为-1
         int ppos = searchInNode(parent, key(node)[pos]);
         if (ppos >= 0) {
-            left = fetchBlock(*subNode(parent, ppos));
-            right = fetchBlock(*subNode(parent, ppos + 2));
+            left = refetchBlock(*subNode(parent, ppos));
+            right = refetchBlock(*subNode(parent, ppos + 2));
         } else {
             // node在parent中的key
             int tppos = -ppos - 1;
             if (tppos <= 0) {
                 left = NULL;
-                right = fetchBlock(*subNode(parent, tppos + 1));
+                right = refetchBlock(*subNode(parent, tppos + 1));
             } else if (tppos >= parent->count) {
                 right = NULL;
-                left = fetchBlock(*subNode(parent, tppos - 1));
+                left = refetchBlock(*subNode(parent, tppos - 1));
 
             } else {
-                left = fetchBlock(*subNode(parent, tppos - 1));
-                right = fetchBlock(*subNode(parent, tppos + 1));
+                left = refetchBlock(*subNode(parent, tppos - 1));
+                right = refetchBlock(*subNode(parent, tppos + 1));
             }
             ppos = -ppos - 2;
         }
@@ -1327,7 +3870,7 @@ void BPlusTree::removeInNonLeaf(Node *node, int pos)
         // 选择左右节点
         if (selectNode(parent, left, right, ppos) == LEFT_NODE) {
             // left有足够多的数据,则分一个给node
-            if (left->count >= (DEGREE + 1) / 2) {
+            if (left->count >= nonLeafMin_) {
                 // 非叶子节点向左转移一位
                 shiftNonLeafFromLeft(node, left, parent, ppos, pos);
 
@@ -1354,7 +3897,7 @@ void BPlusTree::removeInNonLeaf(Node *node, int pos)
             simpleRemoveInNonLeaf(node, pos);
 
             // 若right节点右足够多的数据,向左移动一位
-            if (right->count >= (DEGREE + 1) / 2) {
+            if (right->count >= nonLeafMin_) {
                 shiftNonLeafFromRight(node, right, parent, ppos + 1, pos);
 
                 // 把修改刷回磁盘
@@ -1384,12 +3927,15 @@ void BPlusTree::removeInNonLeaf(Node *node, int pos)
 }
 
 // 在node中删除第pos个数据
-void BPlusTree::simpleRemoveInNonLeaf(Node *node, int pos)
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::simpleRemoveInNonLeaf(
+    Node *node,
+    int pos)
 {
     int rest = node->count - pos - 1;
     // 当pos == node->count-1时,无需移动数据
     if (rest > 0) {
-        memmove(&key(node)[pos], &key(node)[pos + 1], rest * sizeof(key_t));
+        memmove(&key(node)[pos], &key(node)[pos + 1], rest * sizeof(Key));
 
         // 移动subNode时,需注意lastOffset
         if (node->count == DEGREE) // 使用了lastOffset
@@ -1397,31 +3943,32 @@ void BPlusTree::simpleRemoveInNonLeaf(Node *node, int pos)
             memmove(
                 subNode(node, pos + 1),
                 subNode(node, pos + 2),
-                (rest - 1) * sizeof(off_t));
+                (rest - 1) * sizeof(PageId));
 
             *subNode(node, node->count - 1) = *subNode(node, node->count);
         } else { // 未使用lastOffset
             memmove(
                 subNode(node, pos + 1),
                 subNode(node, pos + 2),
-                rest * sizeof(off_t));
+                rest * sizeof(PageId));
         }
     }
     node->count--;
 }
 
 // 非叶子节点 left->parent parent->node
-void BPlusTree::shiftNonLeafFromLeft(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::shiftNonLeafFromLeft(
     Node *node,
     Node *left,
     Node *parent,
     int ppos,
     int pos)
 {
-    // node->count < (DEGREE + 1) / 2; 未使用lastOffset
+    // node->count < nonLeafMin_; 未使用lastOffset
 
-    memmove(&key(node)[1], &key(node)[0], pos * sizeof(key_t));
-    memmove(subNode(node, 1), subNode(node, 0), (pos + 1) * sizeof(off_t));
+    memmove(&key(node)[1], &key(node)[0], pos * sizeof(Key));
+    memmove(subNode(node, 1), subNode(node, 0), (pos + 1) * sizeof(PageId));
 
     key(node)[0] = key(parent)[ppos];
     key(parent)[ppos] = key(left)[left->count - 1];
@@ -1433,7 +3980,8 @@ void BPlusTree::shiftNonLeafFromLeft(
 }
 
 // node合并到left parent->left node->left
-void BPlusTree::mergeNonLeafIntoLeft(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::mergeNonLeafIntoLeft(
     Node *node,
     Node *left,
     Node *parent,
@@ -1444,30 +3992,31 @@ void BPlusTree::mergeNonLeafIntoLeft(
     key(left)[left->count] = key(parent)[ppos];
     left->count++;
 
-    memmove(&key(left)[left->count], &key(node)[0], pos * sizeof(key_t));
+    memmove(&key(left)[left->count], &key(node)[0], pos * sizeof(Key));
     memmove(
         subNode(left, left->count),
         subNode(node, 0),
-        (pos + 1) * sizeof(off_t));
+        (pos + 1) * sizeof(PageId));
     left->count += pos;
 
     // node中除去删除的key,剩余需要转移到left中的key的数量
     int rest = node->count - pos - 1;
     if (rest > 0) {
         memmove(
-            &key(left)[left->count], &key(node)[pos + 1], rest * sizeof(key_t));
+            &key(left)[left->count], &key(node)[pos + 1], rest * sizeof(Key));
         // 不会涉及lastOffset
         memmove(
             subNode(left, left->count + 1),
             subNode(node, pos + 2),
-            rest * sizeof(off_t));
+            rest * sizeof(PageId));
 
         left->count += rest;
     }
 }
 
 // 非叶子节点 向左移动一位 parent->node right->parent
-void BPlusTree::shiftNonLeafFromRight(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::shiftNonLeafFromRight(
     Node *node,
     Node *right,
     Node *parent,
@@ -1481,22 +4030,25 @@ void BPlusTree::shiftNonLeafFromRight(
     node->count++;
     right->count--;
 
-    memmove(&key(right)[0], &key(right)[1], right->count * sizeof(key_t));
+    memmove(&key(right)[0], &key(right)[1], right->count * sizeof(Key));
     // 注意lastOffset
     if (right->count + 1 == DEGREE) {
         memmove(
-            subNode(right, 0), subNode(right, 1), right->count * sizeof(off_t));
+            subNode(right, 0),
+            subNode(right, 1),
+            right->count * sizeof(PageId));
         *subNode(right, right->count) = right->lastOffset;
     } else {
         memmove(
             subNode(right, 0),
             subNode(right, 1),
-            (right->count + 1) * sizeof(off_t));
+            (right->count + 1) * sizeof(PageId));
     }
 }
 
 // right合并到node parent->node right->node
-void BPlusTree::mergeNonLeafWithRight(
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::mergeNonLeafWithRight(
     Node *node,
     Node *right,
     Node *parent,
@@ -1507,17 +4059,20 @@ void BPlusTree::mergeNonLeafWithRight(
     node->count++;
 
     memmove(
-        &key(node)[node->count], &key(right)[0], right->count * sizeof(key_t));
+        &key(node)[node->count], &key(right)[0], right->count * sizeof(Key));
     memmove(
         subNode(node, node->count),
         subNode(right, 0),
-        (right->count + 1) * sizeof(off_t));
+        (right->count + 1) * sizeof(PageId));
 
     node->count += right->count;
 }
 
 // 字符串转换为off_t
-off_t BPlusTree::pchar_2_off_t(const char *str, size_t size)
+template <typename Key, typename Value, int BlockSize>
+off_t BPlusTree<Key, Value, BlockSize>::pchar_2_off_t(
+    const char *str,
+    size_t size)
 {
     off_t ret = 0;
     size_t i;
@@ -1528,29 +4083,24 @@ off_t BPlusTree::pchar_2_off_t(const char *str, size_t size)
     return ret;
 }
 
-// off_t转换为字符串
-void BPlusTree::off_t_2_pchar(off_t offset, char *buf, int len)
-{
-    while (len-- > 0) {
-        buf[len] = offset & 0xff;
-        offset >>= 8;
-    }
-}
-
 // 打印所有叶子节点
-void BPlusTree::showLeaves()
+template <typename Key, typename Value, int BlockSize>
+void BPlusTree<Key, Value, BlockSize>::showLeaves()
 {
-    for (int i = 0; i < MAX_CACHE_NUM; i++)
-        printf("used_[%d] = %d\n", i, used_[i]);
+    printf("pinned = %d\n", pool_->pinnedNum());
 
     if (root_ == INVALID_OFFSET) return;
 
     Node *node = locateNode(root_);
 
     // 获取最左侧节点
-    while (!isLeaf(node)) {
+    while (node != NULL && !isLeaf(node)) {
         node = locateNode(*subNode(node, 0));
     }
+    if (node == NULL) {
+        printf("Unreadable block on the leftmost path.\n");
+        return;
+    }
 
     // 输出每个节点的key
     assert(node->prev == INVALID_OFFSET);
@@ -1559,12 +4109,20 @@ void BPlusTree::showLeaves()
     while (node != NULL) {
         printf("Line %d: ", line++);
         for (int i = 0; i < node->count; i++)
-            printf("%ld ", data(node)[i]);
+            printf("%ld ", (long) leafValue(node, i));
         printf("\n");
 
         node = locateNode(node->next);
     }
 
-    for (int i = 0; i < MAX_CACHE_NUM; i++)
-        printf("used_[%d] = %d\n", i, used_[i]);
-}
\ No newline at end of file
+    printf("pinned = %d\n", pool_->pinnedNum());
+    printf("cache hits = %ld, misses = %ld\n", pool_->hits(), pool_->misses());
+    printf("checksum errors = %ld\n", pool_->checksumErrors());
+}
+
+// 显式实例化. 32位与64位key的索引可以同时使用
+template class BPlusTree<int, int, 128>;
+template class BPlusTree<int, int, 4096>;
+template class BPlusTree<long, long, 128>;
+template class BPlusTree<long, long, 256>;
+template class BPlusTree<long, long, 4096>;
@@ -0,0 +1,948 @@
+/*
+ * @file BufferPool.cc
+ * @brief
+ * 缓冲池源文件
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "BufferPool.h"
+#include "Crc32c.h"
+#include "Wal.h"
+
+// 并发模式下持有缓冲池互斥锁的作用域,mutex为NULL时不加锁
+class PoolGuard
+{
+  private:
+    std::mutex *mutex_;
+
+  public:
+    PoolGuard(std::mutex *mutex) : mutex_(mutex)
+    {
+        if (mutex_ != NULL) mutex_->lock();
+    }
+    ~PoolGuard() { release(); }
+
+    // 提前释放
+    void release()
+    {
+        if (mutex_ != NULL) mutex_->unlock();
+        mutex_ = NULL;
+    }
+};
+
+BufferPool::BufferPool(
+    int fd,
+    int blockSize,
+    size_t cacheSize,
+    bool mapped)
+    : fd_(fd)
+    , blockSize_(blockSize)
+    , hand_(0)
+    , hints_(NULL)
+    , hintMask_(0)
+    , hits_(0)
+    , misses_(0)
+    , writes_(0)
+    , dirtyLimit_(0)
+    , dirtyNum_(0)
+    , checksum_(false)
+    , checksumErrors_(0)
+    , wal_(NULL)
+    , map_(NULL)
+    , mapped_(0)
+    , ring_(NULL)
+    , batch_(false)
+    , concurrent_(false)
+    , snapFd_(-1)
+    , snapshotNum_(0)
+    , nextSnapshot_(0)
+    , snapBuf_(NULL)
+{
+    if (mapped) {
+        // 预留一段连续的地址空间,文件增长时在其后继续映射,已有指针不会失效
+        void *p = mmap(
+            NULL,
+            MMAP_RESERVE,
+            PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1,
+            0);
+        assert(p != MAP_FAILED);
+        map_ = (char *) p;
+
+        struct stat st;
+        int ret = fstat(fd_, &st);
+        assert(ret == 0);
+        mapTo(ret == 0 ? st.st_size : 0);
+
+        frameNum_ = 0;
+        pages_ = NULL;
+        frames_ = NULL;
+        return;
+    }
+
+    frameNum_ = cacheSize / blockSize;
+    if (frameNum_ < MIN_FRAME_NUM) frameNum_ = MIN_FRAME_NUM;
+
+    pages_ = (char *) allocAligned((size_t) frameNum_ * blockSize_);
+    frames_ = (Frame *) malloc(frameNum_ * sizeof(Frame));
+    assert(pages_ != NULL && frames_ != NULL);
+
+    for (int i = 0; i < frameNum_; i++) {
+        frames_[i].offset = FREE_FRAME;
+        frames_[i].pinCount = 0;
+        frames_[i].usage = 0;
+        frames_[i].queued = false;
+        frames_[i].dirty = false;
+        frames_[i].loading = false;
+        pthread_rwlock_init(&frames_[i].latch, NULL);
+        frames_[i].version = 0;
+    }
+    pageTable_.reserve(frameNum_);
+    // 默认一半的缓存块可以是脏块
+    dirtyLimit_ = frameNum_ / 2;
+
+    // 不少于frame数两倍的2的幂,相邻的块落在不同的位置
+    size_t hintNum = 1;
+    while (hintNum < (size_t) frameNum_ * 2)
+        hintNum <<= 1;
+    hints_ = (int *) malloc(hintNum * sizeof(int));
+    assert(hints_ != NULL);
+    for (size_t k = 0; k < hintNum; k++)
+        hints_[k] = -1;
+    hintMask_ = hintNum - 1;
+}
+
+BufferPool::~BufferPool()
+{
+    if (map_ != NULL) munmap(map_, MMAP_RESERVE);
+    delete ring_;
+    for (int i = 0; i < frameNum_; i++)
+        pthread_rwlock_destroy(&frames_[i].latch);
+    free(frames_);
+    free(pages_);
+    free(hints_);
+    free(snapBuf_);
+}
+
+void *BufferPool::fetch(off_t offset)
+{
+    if (map_ != NULL) return lookup(offset);
+
+    PoolGuard guard(lock());
+    bool miss;
+    int i = frameFor(offset, &miss);
+    frames_[i].pinCount++;
+    if (!miss) {
+        if (!__atomic_load_n(&frames_[i].loading, __ATOMIC_RELAXED))
+            return pageOf(i);
+
+        // 其他线程正在读入,等它释放写锁; 读入失败时frame已不对应offset
+        guard.release();
+        pthread_rwlock_rdlock(&frames_[i].latch);
+        pthread_rwlock_unlock(&frames_[i].latch);
+        if (__atomic_load_n(&frames_[i].offset, __ATOMIC_RELAXED) == offset)
+            return pageOf(i);
+        unpin(pageOf(i));
+        return NULL;
+    }
+
+    if (!concurrent_) {
+        bool ok = readPage(offset, pageOf(i));
+        if (!ok) dropFrame(i);
+        endChange(frames_[i]);
+        return ok ? pageOf(i) : NULL;
+    }
+
+    // 读入期间持有块的写锁,不阻塞其他块的访问
+    frames_[i].loading = true;
+    pthread_rwlock_wrlock(&frames_[i].latch);
+    guard.release();
+    bool ok = readPage(offset, pageOf(i));
+    if (ok) {
+        __atomic_store_n(&frames_[i].loading, false, __ATOMIC_RELAXED);
+    } else {
+        PoolGuard again(lock());
+        dropFrame(i);
+    }
+    endChange(frames_[i]);
+    pthread_rwlock_unlock(&frames_[i].latch);
+    return ok ? pageOf(i) : NULL;
+}
+
+void *BufferPool::create(off_t offset)
+{
+    if (map_ != NULL) {
+        mapTo(offset + blockSize_);
+        return map_ + offset;
+    }
+
+    PoolGuard guard(lock());
+
+    // 新块不可能已在缓存中(回收时已丢弃)
+    assert(find(offset) < 0);
+
+    int i;
+    while ((i = allocFrame(offset)) < 0)
+        waitUnpin();
+    frames_[i].pinCount = 1;
+    // 新块只在修改结构时创建,由树的版本保护
+    endChange(frames_[i]);
+    return pageOf(i);
+}
+
+void *BufferPool::lookup(off_t offset)
+{
+    // 直接指向映射,没有复制
+    if (map_ != NULL) {
+        if (offset + blockSize_ > mapped_) mapTo(offset + blockSize_);
+        return map_ + offset;
+    }
+
+    // 与fetch同样读入(不在读入期间持有互斥锁),读入后即释放占用
+    void *page = fetch(offset);
+    if (page != NULL) unpin(page);
+    return page;
+}
+
+void BufferPool::pin(const void *page)
+{
+    if (map_ != NULL) return;
+
+    PoolGuard guard(lock());
+    frames_[frameOf(page)].pinCount++;
+}
+
+void BufferPool::unpin(const void *page)
+{
+    if (map_ != NULL) return;
+
+    PoolGuard guard(lock());
+    int i = frameOf(page);
+    assert(frames_[i].pinCount > 0);
+    if (--frames_[i].pinCount == 0 && concurrent_) unpinned_.notify_all();
+}
+
+int BufferPool::flush(const void *page)
+{
+    // 修改已在映射中,由内核写回
+    if (map_ != NULL) {
+        seal((char *) page);
+        return 0;
+    }
+
+    int i = frameOf(page);
+    assert(frames_[i].offset != FREE_FRAME);
+
+    // 只标记为脏,之后再写回; 并发模式下调用者持有块的写锁
+    if (wal_ == NULL && dirtyLimit_ > 0) {
+        PoolGuard guard(lock());
+        markDirty(i);
+        if (dirtyNum_ > dirtyLimit_ && writeBack(false) != 0) return -1;
+        return 0;
+    }
+
+    // 并发模式下没有日志与批量写回,调用者持有块的写锁,直接写入
+    preserve(frames_[i].offset);
+
+    // 只追加到日志,置换时直接丢弃,需要时从日志中读回
+    if (wal_ != NULL) {
+        seal((char *) page);
+        logged_[frames_[i].offset] = wal_->appendPage(frames_[i].offset, page);
+        return 0;
+    }
+
+    // 暂不写入,占用到批量写回结束(同一块只写一次)
+    if (batch_) {
+        if (!frames_[i].queued) {
+            frames_[i].queued = true;
+            frames_[i].pinCount++;
+            pending_.push_back(i);
+            if ((int) pending_.size() >= batchLimit()) flushPending();
+        }
+        return 0;
+    }
+
+    seal((char *) page);
+    int len = pwrite(fd_, page, blockSize_, frames_[i].offset);
+    if (len != blockSize_) return -1;
+    writes_++;
+    return 0;
+}
+
+void BufferPool::discard(off_t offset)
+{
+    // 回收后块可能被重用,快照需要回收前的镜像
+    preserve(offset);
+
+    PoolGuard guard(lock());
+
+    // 已回收的块无需在检查点写回
+    logged_.erase(offset);
+
+    int i = find(offset);
+    if (i < 0) return;
+
+    // 已回收的块不再写回
+    if (frames_[i].dirty) {
+        frames_[i].dirty = false;
+        dirtyNum_--;
+    }
+    if (frames_[i].queued) {
+        frames_[i].queued = false;
+        frames_[i].pinCount--;
+    }
+
+    // 占用者仍可访问该缓存,但它不再对应任何块
+    pageTable_.erase(offset);
+    beginChange(frames_[i]);
+    __atomic_store_n(&frames_[i].offset, FREE_FRAME, __ATOMIC_RELAXED);
+    frames_[i].usage = 0;
+    endChange(frames_[i]);
+}
+
+int BufferPool::checkpoint()
+{
+    if (map_ != NULL) return msync(map_, mapped_, MS_SYNC);
+    if (dirtyNum_ > 0) {
+        PoolGuard guard(lock());
+        if (writeBack(true) != 0) return -1;
+    }
+    if (logged_.empty()) return fdatasync(fd_);
+
+    // 按偏移排序,尽量顺序写
+    std::vector<std::pair<off_t, off_t>> pages(logged_.begin(), logged_.end());
+    std::sort(pages.begin(), pages.end());
+
+    // 每次提交RING_DEPTH个块
+    char *bufs = (char *) allocAligned((size_t) RING_DEPTH * blockSize_);
+    IoRing::Request reqs[RING_DEPTH];
+    for (size_t k = 0; k < pages.size(); k += RING_DEPTH) {
+        int n = 0;
+        for (size_t j = k; j < pages.size() && j < k + RING_DEPTH; j++, n++) {
+            off_t offset = pages[j].first;
+            int i = find(offset);
+
+            // 缓存中的内容与日志中最新的镜像一致
+            char *page = bufs + (size_t) n * blockSize_;
+            if (i >= 0) {
+                page = pageOf(i);
+                seal(page);
+            } else if (wal_->readPage(pages[j].second, page) != 0) {
+                free(bufs);
+                return -1;
+            }
+
+            reqs[n] = IoRing::Request{page, offset, blockSize_, true, 0};
+        }
+
+        int failed = submit(reqs, n);
+        if (failed != 0) {
+            free(bufs);
+            return -1;
+        }
+        writes_ += n;
+    }
+    free(bufs);
+
+    logged_.clear();
+    return fdatasync(fd_);
+}
+
+int BufferPool::truncate(off_t size)
+{
+    struct stat st;
+    if (fstat(fd_, &st) != 0) return -1;
+    if (st.st_size <= size) return 0;
+
+    // 映射的范围只增不减,截掉后访问会出错,改为打洞
+    if (map_ == NULL) return ftruncate(fd_, size);
+    int ret = fallocate(
+        fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size,
+        st.st_size - size);
+    // 文件系统不支持打洞时保留原样
+    return ret == 0 || errno == EOPNOTSUPP ? 0 : -1;
+}
+
+void BufferPool::setDirtyLimit(int frames)
+{
+    if (map_ != NULL) return;
+
+    PoolGuard guard(lock());
+    dirtyLimit_ = frames > 0 ? frames : 0;
+    // 不再推迟时立即写回已有的脏块
+    if (dirtyNum_ > dirtyLimit_) writeBack(dirtyLimit_ == 0);
+}
+
+int BufferPool::pinnedNum() const
+{
+    int n = 0;
+    for (int i = 0; i < frameNum_; i++) {
+        if (frames_[i].pinCount > 0) n++;
+    }
+    return n;
+}
+
+void *BufferPool::allocAligned(size_t size)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, IO_ALIGN, size) != 0) p = NULL;
+    assert(p != NULL);
+    return p;
+}
+
+int BufferPool::frameOf(const void *page) const
+{
+    size_t diff = (const char *) page - pages_;
+    assert(diff % blockSize_ == 0 && diff / blockSize_ < (size_t) frameNum_);
+    return diff / blockSize_;
+}
+
+int BufferPool::find(off_t offset)
+{
+    std::unordered_map<off_t, int>::iterator it = pageTable_.find(offset);
+    return it == pageTable_.end() ? -1 : it->second;
+}
+
+int BufferPool::allocFrame(off_t offset)
+{
+    int i = evict();
+    if (i < 0) return -1;
+
+    beginChange(frames_[i]);
+    __atomic_store_n(&frames_[i].offset, offset, __ATOMIC_RELAXED);
+    frames_[i].pinCount = 0;
+    frames_[i].usage = 0;
+    frames_[i].queued = false;
+    frames_[i].dirty = false;
+    pageTable_[offset] = i;
+    __atomic_store_n(&hints_[hintOf(offset)], i, __ATOMIC_RELAXED);
+
+    return i;
+}
+
+int BufferPool::frameFor(off_t offset, bool *miss)
+{
+    int i = find(offset);
+    *miss = i < 0;
+    while (i < 0) {
+        i = allocFrame(offset);
+        if (i >= 0) break;
+
+        // 等待其他线程释放占用,期间该块可能已被读入
+        waitUnpin();
+        i = find(offset);
+        *miss = i < 0;
+    }
+
+    if (*miss) {
+        misses_++;
+    } else {
+        hits_++;
+        // 冲突时被其他块覆盖,命中时恢复
+        if (hints_[hintOf(offset)] != i)
+            __atomic_store_n(&hints_[hintOf(offset)], i, __ATOMIC_RELAXED);
+    }
+
+    if (frames_[i].usage < MAX_USAGE_COUNT) frames_[i].usage++;
+    return i;
+}
+
+void BufferPool::setConcurrent()
+{
+    assert(map_ == NULL && wal_ == NULL);
+    concurrent_ = true;
+}
+
+void BufferPool::latch(const void *page, bool exclusive)
+{
+    if (map_ != NULL) return;
+
+    Frame &frame = frames_[frameOf(page)];
+    if (exclusive) {
+        pthread_rwlock_wrlock(&frame.latch);
+        beginChange(frame);
+    } else {
+        pthread_rwlock_rdlock(&frame.latch);
+    }
+}
+
+void BufferPool::unlatch(const void *page)
+{
+    if (map_ != NULL) return;
+
+    // 持有读锁时没有写者,版本为奇数说明持有的是写锁
+    Frame &frame = frames_[frameOf(page)];
+    if (frame.version & 1) endChange(frame);
+    pthread_rwlock_unlock(&frame.latch);
+}
+
+void *BufferPool::peek(off_t offset, unsigned long *version)
+{
+    assert(map_ == NULL);
+
+    int i = __atomic_load_n(&hints_[hintOf(offset)], __ATOMIC_RELAXED);
+    if (i < 0) return NULL;
+
+    Frame &frame = frames_[i];
+    unsigned long v = __atomic_load_n(&frame.version, __ATOMIC_ACQUIRE);
+    if (v & 1) return NULL;
+    if (__atomic_load_n(&frame.offset, __ATOMIC_RELAXED) != offset) return NULL;
+
+    // 只在使用计数为0时写入,热点块不会在多个核之间来回传递
+    if (__atomic_load_n(&frame.usage, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&frame.usage, 1, __ATOMIC_RELAXED);
+
+    *version = v;
+    return pageOf(i);
+}
+
+bool BufferPool::validate(const void *page, unsigned long version) const
+{
+    // 之前的读取完成后再读版本
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const Frame &frame = frames_[frameOf(page)];
+    return __atomic_load_n(&frame.version, __ATOMIC_RELAXED) == version;
+}
+
+int BufferPool::openSnapshot(off_t fileSize)
+{
+    assert(map_ == NULL && snapFd_ >= 0);
+
+    // 快照读取写回镜像,推迟写回的修改先写入文件
+    if (dirtyNum_ > 0) {
+        PoolGuard guard(lock());
+        if (writeBack(true) != 0) return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(snapMutex_);
+    if (snapBuf_ == NULL) snapBuf_ = (char *) allocAligned(blockSize_);
+
+    int id = nextSnapshot_++;
+    snapshots_[id].fileSize = fileSize;
+    __atomic_store_n(&snapshotNum_, snapshots_.size(), __ATOMIC_RELEASE);
+    return id;
+}
+
+void BufferPool::closeSnapshot(int id)
+{
+    std::lock_guard<std::mutex> guard(snapMutex_);
+    std::map<int, SnapshotPages>::iterator it = snapshots_.find(id);
+    assert(it != snapshots_.end());
+
+    std::unordered_map<off_t, off_t> &pages = it->second.pages;
+    for (std::unordered_map<off_t, off_t>::iterator p = pages.begin();
+         p != pages.end();
+         ++p) {
+        if (p->second == LOST_IMAGE) continue;
+        off_t slot = p->second / blockSize_;
+        if (--slotRefs_[slot] == 0) freeSlots_.push_back(slot);
+    }
+    snapshots_.erase(it);
+    __atomic_store_n(&snapshotNum_, snapshots_.size(), __ATOMIC_RELEASE);
+
+    // 没有快照时截断快照文件
+    if (snapshots_.empty()) {
+        slotRefs_.clear();
+        freeSlots_.clear();
+        int ret = ftruncate(snapFd_, 0);
+        assert(ret == 0);
+    }
+}
+
+int BufferPool::readSnapshot(int id, off_t offset, void *page)
+{
+    // 持有锁时块的写回镜像不会改变
+    std::lock_guard<std::mutex> guard(snapMutex_);
+    std::map<int, SnapshotPages>::iterator it = snapshots_.find(id);
+    assert(it != snapshots_.end());
+
+    std::unordered_map<off_t, off_t> &pages = it->second.pages;
+    std::unordered_map<off_t, off_t>::iterator p = pages.find(offset);
+    if (p == pages.end()) return readPage(offset, (char *) page) ? 0 : -1;
+    if (p->second == LOST_IMAGE) return -1;
+
+    int len = pread(snapFd_, page, blockSize_, p->second);
+    return len == blockSize_ && check((const char *) page) ? 0 : -1;
+}
+
+void BufferPool::preserve(off_t offset)
+{
+    if (__atomic_load_n(&snapshotNum_, __ATOMIC_ACQUIRE) == 0) return;
+
+    std::lock_guard<std::mutex> guard(snapMutex_);
+    off_t pos = -1;
+    for (std::map<int, SnapshotPages>::iterator it = snapshots_.begin();
+         it != snapshots_.end();
+         ++it) {
+        SnapshotPages &snap = it->second;
+        if (offset >= snap.fileSize || snap.pages.count(offset)) continue;
+
+        // 尚未保存的快照看到的都是当前的写回镜像,只复制一次
+        if (pos < 0) {
+            // 没有写回过的块(如创建快照时空闲的块)不在任何快照中
+            if (readImage(offset, snapBuf_) != blockSize_) return;
+
+            off_t slot;
+            if (!freeSlots_.empty()) {
+                slot = freeSlots_.back();
+                freeSlots_.pop_back();
+            } else {
+                slot = slotRefs_.size();
+                slotRefs_.push_back(0);
+            }
+            pos = slot * blockSize_;
+            int len = pwrite(snapFd_, snapBuf_, blockSize_, pos);
+            if (len != blockSize_) {
+                // 位置中可能是写了一部分的内容,不再使用
+                pos = LOST_IMAGE;
+            }
+        }
+        snap.pages[offset] = pos;
+        if (pos != LOST_IMAGE) slotRefs_[pos / blockSize_]++;
+    }
+}
+
+bool BufferPool::enableRing()
+{
+    if (map_ != NULL) return false;
+
+    ring_ = new IoRing(RING_DEPTH);
+    if (ring_->valid()) return true;
+
+    delete ring_;
+    ring_ = NULL;
+    return false;
+}
+
+void BufferPool::prefetch(const off_t *offsets, int n)
+{
+    if (map_ != NULL) return;
+
+    std::vector<IoRing::Request> reqs;
+    std::vector<int> loaded;
+    int k = 0;
+
+    // 分批读入,每批占用的块数有限
+    while (k < n) {
+        reqs.clear();
+        loaded.clear();
+        PoolGuard guard(lock());
+        for (; k < n && (int) reqs.size() < batchLimit(); k++) {
+            off_t offset = offsets[k];
+            if (find(offset) >= 0) continue;
+            // 已写入日志的块在需要时从日志读取
+            if (wal_ != NULL && logged_.count(offset)) continue;
+
+            // 读完之前不能被置换,没有可用的缓存时不再预读
+            int i = allocFrame(offset);
+            if (i < 0) break;
+            frames_[i].pinCount++;
+            // 同fetch: 读入期间持有块的写锁,访问该块的线程等待读入完成
+            if (concurrent_) {
+                frames_[i].loading = true;
+                pthread_rwlock_wrlock(&frames_[i].latch);
+            }
+            reqs.push_back(IoRing::Request{pageOf(i), offset, blockSize_, false, 0});
+            loaded.push_back(i);
+        }
+        if (reqs.empty()) break;
+
+        misses_ += reqs.size();
+        guard.release();
+        submit(&reqs[0], reqs.size());
+
+        PoolGuard again(lock());
+        for (size_t j = 0; j < loaded.size(); j++) {
+            int i = loaded[j];
+            // 读取失败的块不留在缓存中,访问时重新读取并返回失败
+            if (reqs[j].result != blockSize_ || !check(pageOf(i))) {
+                dropFrame(i);
+            } else {
+                __atomic_store_n(&frames_[i].loading, false, __ATOMIC_RELAXED);
+                if (--frames_[i].pinCount == 0 && concurrent_)
+                    unpinned_.notify_all();
+                // 预读的块至少保留一轮CLOCK
+                frames_[i].usage = 1;
+            }
+            endChange(frames_[i]);
+            if (concurrent_) pthread_rwlock_unlock(&frames_[i].latch);
+        }
+    }
+}
+
+void BufferPool::beginBatch()
+{
+    assert(!batch_);
+    batch_ = true;
+}
+
+void BufferPool::endBatch()
+{
+    assert(batch_);
+    flushPending();
+    batch_ = false;
+}
+
+int BufferPool::submit(IoRing::Request *reqs, int n)
+{
+    // 单个请求直接读写,省去异步完成的开销; 预读不持有互斥锁,另加锁保护ring
+    if (ring_ != NULL && n > 1) {
+        std::lock_guard<std::mutex> guard(ringMutex_);
+        return ring_->submit(fd_, reqs, n);
+    }
+
+    int failed = 0;
+    for (int k = 0; k < n; k++) {
+        IoRing::Request &req = reqs[k];
+        if (req.write)
+            req.result = pwrite(fd_, req.buf, req.len, req.offset);
+        else
+            req.result = pread(fd_, req.buf, req.len, req.offset);
+        if (req.result != req.len) failed++;
+    }
+    return failed;
+}
+
+void BufferPool::flushPending()
+{
+    if (pending_.empty()) return;
+
+    // 多数操作只修改一个块,直接写回
+    if (pending_.size() == 1) {
+        int i = pending_[0];
+        pending_.clear();
+        if (!frames_[i].queued) return;
+
+        frames_[i].queued = false;
+        seal(pageOf(i));
+        int len = pwrite(fd_, pageOf(i), blockSize_, frames_[i].offset);
+        if (len == blockSize_)
+            writes_++;
+        else
+            markDirty(i);
+        frames_[i].pinCount--;
+        return;
+    }
+
+    // 按偏移排序,尽量顺序写
+    std::vector<int> written;
+    std::vector<IoRing::Request> reqs;
+    for (size_t k = 0; k < pending_.size(); k++) {
+        int i = pending_[k];
+        // 已回收或已在本批写过
+        if (!frames_[i].queued) continue;
+
+        frames_[i].queued = false;
+        written.push_back(i);
+    }
+    std::sort(written.begin(), written.end(), [this](int a, int b) {
+        return frames_[a].offset < frames_[b].offset;
+    });
+    for (size_t k = 0; k < written.size(); k++) {
+        int i = written[k];
+        seal(pageOf(i));
+        reqs.push_back(
+            IoRing::Request{pageOf(i), frames_[i].offset, blockSize_, true, 0});
+    }
+
+    if (!reqs.empty()) {
+        submit(&reqs[0], reqs.size());
+        for (size_t k = 0; k < reqs.size(); k++) {
+            if (reqs[k].result == blockSize_)
+                writes_++;
+            else
+                markDirty(written[k]);
+        }
+    }
+
+    for (size_t k = 0; k < written.size(); k++)
+        frames_[written[k]].pinCount--;
+    pending_.clear();
+}
+
+int BufferPool::writeBack(bool all)
+{
+    std::vector<int> dirty;
+    for (int i = 0; i < frameNum_; i++) {
+        // 被占用的块可能正在修改(并发模式下持有块的写锁)
+        if (frames_[i].dirty && (all || frames_[i].pinCount == 0))
+            dirty.push_back(i);
+    }
+    if (dirty.empty()) return 0;
+
+    // 按偏移排序,尽量顺序写
+    std::sort(dirty.begin(), dirty.end(), [this](int a, int b) {
+        return frames_[a].offset < frames_[b].offset;
+    });
+
+    // 每次提交RING_DEPTH个块
+    IoRing::Request reqs[RING_DEPTH];
+    for (size_t k = 0; k < dirty.size(); k += RING_DEPTH) {
+        int n = 0;
+        for (size_t j = k; j < dirty.size() && j < k + RING_DEPTH; j++) {
+            int i = dirty[j];
+            preserve(frames_[i].offset);
+            seal(pageOf(i));
+            reqs[n++] = IoRing::Request{
+                pageOf(i), frames_[i].offset, blockSize_, true, 0};
+        }
+
+        // 失败时全部保留为脏块,之后再写
+        int failed = submit(reqs, n);
+        if (failed != 0) return -1;
+        writes_ += n;
+    }
+
+    for (size_t k = 0; k < dirty.size(); k++)
+        frames_[dirty[k]].dirty = false;
+    dirtyNum_ -= dirty.size();
+    return 0;
+}
+
+bool BufferPool::readPage(off_t offset, char *page)
+{
+    // 读到的长度不足(读取出错或文件被截短)与校验和不一致同样处理
+    return readImage(offset, page) == blockSize_ && check(page);
+}
+
+bool BufferPool::check(const char *page)
+{
+    if (!checksum_ || verify(page, blockSize_)) return true;
+
+    // 并发模式下读入时不持有互斥锁
+    __atomic_fetch_add(&checksumErrors_, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void BufferPool::dropFrame(int i)
+{
+    Frame &frame = frames_[i];
+    pageTable_.erase(frame.offset);
+    __atomic_store_n(&frame.offset, FREE_FRAME, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame.loading, false, __ATOMIC_RELAXED);
+    frame.usage = 0;
+    if (--frame.pinCount == 0 && concurrent_) unpinned_.notify_all();
+}
+
+void BufferPool::markDirty(int i)
+{
+    if (frames_[i].dirty) return;
+    frames_[i].dirty = true;
+    dirtyNum_++;
+}
+
+void BufferPool::seal(void *page, int blockSize)
+{
+    uint32_t crc = Crc32c::compute(page, blockSize - CHECKSUM_SIZE);
+    memcpy((char *) page + blockSize - CHECKSUM_SIZE, &crc, CHECKSUM_SIZE);
+}
+
+bool BufferPool::verify(const void *page, int blockSize)
+{
+    uint32_t crc;
+    memcpy(&crc, (const char *) page + blockSize - CHECKSUM_SIZE, CHECKSUM_SIZE);
+    return crc == Crc32c::compute(page, blockSize - CHECKSUM_SIZE);
+}
+
+int BufferPool::readImage(off_t offset, char *page)
+{
+    if (wal_ != NULL) {
+        std::unordered_map<off_t, off_t>::iterator it = logged_.find(offset);
+        if (it != logged_.end())
+            return wal_->readPage(it->second, page) == 0 ? blockSize_ : -1;
+    }
+
+    return pread(fd_, page, blockSize_, offset);
+}
+
+int BufferPool::evict()
+{
+    // 最多转MAX_USAGE_COUNT + 1圈,所有使用计数都会减为0
+    for (int n = 0; n < frameNum_ * (MAX_USAGE_COUNT + 1); n++) {
+        int i = hand_;
+        hand_ = (hand_ + 1) % frameNum_;
+
+        Frame &frame = frames_[i];
+        if (frame.pinCount > 0) continue;
+        if (frame.usage > 0) {
+            frame.usage--;
+            continue;
+        }
+
+        // 修改过的块先写回,写入失败时保留该块
+        if (frame.dirty) {
+            preserve(frame.offset);
+            seal(pageOf(i));
+            int len = pwrite(fd_, pageOf(i), blockSize_, frame.offset);
+            if (len != blockSize_) continue;
+            writes_++;
+            frame.dirty = false;
+            dirtyNum_--;
+        }
+
+        // 置换出该frame,由调用者修改版本
+        if (frame.offset != FREE_FRAME) pageTable_.erase(frame.offset);
+        __atomic_store_n(&frame.offset, FREE_FRAME, __ATOMIC_RELAXED);
+        return i;
+    }
+
+    // 所有缓存都被占用,并发模式下由调用者等待其他线程释放
+    assert(concurrent_);
+    return -1;
+}
+
+void BufferPool::waitUnpin()
+{
+    assert(concurrent_);
+
+    // 调用者已持有mutex_
+    std::unique_lock<std::mutex> lock(mutex_, std::adopt_lock);
+    unpinned_.wait(lock);
+    lock.release();
+}
+
+void BufferPool::mapTo(off_t end)
+{
+    if (end <= mapped_) return;
+
+    // 按倍数增长以减少mmap次数,但每次不超过MMAP_MAX_GROW
+    off_t size = mapped_ * 2;
+    if (size < MMAP_MIN_GROW) size = MMAP_MIN_GROW;
+    if (size > mapped_ + MMAP_MAX_GROW) size = mapped_ + MMAP_MAX_GROW;
+    if (size < end) size = end;
+
+    // 映射长度必须是页大小的整数倍
+    off_t pageSize = sysconf(_SC_PAGESIZE);
+    size = (size + pageSize - 1) / pageSize * pageSize;
+    assert((size_t) size <= MMAP_RESERVE);
+
+    // 文件不够长时扩展(批量建树可能已直接写入更长的文件)
+    struct stat st;
+    int ret = fstat(fd_, &st);
+    if (ret == 0 && st.st_size < size) ret = ftruncate(fd_, size);
+    assert(ret == 0);
+
+    // 在预留的地址空间中映射新增的部分
+    void *p = mmap(
+        map_ + mapped_,
+        size - mapped_,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED,
+        fd_,
+        mapped_);
+    assert(p == map_ + mapped_);
+
+    mapped_ = size;
+}
@@ -0,0 +1,728 @@
+/*
+ * @file BytesTree.cc
+ * @brief
+ * 变长key的B+树源文件
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "BytesTree.h"
+
+typedef SlottedPage::Entry Entry;
+
+const char BytesTree::MAGIC[8] = {'B', 'Y', 'T', 'E', 'T', 'R', 'E', 'E'};
+
+BytesTree::BytesTree(const char *fileName, int blockSize, size_t cacheSize)
+    : blockSize_(blockSize)
+    , root_(INVALID_OFFSET)
+    , fileSize_(blockSize)
+    , freeHead_(INVALID_OFFSET)
+{
+    assert(blockSize >= 256 && blockSize <= SlottedPage::MAX_BLOCK_SIZE);
+    assert(blockSize % 256 == 0);
+
+    // 每个节点至少放下4个entry,分裂后的两半都放得下
+    maxCell_ = (blockSize - (int) sizeof(PageHeader)) / 4;
+
+    fd_ = open(fileName, O_CREAT | O_RDWR, 0644);
+    assert(fd_ >= 0);
+
+    pool_ = new BufferPool(fd_, blockSize, cacheSize);
+    metaLoad();
+}
+
+BytesTree::~BytesTree()
+{
+    sync();
+    delete pool_;
+    close(fd_);
+}
+
+void BytesTree::metaLoad()
+{
+    struct stat st;
+    int ret = fstat(fd_, &st);
+    assert(ret == 0);
+    // 新文件,第一个块留给元数据
+    if (ret != 0 || st.st_size < blockSize_) return;
+
+    char *buf = (char *) BufferPool::allocAligned(blockSize_);
+    ret = pread(fd_, buf, blockSize_, 0);
+    assert(ret == blockSize_);
+
+    Meta *meta = (Meta *) buf;
+    if (memcmp(meta->magic, MAGIC, sizeof MAGIC) != 0) {
+        printf("Not a BytesTree index file.\n");
+        assert(0);
+    }
+    // 索引文件的块大小必须与参数一致
+    if (meta->blockSize != blockSize_) {
+        printf("Block size mismatch: %d in index file.\n", meta->blockSize);
+        assert(0);
+    }
+    root_ = meta->root;
+    fileSize_ = meta->fileSize;
+    freeHead_ = meta->freeHead;
+    free(buf);
+}
+
+int BytesTree::metaStore()
+{
+    char *buf = (char *) BufferPool::allocAligned(blockSize_);
+    memset(buf, 0, blockSize_);
+
+    Meta *meta = (Meta *) buf;
+    memcpy(meta->magic, MAGIC, sizeof MAGIC);
+    meta->blockSize = blockSize_;
+    meta->root = root_;
+    meta->fileSize = fileSize_;
+    meta->freeHead = freeHead_;
+
+    int ret = pwrite(fd_, buf, blockSize_, 0) == blockSize_ ? S_OK : S_FALSE;
+    free(buf);
+    return ret;
+}
+
+int BytesTree::sync()
+{
+    // 推迟写回的脏块先写入文件,元数据指向的块都已在文件中
+    if (pool_->checkpoint() != 0) return S_FALSE;
+    if (metaStore() != S_OK) return S_FALSE;
+    return fdatasync(fd_) == 0 ? S_OK : S_FALSE;
+}
+
+int BytesTree::insert(const char *k, int klen, const char *value, int vlen)
+{
+    if (klen < 0 || vlen < 0 || klen > maxKeySize()) return S_FALSE;
+
+    char *leaf;
+    int pos = 0;
+    if (root_ == INVALID_OFFSET) {
+        // 空树
+        leaf = newNode(BYTES_TREE_LEAF);
+        root_ = ((PageHeader *) leaf)->self;
+        traceNode_.clear();
+    } else {
+        leaf = fetchBlock(descend(k, klen, false));
+        pos = page(leaf).search(k, klen);
+        if (pos >= 0) {
+            pool_->unpin(leaf);
+            return S_FALSE;
+        }
+        pos = -pos - 1;
+    }
+
+    if (klen + vlen <= maxEntrySize())
+        return insertLeaf(leaf, pos, k, klen, value, vlen, false);
+
+    // 叶子中放不下的value写入溢出页
+    OverflowRef ref;
+    ref.size = vlen;
+    ref.first = writeOverflow(value, vlen);
+    return insertLeaf(leaf, pos, k, klen, (char *) &ref, sizeof ref, true);
+}
+
+int BytesTree::search(const char *k, int klen, std::string *value)
+{
+    off_t offset = descend(k, klen, false);
+    if (offset == INVALID_OFFSET) return S_FALSE;
+
+    // 叶子刚被读入缓存,这里不会再读磁盘
+    char *leaf = fetchBlock(offset);
+    SlottedPage p = page(leaf);
+    int pos = p.search(k, klen);
+    if (pos >= 0) readValue(p, pos, value);
+    pool_->unpin(leaf);
+    return pos >= 0 ? S_OK : S_FALSE;
+}
+
+int BytesTree::remove(const char *k, int klen)
+{
+    off_t offset = descend(k, klen, false);
+    if (offset == INVALID_OFFSET) return S_FALSE;
+
+    char *leaf = fetchBlock(offset);
+    int pos = page(leaf).search(k, klen);
+    if (pos < 0) {
+        pool_->unpin(leaf);
+        return S_FALSE;
+    }
+
+    SlottedPage p = page(leaf);
+    OverflowRef ref;
+    bool external = p.external(pos);
+    if (external) {
+        int len;
+        memcpy(&ref, p.payload(pos, &len), sizeof ref);
+    }
+    p.remove(pos);
+    if (external) freeOverflow(ref.first);
+
+    mergeNode(leaf);
+    return S_OK;
+}
+
+char *BytesTree::newNode(int type)
+{
+    off_t offset;
+    char *node;
+    if (freeHead_ != INVALID_OFFSET) {
+        // 取出空闲块,链表的下一个记录在块中
+        offset = freeHead_;
+        node = (char *) pool_->fetch(offset);
+        assert(node != NULL);
+        freeHead_ = ((PageHeader *) node)->next;
+    } else {
+        // 在文件末尾增加块
+        offset = fileSize_;
+        fileSize_ += blockSize_;
+        node = (char *) pool_->create(offset);
+    }
+
+    page(node).init(offset, type);
+    PageHeader *h = (PageHeader *) node;
+    h->prev = INVALID_OFFSET;
+    h->next = INVALID_OFFSET;
+    h->lastOffset = INVALID_OFFSET;
+    return node;
+}
+
+void BytesTree::freeNode(char *node)
+{
+    PageHeader *h = (PageHeader *) node;
+    off_t offset = h->self;
+    page(node).init(offset, BYTES_TREE_FREE);
+    h->next = freeHead_;
+    freeHead_ = offset;
+    blockFlush(node);
+}
+
+void BytesTree::blockFlush(char *node)
+{
+    pool_->flush(node);
+    pool_->unpin(node);
+}
+
+char *BytesTree::fetchBlock(off_t offset)
+{
+    if (offset == INVALID_OFFSET) return NULL;
+    // 未启用校验和,只有读到的长度不足时失败
+    char *node = (char *) pool_->fetch(offset);
+    assert(node != NULL);
+    return node;
+}
+
+char *BytesTree::locateNode(off_t offset)
+{
+    if (offset == INVALID_OFFSET) return NULL;
+    char *node = (char *) pool_->lookup(offset);
+    assert(node != NULL);
+    return node;
+}
+
+off_t BytesTree::descend(const char *k, int klen, bool rightmost)
+{
+    traceNode_.clear();
+
+    off_t offset = root_;
+    char *node = locateNode(offset);
+    while (node != NULL && !isLeaf(node)) {
+        // 记录父节点偏移
+        traceNode_.push_back(offset);
+
+        SlottedPage p = page(node);
+        int pos;
+        if (k != NULL) {
+            pos = p.search(k, klen);
+            pos = pos >= 0 ? pos + 1 : -pos - 1;
+        } else {
+            pos = rightmost ? p.count() : 0;
+        }
+
+        offset = p.child(pos);
+        node = locateNode(offset);
+    }
+    return offset;
+}
+
+off_t BytesTree::writeOverflow(const char *value, int vlen)
+{
+    off_t first = INVALID_OFFSET;
+    char *prev = NULL;
+    int done = 0;
+    while (done < vlen) {
+        char *node = newNode(BYTES_TREE_OVERFLOW);
+        PageHeader *h = (PageHeader *) node;
+        int len = std::min(vlen - done, overflowCapacity());
+        memcpy(node + sizeof(PageHeader), value + done, len);
+        h->count = len;
+        done += len;
+
+        // 前一页的next确定后才写回
+        if (prev == NULL)
+            first = h->self;
+        else {
+            ((PageHeader *) prev)->next = h->self;
+            blockFlush(prev);
+        }
+        prev = node;
+    }
+    if (prev != NULL) blockFlush(prev);
+    return first;
+}
+
+void BytesTree::freeOverflow(off_t first)
+{
+    off_t offset = first;
+    while (offset != INVALID_OFFSET) {
+        char *node = fetchBlock(offset);
+        offset = ((PageHeader *) node)->next;
+        freeNode(node);
+    }
+}
+
+void BytesTree::readValue(
+    const SlottedPage &leaf,
+    int pos,
+    std::string *value)
+{
+    int len;
+    const char *p = leaf.payload(pos, &len);
+    if (!leaf.external(pos)) {
+        value->assign(p, len);
+        return;
+    }
+
+    OverflowRef ref;
+    memcpy(&ref, p, sizeof ref);
+    value->clear();
+    value->reserve(ref.size);
+    for (off_t offset = ref.first; offset != INVALID_OFFSET;) {
+        char *node = fetchBlock(offset);
+        PageHeader *h = (PageHeader *) node;
+        value->append(node + sizeof(PageHeader), h->count);
+        offset = h->next;
+        pool_->unpin(node);
+    }
+}
+
+int BytesTree::splitPoint(const std::vector<Entry> &all)
+{
+    int n = all.size();
+    std::vector<int> sizes(n);
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        sizes[i] =
+            SlottedPage::cellSize(all[i].key.size(), all[i].payload.size());
+        total += sizes[i];
+    }
+
+    // 左半部分不超过一半(至少一个)
+    int left = sizes[0];
+    int m = 1;
+    while (m < n - 1 && 2 * (left + sizes[m]) <= total)
+        left += sizes[m++];
+    return m;
+}
+
+std::string
+BytesTree::separator(const std::string &left, const std::string &right)
+{
+    // right中比公共前缀多一个字节即可与left区分
+    int common = SlottedPage::commonPrefix(
+        left.data(), left.size(), right.data(), right.size());
+    return right.substr(0, common + 1);
+}
+
+int BytesTree::insertLeaf(
+    char *leaf,
+    int pos,
+    const char *k,
+    int klen,
+    const char *v,
+    int vlen,
+    bool external)
+{
+    if (page(leaf).insert(pos, k, klen, v, vlen, external)) {
+        blockFlush(leaf);
+        return S_OK;
+    }
+
+    // 放不下->按占用的空间分裂
+    std::vector<Entry> all;
+    page(leaf).entries(&all);
+    Entry e;
+    e.key.assign(k, klen);
+    e.payload.assign(v, vlen);
+    e.external = external;
+    all.insert(all.begin() + pos, e);
+    int n = all.size();
+    int split = splitPoint(all);
+
+    char *right = newNode(BYTES_TREE_LEAF);
+    PageHeader *lh = (PageHeader *) leaf, *rh = (PageHeader *) right;
+    rh->prev = lh->self;
+    rh->next = lh->next;
+    if (lh->next != INVALID_OFFSET) {
+        char *next = fetchBlock(lh->next);
+        ((PageHeader *) next)->prev = rh->self;
+        blockFlush(next);
+    }
+    lh->next = rh->self;
+
+    bool ok = page(leaf).build(&all[0], split);
+    ok = ok && page(right).build(&all[split], n - split);
+    assert(ok);
+    (void) ok;
+
+    off_t leftOffset = lh->self, rightOffset = rh->self;
+    blockFlush(leaf);
+    blockFlush(right);
+
+    // 父节点中只保存区分两个叶子的最短前缀
+    updateParentNode(
+        leftOffset, rightOffset, separator(all[split - 1].key, all[split].key));
+    return S_OK;
+}
+
+void BytesTree::updateParentNode(off_t left, off_t right, const std::string &k)
+{
+    // 分裂的是root,增加一层
+    if (traceNode_.empty()) {
+        char *root = newNode(BYTES_TREE_NON_LEAF);
+        SlottedPage p = page(root);
+        p.insert(0, k.data(), k.size(), (char *) &left, sizeof left);
+        p.setChild(1, right);
+        root_ = p.header()->self;
+        blockFlush(root);
+        return;
+    }
+
+    off_t offset = traceNode_.back();
+    traceNode_.pop_back();
+    char *node = fetchBlock(offset);
+    SlottedPage p = page(node);
+
+    // 分隔key在父节点中左右两个key之间,不会已存在
+    int pos = p.search(k.data(), k.size());
+    assert(pos < 0);
+    pos = -pos - 1;
+
+    // k左侧的子节点为left,原来指向left的位置改为right
+    if (p.insert(pos, k.data(), k.size(), (char *) &left, sizeof left)) {
+        p.setChild(pos + 1, right);
+        blockFlush(node);
+        return;
+    }
+
+    // 非叶子节点分裂,中间的key提升到上一层
+    std::vector<Entry> all;
+    p.entries(&all);
+    off_t last = p.child(p.count());
+    Entry e;
+    e.key = k;
+    e.payload.assign((char *) &left, sizeof left);
+    all.insert(all.begin() + pos, e);
+    int n = all.size();
+    if (pos + 1 < n)
+        all[pos + 1].payload.assign((char *) &right, sizeof right);
+    else
+        last = right;
+
+    // 两侧都至少保留一个key
+    int mid = splitPoint(all);
+    if (mid > n - 2) mid = n - 2;
+    off_t midChild;
+    memcpy(&midChild, all[mid].payload.data(), sizeof midChild);
+
+    char *rightNode = newNode(BYTES_TREE_NON_LEAF);
+    SlottedPage rp = page(rightNode);
+    bool ok = p.build(&all[0], mid);
+    ok = ok && rp.build(&all[mid + 1], n - mid - 1);
+    assert(ok);
+    (void) ok;
+    p.setChild(mid, midChild);
+    rp.setChild(n - mid - 1, last);
+
+    off_t rightOffset = rp.header()->self;
+    blockFlush(node);
+    blockFlush(rightNode);
+
+    updateParentNode(offset, rightOffset, all[mid].key);
+}
+
+void BytesTree::mergeNode(char *node)
+{
+    SlottedPage p = page(node);
+    PageHeader *h = p.header();
+    bool leaf = isLeaf(node);
+
+    // root: 空叶子删除, 没有key的非叶子节点由唯一的子节点代替
+    if (traceNode_.empty()) {
+        if (p.count() > 0) {
+            blockFlush(node);
+        } else {
+            root_ = leaf ? INVALID_OFFSET : h->lastOffset;
+            freeNode(node);
+        }
+        return;
+    }
+
+    // 不小于1/4时不合并
+    if (p.count() > 0 && p.used() >= p.capacity() / 4) {
+        blockFlush(node);
+        return;
+    }
+
+    off_t parentOffset = traceNode_.back();
+    traceNode_.pop_back();
+    char *parent = fetchBlock(parentOffset);
+    SlottedPage pp = page(parent);
+
+    // node在父节点中的位置,与左侧的相邻节点合并(最左的节点与右侧合并)
+    int c = 0;
+    while (c < pp.count() && pp.child(c) != h->self)
+        c++;
+    assert(pp.child(c) == h->self);
+    if (pp.count() == 0) {
+        blockFlush(node);
+        pool_->unpin(parent);
+        return;
+    }
+    int l = c > 0 ? c - 1 : c;
+    char *left = l == c ? node : fetchBlock(pp.child(l));
+    char *right = l == c ? fetchBlock(pp.child(l + 1)) : node;
+    SlottedPage lp = page(left), rp = page(right);
+
+    // 非叶子节点合并时,父节点中的分隔key下移
+    std::vector<Entry> all;
+    lp.entries(&all);
+    if (!leaf) {
+        Entry e;
+        e.key = pp.key(l);
+        off_t child = lp.child(lp.count());
+        e.payload.assign((char *) &child, sizeof child);
+        all.push_back(e);
+    }
+    rp.entries(&all);
+
+    // 合并后放不下则不合并
+    if (SlottedPage::size(all.data(), all.size()) > lp.capacity()) {
+        blockFlush(node);
+        pool_->unpin(node == left ? right : left);
+        pool_->unpin(parent);
+        return;
+    }
+
+    bool ok = lp.build(all.data(), all.size());
+    assert(ok);
+    (void) ok;
+    PageHeader *lh = lp.header(), *rh = rp.header();
+    if (leaf) {
+        lh->next = rh->next;
+        if (rh->next != INVALID_OFFSET) {
+            char *next = fetchBlock(rh->next);
+            ((PageHeader *) next)->prev = lh->self;
+            blockFlush(next);
+        }
+    } else {
+        lh->lastOffset = rh->lastOffset;
+    }
+
+    off_t leftOffset = lh->self;
+    freeNode(right);
+    blockFlush(left);
+
+    // 删除父节点中的分隔key,原来指向right的位置改为left
+    pp.remove(l);
+    pp.setChild(l, leftOffset);
+    mergeNode(parent);
+}
+
+BytesTree::Cursor::Cursor(BytesTree *tree) : tree_(tree), leaf_(NULL), pos_(0)
+{
+}
+
+BytesTree::Cursor::~Cursor()
+{
+    release();
+}
+
+int BytesTree::Cursor::seek(const char *k, int len)
+{
+    off_t offset = tree_->descend(k, len, false);
+    if (offset == INVALID_OFFSET) {
+        release();
+        return S_FALSE;
+    }
+
+    int pos = tree_->page(tree_->locateNode(offset)).search(k, len);
+    return moveTo(offset, pos >= 0 ? pos : -pos - 1);
+}
+
+int BytesTree::Cursor::seekFirst()
+{
+    return moveTo(tree_->descend(NULL, 0, false), 0);
+}
+
+int BytesTree::Cursor::seekLast()
+{
+    return moveTo(tree_->descend(NULL, 0, true), -1);
+}
+
+int BytesTree::Cursor::next()
+{
+    if (leaf_ == NULL) return S_FALSE;
+
+    if (pos_ + 1 < page().count()) {
+        pos_++;
+        return S_OK;
+    }
+    return moveTo(page().header()->next, 0);
+}
+
+int BytesTree::Cursor::prev()
+{
+    if (leaf_ == NULL) return S_FALSE;
+
+    if (pos_ > 0) {
+        pos_--;
+        return S_OK;
+    }
+    return moveTo(page().header()->prev, -1);
+}
+
+std::string BytesTree::Cursor::key() const
+{
+    return page().key(pos_);
+}
+
+std::string BytesTree::Cursor::value() const
+{
+    std::string v;
+    tree_->readValue(page(), pos_, &v);
+    return v;
+}
+
+SlottedPage BytesTree::Cursor::page() const
+{
+    return tree_->page(leaf_);
+}
+
+int BytesTree::Cursor::moveTo(off_t offset, int pos)
+{
+    release();
+
+    while (offset != INVALID_OFFSET) {
+        char *leaf = tree_->fetchBlock(offset);
+        SlottedPage p = tree_->page(leaf);
+        if (pos < 0) pos += p.count();
+
+        if (pos >= 0 && pos < p.count()) {
+            leaf_ = leaf;
+            pos_ = pos;
+            return S_OK;
+        }
+
+        // 越界则移动到相邻的叶子
+        offset = pos < 0 ? p.header()->prev : p.header()->next;
+        pos = pos < 0 ? -1 : 0;
+        tree_->pool_->unpin(leaf);
+    }
+    return S_FALSE;
+}
+
+void BytesTree::Cursor::release()
+{
+    if (leaf_ == NULL) return;
+
+    tree_->pool_->unpin(leaf_);
+    leaf_ = NULL;
+}
+
+BytesTree::ValueReader::ValueReader(BytesTree *tree)
+    : tree_(tree)
+    , page_(NULL)
+    , data_(NULL)
+    , len_(0)
+    , next_(INVALID_OFFSET)
+    , size_(0)
+{
+}
+
+BytesTree::ValueReader::~ValueReader()
+{
+    release();
+}
+
+int BytesTree::ValueReader::open(const char *k, int klen)
+{
+    release();
+    data_ = NULL;
+    next_ = INVALID_OFFSET;
+    size_ = 0;
+
+    off_t offset = tree_->descend(k, klen, false);
+    if (offset == INVALID_OFFSET) return S_FALSE;
+
+    char *leaf = tree_->fetchBlock(offset);
+    SlottedPage p = tree_->page(leaf);
+    int pos = p.search(k, klen);
+    if (pos < 0) {
+        tree_->pool_->unpin(leaf);
+        return S_FALSE;
+    }
+
+    int len;
+    const char *v = p.payload(pos, &len);
+    if (!p.external(pos)) {
+        // 叶子中的value直接返回,叶子占用到下一次调用next
+        page_ = leaf;
+        data_ = v;
+        len_ = len;
+        size_ = len;
+        return S_OK;
+    }
+
+    OverflowRef ref;
+    memcpy(&ref, v, sizeof ref);
+    size_ = ref.size;
+    next_ = ref.first;
+    tree_->pool_->unpin(leaf);
+    return S_OK;
+}
+
+int BytesTree::ValueReader::next(const char **data, int *len)
+{
+    if (data_ != NULL) {
+        *data = data_;
+        *len = len_;
+        data_ = NULL;
+        return S_OK;
+    }
+
+    release();
+    if (next_ == INVALID_OFFSET) return S_FALSE;
+
+    page_ = tree_->fetchBlock(next_);
+    PageHeader *h = (PageHeader *) page_;
+    *data = page_ + sizeof(PageHeader);
+    *len = h->count;
+    next_ = h->next;
+    return S_OK;
+}
+
+void BytesTree::ValueReader::release()
+{
+    if (page_ == NULL) return;
+
+    tree_->pool_->unpin(page_);
+    page_ = NULL;
+}
@@ -0,0 +1,140 @@
+/*
+ * @file Crc32c.cc
+ * @brief
+ * CRC32C源文件,crc32指令的实现通过target属性编译,不要求编译选项
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#if defined(__x86_64__)
+#define CRC32C_X86
+#include <immintrin.h>
+#endif
+#include <string.h>
+#include "Crc32c.h"
+#include "NodeSearch.h"
+
+static const uint32_t POLY = 0x82f63b78; // 按位反转的多项式
+static const int CHUNK = 256; // 三路交错时每一路的长度
+
+struct CrcTables
+{
+    uint32_t slice[8][256]; // slice[k][n]: 字节n之后再经过k个0字节
+    uint32_t shift[4][256]; // 寄存器经过CHUNK个0字节,按寄存器的字节拆分
+
+    CrcTables()
+    {
+        for (int n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; k++)
+                crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+            slice[0][n] = crc;
+        }
+        for (int n = 0; n < 256; n++) {
+            for (int k = 1; k < 8; k++) {
+                uint32_t crc = slice[k - 1][n];
+                slice[k][n] = (crc >> 8) ^ slice[0][crc & 0xff];
+            }
+        }
+
+        // 经过0字节是线性变换,先求每一位的结果再组合
+        uint32_t basis[32];
+        for (int i = 0; i < 32; i++) {
+            uint32_t crc = 1u << i;
+            for (int b = 0; b < CHUNK; b++)
+                crc = (crc >> 8) ^ slice[0][crc & 0xff];
+            basis[i] = crc;
+        }
+        for (int k = 0; k < 4; k++) {
+            for (int n = 0; n < 256; n++) {
+                uint32_t crc = 0;
+                for (int j = 0; j < 8; j++)
+                    if ((n >> j) & 1) crc ^= basis[k * 8 + j];
+                shift[k][n] = crc;
+            }
+        }
+    }
+};
+
+static const CrcTables tables;
+
+static uint32_t scalarExtend(uint32_t crc, const char *p, size_t len)
+{
+    const uint32_t (*t)[256] = tables.slice;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof w);
+        w ^= crc;
+        crc = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^ t[5][(w >> 16) & 0xff]
+              ^ t[4][(w >> 24) & 0xff] ^ t[3][(w >> 32) & 0xff]
+              ^ t[2][(w >> 40) & 0xff] ^ t[1][(w >> 48) & 0xff]
+              ^ t[0][w >> 56];
+    }
+    for (; len > 0; p++, len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ (unsigned char) *p) & 0xff];
+    return crc;
+}
+
+#ifdef CRC32C_X86
+// 寄存器值经过CHUNK个0字节
+static inline uint32_t shiftChunk(uint32_t crc)
+{
+    const uint32_t (*t)[256] = tables.shift;
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff]
+           ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+/**
+ * crc32指令的延迟为3个周期,吞吐为每周期1条: 相邻的三段分别从0开始计算,
+ * 再把前一段的结果经过CHUNK个0字节后异或到后一段上
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+sseExtend(uint32_t crc, const char *p, size_t len)
+{
+    uint64_t crc0 = crc;
+    for (; len >= 3 * CHUNK; p += 3 * CHUNK, len -= 3 * CHUNK) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (int i = 0; i < CHUNK; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + CHUNK + i, 8);
+            memcpy(&c, p + 2 * CHUNK + i, 8);
+            crc0 = _mm_crc32_u64(crc0, a);
+            crc1 = _mm_crc32_u64(crc1, b);
+            crc2 = _mm_crc32_u64(crc2, c);
+        }
+        crc0 = shiftChunk((uint32_t) crc0) ^ crc1;
+        crc0 = shiftChunk((uint32_t) crc0) ^ crc2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof w);
+        crc0 = _mm_crc32_u64(crc0, w);
+    }
+    uint32_t crc32 = (uint32_t) crc0;
+    for (; len > 0; p++, len--)
+        crc32 = _mm_crc32_u8(crc32, (unsigned char) *p);
+    return crc32;
+}
+#endif
+
+int Crc32c::isa_ = NodeSearch::ISA_SCALAR;
+Crc32c::Extend Crc32c::extend_ = scalarExtend;
+
+static bool isaSelected = Crc32c::select(NodeSearch::detect());
+
+bool Crc32c::select(int isa)
+{
+    if (isa > NodeSearch::detect()) return false;
+
+#ifdef CRC32C_X86
+    if (isa >= NodeSearch::ISA_SSE) {
+        extend_ = sseExtend;
+        isa_ = NodeSearch::ISA_SSE;
+        return true;
+    }
+#endif
+    extend_ = scalarExtend;
+    isa_ = NodeSearch::ISA_SCALAR;
+    return true;
+}
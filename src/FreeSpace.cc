@@ -0,0 +1,125 @@
+/*
+ * @file FreeSpace.cc
+ * @brief
+ * 空闲空间管理源文件
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <string.h>
+#include "FreeSpace.h"
+
+static const uint64_t FULL_WORD = ~0ull;
+
+FreeSpace::FreeSpace() : pages_(0), lowest_(0) {}
+
+void FreeSpace::resize(off_t pages)
+{
+    size_t old = words_.size();
+
+    // 最后一个字中超出块数的位记为已使用,分配时不会选中,改变块数前先清除
+    if (pages_ % 64 != 0) words_.back() &= (1ull << (pages_ % 64)) - 1;
+    words_.resize((pages + 63) / 64, 0);
+    pages_ = pages;
+    if (pages_ % 64 != 0) words_.back() |= FULL_WORD << (pages_ % 64);
+
+    // 原来的最后一个字可能有了空闲的位
+    if (old > 0 && lowest_ > old - 1) lowest_ = old - 1;
+    if (lowest_ > words_.size()) lowest_ = words_.size();
+    while (lowest_ < words_.size() && words_[lowest_] == FULL_WORD) lowest_++;
+}
+
+void FreeSpace::mark(off_t page)
+{
+    assert(page >= 0 && page < pages_);
+    words_[page / 64] |= 1ull << (page % 64);
+    while (lowest_ < words_.size() && words_[lowest_] == FULL_WORD) lowest_++;
+}
+
+void FreeSpace::release(off_t page)
+{
+    assert(page >= 0 && page < pages_);
+    size_t w = page / 64;
+    words_[w] &= ~(1ull << (page % 64));
+    if (w < lowest_) lowest_ = w;
+}
+
+off_t FreeSpace::near(off_t hint, int range, bool after) const
+{
+    // 先在优先的方向上找,再找另一个方向
+    for (int pass = 0; pass < 2; pass++, after = !after) {
+        for (int d = 1; d <= range; d++) {
+            off_t page = after ? hint + d : hint - d;
+            if (page < 0 || page >= pages_) break;
+            if (!used(page)) return page;
+        }
+    }
+    return NONE;
+}
+
+off_t FreeSpace::lowest() const
+{
+    for (size_t w = lowest_; w < words_.size(); w++) {
+        if (words_[w] != FULL_WORD)
+            return (off_t) w * 64 + __builtin_ctzll(~words_[w]);
+    }
+    return NONE;
+}
+
+off_t FreeSpace::lowestRun(int n) const
+{
+    off_t start = NONE;
+    int len = 0;
+    for (size_t w = lowest_; w < words_.size(); w++) {
+        uint64_t word = words_[w];
+        if (word == FULL_WORD) {
+            len = 0;
+            continue;
+        }
+        // 整字空闲
+        if (word == 0) {
+            if (len == 0) start = (off_t) w * 64;
+            len += 64;
+            if (len >= n) return start;
+            continue;
+        }
+        for (int b = 0; b < 64; b++) {
+            if ((word >> b) & 1) {
+                len = 0;
+                continue;
+            }
+            if (len == 0) start = (off_t) w * 64 + b;
+            if (++len >= n) return start;
+        }
+    }
+    return NONE;
+}
+
+off_t FreeSpace::usedEnd() const
+{
+    for (size_t w = words_.size(); w-- > 0;) {
+        uint64_t word = words_[w];
+        // 不计超出块数的位
+        if (w == words_.size() - 1 && pages_ % 64 != 0)
+            word &= (1ull << (pages_ % 64)) - 1;
+        if (word != 0) return (off_t) w * 64 + 64 - __builtin_clzll(word);
+    }
+    return 0;
+}
+
+void FreeSpace::store(char *buf) const
+{
+    if (!words_.empty()) memcpy(buf, &words_[0], bytes());
+}
+
+void FreeSpace::load(const char *buf, off_t pages)
+{
+    words_.assign((pages + 63) / 64, 0);
+    if (!words_.empty()) memcpy(&words_[0], buf, bytes());
+    pages_ = pages;
+    if (pages_ % 64 != 0) words_.back() |= FULL_WORD << (pages_ % 64);
+
+    lowest_ = 0;
+    while (lowest_ < words_.size() && words_[lowest_] == FULL_WORD) lowest_++;
+}
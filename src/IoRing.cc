@@ -0,0 +1,177 @@
+/*
+ * @file IoRing.cc
+ * @brief
+ * io_uring批量读写源文件(直接使用系统调用,不依赖liburing)
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "IoRing.h"
+
+IoRing::IoRing(unsigned entries)
+    : ringFd_(-1)
+    , entries_(0)
+    , sqRing_(MAP_FAILED)
+    , sqRingSize_(0)
+    , sqes_((io_uring_sqe *) MAP_FAILED)
+    , sqesSize_(0)
+    , cqRing_(MAP_FAILED)
+    , cqRingSize_(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    ringFd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd_ < 0) return;
+    entries_ = params.sq_entries;
+
+    // 提交队列与完成队列的共享内存
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize_ > sqRingSize_) sqRingSize_ = cqRingSize_;
+        cqRingSize_ = 0;
+    }
+
+    sqRing_ = mmap(
+        NULL,
+        sqRingSize_,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ringFd_,
+        IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        release();
+        return;
+    }
+
+    if (cqRingSize_ == 0) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(
+            NULL,
+            cqRingSize_,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ringFd_,
+            IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            release();
+            return;
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *) mmap(
+        NULL,
+        sqesSize_,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ringFd_,
+        IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        release();
+        return;
+    }
+
+    char *sq = (char *) sqRing_;
+    sqTail_ = (unsigned *) (sq + params.sq_off.tail);
+    sqMask_ = (unsigned *) (sq + params.sq_off.ring_mask);
+    sqArray_ = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = (char *) cqRing_;
+    cqHead_ = (unsigned *) (cq + params.cq_off.head);
+    cqTail_ = (unsigned *) (cq + params.cq_off.tail);
+    cqMask_ = (unsigned *) (cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *) (cq + params.cq_off.cqes);
+}
+
+IoRing::~IoRing() { release(); }
+
+int IoRing::submit(int fd, Request *reqs, int n)
+{
+    assert(valid());
+
+    int next = 0;     // 下一个待提交的请求
+    int done = 0;     // 已完成的请求数
+    int inflight = 0; // 在途的请求数
+    int unsubmit = 0; // 已放入队列但内核尚未接收的请求数
+    int failed = 0;
+
+    while (done < n) {
+        // 尽量填满提交队列
+        unsigned tail = *sqTail_;
+        while (next < n && inflight < (int) entries_) {
+            unsigned index = tail & *sqMask_;
+            io_uring_sqe *sqe = &sqes_[index];
+            Request &req = reqs[next];
+
+            memset(sqe, 0, sizeof *sqe);
+            sqe->opcode = req.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t) req.buf;
+            sqe->len = req.len;
+            sqe->off = req.offset;
+            sqe->user_data = next;
+
+            sqArray_[index] = index;
+            tail++;
+            next++;
+            inflight++;
+            unsubmit++;
+        }
+        __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+
+        // 提交并至少等待一个完成
+        int ret = syscall(
+            __NR_io_uring_enter,
+            ringFd_,
+            unsubmit,
+            1,
+            IORING_ENTER_GETEVENTS,
+            NULL,
+            0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            assert(0);
+            return n - done;
+        }
+        unsubmit -= ret;
+
+        // 收割完成队列
+        unsigned head = *cqHead_;
+        while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe *cqe = &cqes_[head & *cqMask_];
+            Request &req = reqs[cqe->user_data];
+
+            req.result = cqe->res;
+            if (req.result != req.len) failed++;
+
+            head++;
+            done++;
+            inflight--;
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+
+    return failed;
+}
+
+void IoRing::release()
+{
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqesSize_);
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != MAP_FAILED) munmap(sqRing_, sqRingSize_);
+    if (ringFd_ >= 0) close(ringFd_);
+
+    sqes_ = (io_uring_sqe *) MAP_FAILED;
+    cqRing_ = sqRing_ = MAP_FAILED;
+    ringFd_ = -1;
+}
@@ -0,0 +1,121 @@
+/*
+ * @file LeafCodec.cc
+ * @brief
+ * 压缩叶子的差值解码,与NodeSearch相同在加载时选择指令集
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define LEAF_CODEC_X86
+#include <immintrin.h>
+#endif
+#include "LeafCodec.h"
+#include "NodeSearch.h"
+
+// 第i个差值的长度码
+static inline int lengthCode(const uint8_t *ctrl, int i)
+{
+    return ctrl[i >> 2] >> ((i & 3) * 2) & 3;
+}
+
+// 从第i个开始逐个解码
+static const char *scalarDecodeFrom(
+    const uint8_t *ctrl,
+    const char *data,
+    const char *end,
+    int i,
+    int n,
+    uint64_t *out)
+{
+    for (; i < n; i++) {
+        int len = 1 << lengthCode(ctrl, i);
+        uint64_t d = 0;
+        if (data + len <= end) {
+            for (int j = len - 1; j >= 0; j--)
+                d = d << 8 | (uint8_t) data[j];
+        }
+        out[i] = d;
+        data += len;
+    }
+    return data;
+}
+
+static const char *scalarDecode(
+    const uint8_t *ctrl,
+    const char *data,
+    const char *end,
+    int n,
+    uint64_t *out)
+{
+    return scalarDecodeFrom(ctrl, data, end, 0, n, out);
+}
+
+#ifdef LEAF_CODEC_X86
+/**
+ * 两个差值的长度码(4位)对应的pshufb掩码: 第一个差值的字节放到低64位,
+ * 第二个放到高64位,其余字节为0; 以及两个差值共占用的字节数
+ */
+struct PairShuffle
+{
+    __m128i mask[16];
+    int bytes[16];
+
+    PairShuffle()
+    {
+        for (int c = 0; c < 16; c++) {
+            int first = 1 << (c & 3), second = 1 << (c >> 2);
+            char m[16];
+            for (int j = 0; j < 8; j++) {
+                m[j] = j < first ? j : (char) 0x80;
+                m[8 + j] = j < second ? first + j : (char) 0x80;
+            }
+            mask[c] = _mm_loadu_si128((const __m128i *) m);
+            bytes[c] = first + second;
+        }
+    }
+};
+
+static const PairShuffle pairShuffle;
+
+// 每次读取16字节解出两个差值,剩余不足16字节时逐个解码
+__attribute__((target("ssse3"))) static const char *ssse3Decode(
+    const uint8_t *ctrl,
+    const char *data,
+    const char *end,
+    int n,
+    uint64_t *out)
+{
+    int i = 0;
+    for (; i + 2 <= n && data + 16 <= end; i += 2) {
+        int c = ctrl[i >> 2] >> ((i & 3) * 2) & 0xf;
+        __m128i d = _mm_loadu_si128((const __m128i *) data);
+        d = _mm_shuffle_epi8(d, pairShuffle.mask[c]);
+        _mm_storeu_si128((__m128i *) (out + i), d);
+        data += pairShuffle.bytes[c];
+    }
+    return scalarDecodeFrom(ctrl, data, end, i, n, out);
+}
+#endif
+
+int DeltaCodec::isa_ = NodeSearch::ISA_SCALAR;
+DeltaCodec::Decode DeltaCodec::decode_ = scalarDecode;
+
+// SSE4.2的CPU都支持SSSE3
+static bool isaSelected = DeltaCodec::select(NodeSearch::detect());
+
+bool DeltaCodec::select(int isa)
+{
+    if (isa > NodeSearch::detect()) return false;
+
+#ifdef LEAF_CODEC_X86
+    if (isa >= NodeSearch::ISA_SSE) {
+        decode_ = ssse3Decode;
+        isa_ = isa;
+        return true;
+    }
+#endif
+    decode_ = scalarDecode;
+    isa_ = NodeSearch::ISA_SCALAR;
+    return true;
+}
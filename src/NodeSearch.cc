@@ -0,0 +1,162 @@
+/*
+ * @file NodeSearch.cc
+ * @brief
+ * 节点内查找源文件,各指令集的实现通过target属性编译,不要求编译选项
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define NODE_SEARCH_X86
+#include <immintrin.h>
+#endif
+#include "NodeSearch.h"
+
+// 窗口中前n个key对应的位
+static inline unsigned validMask(int n, int window)
+{
+    return n >= window ? (1u << window) - 1 : (1u << n) - 1;
+}
+
+template <typename T>
+static int scalarWindow(const T *keys, int n, T target)
+{
+    const int window = NodeSearch::WINDOW_BYTES / sizeof(T);
+    if (n > window) n = window;
+
+    int less = 0;
+    for (int i = 0; i < n; i++) less += keys[i] < target;
+    return less;
+}
+
+#ifdef NODE_SEARCH_X86
+__attribute__((target("sse4.2"))) static int
+sseWindow32(const int32_t *keys, int n, int32_t target)
+{
+    __m128i t = _mm_set1_epi32(target);
+    unsigned mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i *) (keys + i * 4));
+        __m128 lt = _mm_castsi128_ps(_mm_cmpgt_epi32(t, k));
+        mask |= _mm_movemask_ps(lt) << (i * 4);
+    }
+    return __builtin_popcount(mask & validMask(n, 16));
+}
+
+__attribute__((target("sse4.2"))) static int
+sseWindow64(const int64_t *keys, int n, int64_t target)
+{
+    __m128i t = _mm_set1_epi64x(target);
+    unsigned mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i *) (keys + i * 2));
+        __m128d lt = _mm_castsi128_pd(_mm_cmpgt_epi64(t, k));
+        mask |= _mm_movemask_pd(lt) << (i * 2);
+    }
+    return __builtin_popcount(mask & validMask(n, 8));
+}
+
+__attribute__((target("avx2"))) static int
+avx2Window32(const int32_t *keys, int n, int32_t target)
+{
+    __m256i t = _mm256_set1_epi32(target);
+    __m256i a = _mm256_loadu_si256((const __m256i *) keys);
+    __m256i b = _mm256_loadu_si256((const __m256i *) (keys + 8));
+    __m256 ltA = _mm256_castsi256_ps(_mm256_cmpgt_epi32(t, a));
+    __m256 ltB = _mm256_castsi256_ps(_mm256_cmpgt_epi32(t, b));
+    unsigned mask = _mm256_movemask_ps(ltA) | _mm256_movemask_ps(ltB) << 8;
+    return __builtin_popcount(mask & validMask(n, 16));
+}
+
+__attribute__((target("avx2"))) static int
+avx2Window64(const int64_t *keys, int n, int64_t target)
+{
+    __m256i t = _mm256_set1_epi64x(target);
+    __m256i a = _mm256_loadu_si256((const __m256i *) keys);
+    __m256i b = _mm256_loadu_si256((const __m256i *) (keys + 4));
+    __m256d ltA = _mm256_castsi256_pd(_mm256_cmpgt_epi64(t, a));
+    __m256d ltB = _mm256_castsi256_pd(_mm256_cmpgt_epi64(t, b));
+    unsigned mask = _mm256_movemask_pd(ltA) | _mm256_movemask_pd(ltB) << 4;
+    return __builtin_popcount(mask & validMask(n, 8));
+}
+
+// 带掩码的读取不会访问窗口中无效的key
+__attribute__((target("avx512f"))) static int
+avx512Window32(const int32_t *keys, int n, int32_t target)
+{
+    __mmask16 valid = validMask(n, 16);
+    __m512i k = _mm512_maskz_loadu_epi32(valid, keys);
+    __m512i t = _mm512_set1_epi32(target);
+    return __builtin_popcount(_mm512_mask_cmplt_epi32_mask(valid, k, t));
+}
+
+__attribute__((target("avx512f"))) static int
+avx512Window64(const int64_t *keys, int n, int64_t target)
+{
+    __mmask8 valid = validMask(n, 8);
+    __m512i k = _mm512_maskz_loadu_epi64(valid, keys);
+    __m512i t = _mm512_set1_epi64(target);
+    return __builtin_popcount(_mm512_mask_cmplt_epi64_mask(valid, k, t));
+}
+#endif
+
+int NodeSearch::isa_ = NodeSearch::ISA_SCALAR;
+NodeSearch::Window32 NodeSearch::window32_ = scalarWindow<int32_t>;
+NodeSearch::Window64 NodeSearch::window64_ = scalarWindow<int64_t>;
+
+// 加载时选择CPU支持的最好的指令集
+static bool isaSelected = NodeSearch::select(NodeSearch::detect());
+
+const char *NodeSearch::isaName(int isa)
+{
+    switch (isa) {
+    case ISA_SSE:
+        return "sse4.2";
+    case ISA_AVX2:
+        return "avx2";
+    case ISA_AVX512:
+        return "avx512f";
+    default:
+        return "scalar";
+    }
+}
+
+bool NodeSearch::select(int isa)
+{
+    if (isa > detect()) return false;
+
+    switch (isa) {
+#ifdef NODE_SEARCH_X86
+    case ISA_SSE:
+        window32_ = sseWindow32;
+        window64_ = sseWindow64;
+        break;
+    case ISA_AVX2:
+        window32_ = avx2Window32;
+        window64_ = avx2Window64;
+        break;
+    case ISA_AVX512:
+        window32_ = avx512Window32;
+        window64_ = avx512Window64;
+        break;
+#endif
+    default:
+        isa = ISA_SCALAR;
+        window32_ = scalarWindow<int32_t>;
+        window64_ = scalarWindow<int64_t>;
+        break;
+    }
+    isa_ = isa;
+    return true;
+}
+
+int NodeSearch::detect()
+{
+#ifdef NODE_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return ISA_SSE;
+#endif
+    return ISA_SCALAR;
+}
@@ -0,0 +1,278 @@
+/*
+ * @file SlottedPage.cc
+ * @brief
+ * 变长key的页面格式
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <string.h>
+#include "SlottedPage.h"
+
+// cell中的长度可能不对齐
+static inline int loadLength(const char *p)
+{
+    uint16_t len;
+    memcpy(&len, p, sizeof len);
+    return len;
+}
+
+// cell中payload的长度(去掉EXTERNAL标志)
+static inline int payloadLength(const char *c)
+{
+    return loadLength(c + 2) & ~SlottedPage::EXTERNAL;
+}
+
+static inline void storeLength(char *p, int len)
+{
+    uint16_t v = (uint16_t) len;
+    memcpy(p, &v, sizeof v);
+}
+
+void SlottedPage::init(off_t self, int type)
+{
+    PageHeader *h = header();
+    memset(h, 0, sizeof(PageHeader));
+    h->self = self;
+    h->type = type;
+    h->heap = blockSize_;
+}
+
+const char *SlottedPage::suffix(int i, int *len) const
+{
+    const char *c = cell(i);
+    *len = loadLength(c);
+    return c + CELL_HEADER;
+}
+
+const char *SlottedPage::payload(int i, int *len) const
+{
+    const char *c = cell(i);
+    *len = payloadLength(c);
+    return c + CELL_HEADER + loadLength(c);
+}
+
+bool SlottedPage::external(int i) const
+{
+    return (loadLength(cell(i) + 2) & EXTERNAL) != 0;
+}
+
+std::string SlottedPage::key(int i) const
+{
+    int len;
+    const char *s = suffix(i, &len);
+    std::string k(prefix(), prefixLen());
+    k.append(s, len);
+    return k;
+}
+
+off_t SlottedPage::child(int i) const
+{
+    if (i == count()) return header()->lastOffset;
+
+    int len;
+    off_t offset;
+    memcpy(&offset, payload(i, &len), sizeof offset);
+    return offset;
+}
+
+void SlottedPage::setChild(int i, off_t offset)
+{
+    if (i == count()) {
+        header()->lastOffset = offset;
+        return;
+    }
+
+    int len;
+    memcpy((char *) payload(i, &len), &offset, sizeof offset);
+}
+
+int SlottedPage::search(const char *k, int len) const
+{
+    int n = count();
+    int p = prefixLen();
+
+    // 先与公共前缀比较: 不以前缀开头的key在所有key之前或之后
+    int c = memcmp(k, prefix(), len < p ? len : p);
+    if (c < 0 || (c == 0 && len < p)) return -1;
+    if (c > 0) return -n - 1;
+
+    // 之后只比较后缀
+    k += p;
+    len -= p;
+    int low = 0, high = n - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int slen;
+        const char *s = suffix(mid, &slen);
+        c = compare(s, slen, k, len);
+        if (c == 0) return mid;
+        if (c < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return -low - 1;
+}
+
+int SlottedPage::used() const
+{
+    return blockSize_ - header()->heap + SLOT_SIZE * count()
+           - header()->frag;
+}
+
+bool SlottedPage::insert(
+    int pos,
+    const char *k,
+    int klen,
+    const char *p,
+    int plen,
+    bool external)
+{
+    PageHeader *h = header();
+
+    // 不以公共前缀开头时重建页面,前缀变短
+    if (klen < h->prefix || memcmp(k, prefix(), h->prefix) != 0) {
+        std::vector<Entry> all;
+        entries(&all);
+        Entry e;
+        e.key.assign(k, klen);
+        e.payload.assign(p, plen);
+        e.external = external;
+        all.insert(all.begin() + pos, e);
+        return build(&all[0], (int) all.size());
+    }
+
+    k += h->prefix;
+    klen -= h->prefix;
+    int need = cellSize(klen, plen);
+    if (gap() < need) {
+        if (gap() + h->frag < need) return false;
+        compact();
+    }
+
+    // cell区向前分配
+    h->heap -= need - SLOT_SIZE;
+    char *c = page_ + h->heap;
+    storeLength(c, klen);
+    storeLength(c + 2, external ? plen | EXTERNAL : plen);
+    memcpy(c + CELL_HEADER, k, klen);
+    memcpy(c + CELL_HEADER + klen, p, plen);
+
+    uint16_t *s = slots();
+    memmove(&s[pos + 1], &s[pos], (h->count - pos) * SLOT_SIZE);
+    s[pos] = h->heap;
+    h->count++;
+    return true;
+}
+
+void SlottedPage::remove(int pos)
+{
+    PageHeader *h = header();
+    const char *c = cell(pos);
+    h->frag += CELL_HEADER + loadLength(c) + payloadLength(c);
+
+    uint16_t *s = slots();
+    memmove(&s[pos], &s[pos + 1], (h->count - pos - 1) * SLOT_SIZE);
+    h->count--;
+
+    // 空页面不再保留前缀
+    if (h->count == 0) {
+        h->heap = blockSize_;
+        h->frag = 0;
+        h->prefix = 0;
+    }
+}
+
+void SlottedPage::entries(std::vector<Entry> *out) const
+{
+    for (int i = 0; i < count(); i++) {
+        Entry e;
+        e.key = key(i);
+        int len;
+        const char *p = payload(i, &len);
+        e.payload.assign(p, len);
+        e.external = external(i);
+        out->push_back(e);
+    }
+}
+
+int SlottedPage::size(const Entry *e, int n)
+{
+    if (n == 0) return 0;
+
+    // 有序的key的公共前缀即第一个与最后一个的公共前缀
+    const std::string &first = e[0].key, &last = e[n - 1].key;
+    int p = commonPrefix(first.data(), first.size(), last.data(), last.size());
+    int total = p;
+    for (int i = 0; i < n; i++)
+        total += cellSize(e[i].key.size() - p, e[i].payload.size());
+    return total;
+}
+
+bool SlottedPage::build(const Entry *e, int n)
+{
+    if (size(e, n) > capacity()) return false;
+
+    PageHeader *h = header();
+    h->count = 0;
+    h->frag = 0;
+    h->prefix = 0;
+    if (n > 0) {
+        const std::string &first = e[0].key, &last = e[n - 1].key;
+        h->prefix =
+            commonPrefix(first.data(), first.size(), last.data(), last.size());
+    }
+    h->heap = blockSize_ - h->prefix;
+    if (n > 0) memcpy(page_ + h->heap, e[0].key.data(), h->prefix);
+
+    for (int i = 0; i < n; i++) {
+        bool ok = insert(
+            i,
+            e[i].key.data(),
+            e[i].key.size(),
+            e[i].payload.data(),
+            e[i].payload.size(),
+            e[i].external);
+        assert(ok);
+        (void) ok;
+    }
+    return true;
+}
+
+int SlottedPage::compare(const char *a, int alen, const char *b, int blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) return c;
+    return alen - blen;
+}
+
+int SlottedPage::commonPrefix(const char *a, int alen, const char *b, int blen)
+{
+    int n = alen < blen ? alen : blen;
+    int i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+void SlottedPage::compact()
+{
+    PageHeader *h = header();
+    std::vector<char> copy(page_, page_ + blockSize_);
+    const char *old = &copy[0];
+
+    // 按slot顺序从块末尾(前缀之前)重新排列cell
+    uint16_t *s = slots();
+    int heap = blockSize_ - h->prefix;
+    for (int i = 0; i < h->count; i++) {
+        const char *c = old + s[i];
+        int len = CELL_HEADER + loadLength(c) + payloadLength(c);
+        heap -= len;
+        memcpy(page_ + heap, c, len);
+        s[i] = heap;
+    }
+    h->heap = heap;
+    h->frag = 0;
+}
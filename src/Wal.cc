@@ -0,0 +1,225 @@
+/*
+ * @file Wal.cc
+ * @brief
+ * 写前日志源文件
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Crc32c.h"
+#include "Wal.h"
+
+Wal::Wal(const char *fileName, int blockSize)
+    : blockSize_(blockSize)
+    , groupSize_(DEFAULT_GROUP_SIZE)
+    , groupOps_(0)
+    , uncommitted_(0)
+    , syncs_(0)
+{
+    fd_ = open(fileName, O_CREAT | O_RDWR, 0644);
+    assert(fd_ >= 0);
+
+    written_ = lseek(fd_, 0, SEEK_END);
+    buf_.reserve(BUFFER_SIZE + sizeof(Record) + blockSize_);
+}
+
+Wal::~Wal()
+{
+    sync();
+    close(fd_);
+}
+
+off_t Wal::appendPage(off_t offset, const void *page)
+{
+    append(WAL_PAGE, offset, page, blockSize_);
+
+    // 负载位于记录末尾
+    return size() - blockSize_;
+}
+
+void Wal::appendMeta(off_t root, off_t fileSize)
+{
+    int64_t size = fileSize;
+    append(WAL_META, root, &size, sizeof size);
+}
+
+void Wal::appendAlloc(off_t offset) { append(WAL_ALLOC, offset, NULL, 0); }
+
+void Wal::appendFree(off_t offset) { append(WAL_FREE, offset, NULL, 0); }
+
+int Wal::commit()
+{
+    if (uncommitted_ == 0) return 0;
+
+    append(WAL_COMMIT, 0, NULL, 0);
+    uncommitted_ = 0;
+
+    // 凑满一组再同步
+    if (++groupOps_ < groupSize_) return 0;
+    return sync();
+}
+
+int Wal::sync()
+{
+    if (writeOut() != 0) return -1;
+    if (groupOps_ == 0) return 0;
+
+    groupOps_ = 0;
+    syncs_++;
+    return fdatasync(fd_);
+}
+
+int Wal::readPage(off_t pos, void *page)
+{
+    if (pos >= written_) {
+        // 仍在缓冲中
+        memcpy(page, &buf_[pos - written_], blockSize_);
+        return 0;
+    }
+    return pread(fd_, page, blockSize_, pos) == blockSize_ ? 0 : -1;
+}
+
+int Wal::recover(Replayer replayer, void *arg)
+{
+    assert(buf_.empty());
+
+    off_t fileSize = lseek(fd_, 0, SEEK_END);
+    if (fileSize <= 0) return 0;
+
+    char *log = (char *) malloc(fileSize);
+    assert(log != NULL);
+    // 读到的部分之后按不完整的尾部处理
+    off_t len = pread(fd_, log, fileSize, 0);
+    fileSize = len > 0 ? len : 0;
+
+    off_t pos = 0;
+    off_t group = 0; // 当前操作的第一条记录
+    int ops = 0;
+
+    while (pos + (off_t) sizeof(Record) <= fileSize) {
+        const Record *record = (const Record *) (log + pos);
+        const char *payload = (const char *) (record + 1);
+
+        // 不完整或损坏的记录之后的内容全部丢弃
+        if (record->type < WAL_PAGE || record->type > WAL_COMMIT) break;
+        if (record->format > FORMAT_CRC32C) break;
+        if (record->length > fileSize - pos - sizeof(Record)) break;
+        if (record->checksum != checksum(record, payload)) break;
+
+        pos += sizeof(Record) + record->length;
+        if (record->type != WAL_COMMIT) continue;
+
+        // 重放一个完整的操作
+        for (off_t p = group; p < pos - (off_t) sizeof(Record);) {
+            const Record *r = (const Record *) (log + p);
+            replayer(r, (const char *) (r + 1), arg);
+            p += sizeof(Record) + r->length;
+        }
+        group = pos;
+        ops++;
+    }
+    free(log);
+
+    // 截掉不完整的尾部
+    if (group < fileSize) {
+        int ret = ftruncate(fd_, group);
+        assert(ret == 0);
+        if (ret == 0) fdatasync(fd_);
+    }
+    written_ = group;
+
+    return ops;
+}
+
+int Wal::reset()
+{
+    assert(uncommitted_ == 0);
+
+    buf_.clear();
+    written_ = 0;
+    groupOps_ = 0;
+    if (ftruncate(fd_, 0) != 0) return -1;
+    return fdatasync(fd_);
+}
+
+void Wal::append(
+    uint32_t type,
+    off_t offset,
+    const void *payload,
+    uint32_t length)
+{
+    Record record;
+    record.type = type;
+    record.length = length;
+    record.format = FORMAT_CRC32C;
+    record.offset = offset;
+    record.checksum = checksum(&record, payload);
+
+    const char *p = (const char *) &record;
+    buf_.insert(buf_.end(), p, p + sizeof record);
+    if (length > 0) {
+        p = (const char *) payload;
+        buf_.insert(buf_.end(), p, p + length);
+    }
+    uncommitted_++;
+
+    if (buf_.size() >= BUFFER_SIZE) writeOut();
+}
+
+int Wal::writeOut()
+{
+    if (buf_.empty()) return 0;
+
+    // 写入完整的记录,不完整的操作在恢复时会被丢弃
+    int len = pwrite(fd_, &buf_[0], buf_.size(), written_);
+    if (len != (int) buf_.size()) return -1;
+
+    written_ += len;
+    buf_.clear();
+    return 0;
+}
+
+uint32_t Wal::checksum(const Record *record, const void *payload)
+{
+    if (record->format == FORMAT_FNV) return fnvChecksum(record, payload);
+
+    // 头部(不含checksum字段)与负载连续计算
+    uint32_t crc = Crc32c::compute(
+        &record->type, sizeof(Record) - sizeof(record->checksum));
+    return Crc32c::extend(crc, payload, record->length);
+}
+
+// v4格式: 按64位字计算的FNV-1a, 4路交错以提高指令并行度
+uint32_t Wal::fnvChecksum(const Record *record, const void *payload)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash[4] = {
+        14695981039346656037ull, 14695981039346656037ull ^ 1,
+        14695981039346656037ull ^ 2, 14695981039346656037ull ^ 3};
+    uint64_t word[4];
+
+    // 头部(不含checksum字段)按32位字计算
+    const char *p = (const char *) &record->type;
+    for (size_t i = 0; i + 4 <= sizeof(Record) - 4; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        hash[0] = (hash[0] ^ w) * prime;
+    }
+
+    p = (const char *) payload;
+    size_t i = 0;
+    for (; i + sizeof word <= record->length; i += sizeof word) {
+        memcpy(word, p + i, sizeof word);
+        for (int j = 0; j < 4; j++)
+            hash[j] = (hash[j] ^ word[j]) * prime;
+    }
+    for (; i < record->length; i++)
+        hash[0] = (hash[0] ^ (unsigned char) p[i]) * prime;
+
+    uint64_t h = hash[0] ^ (hash[1] * 3) ^ (hash[2] * 5) ^ (hash[3] * 7);
+    return (uint32_t) (h ^ (h >> 32));
+}
@@ -0,0 +1,152 @@
+/*
+ * @file TreeCheck.h
+ * @brief
+ * 测试的公共部分: 对树和std::map做同样的修改,再比较两者的内容
+ * 失败时打印位置并以非0退出,由ctest判定
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#ifndef __TREECHECK_H__
+#define __TREECHECK_H__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "BPlusTree.h"
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                         \
+        }                                                                    \
+    } while (0)
+
+// 文件中的超级块(块0),与BPlusTree::Superblock的布局相同
+struct DiskSuper
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t blockSize;
+    int64_t fileSize;
+    PageId root;
+    PageId freeMap;
+    uint32_t freeMapPages;
+    uint32_t checksum;
+};
+
+// 删除索引文件及其日志/快照文件
+inline void removeIndex(const char *file)
+{
+    unlink(file);
+    unlink((std::string(file) + ".wal").c_str());
+    unlink((std::string(file) + ".snap").c_str());
+}
+
+/**
+ * 在[0, range)中随机插入或删除n次,model同步修改
+ * 约2/3为插入,插入已存在的key应返回S_FALSE且不修改value
+ */
+template <typename Tree, typename Key, typename Value>
+void randomOps(
+    Tree &tree,
+    std::map<Key, Value> &model,
+    int n,
+    long range,
+    unsigned *seed)
+{
+    for (int i = 0; i < n; i++) {
+        Key k = (Key) (rand_r(seed) % range);
+        if (rand_r(seed) % 3 != 0) {
+            Value v = (Value) (k * 3 + 1);
+            if (model.count(k)) {
+                CHECK(tree.insert(k, v + 1) == S_FALSE);
+                continue;
+            }
+            CHECK(tree.insert(k, v) == S_OK);
+            model[k] = v;
+        } else {
+            bool found = model.erase(k) > 0;
+            CHECK((tree.remove(k) == S_OK) == found);
+        }
+    }
+}
+
+// [0, range)中每个key的查找结果与model一致,游标正反遍历的结果与model相同
+template <typename Tree, typename Key, typename Value>
+void verifyTree(Tree &tree, const std::map<Key, Value> &model, long range)
+{
+    for (long i = 0; i < range; i++) {
+        Key k = (Key) i;
+        Value v;
+        typename std::map<Key, Value>::const_iterator it = model.find(k);
+        int ret = tree.search(k, &v);
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret == S_OK) CHECK(v == it->second);
+    }
+
+    typename Tree::Cursor cursor(&tree);
+    typename std::map<Key, Value>::const_iterator it = model.begin();
+    for (cursor.seekFirst(); cursor.valid(); cursor.next(), ++it) {
+        CHECK(it != model.end());
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    }
+    CHECK(it == model.end());
+
+    typename std::map<Key, Value>::const_reverse_iterator rit = model.rbegin();
+    for (cursor.seekLast(); cursor.valid(); cursor.prev(), ++rit) {
+        CHECK(rit != model.rend());
+        CHECK(cursor.key() == rit->first);
+    }
+    CHECK(rit == model.rend());
+}
+
+/**
+ * 子进程以写前日志打开file,随机修改n次后sync,不关闭直接退出(模拟崩溃),
+ * 修改只在日志中; 父进程对model做同样的修改
+ * replay为打开时是否应重放上次崩溃前的日志
+ */
+template <typename Key, typename Value, int BlockSize>
+void crashAfterSync(
+    const char *file,
+    std::map<Key, Value> &model,
+    int n,
+    long range,
+    unsigned *seed,
+    int groupSize,
+    bool replay)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+
+    // 子进程与父进程使用同样的随机序列,父进程只修改model
+    unsigned childSeed = *seed;
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        std::map<Key, Value> childModel = model;
+        Tree *tree = new Tree(file, 16 * BlockSize, BPLUS_TREE_WAL);
+        CHECK((tree->recovered() > 0) == replay);
+        tree->setGroupCommit(groupSize);
+        randomOps(*tree, childModel, n, range, &childSeed);
+        tree->sync();
+        // 不析构: 没有检查点
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    for (int i = 0; i < n; i++) {
+        Key k = (Key) (rand_r(seed) % range);
+        if (rand_r(seed) % 3 != 0) {
+            if (!model.count(k)) model[k] = (Value) (k * 3 + 1);
+        } else {
+            model.erase(k);
+        }
+    }
+}
+
+#endif // __TREECHECK_H__
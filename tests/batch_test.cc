@@ -0,0 +1,121 @@
+/*
+ * @file batch_test.cc
+ * @brief
+ * 批量写入: 一个叶子放不下整组插入(退回逐个插入,分裂)、整段删除
+ * (退回逐个删除,借数据与合并)、同一个key的多次修改以最后一次为准、
+ * 提交后batch被清空; 随机的batch与std::map对照,重新打开后再比较
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include "TreeCheck.h"
+
+template <typename Tree, typename Key, typename Value>
+static void put(
+    typename Tree::WriteBatch &batch,
+    std::map<Key, Value> &model,
+    Key k,
+    Value v)
+{
+    batch.put(k, v);
+    model[k] = v;
+}
+
+template <typename Tree, typename Key, typename Value>
+static void remove(
+    typename Tree::WriteBatch &batch,
+    std::map<Key, Value> &model,
+    Key k)
+{
+    batch.remove(k);
+    model.erase(k);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int flags, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    typedef typename Tree::WriteBatch Batch;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + flags;
+    const long step = 1000;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+
+        // 空的batch
+        Batch empty;
+        CHECK(tree.commit(&empty) == S_OK);
+
+        // 稀疏的key,每个叶子覆盖很大的范围
+        Batch batch;
+        for (long k = 0; k < range; k += step)
+            put<Tree>(batch, model, (Key) k, (Value) (k + 1));
+        CHECK(tree.commit(&batch) == S_OK);
+        verifyTree(tree, model, range);
+
+        // 落在同一个叶子中的插入远超出叶子的容量,逐个插入时分裂
+        for (long k = step; k < range; k += 7 * step) {
+            for (long i = 1; i < step; i++)
+                put<Tree>(batch, model, (Key) (k + i), (Value) (k + i));
+        }
+        CHECK(tree.commit(&batch) == S_OK);
+        verifyTree(tree, model, range);
+
+        // 删除整段,剩下的叶子下溢,逐个删除时借数据与合并
+        for (long k = step; k < range; k += 7 * step) {
+            for (long i = 0; i < step - 3; i++)
+                remove<Tree>(batch, model, (Key) (k + i));
+        }
+        CHECK(tree.commit(&batch) == S_OK);
+        verifyTree(tree, model, range);
+
+        // 同一个key以最后一次修改为准
+        put<Tree>(batch, model, (Key) 3, (Value) 1);
+        remove<Tree>(batch, model, (Key) 3);
+        put<Tree>(batch, model, (Key) 3, (Value) 2);
+        put<Tree>(batch, model, (Key) 4, (Value) 1);
+        remove<Tree>(batch, model, (Key) 4);
+        remove<Tree>(batch, model, (Key) 5);
+        put<Tree>(batch, model, (Key) 5, (Value) 9);
+        CHECK(tree.commit(&batch) == S_OK);
+        verifyTree(tree, model, range);
+
+        // 提交后batch为空,再次提交不会重复修改
+        CHECK(tree.remove((Key) 3) == S_OK);
+        model.erase((Key) 3);
+        CHECK(tree.commit(&batch) == S_OK);
+        verifyTree(tree, model, range);
+
+        // 随机的batch,大小从1到几千
+        for (int round = 0; round < 40; round++) {
+            int n = 1 + rand_r(&seed) % (round % 4 == 0 ? 4000 : 40);
+            for (int i = 0; i < n; i++) {
+                Key k = (Key) (rand_r(&seed) % range);
+                if (rand_r(&seed) % 3 == 0)
+                    remove<Tree>(batch, model, k);
+                else
+                    put<Tree>(batch, model, k, (Value) (k * 3 + round));
+            }
+            CHECK(tree.commit(&batch) == S_OK);
+        }
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("batch_long128.idx", 0, 100000);
+    run<int, int, 4096>("batch_int4096.idx", 0, 200000);
+    run<long, long, 128>("batch_concurrent.idx", BPLUS_TREE_CONCURRENT, 100000);
+    run<long, long, 4096>("batch_packed.idx", BPLUS_TREE_COMPRESS, 200000);
+    run<long, long, 4096>("batch_wal.idx", BPLUS_TREE_WAL, 200000);
+    printf("batch_test passed\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * @file bulk_test.cc
+ * @brief
+ * 批量建树: 叶子按填充率装满(最后两个叶子平分)并按key的顺序连续存放,
+ * 非叶子节点的子节点数不超过填充率; 填充率减半时叶子数约加倍;
+ * 非空树、乱序输入、非法填充率返回S_FALSE且不改变树
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <algorithm>
+#include <vector>
+#include "TreeCheck.h"
+
+// 文件中的叶子按块号排列
+struct LeafInfo
+{
+    off_t page;
+    int count;
+    int type;
+    PageId next;
+};
+
+template <int BlockSize>
+static void scanFile(
+    const char *file,
+    std::vector<LeafInfo> *leaves,
+    std::vector<int> *children)
+{
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    char buf[BlockSize];
+    for (off_t page = 1;
+         pread(fd, buf, BlockSize, page * BlockSize) == BlockSize;
+         page++) {
+        const Node *node = (const Node *) buf;
+        if (node->self != page || node->count <= 0) continue;
+        // 叶子为0(压缩叶子为3),非叶子节点为1
+        if (node->type == 0 || node->type == 3) {
+            LeafInfo leaf = {page, node->count, node->type, node->next};
+            leaves->push_back(leaf);
+        } else if (node->type == 1) {
+            children->push_back(node->count + 1);
+        }
+    }
+    close(fd);
+}
+
+// 在空的索引上以fill建树,返回叶子数
+template <typename Key, typename Value, int BlockSize>
+static size_t load(const char *file, int flags, double fill, long n)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    std::vector<Key> keys;
+    std::vector<Value> values;
+    for (long i = 0; i < n; i++) {
+        keys.push_back((Key) (i * 2));
+        values.push_back((Value) (i * 6 + 1));
+        model[keys.back()] = values.back();
+    }
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        CHECK(tree.bulkLoad(&keys[0], &values[0], n, fill) == S_OK);
+        verifyTree(tree, model, n * 2);
+    }
+
+    std::vector<LeafInfo> leaves;
+    std::vector<int> children;
+    scanFile<BlockSize>(file, &leaves, &children);
+    CHECK(!leaves.empty());
+
+    // 叶子按key的顺序顺序分配
+    for (size_t i = 0; i + 1 < leaves.size(); i++)
+        CHECK(leaves[i].next == leaves[i + 1].page);
+    CHECK(leaves.back().next == 0xDEADBEEF);
+
+    // 按BPlusTree中的方式计算度,压缩叶子按编码大小装满,只检查上限
+    const int keyOffset = ((int) sizeof(Node) + alignof(Key) - 1)
+                          / alignof(Key) * alignof(Key);
+    const int slot = sizeof(Value) > 4 ? sizeof(Value) : 4;
+    const int degree =
+        (BlockSize - keyOffset - 4) / ((int) sizeof(Key) + slot);
+    int leafFill = std::max((int) (degree * fill), 1);
+    int nonLeafFill = std::max((int) ((degree + 1) * fill), 2);
+    if (leaves[0].type == 0) {
+        for (size_t i = 0; i < leaves.size(); i++) {
+            CHECK(leaves[i].count <= leafFill);
+            if (i + 2 < leaves.size()) CHECK(leaves[i].count == leafFill);
+        }
+        CHECK(leaves.size() == (size_t) ((n + leafFill - 1) / leafFill));
+    }
+    // 每个节点至少2个子节点,填充率为2时奇数个子节点中有一个节点为3个
+    if (nonLeafFill == 2) nonLeafFill = 3;
+    for (size_t i = 0; i < children.size(); i++)
+        CHECK(children[i] >= 2 && children[i] <= nonLeafFill);
+
+    // 建好的树可以继续修改
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        unsigned seed = BlockSize;
+        randomOps(tree, model, n / 2, n * 2, &seed);
+        verifyTree(tree, model, n * 2);
+    }
+    removeIndex(file);
+    return leaves.size();
+}
+
+static bool reverseReader(long *k, long *value, void *arg)
+{
+    long *next = (long *) arg;
+    if (*next < 0) return false;
+    *k = *next;
+    *value = *next * 3 + 1;
+    (*next)--;
+    return true;
+}
+
+// 不能建树时返回S_FALSE,树不变
+template <int BlockSize>
+static void invalidLoads(const char *file, int flags)
+{
+    typedef BPlusTree<long, long, BlockSize> Tree;
+    std::map<long, long> model;
+    long keys[] = {1, 2, 3};
+    long values[] = {4, 7, 10};
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        CHECK(tree.bulkLoad(keys, values, 3, 0) == S_FALSE);
+        CHECK(tree.bulkLoad(keys, values, 3, 1.5) == S_FALSE);
+
+        // 乱序的输入在第二个key处失败,之后仍是空树
+        long next = 10000;
+        CHECK(tree.bulkLoad(reverseReader, &next, 1.0) == S_FALSE);
+        verifyTree(tree, model, 10001);
+
+        CHECK(tree.bulkLoad(keys, values, 3, 1.0) == S_OK);
+        for (int i = 0; i < 3; i++) model[keys[i]] = values[i];
+        CHECK(tree.bulkLoad(keys, values, 3, 1.0) == S_FALSE);
+        verifyTree(tree, model, 10);
+    }
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        verifyTree(tree, model, 10);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    const double fills[] = {1.0, 0.5, 0.25};
+    size_t plain[3], packed[3];
+    for (int i = 0; i < 3; i++) {
+        load<long, long, 128>("bulk_long128.idx", 0, fills[i], 5000);
+        load<int, int, 4096>("bulk_int4096.idx", 0, fills[i], 100000);
+        plain[i] = load<long, long, 4096>(
+            "bulk_wal4096.idx", BPLUS_TREE_WAL, fills[i], 100000);
+        packed[i] = load<long, long, 4096>(
+            "bulk_packed4096.idx", BPLUS_TREE_COMPRESS, fills[i], 100000);
+    }
+    // 填充率减半,叶子数约加倍
+    for (int i = 1; i < 3; i++) {
+        CHECK(plain[i] * 10 >= plain[i - 1] * 19);
+        CHECK(packed[i] * 10 >= packed[i - 1] * 19);
+    }
+
+    invalidLoads<128>("bulk_invalid128.idx", 0);
+    invalidLoads<4096>("bulk_invalid4096.idx", BPLUS_TREE_WAL);
+    printf("bulk_test passed\n");
+    return 0;
+}
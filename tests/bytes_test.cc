@@ -0,0 +1,225 @@
+/*
+ * @file bytes_test.cc
+ * @brief
+ * 变长key的B+树: 共享很长前缀的key(类似URL)、含0字节的key、
+ * 互为前缀的key、空key; 随机插入/删除使叶子和非叶子节点分裂与合并,
+ * 查找、游标的seek与双向遍历与std::map对照,重新打开后再比较;
+ * 直接读取文件检查页内的公共前缀只存一次,父节点中的分隔key被截短
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <vector>
+#include "BytesTree.h"
+#include "TreeCheck.h"
+
+typedef std::map<std::string, std::string> Model;
+
+static const int BLOCK_SIZE = 512;
+// 所有key共享的前缀,比叶子中一个entry的上限短
+static const std::string PREFIX =
+    "https://www.example.com/catalog/products/electronics/category-";
+
+// 文件中的块类型
+enum
+{
+    TYPE_LEAF = 0,
+    TYPE_NON_LEAF = 1
+};
+
+// 第i个key: 公共前缀 + 分散的编号,部分key带0字节或互为前缀
+static std::string keyOf(long i)
+{
+    char buf[32];
+    snprintf(buf, sizeof buf, "%03ld/item-%06ld", i % 37, i * 7919 % 100003);
+    std::string k = PREFIX + buf;
+    if (i % 11 == 0) k.push_back('\0');
+    if (i % 13 == 0) k.resize(k.size() - 4);
+    return k;
+}
+
+static std::string valueOf(const std::string &k, int round)
+{
+    return k.substr(PREFIX.size()) + std::string(round % 7, 'v');
+}
+
+static void insert(
+    BytesTree &tree,
+    Model &model,
+    const std::string &k,
+    const std::string &v)
+{
+    int ret = tree.insert(k.data(), k.size(), v.data(), v.size());
+    if (model.count(k)) {
+        CHECK(ret == S_FALSE);
+        return;
+    }
+    CHECK(ret == S_OK);
+    model[k] = v;
+}
+
+static void remove(BytesTree &tree, Model &model, const std::string &k)
+{
+    int ret = tree.remove(k.data(), k.size());
+    CHECK((ret == S_OK) == (model.erase(k) == 1));
+}
+
+// 查找、seek与正反遍历与model一致
+static void verify(BytesTree &tree, const Model &model, long n)
+{
+    for (long i = 0; i < n; i++) {
+        std::string k = keyOf(i), v;
+        Model::const_iterator it = model.find(k);
+        int ret = tree.search(k.data(), k.size(), &v);
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret == S_OK) CHECK(v == it->second);
+    }
+
+    BytesTree::Cursor cursor(&tree);
+    Model::const_iterator it = model.begin();
+    for (cursor.seekFirst(); cursor.valid(); cursor.next(), ++it) {
+        CHECK(it != model.end());
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    }
+    CHECK(it == model.end());
+
+    Model::const_reverse_iterator rit = model.rbegin();
+    for (cursor.seekLast(); cursor.valid(); cursor.prev(), ++rit) {
+        CHECK(rit != model.rend());
+        CHECK(cursor.key() == rit->first);
+    }
+    CHECK(rit == model.rend());
+
+    // seek为lower_bound,包括公共前缀本身和比所有key都大的key
+    std::vector<std::string> probes;
+    probes.push_back("");
+    probes.push_back(PREFIX);
+    probes.push_back(PREFIX + "~");
+    for (long i = 0; i < n; i += 17) {
+        std::string k = keyOf(i);
+        probes.push_back(k);
+        probes.push_back(k + '\0');
+        probes.push_back(k.substr(0, k.size() - 1));
+    }
+    for (size_t i = 0; i < probes.size(); i++) {
+        it = model.lower_bound(probes[i]);
+        int ret = cursor.seek(probes[i].data(), probes[i].size());
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret == S_OK) CHECK(cursor.key() == it->first);
+    }
+}
+
+/**
+ * 直接读取文件: 节点中的key都以PREFIX开头,公共前缀只在块末尾存一次,
+ * 叶子平均存放的entry多于不压缩时一个叶子能放下的个数;
+ * 非叶子节点中的分隔key至少有一个短于完整的key(后缀截断)
+ */
+static void checkPages(const char *file, size_t minKeyLen)
+{
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    char buf[BLOCK_SIZE];
+    int leaves = 0, entries = 0, truncated = 0;
+    for (off_t offset = BLOCK_SIZE;
+         pread(fd, buf, BLOCK_SIZE, offset) == BLOCK_SIZE;
+         offset += BLOCK_SIZE) {
+        SlottedPage p(buf, BLOCK_SIZE);
+        if (p.header()->self != offset || p.count() < 2) continue;
+        int type = p.header()->type;
+        if (type != TYPE_LEAF && type != TYPE_NON_LEAF) continue;
+
+        CHECK(p.prefixLen() >= (int) PREFIX.size());
+        CHECK(std::string(p.prefix(), PREFIX.size()) == PREFIX);
+        for (int i = 0; i < p.count(); i++) {
+            std::string k = p.key(i);
+            CHECK(k.compare(0, p.prefixLen(), p.prefix(), p.prefixLen()) == 0);
+            if (i > 0) CHECK(p.key(i - 1) < k);
+            if (type == TYPE_NON_LEAF && k.size() < minKeyLen) truncated++;
+        }
+        if (type == TYPE_LEAF) {
+            leaves++;
+            entries += p.count();
+        }
+    }
+    close(fd);
+    CHECK(leaves > 10 && truncated > 0);
+
+    // value至少为key去掉PREFIX的部分
+    int cell = SlottedPage::cellSize(minKeyLen, minKeyLen - PREFIX.size());
+    int uncompressed = (BLOCK_SIZE - (int) sizeof(PageHeader)) / cell;
+    CHECK(entries > leaves * uncompressed);
+}
+
+static void run(const char *file, long n)
+{
+    Model model;
+    unsigned seed = 17;
+    size_t minKeyLen = keyOf(0).size();
+    for (long i = 0; i < n; i++)
+        minKeyLen = std::min(minKeyLen, keyOf(i).size());
+
+    unlink(file);
+    {
+        BytesTree tree(file, BLOCK_SIZE);
+        CHECK(tree.maxKeySize() > (int) keyOf(0).size());
+
+        // 过长的key
+        std::string huge(tree.maxKeySize() + 1, 'k');
+        CHECK(tree.insert(huge.data(), huge.size(), "v", 1) == S_FALSE);
+
+        // 顺序插入一半,再随机插入删除,使节点分裂与合并
+        for (long i = 0; i < n; i += 2)
+            insert(tree, model, keyOf(i), valueOf(keyOf(i), 0));
+        verify(tree, model, n);
+        for (int round = 1; round < 4; round++) {
+            for (long j = 0; j < n; j++) {
+                long i = rand_r(&seed) % n;
+                if (rand_r(&seed) % 3 == 0)
+                    remove(tree, model, keyOf(i));
+                else
+                    insert(tree, model, keyOf(i), valueOf(keyOf(i), round));
+            }
+            verify(tree, model, n);
+        }
+    }
+    checkPages(file, minKeyLen);
+
+    {
+        // 空key,删除大部分,节点合并,树变矮
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+        insert(tree, model, "", "empty");
+        verify(tree, model, n);
+        for (long i = 0; i < n; i++) {
+            if (i % 9 != 0) remove(tree, model, keyOf(i));
+        }
+        verify(tree, model, n);
+        remove(tree, model, "");
+    }
+    {
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+        for (long i = 0; i < n; i++) remove(tree, model, keyOf(i));
+        CHECK(model.empty());
+        verify(tree, model, n);
+        BytesTree::Cursor cursor(&tree);
+        CHECK(cursor.seekFirst() == S_FALSE && cursor.seekLast() == S_FALSE);
+
+        // 删空后重新使用
+        for (long i = 0; i < n; i += 3)
+            insert(tree, model, keyOf(i), valueOf(keyOf(i), 5));
+    }
+    {
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+    }
+    unlink(file);
+}
+
+int main()
+{
+    run("bytes.idx", 20000);
+    printf("bytes_test passed\n");
+    return 0;
+}
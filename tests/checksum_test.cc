@@ -0,0 +1,333 @@
+/*
+ * @file checksum_test.cc
+ * @brief
+ * 损坏的块: 改坏文件中的一个节点(校验和不一致)或在打开后截短文件
+ * (读到的长度不足),落在其中的key的查找、修改和遍历返回S_ERROR,
+ * 其余的key与model一致; 失败的修改不改变树
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "TreeCheck.h"
+
+// 损坏的方式
+enum
+{
+    DAMAGE_CORRUPT,  // 打开前改写块中间的一个字节
+    DAMAGE_TRUNCATE // 打开后把文件截短到块的中间
+};
+
+// 只插入建成的树中节点所在的块(没有空闲块),按块号排序
+template <int BlockSize>
+static void nodePages(
+    const char *file,
+    std::vector<off_t> *leaves,
+    std::vector<off_t> *nonLeaves)
+{
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    char buf[BlockSize];
+    for (off_t page = 1;
+         pread(fd, buf, BlockSize, page * BlockSize) == BlockSize;
+         page++) {
+        const Node *node = (const Node *) buf;
+        if (node->self != page || node->count <= 0) continue;
+        // 叶子为0(压缩叶子为3),非叶子节点为1(Eytzinger布局为2)
+        if (node->type == 0 || node->type == 3)
+            leaves->push_back(page);
+        else if (node->type == 1 || node->type == 2)
+            nonLeaves->push_back(page);
+    }
+    close(fd);
+}
+
+static void copyFile(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    CHECK(in >= 0 && out >= 0);
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(in, buf, sizeof(buf))) > 0)
+        CHECK(write(out, buf, len) == len);
+    close(in);
+    close(out);
+}
+
+static void damage(const char *file, off_t offset, int how)
+{
+    int fd = open(file, O_RDWR);
+    CHECK(fd >= 0);
+    if (how == DAMAGE_CORRUPT) {
+        char c;
+        CHECK(pread(fd, &c, 1, offset) == 1);
+        c ^= 0x5a;
+        CHECK(pwrite(fd, &c, 1, offset) == 1);
+    } else {
+        CHECK(ftruncate(fd, offset) == 0);
+    }
+    close(fd);
+}
+
+// 每个key的查找结果为S_ERROR或与model一致,返回S_ERROR的key
+template <typename Tree, typename Key, typename Value>
+static std::set<Key> searchAll(
+    Tree &tree,
+    const std::map<Key, Value> &model,
+    long range)
+{
+    std::set<Key> lost;
+    for (long i = 0; i < range; i++) {
+        Key k = (Key) i;
+        Value v;
+        typename std::map<Key, Value>::const_iterator it = model.find(k);
+        int ret = tree.search(k, &v);
+        if (ret == S_ERROR) {
+            lost.insert(k);
+            continue;
+        }
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret == S_OK) CHECK(v == it->second);
+    }
+    return lost;
+}
+
+// 在损坏的树上做随机修改: 读取失败的修改不改变树,lost中的key一定失败
+template <typename Tree, typename Key, typename Value>
+static void damagedOps(
+    Tree &tree,
+    std::map<Key, Value> &model,
+    const std::set<Key> &lost,
+    int n,
+    long range,
+    unsigned *seed)
+{
+    for (int i = 0; i < n; i++) {
+        Key k = (Key) (rand_r(seed) % range);
+        int ret;
+        if (rand_r(seed) % 2 == 0) {
+            Value v = (Value) (k * 3 + 1);
+            ret = tree.insert(k, v);
+            if (ret == S_OK) {
+                CHECK(model.count(k) == 0);
+                model[k] = v;
+            }
+            if (ret == S_FALSE) CHECK(model.count(k) == 1);
+        } else {
+            ret = tree.remove(k);
+            if (ret == S_OK) CHECK(model.erase(k) == 1);
+            if (ret == S_FALSE) CHECK(model.count(k) == 0);
+        }
+        if (lost.count(k)) CHECK(ret == S_ERROR);
+    }
+}
+
+template <typename Tree, typename Key, typename Value>
+static void checkDamaged(
+    Tree &tree,
+    std::map<Key, Value> &model,
+    long range,
+    bool leaf,
+    unsigned *seed)
+{
+    std::set<Key> lost = searchAll(tree, model, range);
+    CHECK(!lost.empty());
+    if (leaf) CHECK(lost.size() < model.size());
+
+    // 批量查找与逐个查找的结果相同
+    std::vector<Key> keys;
+    for (long i = 0; i < range; i++)
+        keys.push_back((Key) i);
+    std::random_shuffle(keys.begin(), keys.end());
+    std::vector<Value> values(range);
+    std::vector<int> rets(range);
+    tree.multiGet(&keys[0], &values[0], &rets[0], range);
+    for (long i = 0; i < range; i++) {
+        if (lost.count(keys[i])) {
+            CHECK(rets[i] == S_ERROR);
+            continue;
+        }
+        typename std::map<Key, Value>::const_iterator it = model.find(keys[i]);
+        CHECK((rets[i] == S_OK) == (it != model.end()));
+        if (rets[i] == S_OK) CHECK(values[i] == it->second);
+    }
+
+    // 游标在损坏的叶子处停下
+    int ret;
+    {
+        typename Tree::Cursor cursor(&tree);
+        typename std::map<Key, Value>::const_iterator it = model.begin();
+        for (ret = cursor.seekFirst(); ret == S_OK; ret = cursor.next(), ++it) {
+            CHECK(it != model.end());
+            CHECK(cursor.key() == it->first && cursor.value() == it->second);
+        }
+        CHECK(!cursor.valid());
+        if (leaf) CHECK(ret == S_ERROR);
+        if (ret == S_FALSE) CHECK(it == model.end());
+    }
+
+    // 快照同样读取失败
+    {
+        typename Tree::Snapshot snap(&tree);
+        for (typename std::set<Key>::iterator it = lost.begin();
+             it != lost.end();
+             ++it) {
+            Value v;
+            CHECK(snap.search(*it, &v) == S_ERROR);
+        }
+    }
+
+    // 批量写入跳过读取失败的修改,其余的修改完成
+    Key bad = *lost.begin();
+    Key good = bad;
+    for (typename std::map<Key, Value>::iterator it = model.begin();
+         it != model.end();
+         ++it) {
+        if (!lost.count(it->first)) good = it->first;
+    }
+    if (good != bad) {
+        typename Tree::WriteBatch batch;
+        batch.put(bad, (Value) 7);
+        batch.put(good, (Value) (good * 3 + 2));
+        CHECK(tree.commit(&batch) == S_ERROR);
+        Value v;
+        CHECK(tree.search(good, &v) == S_OK && v == (Value) (good * 3 + 2));
+        model[good] = v;
+    }
+
+    damagedOps(tree, model, lost, 4000, range, seed);
+    std::set<Key> after = searchAll(tree, model, range);
+    CHECK(std::includes(after.begin(), after.end(), lost.begin(), lost.end()));
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int flags, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::string clean = std::string(file) + ".clean";
+    std::map<Key, Value> built;
+    unsigned seed = BlockSize + flags;
+
+    // 只插入,文件中没有空闲块
+    removeIndex(file);
+    {
+        std::vector<Key> keys;
+        for (long i = 0; i < range; i++)
+            keys.push_back((Key) i);
+        std::random_shuffle(keys.begin(), keys.end());
+        Tree tree(file, 16 * BlockSize, flags);
+        for (long i = 0; i < range; i++) {
+            Value v = (Value) (keys[i] * 3 + 1);
+            CHECK(tree.insert(keys[i], v) == S_OK);
+            built[keys[i]] = v;
+        }
+    }
+    copyFile(file, clean.c_str());
+
+    std::vector<off_t> leaves, nonLeaves;
+    nodePages<BlockSize>(file, &leaves, &nonLeaves);
+    CHECK(leaves.size() > 2 && !nonLeaves.empty());
+
+    // 中间的一个叶子,一个非叶子节点(不一定是root)
+    off_t targets[] = { leaves[leaves.size() / 2], nonLeaves[0] };
+    for (int t = 0; t < 2; t++) {
+        std::map<Key, Value> model = built;
+        copyFile(clean.c_str(), file);
+        damage(file, targets[t] * BlockSize + BlockSize / 2, DAMAGE_CORRUPT);
+        {
+            Tree tree(file, 16 * BlockSize, flags);
+            checkDamaged(tree, model, range, t == 0, &seed);
+            CHECK(tree.checksumErrors() > 0);
+        }
+
+        // 损坏的块没有被写回覆盖,重新打开后仍然读取失败
+        Tree tree(file, 16 * BlockSize, flags);
+        std::set<Key> lost = searchAll(tree, model, range);
+        CHECK(!lost.empty());
+    }
+
+    // 打开后截短: 位图已经读入,最后一个节点读到的长度不足
+    std::map<Key, Value> model = built;
+    copyFile(clean.c_str(), file);
+    off_t last = std::max(leaves.back(), nonLeaves.back());
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        damage(file, last * BlockSize + BlockSize / 2, DAMAGE_TRUNCATE);
+        checkDamaged(tree, model, range, false, &seed);
+    }
+
+    removeIndex(file);
+    unlink(clean.c_str());
+}
+
+/**
+ * 删除大部分key留下很多过小的叶子,改坏一个左边的叶子在同一父节点下的
+ * 叶子; 整理时与它合并失败,跳过后继续,其余的key不受影响
+ */
+static void compactDamaged(const char *file)
+{
+    typedef BPlusTree<long, long, 128> Tree;
+    const long range = 3000;
+    std::map<long, long> model;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * 128);
+        tree.setMergeFill(0);
+        for (long k = 0; k < range; k++) {
+            CHECK(tree.insert(k, k * 3 + 1) == S_OK);
+            model[k] = k * 3 + 1;
+        }
+        for (long k = 0; k < range; k++) {
+            if (k % 6 != 0) {
+                CHECK(tree.remove(k) == S_OK);
+                model.erase(k);
+            }
+        }
+    }
+
+    // 子节点为叶子的非叶子节点中,第二个子节点
+    std::vector<off_t> leaves, nonLeaves;
+    nodePages<128>(file, &leaves, &nonLeaves);
+    std::set<off_t> leafSet(leaves.begin(), leaves.end());
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    off_t target = 0;
+    char buf[128];
+    for (size_t i = 0; i < nonLeaves.size() && target == 0; i++) {
+        CHECK(pread(fd, buf, 128, nonLeaves[i] * 128) == 128);
+        const Node *node = (const Node *) buf;
+        // 键从24字节开始,6个key之后为子节点的块号
+        const PageId *children = (const PageId *) (buf + 24 + 6 * 8);
+        if (node->count >= 1 && leafSet.count(children[0])
+            && leafSet.count(children[1]))
+            target = children[1];
+    }
+    close(fd);
+    CHECK(target != 0);
+    damage(file, target * 128 + 64, DAMAGE_CORRUPT);
+
+    Tree tree(file, 16 * 128);
+    while (tree.compact(64) > 0) continue;
+    CHECK(tree.checksumErrors() > 0);
+    std::set<long> lost = searchAll(tree, model, range);
+    CHECK(!lost.empty() && lost.size() < model.size());
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("checksum_long128.idx", 0, 2000);
+    run<long, long, 128>(
+        "checksum_concurrent.idx", BPLUS_TREE_CONCURRENT, 2000);
+    run<int, int, 128>("checksum_eytzinger.idx", BPLUS_TREE_EYTZINGER, 2000);
+    run<long, long, 4096>(
+        "checksum_packed.idx", BPLUS_TREE_COMPRESS | BPLUS_TREE_URING, 30000);
+    compactDamaged("checksum_compact.idx");
+    printf("checksum_test passed\n");
+    return 0;
+}
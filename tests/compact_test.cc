@@ -0,0 +1,134 @@
+/*
+ * @file compact_test.cc
+ * @brief
+ * 在线整理: 大量删除后与随机修改交替整理,文件应缩小且内容不变;
+ * 并发模式下多个线程同时整理,同时有线程修改
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <pthread.h>
+#include <sys/stat.h>
+#include "TreeCheck.h"
+
+static off_t fileSize(const char *file)
+{
+    struct stat st;
+    CHECK(stat(file, &st) == 0);
+    return st.st_size;
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range, int flags)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 13;
+
+    removeIndex(file);
+    off_t before;
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        randomOps(tree, model, n, range, &seed);
+        for (long i = 0; i < range; i++) {
+            if (i % 10 == 0) continue;
+            tree.remove((Key) i);
+            model.erase((Key) i);
+        }
+        tree.checkpoint();
+        before = fileSize(file);
+
+        // 整理的两步之间插入其他修改
+        while (tree.compact(32) > 0)
+            randomOps(tree, model, 20, range / 10, &seed);
+        verifyTree(tree, model, range);
+    }
+    CHECK(fileSize(file) < before);
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        while (tree.compact(1000) > 0) continue;
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+typedef BPlusTree<long, long, 4096> ConcurrentTree;
+
+static const long WRITERS = 2;
+static const long WRITES = 40000;
+
+struct Writer
+{
+    ConcurrentTree *tree;
+    long id;
+};
+
+static volatile int writing;
+
+// 写入id对应的key,再删除其中的大部分,留下的key为i % 8 == 0
+static void *writeKeys(void *arg)
+{
+    Writer *w = (Writer *) arg;
+    for (long i = 0; i < WRITES; i++) {
+        long k = i * WRITERS + w->id;
+        CHECK(w->tree->insert(k, k + 1) == S_OK);
+    }
+    for (long i = 0; i < WRITES; i++) {
+        if (i % 8 == 0) continue;
+        CHECK(w->tree->remove(i * WRITERS + w->id) == S_OK);
+    }
+    return NULL;
+}
+
+static void *compactLoop(void *arg)
+{
+    ConcurrentTree *tree = (ConcurrentTree *) arg;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE))
+        tree->compact(16);
+    return NULL;
+}
+
+static void concurrent(const char *file)
+{
+    removeIndex(file);
+    {
+        ConcurrentTree tree(file, 64 * 4096, BPLUS_TREE_CONCURRENT);
+        pthread_t writers[WRITERS], compactors[2];
+        Writer args[WRITERS];
+
+        writing = 1;
+        for (int i = 0; i < 2; i++)
+            pthread_create(&compactors[i], NULL, compactLoop, &tree);
+        for (long i = 0; i < WRITERS; i++) {
+            args[i].tree = &tree;
+            args[i].id = i;
+            pthread_create(&writers[i], NULL, writeKeys, &args[i]);
+        }
+        for (long i = 0; i < WRITERS; i++) pthread_join(writers[i], NULL);
+        __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+        for (int i = 0; i < 2; i++) pthread_join(compactors[i], NULL);
+
+        while (tree.compact(1000) > 0) continue;
+    }
+
+    std::map<long, long> model;
+    for (long i = 0; i < WRITES; i += 8)
+        for (long id = 0; id < WRITERS; id++)
+            model[i * WRITERS + id] = i * WRITERS + id + 1;
+    ConcurrentTree tree(file, 64 * 4096);
+    verifyTree(tree, model, WRITES * WRITERS);
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("compact_long128.idx", 40000, 20000, 0);
+    run<long, long, 4096>("compact_long4096.idx", 200000, 100000, 0);
+    run<long, long, 4096>(
+        "compact_packed4096.idx", 200000, 100000, BPLUS_TREE_COMPRESS);
+    run<int, int, 128>("compact_wal128.idx", 40000, 20000, BPLUS_TREE_WAL);
+    concurrent("compact_concurrent.idx");
+    printf("compact_test passed\n");
+    return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * @file convert_test.cc
+ * @brief
+ * 旧格式转换: 按v1(pack(2)页头,8字节文件偏移)和v2(与当前相同的页头,
+ * 块号)格式构造三层的索引文件和.boot文件,块的顺序打乱并夹有空闲块,
+ * 非叶子节点的子节点用满(最右的子节点在lastOffset中);
+ * convert后打开与model比较,并继续修改; .boot缺失、块大小不符、
+ * 日志不为空和损坏的节点时返回S_FALSE
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <algorithm>
+#include <vector>
+#include "TreeCheck.h"
+
+typedef BPlusTree<long, long, 128> Tree;
+
+static const int BLOCK_SIZE = 128;
+static const long INVALID = 0xDEADBEEF;
+
+// 文件中的块类型
+enum
+{
+    TYPE_LEAF = 0,
+    TYPE_NON_LEAF = 1
+};
+
+// v1格式的页头
+#pragma pack(push)
+#pragma pack(2)
+struct NodeV1
+{
+    off_t self;
+    off_t prev;
+    off_t next;
+    off_t lastOffset;
+    short type;
+    int count;
+};
+#pragma pack(pop)
+
+// 两种格式的节点布局: key的位置和度,slot为value或子节点引用
+struct Layout
+{
+    int version;
+    int keyOffset;
+    int degree;
+    int refSize;
+
+    int slotOffset() const { return keyOffset + degree * (int) sizeof(long); }
+};
+
+static const Layout V1 = {1, (int) sizeof(NodeV1), 5, 8};
+// v2中key按8字节对齐
+static const Layout V2 = {2, ((int) sizeof(Node) + 7) / 8 * 8, 6, 4};
+
+// v1中的引用为文件偏移,v2中为块号
+static long ref(const Layout &l, long page)
+{
+    if (page == INVALID || l.version == 2) return page;
+    return page * BLOCK_SIZE;
+}
+
+static void header(
+    const Layout &l,
+    char *buf,
+    long self,
+    int type,
+    int count,
+    long prev,
+    long next,
+    long lastOffset)
+{
+    if (l.version == 1) {
+        NodeV1 h;
+        h.self = self * BLOCK_SIZE;
+        h.prev = ref(l, prev);
+        h.next = ref(l, next);
+        h.lastOffset = ref(l, lastOffset);
+        h.type = type;
+        h.count = count;
+        memcpy(buf, &h, sizeof h);
+    } else {
+        Node *h = (Node *) buf;
+        h->self = self;
+        h->type = type;
+        h->count = count;
+        h->prev = type == TYPE_LEAF ? prev : lastOffset;
+        h->next = next;
+    }
+}
+
+/**
+ * 三层的树: 根节点有degree + 1个子节点,每个中间节点有2个叶子,
+ * 每个叶子3个key; 节点的块号打乱,另有2个空闲块
+ */
+struct Image
+{
+    std::vector<std::string> blocks;
+    std::vector<long> freeBlocks;
+    long root;
+};
+
+static Image build(const Layout &l, std::map<long, long> &model)
+{
+    int fanout = l.degree + 1;
+    int leaves = fanout * 2;
+    int nodes = leaves + fanout + 1;
+    int total = nodes + 2;
+
+    std::vector<long> page(total);
+    for (int i = 0; i < total; i++) page[i] = i;
+    unsigned seed = l.version;
+    for (int i = total - 1; i > 0; i--)
+        std::swap(page[i], page[rand_r(&seed) % (i + 1)]);
+
+    Image img;
+    img.blocks.assign(total, std::string(BLOCK_SIZE, 0));
+    std::vector<long> first(leaves);
+
+    for (int j = 0; j < leaves; j++) {
+        char *buf = &img.blocks[page[j]][0];
+        long prev = j > 0 ? page[j - 1] : INVALID;
+        long next = j + 1 < leaves ? page[j + 1] : INVALID;
+        header(l, buf, page[j], TYPE_LEAF, 3, prev, next, INVALID);
+        for (int i = 0; i < 3; i++) {
+            long k = j * 10 + i * 3, v = k * 3 + 1;
+            memcpy(buf + l.keyOffset + i * sizeof k, &k, sizeof k);
+            memcpy(buf + l.slotOffset() + i * sizeof v, &v, sizeof v);
+            model[k] = v;
+        }
+        first[j] = j * 10;
+    }
+
+    // 中间节点m的子节点为叶子2m和2m + 1,根节点的子节点为所有中间节点
+    for (int m = 0; m <= fanout; m++) {
+        bool root = m == fanout;
+        int id = root ? nodes - 1 : leaves + m;
+        int count = root ? fanout - 1 : 1;
+        char *buf = &img.blocks[page[id]][0];
+        long last = INVALID;
+        for (int i = 0; i <= count; i++) {
+            int child = root ? leaves + i : 2 * m + i;
+            if (i > 0) {
+                long k = first[root ? 2 * i : 2 * m + 1];
+                memcpy(buf + l.keyOffset + (i - 1) * sizeof k, &k, sizeof k);
+            }
+            long r = ref(l, page[child]);
+            if (i == l.degree) {
+                last = page[child];
+            } else {
+                memcpy(buf + l.slotOffset() + i * l.refSize, &r, l.refSize);
+            }
+        }
+        header(l, buf, page[id], TYPE_NON_LEAF, count, INVALID, INVALID, last);
+    }
+    img.root = page[nodes - 1];
+
+    // 空闲块的内容不被读取
+    for (int i = nodes; i < total; i++) {
+        img.blocks[page[i]].assign(BLOCK_SIZE, (char) 0xAB);
+        img.freeBlocks.push_back(page[i]);
+    }
+    return img;
+}
+
+// .boot文件中每个值占16字节,大端
+static void offsetStore(FILE *fp, long value)
+{
+    unsigned char buf[16] = {0};
+    for (int i = 0; i < 8; i++)
+        buf[15 - i] = (unsigned char) (value >> (i * 8));
+    CHECK(fwrite(buf, sizeof buf, 1, fp) == 1);
+}
+
+static void write(const Layout &l, const char *file, const Image &img)
+{
+    removeIndex(file);
+    FILE *fp = fopen(file, "wb");
+    CHECK(fp != NULL);
+    for (size_t i = 0; i < img.blocks.size(); i++)
+        CHECK(fwrite(img.blocks[i].data(), BLOCK_SIZE, 1, fp) == 1);
+    fclose(fp);
+
+    std::string boot = std::string(file) + ".boot";
+    fp = fopen(boot.c_str(), "wb");
+    CHECK(fp != NULL);
+    offsetStore(fp, ref(l, img.root));
+    long blockSize = BLOCK_SIZE;
+    if (l.version == 2) blockSize |= 2L << 32;
+    offsetStore(fp, blockSize);
+    offsetStore(fp, (long) img.blocks.size() * BLOCK_SIZE);
+    for (size_t i = 0; i < img.freeBlocks.size(); i++)
+        offsetStore(fp, ref(l, img.freeBlocks[i]));
+    fclose(fp);
+}
+
+static void removeAll(const char *from, const char *to)
+{
+    removeIndex(from);
+    removeIndex(to);
+    unlink((std::string(from) + ".boot").c_str());
+}
+
+static void run(const Layout &l, const char *from, const char *to)
+{
+    std::map<long, long> model;
+    Image img = build(l, model);
+    long range = (long) model.size() * 4;
+
+    write(l, from, img);
+    CHECK(Tree::convert(from, to) == S_OK);
+
+    // 块号加1,块0为超级块
+    DiskSuper super;
+    int fd = open(to, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(pread(fd, &super, sizeof super, 0) == sizeof super);
+    close(fd);
+    CHECK(memcmp(super.magic, "BPLUSTRE", 8) == 0);
+    CHECK(super.version == 5 && super.blockSize == BLOCK_SIZE);
+    CHECK(super.root == img.root + 1);
+
+    unsigned seed = 7 + l.version;
+    {
+        Tree tree(to);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, 2000, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(to);
+        verifyTree(tree, model, range);
+    }
+    removeAll(from, to);
+}
+
+static void failures(const char *from, const char *to)
+{
+    std::map<long, long> model;
+    Image img = build(V2, model);
+
+    // 没有.boot文件
+    removeAll(from, to);
+    FILE *fp = fopen(from, "wb");
+    CHECK(fp != NULL);
+    fclose(fp);
+    CHECK(Tree::convert(from, to) == S_FALSE);
+
+    // 块大小不同的树
+    write(V2, from, img);
+    typedef BPlusTree<long, long, 256> Tree256;
+    CHECK(Tree256::convert(from, to) == S_FALSE);
+
+    // 日志中有未写回的修改
+    fp = fopen((std::string(from) + ".wal").c_str(), "wb");
+    CHECK(fp != NULL && fputc(1, fp) == 1);
+    fclose(fp);
+    CHECK(Tree::convert(from, to) == S_FALSE);
+    unlink((std::string(from) + ".wal").c_str());
+    CHECK(Tree::convert(from, to) == S_OK);
+
+    // 损坏的节点
+    Node *root = (Node *) &img.blocks[img.root][0];
+    root->count = V2.degree + 1;
+    write(V2, from, img);
+    CHECK(Tree::convert(from, to) == S_FALSE);
+    removeAll(from, to);
+}
+
+int main()
+{
+    run(V1, "convert_v1.idx", "convert_v1.new");
+    run(V2, "convert_v2.idx", "convert_v2.new");
+    failures("convert_bad.idx", "convert_bad.new");
+    printf("convert_test passed\n");
+    return 0;
+}
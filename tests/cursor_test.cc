@@ -0,0 +1,144 @@
+/*
+ * @file cursor_test.cc
+ * @brief
+ * 游标: seek到两端之外、在第一个/最后一个key处继续prev/next、
+ * 空树上定位、在每个位置next与prev互逆,与std::map的迭代器对照;
+ * 覆盖并发模式(每次移动加锁)、快照上的游标和压缩叶子
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include "TreeCheck.h"
+
+// 游标定位在it处(it为end时游标无效)
+template <typename Cursor, typename Key, typename Value>
+static void expectAt(
+    Cursor &cursor,
+    int ret,
+    const std::map<Key, Value> &model,
+    typename std::map<Key, Value>::const_iterator it)
+{
+    if (it == model.end()) {
+        CHECK(ret == S_FALSE && !cursor.valid());
+        return;
+    }
+    CHECK(ret == S_OK && cursor.valid());
+    CHECK(cursor.key() == it->first && cursor.value() == it->second);
+}
+
+template <typename Cursor, typename Key, typename Value>
+static void checkCursor(Cursor &cursor, const std::map<Key, Value> &model)
+{
+    typedef typename std::map<Key, Value>::const_iterator Iter;
+
+    if (model.empty()) {
+        CHECK(cursor.seek(0) == S_FALSE && !cursor.valid());
+        CHECK(cursor.seekFirst() == S_FALSE && !cursor.valid());
+        CHECK(cursor.seekLast() == S_FALSE && !cursor.valid());
+        CHECK(cursor.next() == S_FALSE && cursor.prev() == S_FALSE);
+        return;
+    }
+    Key first = model.begin()->first;
+    Key last = model.rbegin()->first;
+
+    // 两端之外: 小于最小的key时定位到最小的key,大于最大的key时无效
+    expectAt(cursor, cursor.seek(first - 100), model, model.begin());
+    expectAt(cursor, cursor.seek(last + 1), model, model.end());
+    CHECK(cursor.next() == S_FALSE && cursor.prev() == S_FALSE);
+
+    // 最小的key之前、最大的key之后没有key,游标变为无效且不能再移动
+    expectAt(cursor, cursor.seekFirst(), model, model.begin());
+    CHECK(cursor.prev() == S_FALSE && !cursor.valid());
+    CHECK(cursor.next() == S_FALSE && !cursor.valid());
+    expectAt(cursor, cursor.seekLast(), model, --model.end());
+    CHECK(cursor.next() == S_FALSE && !cursor.valid());
+    CHECK(cursor.prev() == S_FALSE && !cursor.valid());
+
+    // 每个key及其之后的位置: seek为lower_bound,next/prev与迭代器相同
+    for (Key k = first - 1; k <= last + 1; k++) {
+        Iter it = model.lower_bound(k);
+        expectAt(cursor, cursor.seek(k), model, it);
+        if (it == model.end()) continue;
+
+        Iter next = it;
+        ++next;
+        expectAt(cursor, cursor.next(), model, next);
+        if (next == model.end()) continue;
+        expectAt(cursor, cursor.prev(), model, it);
+        if (it == model.begin()) {
+            CHECK(cursor.prev() == S_FALSE && !cursor.valid());
+        } else {
+            Iter prev = it;
+            expectAt(cursor, cursor.prev(), model, --prev);
+        }
+    }
+
+    // 从最后一个key逆向遍历
+    typename std::map<Key, Value>::const_reverse_iterator rit = model.rbegin();
+    int ret;
+    for (ret = cursor.seekLast(); ret == S_OK; ret = cursor.prev(), ++rit) {
+        CHECK(rit != model.rend());
+        CHECK(cursor.key() == rit->first && cursor.value() == rit->second);
+    }
+    CHECK(ret == S_FALSE && rit == model.rend());
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int flags, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + flags;
+
+    removeIndex(file);
+    Tree tree(file, 16 * BlockSize, flags);
+    {
+        typename Tree::Cursor cursor(&tree);
+        checkCursor(cursor, model);
+    }
+
+    // 一个key
+    CHECK(tree.insert(5, 16) == S_OK);
+    model[5] = 16;
+    {
+        typename Tree::Cursor cursor(&tree);
+        checkCursor(cursor, model);
+    }
+
+    // 插入后删除大部分,留下稀疏的叶子
+    tree.setMergeFill(0.1);
+    randomOps(tree, model, (int) range * 3, range, &seed);
+    for (long k = 0; k < range; k++) {
+        if (rand_r(&seed) % 4 != 0 && model.erase((Key) k))
+            CHECK(tree.remove((Key) k) == S_OK);
+    }
+    {
+        typename Tree::Cursor cursor(&tree);
+        checkCursor(cursor, model);
+    }
+
+    // 快照上的游标不受之后修改的影响
+    std::map<Key, Value> frozen = model;
+    typename Tree::Snapshot *snap = new typename Tree::Snapshot(&tree);
+    randomOps(tree, model, (int) range, range, &seed);
+    {
+        typename Tree::Cursor cursor(snap);
+        checkCursor(cursor, frozen);
+    }
+    delete snap;
+    {
+        typename Tree::Cursor cursor(&tree);
+        checkCursor(cursor, model);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("cursor_long128.idx", 0, 3000);
+    run<int, int, 128>("cursor_int128.idx", 0, 3000);
+    run<long, long, 128>("cursor_concurrent.idx", BPLUS_TREE_CONCURRENT, 3000);
+    run<long, long, 4096>("cursor_packed.idx", BPLUS_TREE_COMPRESS, 30000);
+    printf("cursor_test passed\n");
+    return 0;
+}
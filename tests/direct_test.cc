@@ -0,0 +1,101 @@
+/*
+ * @file direct_test.cc
+ * @brief
+ * O_DIRECT读写: 块大小不满足对齐要求(或文件系统不支持)时退回到普通读写,
+ * 索引文件的描述符是否带O_DIRECT与此一致; 两种情况下都与std::map比较,
+ * 再以普通模式打开比较
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TreeCheck.h"
+
+// 本进程中打开file的描述符的标志(通过/proc/self/fd查找)
+static int fileFlags(const char *file)
+{
+    char path[PATH_MAX];
+    CHECK(realpath(file, path) != NULL);
+
+    DIR *dir = opendir("/proc/self/fd");
+    CHECK(dir != NULL);
+    int flags = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char link[PATH_MAX], target[PATH_MAX];
+        snprintf(link, sizeof link, "/proc/self/fd/%s", entry->d_name);
+        ssize_t len = readlink(link, target, sizeof target - 1);
+        if (len <= 0) continue;
+        target[len] = 0;
+        if (strcmp(target, path) == 0) {
+            CHECK(flags == -1);
+            flags = fcntl(atoi(entry->d_name), F_GETFL);
+        }
+    }
+    closedir(dir);
+    CHECK(flags != -1);
+    return flags;
+}
+
+// 当前目录下能否以O_DIRECT按blockSize读写
+static bool directSupported(int blockSize)
+{
+    const char *probe = "direct_probe.tmp";
+    int fd = open(probe, O_CREAT | O_RDWR | O_DIRECT, 0644);
+    if (fd < 0) return false;
+
+    void *buf;
+    CHECK(posix_memalign(&buf, 4096, blockSize) == 0);
+    memset(buf, 0, blockSize);
+    bool ok = pwrite(fd, buf, blockSize, 0) == blockSize;
+    free(buf);
+    close(fd);
+    unlink(probe);
+    return ok;
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range, int flags, bool direct)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 11;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_DIRECT | flags);
+        CHECK(((fileFlags(file) & O_DIRECT) != 0) == direct);
+        randomOps(tree, model, n, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        CHECK((fileFlags(file) & O_DIRECT) == 0);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+    }
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_DIRECT | flags);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    // 文件系统不支持O_DIRECT(如tmpfs)时两种块大小都退回到普通读写
+    bool direct = directSupported(4096);
+    if (!direct) printf("O_DIRECT is not supported here, expect fallback.\n");
+
+    // 128字节的块不是扇区大小的整数倍
+    run<long, long, 128>("direct_long128.idx", 40000, 20000, 0, false);
+    run<long, long, 4096>("direct_long4096.idx", 200000, 100000, 0, direct);
+    run<long, long, 4096>(
+        "direct_wal4096.idx", 100000, 50000, BPLUS_TREE_WAL, direct);
+    printf("direct_test passed\n");
+    return 0;
+}
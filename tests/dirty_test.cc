@@ -0,0 +1,169 @@
+/*
+ * @file dirty_test.cc
+ * @brief
+ * 延迟写回: 不同的脏块上限下随机修改后重新打开比较; 树在缓存中时
+ * 上限越大,同一个块的多次修改合并写回,写回的块越少;
+ * 并发模式下4个线程修改、2个线程查找,同时另一线程反复做检查点
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <pthread.h>
+#include "TreeCheck.h"
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range, int limit, int flags)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + limit;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 64 * BlockSize, flags);
+        if (limit >= 0) tree.setDirtyLimit(limit);
+        randomOps(tree, model, n / 2, range, &seed);
+        CHECK(tree.checkpoint() == S_OK);
+        randomOps(tree, model, n / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+// 整棵树都在缓存中,随机修改后做检查点,返回写回的块数
+static long deferredWrites(const char *file, int limit)
+{
+    typedef BPlusTree<long, long, 128> Tree;
+    std::map<long, long> model;
+    unsigned seed = 29;
+
+    removeIndex(file);
+    long writes;
+    {
+        Tree tree(file, 4096 * 128);
+        tree.setDirtyLimit(limit);
+        randomOps(tree, model, 20000, 5000, &seed);
+        CHECK(tree.checkpoint() == S_OK);
+        writes = tree.blockWrites();
+        verifyTree(tree, model, 5000);
+    }
+    {
+        Tree tree(file, 16 * 128);
+        verifyTree(tree, model, 5000);
+    }
+    removeIndex(file);
+    return writes;
+}
+
+typedef BPlusTree<long, long, 4096> ConcurrentTree;
+
+static const long WRITERS = 4;
+static const long READERS = 2;
+static const long WRITES = 60000;
+static const long RANGE = WRITES * WRITERS;
+
+struct Worker
+{
+    ConcurrentTree *tree;
+    long id;
+};
+
+static volatile int running;
+
+// 写入id对应的key,每3个删除之前写入的1个; 留下的key的value为key + 1
+static void *writeKeys(void *arg)
+{
+    Worker *w = (Worker *) arg;
+    for (long i = 0; i < WRITES; i++) {
+        long k = i * WRITERS + w->id;
+        CHECK(w->tree->insert(k, k + 1) == S_OK);
+        if (i % 3 == 0 && i >= 3)
+            CHECK(w->tree->remove(k - 3 * WRITERS) == S_OK);
+    }
+    return NULL;
+}
+
+// 查找到的value必须是写入的值
+static void *readKeys(void *arg)
+{
+    Worker *w = (Worker *) arg;
+    long k = w->id;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        long v;
+        k = (k + 7919) % RANGE;
+        if (w->tree->search(k, &v) == S_OK) CHECK(v == k + 1);
+    }
+    return NULL;
+}
+
+static void *checkpointLoop(void *arg)
+{
+    ConcurrentTree *tree = (ConcurrentTree *) arg;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        CHECK(tree->checkpoint() == S_OK);
+        usleep(2000);
+    }
+    return NULL;
+}
+
+static void concurrent(const char *file)
+{
+    removeIndex(file);
+    {
+        ConcurrentTree tree(file, 64 * 4096, BPLUS_TREE_CONCURRENT);
+        pthread_t writers[WRITERS], readers[READERS], checkpointer;
+        Worker args[WRITERS + READERS];
+
+        running = 1;
+        for (long i = 0; i < WRITERS + READERS; i++) {
+            args[i].tree = &tree;
+            args[i].id = i;
+        }
+        for (long i = 0; i < READERS; i++)
+            pthread_create(&readers[i], NULL, readKeys, &args[WRITERS + i]);
+        pthread_create(&checkpointer, NULL, checkpointLoop, &tree);
+        for (long i = 0; i < WRITERS; i++)
+            pthread_create(&writers[i], NULL, writeKeys, &args[i]);
+
+        for (long i = 0; i < WRITERS; i++) pthread_join(writers[i], NULL);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        for (long i = 0; i < READERS; i++) pthread_join(readers[i], NULL);
+        pthread_join(checkpointer, NULL);
+    }
+
+    std::map<long, long> model;
+    for (long i = 0; i < WRITES; i++) {
+        for (long id = 0; id < WRITERS; id++) {
+            long k = i * WRITERS + id;
+            model[k] = k + 1;
+            if (i % 3 == 0 && i >= 3) model.erase(k - 3 * WRITERS);
+        }
+    }
+    ConcurrentTree tree(file, 64 * 4096);
+    verifyTree(tree, model, RANGE);
+    removeIndex(file);
+}
+
+int main()
+{
+    const int limits[] = {-1, 0, 4, 64};
+    for (int i = 0; i < 4; i++) {
+        run<long, long, 128>("dirty_long128.idx", 40000, 20000, limits[i], 0);
+        run<long, long, 4096>(
+            "dirty_wal4096.idx", 100000, 50000, limits[i], BPLUS_TREE_WAL);
+    }
+    long writes = deferredWrites("dirty_deferred.idx", 0);
+    const int larger[] = {4, 64, 1024};
+    for (int i = 0; i < 3; i++) {
+        long w = deferredWrites("dirty_deferred.idx", larger[i]);
+        CHECK(w < writes);
+        writes = w;
+    }
+    concurrent("dirty_concurrent.idx");
+    printf("dirty_test passed\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * @file eytzinger_test.cc
+ * @brief
+ * Eytzinger布局: 非叶子节点按层序写回(文件中的节点类型为2),
+ * 修改时恢复有序; 之后不带该选项打开,修改过的节点按有序布局写回,
+ * 两种布局的节点共存; 再带该选项打开,修改过的节点重新按层序写回
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <vector>
+#include "TreeCheck.h"
+
+// 文件中的非叶子节点类型: 有序布局为1,Eytzinger布局为2
+enum
+{
+    TYPE_NON_LEAF = 1,
+    TYPE_NON_LEAF_EYTZINGER = 2
+};
+
+/**
+ * 从超级块中的root开始直接读取文件,统计可达的非叶子节点中
+ * 两种布局各自的个数(counts[1]和counts[2])
+ */
+template <typename Key, typename Value, int BlockSize>
+static void nonLeafTypes(const char *file, int counts[3])
+{
+    const int keyOffset = ((int) sizeof(Node) + alignof(Key) - 1)
+                          / alignof(Key) * alignof(Key);
+    const int slot = sizeof(Value) > 4 ? sizeof(Value) : 4;
+    const int degree =
+        (BlockSize - keyOffset - 4) / ((int) sizeof(Key) + slot);
+
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    DiskSuper super;
+    CHECK(pread(fd, &super, sizeof(super), 0) == sizeof(super));
+
+    counts[0] = counts[1] = counts[2] = 0;
+    std::vector<PageId> pages(1, super.root);
+    char buf[BlockSize];
+    while (!pages.empty()) {
+        PageId page = pages.back();
+        pages.pop_back();
+        CHECK(pread(fd, buf, BlockSize, (off_t) page * BlockSize)
+              == BlockSize);
+        const Node *node = (const Node *) buf;
+        CHECK(node->self == page);
+        if (node->type != TYPE_NON_LEAF
+            && node->type != TYPE_NON_LEAF_EYTZINGER)
+            continue;
+
+        counts[node->type]++;
+        // 子节点按有序存放,最后一个位置的子节点在lastOffset中
+        const PageId *children = (const PageId *) (buf + keyOffset
+                                                   + degree * sizeof(Key));
+        for (int i = 0; i <= node->count; i++)
+            pages.push_back(i == degree ? node->lastOffset : children[i]);
+    }
+    close(fd);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 15;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_EYTZINGER);
+        randomOps(tree, model, n, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    int counts[3];
+    nonLeafTypes<Key, Value, BlockSize>(file, counts);
+    CHECK(counts[TYPE_NON_LEAF] == 0 && counts[TYPE_NON_LEAF_EYTZINGER] > 0);
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    nonLeafTypes<Key, Value, BlockSize>(file, counts);
+    CHECK(counts[TYPE_NON_LEAF] > 0);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_EYTZINGER);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    nonLeafTypes<Key, Value, BlockSize>(file, counts);
+    CHECK(counts[TYPE_NON_LEAF_EYTZINGER] > 0);
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("eytzinger_long128.idx", 40000, 20000);
+    run<int, int, 4096>("eytzinger_int4096.idx", 400000, 200000);
+    run<long, long, 4096>("eytzinger_long4096.idx", 400000, 200000);
+    printf("eytzinger_test passed\n");
+    return 0;
+}
@@ -10,7 +10,7 @@
 
 int main(int argc, char const *argv[])
 {
-    BPlusTree bpTree("data.index", 128);
+    BPlusTree<long, long, 128> bpTree("data.index");
     bpTree.commandHander();
 
     return 0;
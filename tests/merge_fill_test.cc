@@ -0,0 +1,88 @@
+/*
+ * @file merge_fill_test.cc
+ * @brief
+ * 删除时的最少填充率: 不同的填充率下大量随机删除,借数据/合并推迟或
+ * 只在叶子删空时进行,内容都应与std::map一致; 之后整理合并过小的叶子
+ * 不压缩的树中填充率越低,删除时写回的块越少
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <vector>
+#include <algorithm>
+#include "TreeCheck.h"
+
+// 返回随机删除期间写回的块数
+template <typename Key, typename Value, int BlockSize>
+static long run(const char *file, long range, double fill, int flags)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 17;
+
+    // 随机顺序删除,节点大多不会被删空
+    std::vector<long> order;
+    for (long i = 0; i < range; i++) order.push_back(i);
+    for (long i = range - 1; i > 0; i--)
+        std::swap(order[i], order[rand_r(&seed) % (i + 1)]);
+
+    long writes;
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        tree.setMergeFill(fill);
+        for (long i = 0; i < range; i++) {
+            CHECK(tree.insert((Key) i, (Value) (i * 3 + 1)) == S_OK);
+            model[(Key) i] = (Value) (i * 3 + 1);
+        }
+        tree.sync();
+        writes = tree.blockWrites();
+        for (long i = 0; i < range * 9 / 10; i++) {
+            CHECK(tree.remove((Key) order[i]) == S_OK);
+            model.erase((Key) order[i]);
+        }
+        tree.sync();
+        writes = tree.blockWrites() - writes;
+        verifyTree(tree, model, range);
+        randomOps(tree, model, (int) range / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        tree.setMergeFill(fill);
+        verifyTree(tree, model, range);
+        while (tree.compact(64) > 0) continue;
+        verifyTree(tree, model, range);
+
+        // 全部删除后树为空
+        for (long i = 0; i < range; i++) {
+            Key k = (Key) i;
+            CHECK((tree.remove(k) == S_OK) == (model.erase(k) > 0));
+        }
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+    return writes;
+}
+
+int main()
+{
+    const double fills[] = {0.5, 0.25, 0.1, 0};
+    long writes[2][4];
+    for (int i = 0; i < 4; i++) {
+        writes[0][i] =
+            run<long, long, 128>("merge_long128.idx", 10000, fills[i], 0);
+        writes[1][i] =
+            run<int, int, 4096>("merge_int4096.idx", 40000, fills[i], 0);
+        run<long, long, 4096>(
+            "merge_packed4096.idx", 40000, fills[i], BPLUS_TREE_COMPRESS);
+    }
+
+    // 填充率越低,借数据与合并越少,写回的块越少
+    for (int t = 0; t < 2; t++) {
+        for (int i = 1; i < 4; i++) CHECK(writes[t][i] <= writes[t][i - 1]);
+        CHECK(writes[t][3] < writes[t][0]);
+    }
+    printf("merge_fill_test passed\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * @file mmap_test.cc
+ * @brief
+ * 映射模式: 随机修改使文件多次增长(映射随之扩展),
+ * 关闭后分别以映射模式和普通模式打开比较; 映射增长后节点的地址不变
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <sys/stat.h>
+#include "TreeCheck.h"
+
+static off_t fileSize(const char *file)
+{
+    struct stat st;
+    CHECK(stat(file, &st) == 0);
+    return st.st_size;
+}
+
+/**
+ * 节点直接指向映射: 游标停在最左的叶子上(持有指向映射的指针),
+ * 在右边插入使文件和映射多次增长,之前取得的指针仍然有效
+ */
+template <typename Key, typename Value, int BlockSize>
+static void growUnderCursor(const char *file, long n)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+
+    removeIndex(file);
+    Tree tree(file, 0, BPLUS_TREE_MMAP);
+    for (long k = 0; k < 1000; k++) {
+        CHECK(tree.insert((Key) k, (Value) (k * 3 + 1)) == S_OK);
+        model[(Key) k] = (Value) (k * 3 + 1);
+    }
+    off_t before = fileSize(file);
+
+    // 游标保存叶子和其中key/value的地址,移动时不重新读取节点
+    typename Tree::Cursor cursor(&tree);
+    CHECK(cursor.seekFirst() == S_OK && cursor.next() == S_OK);
+
+    // 只插入更大的key,最左的叶子不被修改
+    for (long k = 1000; k < n; k++) {
+        CHECK(tree.insert((Key) k, (Value) (k * 3 + 1)) == S_OK);
+        model[(Key) k] = (Value) (k * 3 + 1);
+    }
+    // 映射每次至少翻倍,增长了多次
+    CHECK(fileSize(file) >= before * 8);
+
+    CHECK(cursor.key() == 1 && cursor.value() == 4);
+    typename std::map<Key, Value>::const_iterator it = model.find(1);
+    for (; cursor.valid() && it->first < 2000; cursor.next(), ++it)
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    CHECK(it->first == 2000);
+    verifyTree(tree, model, n);
+    removeIndex(file);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 7;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 0, BPLUS_TREE_MMAP);
+        randomOps(tree, model, n, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+    }
+    {
+        Tree tree(file, 0, BPLUS_TREE_MMAP);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("mmap_long128.idx", 40000, 20000);
+    run<long, long, 4096>("mmap_long4096.idx", 200000, 100000);
+    growUnderCursor<long, long, 128>("mmap_grow128.idx", 300000);
+    growUnderCursor<long, long, 4096>("mmap_grow4096.idx", 1000000);
+    printf("mmap_test passed\n");
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * @file multiget_test.cc
+ * @brief
+ * 批量查找: 乱序、重复、不存在和两端之外的key,n为0和1,空树,
+ * 远多于缓存块数的一批,结果与逐个search相同且返回找到的个数;
+ * 并发模式下与修改线程同时进行
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include "TreeCheck.h"
+
+// 一批查找的结果与逐个search和model一致
+template <typename Tree, typename Key, typename Value>
+static void checkBatch(
+    Tree &tree,
+    const std::map<Key, Value> &model,
+    const std::vector<Key> &keys)
+{
+    size_t n = keys.size();
+    // 多留一个位置,检查没有越界写入
+    std::vector<Value> values(n + 1, (Value) -7);
+    std::vector<int> rets(n + 1, 99);
+    size_t found = 0;
+
+    size_t ret = tree.multiGet(
+        n > 0 ? &keys[0] : NULL, &values[0], &rets[0], n);
+    for (size_t i = 0; i < n; i++) {
+        typename std::map<Key, Value>::const_iterator it = model.find(keys[i]);
+        Value v;
+        CHECK(tree.search(keys[i], &v) == rets[i]);
+        CHECK((rets[i] == S_OK) == (it != model.end()));
+        if (rets[i] == S_OK) {
+            CHECK(values[i] == it->second);
+            found++;
+        } else {
+            CHECK(rets[i] == S_FALSE && values[i] == (Value) -7);
+        }
+    }
+    CHECK(ret == found);
+    CHECK(rets[n] == 99 && values[n] == (Value) -7);
+}
+
+template <typename Tree, typename Key, typename Value>
+static void checkAll(
+    Tree &tree,
+    const std::map<Key, Value> &model,
+    long range,
+    unsigned *seed)
+{
+    std::vector<Key> keys;
+
+    // n为0和1
+    checkBatch(tree, model, keys);
+    keys.push_back((Key) (range / 2));
+    checkBatch(tree, model, keys);
+
+    // 两端之外和每个叶子的边界附近
+    keys.clear();
+    keys.push_back((Key) -1);
+    keys.push_back((Key) range);
+    keys.push_back((Key) (range * 2));
+    typename std::map<Key, Value>::const_iterator it;
+    for (it = model.begin(); it != model.end(); ++it) {
+        keys.push_back(it->first);
+        keys.push_back(it->first + 1);
+    }
+    checkBatch(tree, model, keys);
+
+    // 降序
+    std::reverse(keys.begin(), keys.end());
+    checkBatch(tree, model, keys);
+
+    // 随机顺序,包含重复的key
+    for (int round = 0; round < 10; round++) {
+        keys.clear();
+        size_t n = 1 + rand_r(seed) % 500;
+        for (size_t i = 0; i < n; i++) {
+            Key k = (Key) (rand_r(seed) % range);
+            keys.push_back(k);
+            if (rand_r(seed) % 4 == 0) keys.push_back(k);
+        }
+        std::random_shuffle(keys.begin(), keys.end());
+        checkBatch(tree, model, keys);
+    }
+
+    // 同一个key重复整批
+    keys.assign(300, model.empty() ? (Key) 0 : model.begin()->first);
+    checkBatch(tree, model, keys);
+
+    // 整个范围: 一批中的节点数远多于缓存块数,分段预读
+    keys.clear();
+    for (long i = 0; i < range; i++)
+        keys.push_back((Key) i);
+    std::random_shuffle(keys.begin(), keys.end());
+    checkBatch(tree, model, keys);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int flags, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + flags;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, flags);
+        // 空树,只有一个叶子
+        checkAll(tree, model, range, &seed);
+        randomOps(tree, model, 5, range, &seed);
+        checkAll(tree, model, range, &seed);
+
+        randomOps(tree, model, (int) range * 2, range, &seed);
+        checkAll(tree, model, range, &seed);
+
+        // 删除大部分后叶子稀疏
+        for (long k = 0; k < range; k++) {
+            if (k % 5 != 0 && model.erase((Key) k))
+                CHECK(tree.remove((Key) k) == S_OK);
+        }
+        checkAll(tree, model, range, &seed);
+    }
+    {
+        // 重新打开,缓存为空
+        Tree tree(file, 16 * BlockSize, flags);
+        checkAll(tree, model, range, &seed);
+    }
+    removeIndex(file);
+}
+
+typedef BPlusTree<long, long, 128> ConcurrentTree;
+
+static const long RANGE = 20000;
+
+static volatile int writing;
+
+// 反复插入和删除奇数key,value为key + 1
+static void *writeOdd(void *arg)
+{
+    ConcurrentTree *tree = (ConcurrentTree *) arg;
+    unsigned seed = 5;
+    for (int i = 0; i < 100000; i++) {
+        long k = rand_r(&seed) % (RANGE / 2) * 2 + 1;
+        if (rand_r(&seed) % 2)
+            tree->insert(k, k + 1);
+        else
+            tree->remove(k);
+    }
+    __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// 偶数key不被修改,一定能找到; 奇数key找到时value正确
+static void concurrent(const char *file)
+{
+    removeIndex(file);
+    ConcurrentTree tree(file, 16 * 128, BPLUS_TREE_CONCURRENT);
+    for (long k = 0; k < RANGE; k += 2)
+        CHECK(tree.insert(k, k * 3) == S_OK);
+
+    writing = 1;
+    pthread_t writer;
+    pthread_create(&writer, NULL, writeOdd, &tree);
+
+    unsigned seed = 11;
+    std::vector<long> keys(2000), values(keys.size());
+    std::vector<int> rets(keys.size());
+    int rounds = 0;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE) || rounds < 10) {
+        size_t even = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            keys[i] = rand_r(&seed) % RANGE;
+            even += keys[i] % 2 == 0;
+        }
+        CHECK(tree.multiGet(&keys[0], &values[0], &rets[0], keys.size())
+              >= even);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] % 2 == 0)
+                CHECK(rets[i] == S_OK && values[i] == keys[i] * 3);
+            else if (rets[i] == S_OK)
+                CHECK(values[i] == keys[i] + 1);
+            else
+                CHECK(rets[i] == S_FALSE);
+        }
+        rounds++;
+    }
+    pthread_join(writer, NULL);
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("multiget_long128.idx", 0, 3000);
+    run<int, int, 4096>("multiget_int4096.idx", 0, 30000);
+    run<long, long, 128>(
+        "multiget_concurrent.idx", BPLUS_TREE_CONCURRENT, 3000);
+    run<long, long, 4096>(
+        "multiget_uring.idx", BPLUS_TREE_URING | BPLUS_TREE_COMPRESS, 30000);
+    run<long, long, 4096>("multiget_mmap.idx", BPLUS_TREE_MMAP, 30000);
+    concurrent("multiget_threads.idx");
+    printf("multiget_test passed\n");
+    return 0;
+}
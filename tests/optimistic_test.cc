@@ -0,0 +1,125 @@
+/*
+ * @file optimistic_test.cc
+ * @brief
+ * 乐观查找: 节点都在缓存中且没有写者时,查找全部乐观完成(不退回加锁);
+ * 重新打开后不在缓存中的节点退回加锁读入; 多个读者与分裂、合并叶子的
+ * 写者同时进行时,不被修改的key总能找到,被修改的key的value正确
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <pthread.h>
+#include "TreeCheck.h"
+
+typedef BPlusTree<long, long, 128> Tree;
+
+static const long RANGE = 20000;
+static const size_t CACHE = 4 << 20; // 整棵树都在缓存中
+static const int READERS = 2;
+static const int WRITERS = 2;
+
+static volatile int writing;
+
+// 只修改id对应的奇数key,value为key + 1
+static void *writeOdd(void *arg)
+{
+    Tree *tree = ((std::pair<Tree *, long> *) arg)->first;
+    long id = ((std::pair<Tree *, long> *) arg)->second;
+    unsigned seed = id;
+    for (int round = 0; round < 4; round++) {
+        // 连续插入一段使叶子分裂,再删除使叶子合并
+        for (long k = 1 + id * 2; k < RANGE; k += WRITERS * 2)
+            tree->insert(k, k + 1);
+        for (long k = 1 + id * 2; k < RANGE; k += WRITERS * 2) {
+            if (rand_r(&seed) % 4 != 0) tree->remove(k);
+        }
+    }
+    return NULL;
+}
+
+struct Reader
+{
+    Tree *tree;
+    long searches;
+};
+
+// 偶数key不被修改,value为key * 3
+static void *readKeys(void *arg)
+{
+    Reader *r = (Reader *) arg;
+    unsigned seed = 17 + r->searches;
+    r->searches = 0;
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE) || r->searches < 1000) {
+        long k = rand_r(&seed) % RANGE;
+        long v = -1;
+        int ret = r->tree->search(k, &v);
+        if (k % 2 == 0)
+            CHECK(ret == S_OK && v == k * 3);
+        else
+            CHECK(ret == S_FALSE || (ret == S_OK && v == k + 1));
+        r->searches++;
+    }
+    return NULL;
+}
+
+// 查找每个偶数key,返回退回加锁的次数
+static long searchEven(Tree &tree)
+{
+    long before = tree.lockedSearches();
+    for (long k = 0; k < RANGE; k += 2) {
+        long v;
+        CHECK(tree.search(k, &v) == S_OK && v == k * 3);
+        CHECK(tree.search(k + 1, &v) == S_FALSE);
+    }
+    return tree.lockedSearches() - before;
+}
+
+int main()
+{
+    const char *file = "optimistic.idx";
+    removeIndex(file);
+    {
+        Tree tree(file, CACHE, BPLUS_TREE_CONCURRENT);
+        for (long k = 0; k < RANGE; k += 2)
+            CHECK(tree.insert(k, k * 3) == S_OK);
+        CHECK(searchEven(tree) == 0);
+    }
+    {
+        // 节点不在缓存中时加锁读入,读入后乐观完成
+        Tree tree(file, CACHE, BPLUS_TREE_CONCURRENT);
+        CHECK(searchEven(tree) > 0);
+        CHECK(searchEven(tree) == 0);
+
+        pthread_t readers[READERS], writers[WRITERS];
+        Reader args[READERS];
+        std::pair<Tree *, long> ids[WRITERS];
+        writing = 1;
+        for (int i = 0; i < READERS; i++) {
+            args[i].tree = &tree;
+            args[i].searches = i;
+            pthread_create(&readers[i], NULL, readKeys, &args[i]);
+        }
+        for (int i = 0; i < WRITERS; i++) {
+            ids[i] = std::make_pair(&tree, (long) i);
+            pthread_create(&writers[i], NULL, writeOdd, &ids[i]);
+        }
+        for (int i = 0; i < WRITERS; i++) pthread_join(writers[i], NULL);
+        __atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+
+        long searches = 0;
+        for (int i = 0; i < READERS; i++) {
+            pthread_join(readers[i], NULL);
+            searches += args[i].searches;
+        }
+        // 冲突时才退回加锁
+        CHECK(tree.lockedSearches() < searches);
+
+        for (long k = 0; k < RANGE; k += 2) {
+            long v;
+            CHECK(tree.search(k, &v) == S_OK && v == k * 3);
+        }
+    }
+    removeIndex(file);
+    printf("optimistic_test passed\n");
+    return 0;
+}
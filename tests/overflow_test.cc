@@ -0,0 +1,204 @@
+/*
+ * @file overflow_test.cc
+ * @brief
+ * 变长value: 叶子中放得下的value与溢出到多个溢出页的value
+ * (恰好放满叶子、多1字节、溢出页的整数倍等边界长度);
+ * 查找、游标和流式读取(每个溢出页一段)与model一致;
+ * 删除后回收的溢出页和节点被重用,文件不再增长; 重新打开后再比较
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <sys/stat.h>
+#include <vector>
+#include "BytesTree.h"
+#include "TreeCheck.h"
+
+typedef std::map<std::string, std::string> Model;
+
+static const int BLOCK_SIZE = 512;
+// 溢出页中数据的长度
+static const int OVERFLOW_CAPACITY = BLOCK_SIZE - (int) sizeof(PageHeader);
+
+static off_t fileSize(const char *file)
+{
+    struct stat st;
+    CHECK(stat(file, &st) == 0);
+    return st.st_size;
+}
+
+static std::string keyOf(long i)
+{
+    char buf[32];
+    snprintf(buf, sizeof buf, "value/%06ld", i);
+    return buf;
+}
+
+// 内容与key和长度相关的value
+static std::string valueOf(long i, size_t len)
+{
+    std::string v(len, 0);
+    for (size_t j = 0; j < len; j++)
+        v[j] = (char) ((i * 131 + j * 7 + len) & 0xff);
+    return v;
+}
+
+// 各种边界长度
+static std::vector<size_t> lengths(const BytesTree &tree, size_t klen)
+{
+    size_t inlineMax = tree.maxEntrySize() - klen;
+    size_t l[] = {0,
+                  1,
+                  inlineMax - 1,
+                  inlineMax,
+                  inlineMax + 1,
+                  OVERFLOW_CAPACITY - 1,
+                  OVERFLOW_CAPACITY,
+                  OVERFLOW_CAPACITY + 1,
+                  3 * OVERFLOW_CAPACITY,
+                  3 * OVERFLOW_CAPACITY + 5,
+                  10000,
+                  100000};
+    return std::vector<size_t>(l, l + sizeof(l) / sizeof(l[0]));
+}
+
+// 流式读取: 叶子中的value一段,溢出的value每个溢出页一段
+static void checkReader(
+    BytesTree &tree,
+    const std::string &k,
+    const std::string &v)
+{
+    BytesTree::ValueReader reader(&tree);
+    CHECK(reader.open(k.data(), k.size()) == S_OK);
+    CHECK(reader.size() == v.size());
+
+    bool external = (int) (k.size() + v.size()) > tree.maxEntrySize();
+    std::string got;
+    const char *data;
+    int len, segments = 0;
+    while (reader.next(&data, &len) == S_OK) {
+        if (external) CHECK(len > 0 && len <= OVERFLOW_CAPACITY);
+        got.append(data, len);
+        segments++;
+    }
+    CHECK(got == v);
+    int pages = (v.size() + OVERFLOW_CAPACITY - 1) / OVERFLOW_CAPACITY;
+    CHECK(segments == (external ? pages : 1));
+    CHECK(reader.next(&data, &len) == S_FALSE);
+}
+
+static void verify(BytesTree &tree, const Model &model, long n)
+{
+    for (long i = 0; i < n; i++) {
+        std::string k = keyOf(i), v;
+        Model::const_iterator it = model.find(k);
+        int ret = tree.search(k.data(), k.size(), &v);
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret != S_OK) {
+            BytesTree::ValueReader reader(&tree);
+            CHECK(reader.open(k.data(), k.size()) == S_FALSE);
+            continue;
+        }
+        CHECK(v == it->second);
+        checkReader(tree, k, v);
+    }
+
+    BytesTree::Cursor cursor(&tree);
+    Model::const_iterator it = model.begin();
+    for (cursor.seekFirst(); cursor.valid(); cursor.next(), ++it) {
+        CHECK(it != model.end());
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    }
+    CHECK(it == model.end());
+}
+
+// 每个key取一个边界长度,插入后与model对照
+static void fill(
+    BytesTree &tree,
+    Model &model,
+    long n,
+    int round,
+    const std::vector<size_t> &lens)
+{
+    for (long i = 0; i < n; i++) {
+        std::string k = keyOf(i);
+        std::string v = valueOf(i + round, lens[(i + round) % lens.size()]);
+        CHECK(tree.insert(k.data(), k.size(), v.data(), v.size()) == S_OK);
+        model[k] = v;
+    }
+}
+
+static void removeAll(BytesTree &tree, Model &model, long n, int step)
+{
+    for (long i = 0; i < n; i += step) {
+        std::string k = keyOf(i);
+        int ret = tree.remove(k.data(), k.size());
+        CHECK((ret == S_OK) == (model.erase(k) == 1));
+    }
+}
+
+int main()
+{
+    const char *file = "overflow.idx";
+    const long n = 240;
+    Model model;
+
+    unlink(file);
+    off_t full;
+    {
+        BytesTree tree(file, BLOCK_SIZE);
+        std::vector<size_t> lens = lengths(tree, keyOf(0).size());
+        fill(tree, model, n, 0, lens);
+        verify(tree, model, n);
+
+        // 已存在的key不覆盖,value不变
+        std::string k = keyOf(3), v(50000, 'x');
+        CHECK(tree.insert(k.data(), k.size(), v.data(), v.size()) == S_FALSE);
+        verify(tree, model, n);
+        tree.sync();
+        full = fileSize(file);
+
+        // 删除一半再插入同样长度的value,使用回收的块
+        removeAll(tree, model, n, 2);
+        verify(tree, model, n);
+        for (long i = 0; i < n; i += 2) {
+            std::string k = keyOf(i);
+            std::string v = valueOf(i, lens[i % lens.size()]);
+            CHECK(tree.insert(k.data(), k.size(), v.data(), v.size()) == S_OK);
+            model[k] = v;
+        }
+        verify(tree, model, n);
+        tree.sync();
+        CHECK(fileSize(file) == full);
+    }
+    {
+        // 重新打开后空闲链表仍可使用
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+        std::vector<size_t> lens = lengths(tree, keyOf(0).size());
+        removeAll(tree, model, n, 1);
+        CHECK(model.empty());
+        verify(tree, model, n);
+        fill(tree, model, n, 0, lens);
+        verify(tree, model, n);
+    }
+    CHECK(fileSize(file) == full);
+    {
+        // 长度不同的value相互替换
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+        std::vector<size_t> lens = lengths(tree, keyOf(0).size());
+        for (int round = 1; round < 4; round++) {
+            removeAll(tree, model, n, 1);
+            fill(tree, model, n, round, lens);
+            verify(tree, model, n);
+        }
+    }
+    {
+        BytesTree tree(file, BLOCK_SIZE);
+        verify(tree, model, n);
+    }
+    unlink(file);
+    printf("overflow_test passed\n");
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * @file packed_test.cc
+ * @brief
+ * 压缩叶子: 随机插入/删除时叶子按编码大小分裂与合并,批量写入覆盖的value
+ * 编码变长时分裂; 之后不带压缩选项打开,两种格式的叶子共存
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include "TreeCheck.h"
+
+// 覆盖已存在的key,value在小整数与大整数之间切换,编码大小随之变化
+template <typename Tree, typename Key, typename Value>
+static void overwrite(
+    Tree &tree,
+    std::map<Key, Value> &model,
+    int rounds,
+    unsigned *seed)
+{
+    for (int round = 0; round < rounds; round++) {
+        typename Tree::WriteBatch batch;
+        typename std::map<Key, Value>::iterator it = model.begin();
+        for (; it != model.end(); ++it) {
+            if (rand_r(seed) % 4 != 0) continue;
+            Value v = round % 2 ? (Value) rand_r(seed) << 16 : it->first;
+            batch.put(it->first, v);
+            it->second = v;
+        }
+        CHECK(tree.commit(&batch) == S_OK);
+    }
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 16;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_COMPRESS);
+        CHECK(tree.compressEnabled());
+        randomOps(tree, model, n, range, &seed);
+        verifyTree(tree, model, range);
+        overwrite(tree, model, 4, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        // 普通格式的叶子与压缩叶子混合修改
+        Tree tree(file, 16 * BlockSize);
+        CHECK(!tree.compressEnabled());
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+        overwrite(tree, model, 2, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_COMPRESS);
+        randomOps(tree, model, n / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+/**
+ * 插入已存在的key在两种格式的叶子中都返回S_FALSE,value不变
+ * 小于512字节的块不支持压缩叶子,忽略BPLUS_TREE_COMPRESS
+ */
+template <typename Key, typename Value, int BlockSize>
+static void duplicate(const char *file, int flags)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    removeIndex(file);
+    Tree tree(file, 16 * BlockSize, flags);
+    CHECK(tree.compressEnabled()
+          == ((flags & BPLUS_TREE_COMPRESS) && BlockSize >= 512));
+    for (long i = 0; i < 5000; i++) CHECK(tree.insert(i, i) == S_OK);
+    for (long i = 0; i < 5000; i += 7) CHECK(tree.insert(i, -i) == S_FALSE);
+    for (long i = 0; i < 5000; i++) {
+        Value v;
+        CHECK(tree.search(i, &v) == S_OK && v == (Value) i);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 4096>("packed_long4096.idx", 300000, 200000);
+    run<int, int, 4096>("packed_int4096.idx", 300000, 200000);
+    duplicate<long, long, 4096>("packed_dup.idx", BPLUS_TREE_COMPRESS);
+    duplicate<long, long, 4096>("packed_dup.idx", 0);
+    duplicate<long, long, 4096>(
+        "packed_dup.idx", BPLUS_TREE_COMPRESS | BPLUS_TREE_CONCURRENT);
+    duplicate<long, long, 128>("packed_dup.idx", BPLUS_TREE_CONCURRENT);
+    duplicate<long, long, 128>("packed_dup.idx", BPLUS_TREE_COMPRESS);
+    printf("packed_test passed\n");
+    return 0;
+}
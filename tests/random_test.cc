@@ -0,0 +1,42 @@
+/*
+ * @file random_test.cc
+ * @brief
+ * 随机插入/删除与std::map对照,缓冲池很小以覆盖置换与写回,
+ * 关闭后重新打开再比较一次
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include "TreeCheck.h"
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + sizeof(Key);
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize);
+        randomOps(tree, model, n, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n / 2, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("random_long128.idx", 40000, 20000);
+    run<int, int, 128>("random_int128.idx", 40000, 20000);
+    run<long, long, 256>("random_long256.idx", 40000, 20000);
+    run<long, long, 4096>("random_long4096.idx", 100000, 50000);
+    printf("random_test passed\n");
+    return 0;
+}
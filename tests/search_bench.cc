@@ -0,0 +1,161 @@
+/*
+ * @file search_bench.cc
+ * @brief
+ * 节点内查找的微基准: 对比各块大小下二分查找,各指令集的向量比较
+ * 以及Eytzinger布局的查找
+ * hot为反复查找同一个节点, cold为在大量节点间随机查找(节点不在CPU缓存中)
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "NodeSearch.h"
+
+static const int NODE_HEADER = 20;         // sizeof(Node)
+static const int SLOT_SIZE = 8;            // data/subNode的大小
+static const size_t COLD_BYTES = 64 << 20; // cold测试的节点总大小
+static const int QUERIES = 1 << 22;
+
+// 保存查找结果,避免未使用的结果被优化掉
+static volatile long sink;
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Eytzinger布局的查找,返回有序数组中的位置
+template <typename Key, int N>
+struct EytzingerSearch
+{
+    static int lowerBound(const Key *keys, int count, Key target)
+    {
+        int k = Eytzinger<Key, N>::lowerBound(keys, count, target);
+        return k == 0 ? count : Eytzinger<Key, N>::rank(k, count);
+    }
+};
+
+template <typename Key, int BlockSize>
+class SearchBench
+{
+    // 与树中一样,key按Key的边界对齐
+    static const int KEY_OFFSET =
+        (NODE_HEADER + (int) sizeof(Key) - 1) / sizeof(Key) * sizeof(Key);
+    static const int DEGREE =
+        (BlockSize - KEY_OFFSET) / ((int) sizeof(Key) + SLOT_SIZE);
+
+    std::vector<char> blocks_;
+    size_t nodes_;
+    std::vector<Key> targets_;
+    std::vector<size_t> order_; // 每次查找的节点
+
+  public:
+    SearchBench(size_t nodes) : blocks_(nodes * BlockSize), nodes_(nodes)
+    {
+        // 每个节点都是满的,key为递增的偶数
+        for (size_t n = 0; n < nodes_; n++) {
+            Key *keys = this->keys(n);
+            for (int i = 0; i < DEGREE; i++) keys[i] = (Key) i * 2;
+        }
+        for (int i = 0; i < QUERIES; i++) {
+            targets_.push_back((Key) (rand() % (DEGREE * 2 + 1)));
+            order_.push_back(nodes_ == 1 ? 0 : rand() % nodes_);
+        }
+    }
+
+    Key *keys(size_t n)
+    {
+        return (Key *) &blocks_[n * BlockSize + KEY_OFFSET];
+    }
+
+    /**
+     * 返回每次查找的纳秒数,sum为结果之和(用于校验)
+     * 与树的查找一样,下一次查找依赖上一次的结果,测量的是延迟
+     */
+    template <typename Search>
+    double run(long *sum)
+    {
+        long s = 0;
+        int last = 0;
+        double start = now();
+        for (int i = 0; i < QUERIES; i++) {
+            // last不超过DEGREE, last >> 30恒为0
+            Key target = targets_[i] + (last >> 30);
+            last = Search::lowerBound(keys(order_[i]), DEGREE, target);
+            s += last;
+        }
+        *sum = sink = s;
+        return (now() - start) / QUERIES;
+    }
+
+    void report(const char *name)
+    {
+        long expect, sum;
+        double ns = run<KeySearch<Key, DEGREE, false> >(&expect);
+        printf(
+            "%-5s %6d %6d %-6s scalar %6.1f",
+            name,
+            BlockSize,
+            DEGREE,
+            nodes_ == 1 ? "hot" : "cold",
+            ns);
+
+        // 节点太小时不使用向量比较
+        int best = NodeSearch::isa();
+        for (int isa = NodeSearch::ISA_SSE;
+             isa <= best && DEGREE >= NodeSearch::MIN_KEYS;
+             isa++) {
+            NodeSearch::select(isa);
+            ns = run<KeySearch<Key, DEGREE, true> >(&sum);
+            assert(sum == expect);
+            printf(" %s %6.1f", NodeSearch::isaName(isa), ns);
+        }
+        NodeSearch::select(best);
+
+        // 所有节点转换为Eytzinger布局
+        for (size_t n = 0; n < nodes_; n++)
+            Eytzinger<Key, DEGREE>::pack(keys(n), DEGREE);
+        ns = run<EytzingerSearch<Key, DEGREE> >(&sum);
+        assert(sum == expect);
+        printf(" eytzinger %6.1f\n", ns);
+    }
+};
+
+template <typename Key, int BlockSize>
+static void bench(const char *name)
+{
+    SearchBench<Key, BlockSize> hot(1);
+    hot.report(name);
+    SearchBench<Key, BlockSize> cold(COLD_BYTES / BlockSize);
+    cold.report(name);
+}
+
+int main(int argc, char const *argv[])
+{
+    srand(1);
+    printf("detected isa: %s\n", NodeSearch::isaName(NodeSearch::isa()));
+    printf("key   block  degree mode   ns/search\n");
+
+    bench<int32_t, 128>("int");
+    bench<int32_t, 512>("int");
+    bench<int32_t, 1024>("int");
+    bench<int32_t, 4096>("int");
+    bench<int32_t, 8192>("int");
+    bench<int32_t, 16384>("int");
+
+    bench<int64_t, 128>("long");
+    bench<int64_t, 512>("long");
+    bench<int64_t, 1024>("long");
+    bench<int64_t, 4096>("long");
+    bench<int64_t, 8192>("long");
+    bench<int64_t, 16384>("long");
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * @file search_test.cc
+ * @brief
+ * 节点内查找: 依次选择CPU支持的每个指令集,向量比较的窗口计数、
+ * KeySearch和Eytzinger布局的查找与std::lower_bound一致
+ * (窗口不满、target在两端之外、相邻key、类型的最小/最大值),
+ * 并在每个指令集下运行整棵树; CPU不支持的指令集打印跳过
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "NodeSearch.h"
+#include "TreeCheck.h"
+
+// 有序不重复的n个key,后面留出PAD_BYTES的填充
+template <typename Key>
+static std::vector<Key> sortedKeys(int n, unsigned *seed)
+{
+    std::vector<Key> keys(n + NodeSearch::PAD_BYTES / sizeof(Key));
+    Key k = std::numeric_limits<Key>::min();
+    for (int i = 0; i < n; i++) {
+        // 包括类型的最小值,相邻key的间隔为1或随机
+        keys[i] = k;
+        k += 1 + (rand_r(seed) % 2 ? 0 : rand_r(seed) % 1000);
+        if (i == n / 2) k = 0;
+    }
+    if (n > 1) keys[n - 1] = std::numeric_limits<Key>::max();
+    std::sort(keys.begin(), keys.begin() + n);
+    // 填充的内容与结果无关
+    for (size_t i = n; i < keys.size(); i++)
+        keys[i] = (Key) rand_r(seed);
+    return keys;
+}
+
+// 查找的target: 每个key、相邻的值和两端之外
+template <typename Key>
+static std::vector<Key> targets(const std::vector<Key> &keys, int n)
+{
+    std::vector<Key> t;
+    t.push_back(std::numeric_limits<Key>::min());
+    t.push_back(std::numeric_limits<Key>::max());
+    t.push_back(0);
+    for (int i = 0; i < n; i++) {
+        t.push_back(keys[i]);
+        if (keys[i] != std::numeric_limits<Key>::min())
+            t.push_back(keys[i] - 1);
+        if (keys[i] != std::numeric_limits<Key>::max())
+            t.push_back(keys[i] + 1);
+    }
+    return t;
+}
+
+template <typename Key>
+static int expected(const std::vector<Key> &keys, int n, Key target)
+{
+    return std::lower_bound(keys.begin(), keys.begin() + n, target)
+           - keys.begin();
+}
+
+// 向量比较的窗口: n不满、恰好满和超过窗口时只数窗口内的key
+template <typename Key>
+static void checkWindow(unsigned *seed)
+{
+    const int window = NodeSearch::WINDOW_BYTES / sizeof(Key);
+    for (int n = 0; n <= window * 2; n++) {
+        std::vector<Key> keys = sortedKeys<Key>(n, seed);
+        std::vector<Key> t = targets(keys, n);
+        for (size_t i = 0; i < t.size(); i++) {
+            int count = NodeSearch::countLess(&keys[0], n, t[i]);
+            CHECK(count == expected(keys, std::min(n, window), t[i]));
+        }
+    }
+}
+
+// 按树的度实例化的查找,count从0到N
+template <typename Key, int N>
+static void checkKeySearch(unsigned *seed)
+{
+    for (int n = 0; n <= N; n += 1 + n / 8) {
+        std::vector<Key> keys = sortedKeys<Key>(n, seed);
+        std::vector<Key> t = targets(keys, n);
+        for (size_t i = 0; i < t.size(); i++) {
+            int pos = KeySearch<Key, N>::lowerBound(&keys[0], n, t[i]);
+            CHECK(pos == expected(keys, n, t[i]));
+        }
+    }
+}
+
+template <typename Key, int N>
+static void checkEytzinger(unsigned *seed)
+{
+    typedef Eytzinger<Key, N> E;
+    for (int n = 1; n <= N; n += 1 + n / 8) {
+        std::vector<Key> keys = sortedKeys<Key>(n, seed);
+        std::vector<Key> packed = keys;
+        E::pack(&packed[0], n);
+        for (int r = 0; r < n; r++)
+            CHECK(E::rank(E::index(r, n), n) == r);
+
+        std::vector<Key> t = targets(keys, n);
+        for (size_t i = 0; i < t.size(); i++) {
+            int k = E::lowerBound(&packed[0], n, t[i]);
+            int pos = k == 0 ? n : E::rank(k, n);
+            CHECK(pos == expected(keys, n, t[i]));
+        }
+
+        E::unpack(&packed[0], n);
+        CHECK(std::equal(keys.begin(), keys.begin() + n, packed.begin()));
+    }
+}
+
+// 度不小于MIN_KEYS的树,节点内查找使用向量比较
+template <typename Key, typename Value, int BlockSize>
+static void checkTree(const char *file)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + NodeSearch::isa();
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize);
+        randomOps(tree, model, 60000, 40000, &seed);
+        verifyTree(tree, model, 40000);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    int best = NodeSearch::detect();
+    for (int isa = NodeSearch::ISA_SCALAR; isa <= NodeSearch::ISA_AVX512;
+         isa++) {
+        if (!NodeSearch::select(isa)) {
+            CHECK(isa > best);
+            printf("%s is not supported here, skipped\n",
+                   NodeSearch::isaName(isa));
+            continue;
+        }
+        CHECK(NodeSearch::isa() == isa);
+        unsigned seed = isa;
+
+        checkWindow<int32_t>(&seed);
+        checkWindow<int64_t>(&seed);
+        // 128字节到16K字节块的度
+        checkKeySearch<int32_t, 14>(&seed);
+        checkKeySearch<int32_t, 509>(&seed);
+        checkKeySearch<int64_t, 6>(&seed);
+        checkKeySearch<int64_t, 254>(&seed);
+        checkKeySearch<int64_t, 2046>(&seed);
+        checkEytzinger<int32_t, 509>(&seed);
+        checkEytzinger<int64_t, 254>(&seed);
+
+        checkTree<int, int, 4096>("search_int4096.idx");
+        checkTree<long, long, 4096>("search_long4096.idx");
+    }
+    CHECK(NodeSearch::select(best));
+    printf("search_test passed\n");
+    return 0;
+}
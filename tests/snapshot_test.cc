@@ -0,0 +1,132 @@
+/*
+ * @file snapshot_test.cc
+ * @brief
+ * 快照: 创建后继续修改树(含整理),快照中的查找和遍历应与创建时的
+ * model一致; 同时存在多个快照,先后释放; 推迟写回的修改写不进文件时
+ * 快照创建失败(valid()为false,读取返回S_ERROR),树不受影响
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <signal.h>
+#include <sys/resource.h>
+#include "TreeCheck.h"
+
+// 快照中的查找与游标遍历与model一致
+template <typename Tree, typename Key, typename Value>
+static void verifySnapshot(
+    typename Tree::Snapshot &snap,
+    const std::map<Key, Value> &model,
+    long range)
+{
+    for (long i = 0; i < range; i++) {
+        Key k = (Key) i;
+        Value v;
+        typename std::map<Key, Value>::const_iterator it = model.find(k);
+        int ret = snap.search(k, &v);
+        CHECK((ret == S_OK) == (it != model.end()));
+        if (ret == S_OK) CHECK(v == it->second);
+    }
+
+    typename Tree::Cursor cursor(&snap);
+    typename std::map<Key, Value>::const_iterator it = model.begin();
+    for (cursor.seekFirst(); cursor.valid(); cursor.next(), ++it) {
+        CHECK(it != model.end());
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    }
+    CHECK(it == model.end());
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int flags, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + flags;
+
+    removeIndex(file);
+    Tree tree(file, 16 * BlockSize, flags);
+    randomOps(tree, model, n, range, &seed);
+
+    std::map<Key, Value> first = model;
+    typename Tree::Snapshot *snap1 = new typename Tree::Snapshot(&tree);
+    randomOps(tree, model, n, range, &seed);
+
+    std::map<Key, Value> second = model;
+    typename Tree::Snapshot *snap2 = new typename Tree::Snapshot(&tree);
+    randomOps(tree, model, n / 2, range, &seed);
+    while (tree.compact(64) > 0) randomOps(tree, model, 10, range, &seed);
+
+    verifySnapshot<Tree>(*snap1, first, range);
+    verifySnapshot<Tree>(*snap2, second, range);
+    delete snap1;
+
+    // 释放一个快照后,它的旧镜像位置被重用
+    randomOps(tree, model, n / 2, range, &seed);
+    verifySnapshot<Tree>(*snap2, second, range);
+    delete snap2;
+
+    verifyTree(tree, model, range);
+}
+
+// 文件大小上限改为limit,超过时写入失败(忽略SIGXFSZ),返回原来的上限
+static rlim_t limitFileSize(rlim_t limit)
+{
+    struct rlimit rl;
+    CHECK(getrlimit(RLIMIT_FSIZE, &rl) == 0);
+    rlim_t old = rl.rlim_cur;
+    rl.rlim_cur = limit;
+    CHECK(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+    return old;
+}
+
+static void failedSnapshot(const char *file)
+{
+    typedef BPlusTree<long, long, 128> Tree;
+    std::map<long, long> model;
+    unsigned seed = 3;
+
+    removeIndex(file);
+    Tree tree(file, 1024 * 128);
+    tree.setDirtyLimit(1000);
+    randomOps(tree, model, 2000, 2000, &seed);
+
+    // 脏块写不进文件
+    signal(SIGXFSZ, SIG_IGN);
+    rlim_t old = limitFileSize(2 * 128);
+    {
+        Tree::Snapshot snap(&tree);
+        CHECK(!snap.valid());
+        long v;
+        CHECK(snap.search(model.begin()->first, &v) == S_ERROR);
+        Tree::Cursor cursor(&snap);
+        CHECK(cursor.seekFirst() == S_ERROR && !cursor.valid());
+    }
+    limitFileSize(old);
+
+    // 脏块仍在缓存中,之后写回成功
+    verifyTree(tree, model, 2000);
+    {
+        Tree::Snapshot snap(&tree);
+        CHECK(snap.valid());
+        std::map<long, long> frozen = model;
+        randomOps(tree, model, 2000, 2000, &seed);
+        verifySnapshot<Tree>(snap, frozen, 2000);
+    }
+    verifyTree(tree, model, 2000);
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("snapshot_long128.idx", 0, 20000, 10000);
+    run<long, long, 4096>("snapshot_wal.idx", BPLUS_TREE_WAL, 50000, 30000);
+    run<long, long, 4096>(
+        "snapshot_packed.idx", BPLUS_TREE_COMPRESS, 50000, 30000);
+    removeIndex("snapshot_long128.idx");
+    removeIndex("snapshot_wal.idx");
+    removeIndex("snapshot_packed.idx");
+    failedSnapshot("snapshot_failed.idx");
+    printf("snapshot_test passed\n");
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * @file superblock_test.cc
+ * @brief
+ * 超级块: 新文件和修改后关闭的文件中,块0的标识、版本、块大小、
+ * 文件长度、根节点和位图的位置与文件一致,校验和为CRC32C,
+ * 不再生成.boot文件; 标识错误、内容损坏(校验和不符)和块大小不同的
+ * 文件在打开时被拒绝
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "Crc32c.h"
+#include "TreeCheck.h"
+
+typedef BPlusTree<long, long, 128> Tree;
+
+static const int BLOCK_SIZE = 128;
+static const PageId INVALID = 0xDEADBEEF;
+
+static DiskSuper readSuper(const char *file)
+{
+    DiskSuper super;
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(pread(fd, &super, sizeof super, 0) == sizeof super);
+    close(fd);
+    return super;
+}
+
+static void writeSuper(const char *file, const DiskSuper &super)
+{
+    int fd = open(file, O_WRONLY);
+    CHECK(fd >= 0);
+    CHECK(pwrite(fd, &super, sizeof super, 0) == sizeof super);
+    close(fd);
+}
+
+// 超级块中的长度和位置都落在文件之内
+static DiskSuper checkSuper(const char *file)
+{
+    DiskSuper super = readSuper(file);
+    CHECK(memcmp(super.magic, "BPLUSTRE", 8) == 0);
+    CHECK(super.version == 5 && super.blockSize == BLOCK_SIZE);
+    CHECK(super.checksum
+          == Crc32c::compute(&super, offsetof(DiskSuper, checksum)));
+
+    struct stat st;
+    CHECK(stat(file, &st) == 0);
+    CHECK(super.fileSize == st.st_size && st.st_size % BLOCK_SIZE == 0);
+    long pages = st.st_size / BLOCK_SIZE;
+    CHECK(super.freeMap > 0 && super.freeMapPages > 0);
+    CHECK(super.freeMap + super.freeMapPages <= pages);
+    if (super.root != INVALID) {
+        CHECK(super.root > 0 && super.root < pages);
+        CHECK(super.root < super.freeMap
+              || super.root >= super.freeMap + super.freeMapPages);
+    }
+    CHECK(access((std::string(file) + ".boot").c_str(), F_OK) != 0);
+    return super;
+}
+
+// 在子进程中打开,应因超级块不符而中止
+template <typename T>
+static void rejected(const char *file)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        T tree(file);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int main()
+{
+    const char *file = "superblock.idx";
+    std::map<long, long> model;
+    unsigned seed = 3;
+
+    removeIndex(file);
+    {
+        // 空树没有根节点,只有超级块和位图
+        Tree tree(file);
+    }
+    DiskSuper empty = checkSuper(file);
+    CHECK(empty.root == INVALID && empty.fileSize <= 4 * BLOCK_SIZE);
+    {
+        Tree tree(file);
+        verifyTree(tree, model, 100);
+        randomOps(tree, model, 20000, 10000, &seed);
+    }
+    DiskSuper full = checkSuper(file);
+    CHECK(full.root != INVALID && full.fileSize > empty.fileSize);
+    {
+        Tree tree(file);
+        verifyTree(tree, model, 10000);
+        randomOps(tree, model, 5000, 10000, &seed);
+    }
+    full = checkSuper(file);
+
+    // 标识、校验和与块大小
+    DiskSuper bad = full;
+    bad.magic[0] = 'X';
+    writeSuper(file, bad);
+    rejected<Tree>(file);
+
+    bad = full;
+    bad.root++;
+    writeSuper(file, bad);
+    rejected<Tree>(file);
+
+    bad = full;
+    bad.checksum ^= 1;
+    writeSuper(file, bad);
+    rejected<Tree>(file);
+
+    writeSuper(file, full);
+    rejected<BPlusTree<long, long, 256> >(file);
+
+    // 恢复后可以正常打开
+    {
+        Tree tree(file);
+        verifyTree(tree, model, 10000);
+    }
+    checkSuper(file);
+    removeIndex(file);
+    printf("superblock_test passed\n");
+    return 0;
+}
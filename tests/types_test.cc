@@ -0,0 +1,150 @@
+/*
+ * @file types_test.cc
+ * @brief
+ * 模板参数: 不同的Key/Value类型和块大小下,key取到类型的两端(含负数),
+ * value用到高位; 文件中叶子的key/value按度和偏移存放,与model一致
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "TreeCheck.h"
+
+// 按BPlusTree中的方式计算块内的布局
+template <typename Key, typename Value, int BlockSize>
+struct Layout
+{
+    static const int SLOT_SIZE =
+        sizeof(Value) > sizeof(PageId) ? sizeof(Value) : sizeof(PageId);
+    static const int KEY_OFFSET = ((int) sizeof(Node) + alignof(Key) - 1)
+                                  / alignof(Key) * alignof(Key);
+    // 块末尾4字节为校验和
+    static const int DEGREE =
+        (BlockSize - KEY_OFFSET - 4) / ((int) sizeof(Key) + SLOT_SIZE);
+};
+
+template <typename Key, typename Value>
+static Value valueOf(Key k)
+{
+    // 乘法散列,value的高位也不为0
+    return (Value) ((unsigned long) k * 0x9e3779b97f4a7c15UL);
+}
+
+// 查找model中的key和相邻的key,游标正向遍历与model相同
+template <typename Tree, typename Key, typename Value>
+static void verify(Tree &tree, const std::map<Key, Value> &model)
+{
+    typename std::map<Key, Value>::const_iterator it;
+    for (it = model.begin(); it != model.end(); ++it) {
+        Value v;
+        CHECK(tree.search(it->first, &v) == S_OK && v == it->second);
+        if (it->first != std::numeric_limits<Key>::max()) {
+            Key next = it->first + 1;
+            CHECK((tree.search(next, &v) == S_OK) == (model.count(next) == 1));
+        }
+    }
+
+    typename Tree::Cursor cursor(&tree);
+    it = model.begin();
+    for (cursor.seekFirst(); cursor.valid(); cursor.next(), ++it) {
+        CHECK(it != model.end());
+        CHECK(cursor.key() == it->first && cursor.value() == it->second);
+    }
+    CHECK(it == model.end());
+}
+
+// 直接读取文件中的节点: 叶子中的key/value与model一致,key数不超过度
+template <typename Key, typename Value, int BlockSize>
+static void checkFile(const char *file, const std::map<Key, Value> &model)
+{
+    typedef Layout<Key, Value, BlockSize> L;
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0 && st.st_size % BlockSize == 0);
+
+    char buf[BlockSize];
+    size_t entries = 0;
+    for (off_t page = 1;
+         pread(fd, buf, BlockSize, page * BlockSize) == BlockSize;
+         page++) {
+        const Node *node = (const Node *) buf;
+        if (node->self != page) continue;
+        // 叶子为0,非叶子节点为1
+        if (node->type == 1) CHECK(node->count > 0 && node->count <= L::DEGREE);
+        if (node->type != 0) continue;
+
+        CHECK(node->count > 0 && node->count <= L::DEGREE);
+        const Key *keys = (const Key *) (buf + L::KEY_OFFSET);
+        const Value *values = (const Value *) (keys + L::DEGREE);
+        for (int i = 0; i < node->count; i++) {
+            if (i > 0) CHECK(keys[i - 1] < keys[i]);
+            typename std::map<Key, Value>::const_iterator it =
+                model.find(keys[i]);
+            CHECK(it != model.end() && it->second == values[i]);
+        }
+        entries += node->count;
+    }
+    CHECK(entries == model.size());
+    close(fd);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, long n)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + sizeof(Key);
+
+    // key均匀分布在整个取值范围,包括两端
+    std::vector<Key> keys;
+    Key stride = std::numeric_limits<Key>::max() / n;
+    for (long i = -n; i < n; i++)
+        keys.push_back((Key) (i * stride));
+    keys.push_back(std::numeric_limits<Key>::min());
+    keys.push_back(std::numeric_limits<Key>::max());
+    std::random_shuffle(keys.begin(), keys.end());
+
+    // 只插入时文件中没有空闲块,可以逐块检查
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize);
+        for (size_t i = 0; i < keys.size(); i++) {
+            Value v = valueOf<Key, Value>(keys[i]);
+            CHECK(tree.insert(keys[i], v) == S_OK);
+            model[keys[i]] = v;
+        }
+        verify(tree, model);
+    }
+    checkFile<Key, Value, BlockSize>(file, model);
+
+    {
+        Tree tree(file, 16 * BlockSize);
+        verify(tree, model);
+        for (size_t i = 0; i < keys.size(); i += 1 + rand_r(&seed) % 3) {
+            CHECK(tree.remove(keys[i]) == S_OK);
+            model.erase(keys[i]);
+        }
+        verify(tree, model);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verify(tree, model);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<int, int, 128>("types_int128.idx", 5000);
+    run<int, int, 4096>("types_int4096.idx", 50000);
+    run<long, long, 128>("types_long128.idx", 5000);
+    run<long, long, 256>("types_long256.idx", 5000);
+    run<long, long, 4096>("types_long4096.idx", 50000);
+    printf("types_test passed\n");
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * @file upgrade_test.cc
+ * @brief
+ * 旧版本的索引文件: 把建好的树改写为v3格式(空闲块串成链表,超级块指向
+ * 链表头,块末尾没有校验和),打开时升级为v5: 节点写入校验和,
+ * 空闲链表中的块在位图中为空闲,其余块已使用; 内容与model一致,
+ * 升级后继续修改并重新打开; 日志不为空的v3文件拒绝升级
+ * v4格式(位图,块末尾没有校验和)的文件与崩溃时留下的v4格式日志
+ * (FNV-1a校验的记录,镜像没有校验和)在打开时升级并重放
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/wait.h>
+#include <set>
+#include "BufferPool.h"
+#include "FreeSpace.h"
+#include "TreeCheck.h"
+
+static const PageId INVALID = 0xDEADBEEF;
+static const short TYPE_FREE = 4;
+
+static DiskSuper readSuper(int fd)
+{
+    DiskSuper super;
+    CHECK(pread(fd, &super, sizeof super, 0) == sizeof super);
+    return super;
+}
+
+// v3/v4的超级块校验和(FNV-1a)
+static uint32_t fnv(const DiskSuper &super)
+{
+    const unsigned char *p = (const unsigned char *) &super;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(DiskSuper, checksum); i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// v4格式日志记录的校验和: 按64位字计算的FNV-1a, 4路交错
+static uint32_t fnvRecord(const Wal::Record *record, const void *payload)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash[4] = {
+        14695981039346656037ull, 14695981039346656037ull ^ 1,
+        14695981039346656037ull ^ 2, 14695981039346656037ull ^ 3};
+    uint64_t word[4];
+
+    const char *p = (const char *) &record->type;
+    for (size_t i = 0; i + 4 <= sizeof(Wal::Record) - 4; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        hash[0] = (hash[0] ^ w) * prime;
+    }
+
+    p = (const char *) payload;
+    size_t i = 0;
+    for (; i + sizeof word <= record->length; i += sizeof word) {
+        memcpy(word, p + i, sizeof word);
+        for (int j = 0; j < 4; j++)
+            hash[j] = (hash[j] ^ word[j]) * prime;
+    }
+    for (; i < record->length; i++)
+        hash[0] = (hash[0] ^ (unsigned char) p[i]) * prime;
+
+    uint64_t h = hash[0] ^ (hash[1] * 3) ^ (hash[2] * 5) ^ (hash[3] * 7);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+// 超级块指向的位图
+template <int BlockSize>
+static void loadMap(int fd, const DiskSuper &super, FreeSpace *space)
+{
+    std::string buf((size_t) super.freeMapPages * BlockSize, 0);
+    CHECK(pread(fd, &buf[0], buf.size(), (off_t) super.freeMap * BlockSize)
+          == (ssize_t) buf.size());
+    space->load(buf.data(), super.fileSize / BlockSize);
+}
+
+// 擦掉节点末尾的校验和
+template <int BlockSize>
+static void eraseChecksums(int fd, const std::set<off_t> &nodes)
+{
+    char buf[BlockSize];
+    std::set<off_t>::const_iterator it;
+    for (it = nodes.begin(); it != nodes.end(); ++it) {
+        CHECK(pread(fd, buf, BlockSize, *it * BlockSize) == BlockSize);
+        memset(buf + BlockSize - BufferPool::CHECKSUM_SIZE, 0,
+               BufferPool::CHECKSUM_SIZE);
+        CHECK(pwrite(fd, buf, BlockSize, *it * BlockSize) == BlockSize);
+    }
+}
+
+/**
+ * 把v5文件改写为version(3或4)格式: 位图以外已使用的块(节点)放入nodes,
+ * 擦掉其校验和; v3中其余块(包括位图)串成空闲链表
+ */
+template <int BlockSize>
+static void downgrade(const char *file, int version, std::set<off_t> *nodes)
+{
+    int fd = open(file, O_RDWR);
+    CHECK(fd >= 0);
+    DiskSuper super = readSuper(fd);
+    CHECK(super.version == 5);
+    FreeSpace space;
+    loadMap<BlockSize>(fd, super, &space);
+
+    std::vector<off_t> freeList;
+    char buf[BlockSize];
+    for (off_t page = 1; page < space.pages(); page++) {
+        bool map = page >= super.freeMap
+                   && page < super.freeMap + super.freeMapPages;
+        if (!space.used(page) || map) {
+            freeList.push_back(page);
+            continue;
+        }
+        nodes->insert(page);
+    }
+    eraseChecksums<BlockSize>(fd, *nodes);
+
+    if (version == 3) {
+        // 从后向前串起,链表头为最后一个空闲块
+        CHECK(freeList.size() >= 2);
+        PageId head = INVALID;
+        for (size_t i = 0; i < freeList.size(); i++) {
+            off_t page = freeList[i];
+            memset(buf, 0, BlockSize);
+            Node *node = (Node *) buf;
+            node->self = page;
+            node->type = TYPE_FREE;
+            node->next = head;
+            CHECK(pwrite(fd, buf, BlockSize, page * BlockSize) == BlockSize);
+            head = page;
+        }
+        super.freeMap = head;
+        super.freeMapPages = 0;
+    }
+    super.version = version;
+    super.checksum = fnv(super);
+    CHECK(pwrite(fd, &super, sizeof super, 0) == sizeof super);
+    close(fd);
+}
+
+// 把日志改写为v4格式: 记录用FNV-1a校验,块镜像末尾没有校验和
+template <int BlockSize>
+static void downgradeWal(const char *file)
+{
+    std::string wal = std::string(file) + ".wal";
+    int fd = open(wal.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    std::string log(lseek(fd, 0, SEEK_END), 0);
+    CHECK(pread(fd, &log[0], log.size(), 0) == (ssize_t) log.size());
+
+    int pages = 0;
+    for (size_t pos = 0; pos < log.size();) {
+        Wal::Record *r = (Wal::Record *) &log[pos];
+        char *payload = (char *) (r + 1);
+        CHECK(r->format == Wal::FORMAT_CRC32C);
+        r->format = Wal::FORMAT_FNV;
+        if (r->type == Wal::WAL_PAGE) {
+            memset(payload + BlockSize - BufferPool::CHECKSUM_SIZE, 0,
+                   BufferPool::CHECKSUM_SIZE);
+            pages++;
+        }
+        r->checksum = fnvRecord(r, payload);
+        pos += sizeof(Wal::Record) + r->length;
+    }
+    CHECK(pages > 0);
+    CHECK(pwrite(fd, &log[0], log.size(), 0) == (ssize_t) log.size());
+    close(fd);
+}
+
+// 升级后: 节点都有校验和,位图中只有超级块、节点和位图已使用
+template <int BlockSize>
+static void checkUpgraded(const char *file, const std::set<off_t> &nodes)
+{
+    int fd = open(file, O_RDONLY);
+    CHECK(fd >= 0);
+    DiskSuper super = readSuper(fd);
+    CHECK(super.version == 5);
+    FreeSpace space;
+    loadMap<BlockSize>(fd, super, &space);
+
+    char buf[BlockSize];
+    for (off_t page = 0; page < space.pages(); page++) {
+        bool map = page >= super.freeMap
+                   && page < super.freeMap + super.freeMapPages;
+        bool node = nodes.count(page) > 0;
+        CHECK(space.used(page) == (page == 0 || map || node));
+        if (!node) continue;
+
+        CHECK(pread(fd, buf, BlockSize, page * BlockSize) == BlockSize);
+        if (((Node *) buf)->self == page)
+            CHECK(BufferPool::verify(buf, BlockSize));
+    }
+    CHECK(*nodes.rbegin() < space.pages());
+    close(fd);
+}
+
+// 在子进程中打开,应中止
+template <typename Tree>
+static void rejected(const char *file)
+{
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        Tree tree(file);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize;
+
+    removeIndex(file);
+    {
+        // 删除一段中的大部分key,合并后留下空闲块
+        Tree tree(file, 16 * BlockSize);
+        randomOps(tree, model, (int) range * 2, range, &seed);
+        for (long k = 0; k < range / 2; k++) {
+            if (k % 5 != 0 && model.erase((Key) k))
+                CHECK(tree.remove((Key) k) == S_OK);
+        }
+    }
+    std::set<off_t> nodes;
+    downgrade<BlockSize>(file, 3, &nodes);
+
+    // 日志中的记录按空闲链表记录,不能重放到位图上
+    std::string wal = std::string(file) + ".wal";
+    FILE *fp = fopen(wal.c_str(), "wb");
+    CHECK(fp != NULL && fputc(1, fp) == 1);
+    fclose(fp);
+    rejected<Tree>(file);
+    unlink(wal.c_str());
+    // 中止前已写入校验和(重复写入无害),再擦掉
+    int fd = open(file, O_RDWR);
+    CHECK(fd >= 0);
+    eraseChecksums<BlockSize>(fd, nodes);
+    close(fd);
+
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+    }
+    checkUpgraded<BlockSize>(file, nodes);
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, (int) range, range, &seed);
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+// v4文件与日志: 升级时写入节点的校验和,重放的镜像补上校验和
+template <typename Key, typename Value, int BlockSize>
+static void runV4(const char *file, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 4;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize);
+        randomOps(tree, model, (int) range * 2, range, &seed);
+    }
+    crashAfterSync<Key, Value, BlockSize>(
+        file, model, (int) range, range, &seed, 64, false);
+    std::set<off_t> nodes;
+    downgrade<BlockSize>(file, 4, &nodes);
+    downgradeWal<BlockSize>(file);
+
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_WAL);
+        CHECK(tree.recovered() > 0);
+        verifyTree(tree, model, range);
+        CHECK(tree.checksumErrors() == 0);
+        randomOps(tree, model, (int) range, range, &seed);
+    }
+    {
+        // 缓存很小,节点都从文件读入并校验
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+        CHECK(tree.checksumErrors() == 0);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("upgrade_long128.idx", 5000);
+    run<int, int, 4096>("upgrade_int4096.idx", 50000);
+    runV4<long, long, 128>("upgrade_v4_long128.idx", 5000);
+    runV4<int, int, 4096>("upgrade_v4_int4096.idx", 50000);
+    printf("upgrade_test passed\n");
+    return 0;
+}
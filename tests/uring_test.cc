@@ -0,0 +1,87 @@
+/*
+ * @file uring_test.cc
+ * @brief
+ * io_uring: 预读(multiGet)与批量写回(WriteBatch)经过io_uring提交,
+ * 树启用io_uring与内核是否支持一致; 内核不支持时在pread/pwrite上运行,
+ * 以SKIP_RETURN_CODE退出,ctest显示为跳过
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <vector>
+#include "IoRing.h"
+#include "TreeCheck.h"
+
+// ctest中的SKIP_RETURN_CODE
+static const int SKIPPED = 77;
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range, bool supported)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 9;
+
+    removeIndex(file);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_URING);
+        CHECK(tree.uringEnabled() == supported);
+        randomOps(tree, model, n, range, &seed);
+
+        // 批量写入: 一次提交中修改的多个叶子一起写回
+        for (int round = 0; round < 20; round++) {
+            typename Tree::WriteBatch batch;
+            for (int i = 0; i < 500; i++) {
+                Key k = (Key) (rand_r(&seed) % range);
+                if (rand_r(&seed) % 2) {
+                    batch.put(k, (Value) (k + round));
+                    model[k] = (Value) (k + round);
+                } else {
+                    batch.remove(k);
+                    model.erase(k);
+                }
+            }
+            CHECK(tree.commit(&batch) == S_OK);
+        }
+
+        // 批量查找: 不在缓存中的节点一次预读
+        std::vector<Key> keys(1000);
+        std::vector<Value> values(keys.size());
+        std::vector<int> rets(keys.size());
+        for (int round = 0; round < 20; round++) {
+            size_t found = 0;
+            for (size_t i = 0; i < keys.size(); i++) {
+                keys[i] = (Key) (rand_r(&seed) % range);
+                found += model.count(keys[i]);
+            }
+            CHECK(tree.multiGet(&keys[0], &values[0], &rets[0], keys.size())
+                  == found);
+            for (size_t i = 0; i < keys.size(); i++) {
+                bool exist = model.count(keys[i]) > 0;
+                CHECK((rets[i] == S_OK) == exist);
+                if (exist) CHECK(values[i] == model[keys[i]]);
+            }
+        }
+        verifyTree(tree, model, range);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        CHECK(!tree.uringEnabled());
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    bool supported = IoRing(8).valid();
+    run<long, long, 128>("uring_long128.idx", 40000, 20000, supported);
+    run<long, long, 4096>("uring_long4096.idx", 100000, 60000, supported);
+    if (!supported) {
+        printf("io_uring is not supported here, "
+               "only the pread/pwrite fallback was tested\n");
+        return SKIPPED;
+    }
+    printf("uring_test passed\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * @file wal_test.cc
+ * @brief
+ * 写前日志: 子进程修改后sync,不关闭直接退出(模拟崩溃),
+ * 重新打开时重放日志,内容应与sync时的model一致;
+ * 日志中块镜像自带的校验和在重放时校验,不符的块读取时返回S_ERROR
+ *
+ * @author Liu GuangRui
+ * @email 675040625@qq.com
+ */
+#include <fcntl.h>
+#include "Crc32c.h"
+#include "TreeCheck.h"
+
+template <typename Key, typename Value, int BlockSize>
+static void run(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize;
+
+    removeIndex(file);
+    // 第二次崩溃前日志中还有第一次重放之后的修改
+    crashAfterSync<Key, Value, BlockSize>(
+        file, model, n, range, &seed, 64, false);
+    crashAfterSync<Key, Value, BlockSize>(
+        file, model, n, range, &seed, 1, true);
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_WAL);
+        CHECK(tree.recovered() > 0);
+        verifyTree(tree, model, range);
+        randomOps(tree, model, n, range, &seed);
+    }
+    // 正常关闭后日志已清空
+    {
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_WAL);
+        CHECK(tree.recovered() == 0);
+    }
+    {
+        Tree tree(file, 16 * BlockSize);
+        verifyTree(tree, model, range);
+    }
+    removeIndex(file);
+}
+
+/**
+ * 改坏日志中最后一个块镜像的内容并重新计算记录的校验和(记录完整,
+ * 镜像在记录前已损坏): 重放时不重新计算镜像的校验和,该块读取失败
+ */
+template <typename Key, typename Value, int BlockSize>
+static void damagedImage(const char *file, int n, long range)
+{
+    typedef BPlusTree<Key, Value, BlockSize> Tree;
+    std::map<Key, Value> model;
+    unsigned seed = BlockSize + 1;
+
+    removeIndex(file);
+    crashAfterSync<Key, Value, BlockSize>(
+        file, model, n, range, &seed, 64, false);
+
+    std::string wal = std::string(file) + ".wal";
+    int fd = open(wal.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    std::string log(lseek(fd, 0, SEEK_END), 0);
+    CHECK(pread(fd, &log[0], log.size(), 0) == (ssize_t) log.size());
+    size_t last = log.size();
+    for (size_t pos = 0; pos < log.size();) {
+        const Wal::Record *r = (const Wal::Record *) &log[pos];
+        if (r->type == Wal::WAL_PAGE) last = pos;
+        pos += sizeof(Wal::Record) + r->length;
+    }
+    CHECK(last < log.size());
+
+    Wal::Record *r = (Wal::Record *) &log[last];
+    char *payload = (char *) (r + 1);
+    payload[BlockSize / 2] ^= 0x5a;
+    r->checksum = Crc32c::extend(
+        Crc32c::compute(&r->type, sizeof(Wal::Record) - sizeof(r->checksum)),
+        payload,
+        r->length);
+    CHECK(pwrite(fd, &log[0], log.size(), 0) == (ssize_t) log.size());
+    close(fd);
+
+    for (int round = 0; round < 2; round++) {
+        // 第二次打开时日志已清空,损坏的块已写入索引文件
+        Tree tree(file, 16 * BlockSize, BPLUS_TREE_WAL);
+        CHECK((tree.recovered() > 0) == (round == 0));
+        long lost = 0;
+        for (long i = 0; i < range; i++) {
+            Key k = (Key) i;
+            Value v;
+            int ret = tree.search(k, &v);
+            if (ret == S_ERROR) {
+                lost++;
+                continue;
+            }
+            CHECK((ret == S_OK) == (model.count(k) > 0));
+            if (ret == S_OK) CHECK(v == model[k]);
+        }
+        CHECK(lost > 0 && tree.checksumErrors() > 0);
+    }
+    removeIndex(file);
+}
+
+int main()
+{
+    run<long, long, 128>("wal_long128.idx", 20000, 10000);
+    run<long, long, 4096>("wal_long4096.idx", 50000, 30000);
+    damagedImage<long, long, 128>("wal_damaged128.idx", 20000, 10000);
+    damagedImage<long, long, 4096>("wal_damaged4096.idx", 50000, 30000);
+    printf("wal_test passed\n");
+    return 0;
+}